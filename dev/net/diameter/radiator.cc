@@ -33,11 +33,116 @@
  *                          -o option.  Wathdogging is disabled implicitly.
  *                          -S and -N are not compatible.
  *
+ * -C, --connect <addr>     Make the connection(s) ourselves to <addr>, which
+ *                          is "<host>[:<port>]" or "[<IPv6>]:<port>".  The
+ *                          default port is 3868.
+ * -l, --listen <addr>      Listen on <addr> and accept any number of peers.
+ *                          Leave <host> empty to bind to all addresses.
+ * -n, --connections <n>    The number of connections to make with -C.
+ *                          Defaults to 1.
+ * -P, --sctp               Use SCTP rather than TCP with -C and -l.
+ * --io-uring               Receive and send on TCP connections through an
+ *                          io_uring rather than with read() and writev():
+ *                          each connection has a multishot receive into
+ *                          buffers registered with the kernel, and the
+ *                          writes of all connections are submitted in one
+ *                          batch.  If the kernel can't do it (Linux 6.0 is
+ *                          needed), epoll is used as usual.  SCTP always
+ *                          uses epoll.
+ * --workers <n>            Fork <n> worker processes with -l, each pinned
+ *                          to a different CPU and listening on <addr> with
+ *                          its own SO_REUSEPORT socket, so the kernel
+ *                          spreads the incoming connections among them.
+ *                          This lets a server keep up with clients running
+ *                          on several cores.  The workers don't read the
+ *                          standard input, and the traffic counters of
+ *                          all of them are summed up at exit.  Capturing,
+ *                          --trace, --metrics and --scenario are not
+ *                          supported with workers.  With --affinity the
+ *                          workers are spread over the CPUs of the network
+ *                          thread.
+ * --affinity <role>=<cpus> Run the threads of <role> on <cpus>, like
+ *                          "0-3,8".  The roles are "network" (receiving,
+ *                          sending and pacing the "rate"), "command" (the
+ *                          standard input), "scenario", "capture" (writing
+ *                          the pcaps) and "metrics".  Can be repeated for
+ *                          different roles.  The threads are started on
+ *                          their CPUs, so the memory they allocate comes
+ *                          from the NUMA node of those CPUs.  The rest of
+ *                          the threads may run on any CPU we're allowed
+ *                          to.  The effective topology is printed at
+ *                          startup, and also without --affinity with -v.
+ *
+ * --bench                  Measure how many messages per second can be
+ *                          built from scratch and from templates, how
+ *                          many Session-Id:s can be generated and parsed,
+ *                          and how many UDRs can be exchanged on loopback
+ *                          TCP and at what CPU cost with epoll and with
+ *                          io_uring, then exit.
+ * --bench-codec            Measure the Diameter encoder and parser
+ *                          primitives (startMessage(), addAVP(), ...,
+ *                          makeResponse()) one by one on a CER, UDR, UDA
+ *                          and PNR like ours, print the time, bytes and
+ *                          DGram allocations per operation as JSON, then
+ *                          exit.
+ * --baseline <fname>       With --bench-codec compare the results with
+ *                          those saved in <fname> earlier, and exit with
+ *                          1 if any operation has got slower by more than
+ *                          10% or allocates more.
+ *
+ * --metrics <path>         Serve live statistics on a UNIX domain socket
+ *                          at <path> over HTTP: "GET /metrics" returns them
+ *                          in Prometheus text format and "GET /json" as
+ *                          JSON.  They include the messages and bytes sent
+ *                          and received per command code, SCTP stream and
+ *                          Result-Code, the number of requests in flight,
+ *                          error counts and round-trip times.  Try
+ *                          "curl --unix-socket <path> localhost/metrics".
+ *
  * -O, --write-input <fname>  Write everything sent or received to <fname>
- *                            in PCAP format with fake IP and SCTP header.
+ *                            in PCAP-NG format with fake IP and SCTP
+ *                            headers carrying the real addresses.  Each
+ *                            connection and SCTP stream is a separate
+ *                            interface, and the packets are commented
+ *                            with their direction and the time they spent
+ *                            in the send queue or the round-trip time of
+ *                            the request they answer.
  * -o, --write-output <fname> The output file is truncated and overwritten.
  * -w, --write <fname>        Write both input and output to <fname>.  "-"
  *                            designates the standard output.
+ * --capture-overload <policy> What to do when the messages to capture come
+ *                            faster than they can be written.  They are
+ *                            written in large blocks in the background,
+ *                            and if the queue fills up, with "block" (the
+ *                            default) we wait for the writer, while with
+ *                            "drop" the messages are not captured (but
+ *                            sent or processed nevertheless).  The number
+ *                            of dropped messages is reported at exit.
+ * --trace <fname>            Write all messages sent and received to
+ *                            <fname> in a compact binary format, along
+ *                            with their time, connection, stream and
+ *                            latency.  This is done in the background
+ *                            like the capture, so unlike -vvv it doesn't
+ *                            slow down the traffic much, and the -vvv
+ *                            dumps are omitted.
+ * --decode <fname>           Print the messages of a --trace file as
+ *                            -vvv would have, then exit.
+ *
+ * --scenario <fname>       Run the load test described in <fname> as soon
+ *                          as there's a connection, then exit.  Each line
+ *                          is a phase, run one after the other:
+ *                            ramp <from-tps> <to-tps> <duration>
+ *                            hold <tps> <duration>
+ *                            spike <tps> <duration>
+ *                          or a setting taking effect from the next phase:
+ *                            user-data | streams | lga {<exact>|<min> <max>}
+ *                          like the commands of the same name.  <duration>
+ *                          is in seconds, or minutes or hours with an 'm'
+ *                          or 'h' suffix.  Lines starting with '#' are
+ *                          ignored.  UDRs (PNRs) are sent like by "rate",
+ *                          and at the end the latency percentiles and the
+ *                          achieved rates are printed for every phase.
+ *                          Combine it with -S to run in the background.
  *
  * Parameters:
  * -i, --hop-by-hop         Specify low 16 bits of the Hop-by-Hop Id with
@@ -45,7 +150,9 @@
  *                          The default is 3333.  If only the lower 16 bits
  *                          are specified the high bits will be filled with
  *                          the local port number of the connection.
- * -I, --end-to-end         The End-to-End Id, defaulting to 4444.
+ * -I, --end-to-end         The base of End-to-End Ids, defaulting to 4444.
+ *                          Requests are sent with this plus the number
+ *                          in their Session-Id, so they can be told apart.
  * -h, --origin-host <str>  Sets the Origin-Host.  The default is
  *                          "radiator-{client,server}-host".
  * -r, --origin-realm <str> Sets the Origin-Realm.  The default is
@@ -62,6 +169,10 @@
  *                          Specify 0 to disable watchdogging permanently
  *                          (so it can't be enabled with the "watchdog"
  *                           command in run-time).
+ * -T, --answer-timeout <time>
+ *                          How much to wait in seconds for the answer
+ *                          to a request before it's considered lost.
+ *                          The default is 5 seconds, 0 waits forever.
  * -u, --send-delay <time>  Time to wait in (sub)milliseconds before sending
  *                          the next UDR/PNR while conducting a measurement.
  *                          Effectively with this option you can control
@@ -70,7 +181,9 @@
  *                          (sub)milliseconds.  This is useful to simulate
  *                          non-zero processing time of requests, or with
  *                          the -D (--no-reply) option induce congestion
- *                          on the network connection.
+ *                          on the network connection.  The answers are
+ *                          delayed independently of each other, so this
+ *                          doesn't limit the rate of answering.
  *
  * -a, --min-stream <lo>, -A, --max-stream <hi>
  *                          When sending an UDR, choose the stream number
@@ -87,10 +200,26 @@
  *                          Specifies the minimum and maximum size of
  *                          User-Data in UDA and PNR.
  *
- * radiator itself doesn't make network connections.  It expects its
- * standard output to be an already connected socket.  This socket can
- * have any protocols as long as it accepts read() and write().  However,
- * if you intend to use multiple streams, the socket must be IPPROTO_SCTP.
+ * -F, --flush-bytes <n>    Messages are written by the network thread,
+ * -W, --flush-delay <time> as many of them in one system call as possible.
+ *                          With -W it waits up to <time> (sub)milliseconds
+ *                          for more to accumulate before writing them out,
+ *                          unless there are at least <n> bytes (64 KiB by
+ *                          default) to write already.  This trades latency
+ *                          for fewer system calls.  The default is not to
+ *                          wait.
+ *
+ * Unless -C or -l is given radiator doesn't make network connections.
+ * It expects its standard output to be an already connected socket.
+ * This socket can have any protocols as long as it accepts read() and
+ * write().  However, if you intend to use multiple streams, the socket
+ * must be IPPROTO_SCTP.
+ *
+ * With -C or -l every connection has its own state (Capability-Exchange,
+ * watchdog, Hop-by-Hop Id, traffic counters), but they share all other
+ * parameters.  Requests entered on the standard input are distributed
+ * among the connections in round-robin fashion.  A summary of all the
+ * connections is printed on exit.
  *
  * Compilation of the program:
  *   c++ -Wall -O2 -pthread -lrt -lsctp radiator.cc -o radiator
@@ -99,6 +228,10 @@
  *   sicktp -p1 -s 4444 127.0.0.1 -x radiator       # server side
  *   sicktp -p1 -d 4444 127.0.0.1 -x radiator -c    # client side
  *
+ * Usage: standalone
+ *   radiator -s -l :3868                           # server side
+ *   radiator -c -C 127.0.0.1:3868 -n 100           # client side
+ *
  * While the program is running you can issue commands on the standard input:
  * # <anything>                         Skip the line.
  * verbosity [<level>]                  Show or change the verbosity level.
@@ -127,6 +260,64 @@
  * [!] [<n>] file [-bHh] <fname>        Likewise, except that the contents are
  *                                      loaded from <fname>.  -b designates
  *                                      binary file, not hexadecimal.
+ * [<n>] rate <tps> [<seconds>]         Send <n> UDRs (PNRs in server mode)
+ *                                      or as many as <tps> * <seconds>
+ *                                      at a constant rate in the background,
+ *                                      and measure the latency of each
+ *                                      answer from the time its request was
+ *                                      due.  When all requests have been
+ *                                      answered (or the run is cancelled)
+ *                                      the latency percentiles and the
+ *                                      achieved rates are printed.
+ *
+ *                                      Answers are matched with their requests
+ *                                      by their Hop-by-Hop and End-to-End Ids.
+ *                                      When a measurement ends, the number of
+ *                                      answered, timed out, unmatched,
+ *                                      duplicate and reordered ones and the
+ *                                      round-trip time percentiles are shown.
+ * [<n>] replay [-f|-x<speed>] <fname>  Resend the requests found in <fname>,
+ *                                      a PCAP or PCAP-NG capture of SCTP
+ *                                      DATA chunks or TCP segments over IPv4
+ *                                      or IPv6, at their original pace, or
+ *                                      <speed> times faster, or with -f as
+ *                                      fast as possible.  Hop-by-Hop and
+ *                                      End-to-End Ids, Session-Id,
+ *                                      Origin-Host and Destination-Host are
+ *                                      replaced with ours, and CER, DWR and
+ *                                      DPR are skipped.  The answers are
+ *                                      measured like with a number prefix.
+ *                                      With <n> only the first <n> requests
+ *                                      are sent.
+ * [<n>] fuzz [-s<seed>] [<fname>]      Send <n> malformed requests as fast
+ *                                      as the connections take them, and
+ *                                      watch how the peer reacts.  They are
+ *                                      mutated from the requests of <fname>
+ *                                      (a capture, like with "replay") or
+ *                                      from our UDR/PNR: AVPs are repeated,
+ *                                      nested in groups deeply, their flags
+ *                                      flipped, their lengths corrupted,
+ *                                      and the message is truncated.  The
+ *                                      same <seed> makes the same mutations.
+ *                                      If the peer disconnects or misses
+ *                                      a DWA, the requests it hasn't
+ *                                      answered are saved in the current
+ *                                      directory as fuzz-<seed>-<id>.bin,
+ *                                      like the first few answered without
+ *                                      a Result-Code or with one which
+ *                                      doesn't agree with the E bit.
+ *                                      "file -bH <fname>" resends them.
+ * window <depth>[..<max>] [<seconds>]  Keep <depth> UDRs (PNRs) in flight
+ *                                      on every connection, sending a new
+ *                                      one whenever one is answered or times
+ *                                      out, to find the throughput the peer
+ *                                      can sustain.  With <max>, <depth> is
+ *                                      doubled every <seconds> (10 by
+ *                                      default) until it would exceed <max>.
+ *                                      Then the throughput and round-trip
+ *                                      times of each step are printed, also
+ *                                      as CSV for plotting the latency
+ *                                      against the throughput.
  * ?                                    Print the Session-Id counters.
  *                                      Only useful for debugging.
  * cancel                               Cancel the ongoing measurement.
@@ -144,11 +335,20 @@
  *                                      the high 16 bit of the HbH Id (-bB).
  * user-data    [{<exact>|<min> <max>}] Add this much data to User-Data (-mM)
  *                                      or show the limits.
+ * connections                          Show the state and traffic counters
+ *                                      of all connections.
+ * pool                                 Show how many message buffers have
+ *                                      been recycled and allocated.
  * ^D, ^C                               End the program.
  *
- * When radiator starts normally it creates two threads: one to process
- * user commands and another for watchdogging.  The main thread handles
- * incoming network traffic until it's interrupted with SIGINT or SIGTERM.
+ * When radiator starts normally the main thread becomes the network thread:
+ * it runs an epoll loop handling the traffic of all connections, and fires
+ * the timers of the DWRs, the delayed answers, the pacing of the "rate"
+ * and the expiry of the requests, until it's interrupted with SIGINT or
+ * SIGTERM, or all connections are closed.  The command thread processes
+ * the user commands.  A capture thread writes the pcaps and the --trace
+ * with -wOo or --trace, a metrics thread serves --metrics, and a scenario
+ * thread runs the --scenario.
  *
  * Many structs and classes have been stolen from LBSDIACore and effort is
  * made to keep them synchronized.
@@ -168,21 +368,41 @@
 #include <setjmp.h>
 #include <ctype.h>
 #include <limits.h>
+#include <math.h>
 
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <getopt.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <time.h>
+#include <sched.h>
 #include <pthread.h>
+#include <poll.h>
 
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <netdb.h>
 #include <arpa/inet.h>
 #include <netinet/ip.h>
+#include <netinet/ip6.h>
 #include <netinet/sctp.h>
+#include <linux/io_uring.h>
 
+#include <map>
+#include <string>
 #include <vector>
 // }}}
 
@@ -246,16 +466,91 @@ typedef struct _Sip_addr_t {
 
 /* Our definitions {{{ */
 #define PCAP_MAGIC                  0xA1B2C3D4
-#define PCAP_VERSION_MAJOR          2
-#define PCAP_VERSION_MINOR          4
-#define PCAP_DLT_RAW_IPV4           228
-#define PCAP_MAX_SNAPLEN            65535
+#define PCAP_MAGIC_NSEC             0xA1B23C4D
+#define PCAPNG_SHB                  0x0A0D0D0A
+#define PCAPNG_IDB                  0x00000001
+#define PCAPNG_EPB                  0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC     0x1A2B3C4D
+#define PCAPNG_VERSION_MAJOR        1
+#define PCAPNG_VERSION_MINOR        0
+#define PCAPNG_OPT_ENDOFOPT         0
+#define PCAPNG_OPT_COMMENT          1
+#define PCAPNG_SHB_USERAPPL         4
+#define PCAPNG_IF_NAME              2
+#define PCAPNG_IF_DESCRIPTION       3
+#define PCAPNG_IF_TSRESOL           9
+#define PCAPNG_EPB_FLAGS            2
+#define PCAPNG_EPB_INBOUND          1
+#define PCAPNG_EPB_OUTBOUND         2
+#define PCAP_LINKTYPE_ETHERNET      1
+#define PCAP_LINKTYPE_RAW           101
+#define PCAP_LINKTYPE_LINUX_SLL     113
+#define PCAP_LINKTYPE_IPV4          228
+#define PCAP_LINKTYPE_IPV6          229
+#define PCAP_LINKTYPE_LINUX_SLL2    276
+#define ETHERTYPE_IPV4              0x0800
+#define ETHERTYPE_IPV6              0x86DD
+#define ETHERTYPE_VLAN              0x8100
 #define SCTP_PPID_DIAMETER          46
 #define DIAMETER_SERVER_PORT        3868
 #define DIAMETER_CLIENT_PORT        2222
-#define DIAMETER_PORTS(ctx)         \
-    ((ctx)->is_client ? DIAMETER_SERVER_PORT : DIAMETER_CLIENT_PORT), \
-    ((ctx)->is_client ? DIAMETER_CLIENT_PORT : DIAMETER_SERVER_PORT)
+
+// The regular size of the receive buffer of a connection, and how much
+// free space we want to read() into at least before we move the partial
+// message at the end of the buffer to its start.
+#define RECV_BUFFER_SIZE            65536
+#define RECV_MIN_FREE               4096
+
+// How many SCTP messages to receive with one recvmmsg(), and into how
+// large buffers.  Larger messages are received in pieces.
+#define SCTP_RECV_BATCH             16
+#define SCTP_RECV_SLOT              4096
+
+// The size of the submission queue of the io_uring (--io-uring), and how
+// many buffers (a power of 2) of what size the kernel can receive into.
+#define URING_ENTRIES               1024
+#define URING_RECV_BUFS             512
+#define URING_RECV_BUF_SIZE         16384
+
+// How many messages can be waiting to be captured (must be a power of 2),
+// and how large blocks the capture writer writes at once.
+#define CAPTURE_RING_SIZE           65536
+#define CAPTURE_BLOCK_SIZE          (256 * 1024)
+
+// Identification of the binary trace files (--trace).
+#define TRACE_MAGIC                 "RADTRACE"
+#define TRACE_VERSION               1
+
+// How many requests of a replay to send at once at most before letting
+// the network thread read the answers.
+#define REPLAY_BURST                64
+
+// How many fuzz cases to remember until they're answered, how many of
+// them to save at most when the peer crashes, and how many of those
+// answered with an unexpected Result-Code to save in a run.  An AVP is
+// buried in at most FUZZ_MAX_DEPTH groups.
+#define FUZZ_HISTORY                4096
+#define FUZZ_SUSPECTS               16
+#define FUZZ_MAX_ODDITIES           16
+#define FUZZ_MAX_DEPTH              64
+
+// How many User-Data sizes to draw in advance for the answers, and how
+// many more random characters to generate than the largest one, so the
+// User-Data:s can start at different offsets.
+#define USER_DATA_POOL              1024
+#define USER_DATA_SLACK             4096
+
+// How many times and for how long (in seconds) --bench-codec measures
+// each operation (the fastest round counts), and by how many percent it
+// may be slower than the --baseline before it's reported as a regression.
+#define CODEC_BENCH_ROUNDS          5
+#define CODEC_BENCH_SECS            0.05
+#define CODEC_BENCH_TOLERANCE       10
+
+// The largest number of requests the "window" command can keep in flight
+// on a connection, and how long each of its steps lasts by default.
+#define WINDOW_MAX_DEPTH            65536
+#define WINDOW_STEP_SECS            10
 
 // This is the TYPE_0 LCG from glibc 2.19 and has been brought there
 // because we need a lot of random numbers and performance matters.
@@ -271,16 +566,63 @@ typedef struct {
     int32_t  thiszone;	    /* GMT->local timezone correction in secs (0).  */
     uint32_t sigfigs;	    /* Accuracy of timestamps (0 in practice).      */
     uint32_t snaplen;	    /* Max size of packet captures (65535 usually). */
-    uint32_t network;	    /* Data link type (raw IPv4 in our case).       */
+    uint32_t network;	    /* Data link type.                              */
 } __attribute__((packed)) pcap_hdr_t;
 
 /* PCAP per packet header */
 typedef struct {
-    uint32_t ts_sec, ts_usec;       /* Time of packet receipt/sendout. */
+    uint32_t ts_sec, ts_usec;       /* Time of packet receipt/sendout
+                                     * (ts_usec is in nanoseconds with
+                                     * PCAP_MAGIC_NSEC). */
     uint32_t incl_len, orig_len;    /* # of octets included in the capture,
                                      * and the actual size of the packet. */
 } __attribute__((packed)) pcap_pkt_hdr_t;
 
+/* Header of a trace file */
+typedef struct {
+    char     magic[8];              /* TRACE_MAGIC */
+    uint32_t version;               /* TRACE_VERSION in host byte order */
+    uint32_t reserved;
+} __attribute__((packed)) trace_hdr_t;
+
+/* Header of a traced message, followed by the message itself */
+typedef struct {
+    uint64_t ts;                    /* CLOCK_REALTIME in nanoseconds */
+    uint64_t latency;               /* Time spent in the send queue or
+                                     * the round-trip time, or 0. */
+    uint32_t connection, length;
+    uint16_t stream;
+    uint8_t  sent, reserved;
+} __attribute__((packed)) trace_rec_t;
+
+/* PCAP-NG Section Header Block, up to the options */
+typedef struct {
+    uint32_t block_type, block_length;
+    uint32_t byte_order_magic;
+    uint16_t version_major, version_minor;
+    int64_t  section_length;        /* -1 if not specified */
+} __attribute__((packed)) pcapng_shb_t;
+
+/* PCAP-NG Interface Description Block, up to the options */
+typedef struct {
+    uint32_t block_type, block_length;
+    uint16_t linktype, reserved;
+    uint32_t snaplen;               /* 0 if unlimited */
+} __attribute__((packed)) pcapng_idb_t;
+
+/* PCAP-NG Enhanced Packet Block, up to the packet data */
+typedef struct {
+    uint32_t block_type, block_length;
+    uint32_t interface_id;
+    uint32_t ts_high, ts_low;       /* in units of if_tsresol */
+    uint32_t captured_len, orig_len;
+} __attribute__((packed)) pcapng_epb_t;
+
+/* Header of PCAP-NG options, followed by the value padded to 4 bytes */
+typedef struct {
+    uint16_t code, length;
+} __attribute__((packed)) pcapng_opt_t;
+
 /* Common SCTP header */
 typedef struct {
     uint16_t src_port, dst_port;
@@ -312,22 +654,28 @@ typedef struct {
     uint32_t payload_protocol_identifier;
 } __attribute__((packed)) sctp_data_header_t;
 
-/* All network headers together */
+/* The SCTP headers of a captured message */
 typedef struct {
-    pcap_pkt_hdr_t              pcap;
-    struct iphdr                ip;
-    struct {
-        sctp_common_header_t    common;
-        sctp_data_header_t      data;
-    } __attribute__((packed)) sctp;
-} __attribute__((packed)) net_hdr_t;
-
-/* All fields except @sfd are configurable by command line arguments. */
+    sctp_common_header_t    common;
+    sctp_data_header_t      data;
+} __attribute__((packed)) sctp_hdr_t;
+
+struct DGram;
+struct InFlight;
+struct MsgTemplate;
+
+/* The fields up to @flush_bytes and @flush_delay are configurable by
+ * command line arguments (except for @sfd, @is_eof and @is_sctp), and are
+ * shared by all connections.  The rest is the private state of the
+ * connection. */
 struct ConnectionCtx {
     int sfd;
     bool is_eof;
     bool is_sctp;
 
+    // -L
+    bool to_lbsdia;
+
     // -iI
     unsigned hop_by_hop, end_to_end;
 
@@ -343,6 +691,9 @@ struct ConnectionCtx {
     // -t: watchdog period in microseconds
     unsigned watchdog_timeout;
 
+    // -T: how long to wait for answers in microseconds
+    unsigned answer_timeout;
+
     // -aA: the streams to send UDRs on
     unsigned min_stream, max_stream;
 
@@ -354,9 +705,177 @@ struct ConnectionCtx {
 
     // -uU: delay between sending/replying to UDR/PNR
     unsigned send_delay, recv_delay;
+
+    // -FW: how many bytes to accumulate or how long to wait in
+    // microseconds at most before writing the queued messages
+    unsigned flush_bytes, flush_delay;
+
+    // @idx:            the ordinal number of the connection
+    // @is_connecting:  a non-blocking connect() is in progress
+    // @local_addr, @peer_addr: the addresses of the connection for the
+    //                  capture, or made up ones if it's not a socket
+    // @request_sent:   when the request of the answer just received was
+    //                  sent, or 0 if it's unknown (for the capture)
+    // @rbuf:           the receive buffer; on TCP the messages before
+    //                  @rpos have been processed already, on SCTP it
+    //                  collects a message received in pieces
+    // @inflight:       the requests waiting for an answer
+    // @request_tmpl:   the UDR or PNR we send, precompiled
+    // @answer_tmpl:    the UDA we send, without Session-Id
+    // @pna_tmpl:       the PNA we send, without Session-Id
+    // @session_id:     our Session-Id AVP prerendered by addSessionId(),
+    //                  whose counter is at @session_id_at
+    unsigned idx;
+    bool is_connecting;
+    struct sockaddr_storage local_addr, peer_addr;
+    uint64_t request_sent;
+    DGram *rbuf;
+    size_t rpos;
+    InFlight *inflight;
+    MsgTemplate *request_tmpl, *answer_tmpl, *pna_tmpl;
+    DGram *session_id;
+    size_t session_id_at;
+
+    // The send queue.  Any thread can push DGram:s onto @tx_stack, and
+    // the first one to do so puts the connection on @ReadyConnections
+    // through @tx_next and sets @tx_scheduled.  Only the network thread
+    // writes the socket: it moves the DGram:s from @tx_stack to the
+    // @txq_head..@txq_tail list in order, and writes them out when
+    // @txq_bytes reaches @flush_bytes or @txq_head has been waiting
+    // since @txq_since (in nanoseconds) for @flush_delay.  @tx_offset
+    // bytes of @txq_head have been written already.  If the socket is
+    // full, @tx_blocked is set until EPOLLOUT.  @tx_lingering tells
+    // whether the connection is on @Lingering.
+    DGram *tx_stack;
+    ConnectionCtx *tx_next;
+    bool tx_scheduled;
+    DGram *txq_head, *txq_tail;
+    size_t txq_bytes, tx_offset;
+    uint64_t txq_since;
+    bool tx_blocked, tx_lingering;
+
+    // With --io-uring a TCP connection is read by a multishot receive
+    // once @uring is set, and its transmit queue is written by writev()s
+    // of @uring_iov.  One is in flight while @uring_niov is nonzero.
+    bool uring;
+    unsigned uring_niov;
+    struct iovec *uring_iov;
+
+    // Capability-Exchange state and the number of DWRs sent without
+    // an answer so far.
+    enum { CE_NONE, CE_SENT, CE_OK, CE_FAILED } ce_state;
+    unsigned dwr_pending, dwa_missed;
+
+    // Traffic counters, only touched by the network thread (or with -N
+    // by the stdin thread).  @syscalls is the number of writes made
+    // to send the @sent messages.
+    struct {
+        uint64_t sent, bytes_sent, syscalls;
+        uint64_t received, bytes_received;
+        uint64_t requests, answers;
+        uint64_t errors;
+        uint64_t timeouts, unmatched, duplicates, reordered;
+    } stats;
 };
 // }}}
 
+// Struct TimerWheel {{{
+// A timer of the TimerWheel.  When it's @due (CLOCK_MONOTONIC time in
+// nanoseconds), @fun is called with @arg.  The timer may be added again
+// from @fun.  @next and @prev link it in a slot of the wheel; they're
+// NULL when the timer isn't pending.
+struct Timer {
+    uint64_t due;
+    void (*fun)(void *arg);
+    void *arg;
+    Timer *next, *prev;
+
+    Timer(void (*f)(void *) = NULL, void *a = NULL):
+        due(0), fun(f), arg(a), next(NULL), prev(NULL)
+        NOP();
+    bool pending() const                { return next != NULL; }
+};
+
+// Hierarchical timing wheel of the network thread, so it's not
+// thread-safe.  Time is measured in TICK nanoseconds.  Level 0 has
+// a slot for each of the next SLOTS ticks, and a slot of level n covers
+// SLOTS^n ticks.  When the ticks of a higher-level slot come, its timers
+// are cascaded to the lower levels.  Adding and cancelling a timer is
+// O(1), and so is advancing the wheel by a tick.  Timers due later than
+// the wheel can cover sit in the last slot and are cascaded repeatedly.
+struct TimerWheel {
+    static const unsigned LEVEL_BITS = 6;
+    static const unsigned SLOTS = 1 << LEVEL_BITS;
+    static const unsigned LEVELS = 4;
+    static const uint64_t TICK = 100000;
+
+    TimerWheel();
+
+    void        add(Timer *timer);
+    void        cancel(Timer *timer);
+    void        advance(uint64_t now);
+    bool        next(uint64_t *duep) const;
+    size_t      pending() const         { return mPending; }
+
+protected:
+    void        link(Timer *timer);
+    void        cascade(unsigned level, unsigned slot);
+
+    // @mTick is the next tick to be processed.  @mSlots are the list
+    // heads, and @mPending is the number of timers on them.
+    uint64_t mTick;
+    Timer mSlots[LEVELS][SLOTS];
+    size_t mPending;
+}; // }}}
+
+// Struct IoRing {{{
+// A bare io_uring driven by system calls, for a single thread.  get()
+// returns a cleared SQE to fill, and submit() hands all of them to the
+// kernel at once.  CQE:s are taken with peek() and seen().  The kernel
+// receives into URING_RECV_BUFS buffers of URING_RECV_BUF_SIZE bytes
+// provided in buffer group 0, which are given back with recycle().
+struct IoRing {
+    IoRing(): mFd(-1), mRings(NULL), mSqes(NULL),
+        mBufRing(NULL), mBufs(NULL)
+        NOP();
+    ~IoRing()                           { destroy(); }
+
+    bool        init(unsigned entries);
+    void        destroy();
+    int         fd() const              { return mFd; }
+
+    struct io_uring_sqe *get();
+    bool        submit(unsigned wait = 0);
+
+    const struct io_uring_cqe *peek() const;
+    void        seen();
+
+    const byte *buffer(unsigned bid) const
+        { return &mBufs[bid * URING_RECV_BUF_SIZE]; }
+    void        recycle(unsigned bid);
+
+protected:
+    bool        mapRings(const struct io_uring_params *params);
+    bool        provideBuffers();
+    bool        probeMultishot();
+
+    // @mSqTail is our copy of *@mSqKTail, which is only updated when the
+    // SQE:s from @mSqSubmitted are submitted.  @mRings is where both
+    // rings are mapped, and @mBufRing lists the free buffers of @mBufs.
+    int mFd;
+    void *mRings;
+    size_t mRingsSize;
+    unsigned *mSqKHead, *mSqKTail, mSqMask, mSqEntries;
+    unsigned mSqTail, mSqSubmitted;
+    struct io_uring_sqe *mSqes;
+    size_t mSqesSize;
+    unsigned *mCqKHead, *mCqKTail, mCqMask;
+    struct io_uring_cqe *mCqes;
+    struct io_uring_buf *mBufRing;
+    byte *mBufs;
+    uint16_t mBufTail;
+}; // }}}
+
 // Struct DMXEndPoint {{{
 // Binds IP version, address and port in a DMX fashion.
 struct DMXEndPoint {
@@ -420,6 +939,20 @@ struct DMXEndPoint {
 }; // }}}
 
 // Struct DGram {{{
+// A reference counted, immutable buffer which DGram:s can refer to
+// rather than copying its contents, see DGram::mTail.  Its owner and
+// every DGram referring to it hold a reference.
+struct DGramSegment { // {{{
+    static DGramSegment *alloc(size_t size);
+    DGramSegment *ref()
+        { __atomic_add_fetch(&mRefs, 1, __ATOMIC_RELAXED); return this; }
+    static void unref(DGramSegment *segment);
+
+    unsigned mRefs;
+    size_t mSize;
+    byte mData[0] __attribute__((aligned));
+}; // }}}
+
 // DGrams are what IOTask:s deliver.  It is a variadic size struct
 // with some header information and lots of methods.
 struct DGram { // {{{
@@ -428,7 +961,8 @@ struct DGram { // {{{
     // initialized (eg. static constant) DGram:s.
     DGram(size_t size, size_t used = 0):
         // Don't initialize @mData, as the creator is expected to fill it in.
-        mTotal(size), mUsed(used), mStreamId(0)
+        mTotal(size), mUsed(used), mStreamId(0), mPool(0), mNext(NULL),
+        mQueued(0), mTail(NULL), mTailData(NULL), mTailLen(0), mTailPad(0)
         NOP();
 
     // Methods {{{
@@ -449,7 +983,16 @@ struct DGram { // {{{
     bool        empty() const                   { return (mUsed == 0); }
     void        truncate()                      { mUsed = 0; }
 
+    // The length on wire, including the @mTail.
+    size_t      size() const
+                { return mUsed + mTailLen + mTailPad; }
+    unsigned    gather(struct iovec *iov, size_t skip = 0) const;
+    void        attach(DGramSegment *segment, const byte *data, size_t len);
+    static bool __attribute__((nonnull(1)))
+        flatten(DGram **dgramPtr);
+
     static DGram *alloc(size_t size, DGram *dgram = NULL);
+    static void release(DGram *dgram);
     static bool __attribute__((nonnull(1)))
         expand(DGram **dgramPtr, size_t amount);
     static bool __attribute__((nonnull(1)))
@@ -471,8 +1014,24 @@ struct DGram { // {{{
     // @mUsed:      how many bytes are in @mData
     // @mStreamId:  which SCTP stream has @mData been received from
     //              or on which stream should it be dispatched
+    // @mPool:      the size class + 1 of the DGramPool the DGram belongs
+    //              to, or 0 if it was malloc()ed
+    // @mNext:      links the DGram in a send queue
+    // @mQueued:    CLOCK_MONOTONIC time in nanoseconds when the DGram
+    //              was queued for sending, if it's to be captured
+    // @mTail:      if not NULL, the @mTailLen bytes at @mTailData in
+    //              this segment and @mTailPad bytes of zero padding
+    //              follow @mData on wire, without being copied there;
+    //              nothing can be added to the DGram after them
     size_t mTotal, mUsed;
     unsigned mStreamId;
+    unsigned char mPool;
+    DGram *mNext;
+    uint64_t mQueued;
+    DGramSegment *mTail;
+    const byte *mTailData;
+    size_t mTailLen;
+    unsigned char mTailPad;
 
     // This needs to be aligned to let DGRAM_FROM_STRING_LITERAL_WITH_SIZE()
     // work.  Interestingly enough DGramTmpl::mPayload is properly unaligned
@@ -502,6 +1061,49 @@ struct DGramTmplAry: public DGram { // {{{
 
     T mPayload[n];
 }; // }}}
+
+// DGramPool {{{
+// Recycles the buffers of DGram:s in a few size classes, so that
+// constructing and sending messages in steady state doesn't malloc().
+// Every thread keeps a cache of free buffers per class, which it refills
+// from or spills to a shared depot in batches.  Larger DGram:s are
+// malloc()ed and free()d as usual.
+struct DGramPool {
+    enum { NCLASSES = 3, CACHE_MAX = 64, BATCH = 32 };
+    static const size_t Sizes[NCLASSES];
+
+    // @hits:           allocations served from a cache or the depot
+    // @misses:         allocations which had to malloc()
+    // @outstanding:    buffers allocated but not released
+    // @high_water:     the maximum of @outstanding
+    struct Stats {
+        uint64_t hits, misses;
+        uint64_t outstanding, high_water;
+    };
+
+    static DGram   *get(size_t size);
+    static void     put(DGram *dgram);
+    static void     show();
+    static uint64_t allocations();
+
+protected:
+    struct Cache {
+        ~Cache();
+        DGram *head[NCLASSES];
+        unsigned count[NCLASSES];
+    };
+
+    static DGram   *next(DGram *dgram)
+                    { return *reinterpret_cast<DGram **>(dgram->mData); }
+    static void     link(DGram *dgram, DGram *next)
+                    { *reinterpret_cast<DGram **>(dgram->mData) = next; }
+    static void     spill(Cache *c, unsigned cls, unsigned n);
+
+    static thread_local Cache cache;
+    static pthread_mutex_t depotLock;
+    static DGram *depot[NCLASSES];
+    static Stats stats[NCLASSES];
+}; // }}}
 // }}}
 
 // Struct Diameter {{{
@@ -535,11 +1137,13 @@ struct Diameter: public DGram {
         // Header and AVP flags
 #if __BYTE_ORDER == __LITTLE_ENDIAN
         FLAG_REQUEST            = 0x80,
+        FLAG_PROXIABLE          = 0x40,
         FLAG_MANDATORY          = 0x40,
         FLAG_ERROR              = 0x20,
         FLAG_VENDOR             = 0x80,
 #else
         FLAG_REQUEST            = 1,
+        FLAG_PROXIABLE          = 2,
         FLAG_MANDATORY          = 2,
         FLAG_ERROR              = 4,
         FLAG_VENDOR             = 1,
@@ -607,15 +1211,7 @@ struct Diameter: public DGram {
         SUBS_REQ_TYPE           = 705,  // Unsigned32
         EXPIRY_TIME             = 709,  // Time (Unsigned32)
 
-        // Grouped AVPs (used by dumpAVP() to know which AVPs to descend into)
-        REQUESTED_SERVICE_UNIT  = 437,
-        SUBSCRIPTION_ID         = 443,
-        USED_SERVICE_UNIT       = 446,
-        MULTIPLE_SERVICES_CC    = 456,
-        USER_EQUIPMENT_INFO     = 458,
-        SERVICE_INFORMATION     = 873,
-        PS_INFORMATION          = 874,
-        SMS_INFORMATION         = 2000,
+        // The rest of the AVPs we know about are in the Dictionary.
     };
     // }}}
 
@@ -681,6 +1277,11 @@ struct Diameter: public DGram {
         addAVP(DGram **dgramPtr, unsigned code,
                bool mandatory, unsigned vendorId,
                size_t datasize, const void *data);
+    static bool __attribute__((nonnull))
+        addSharedAVP(DGram **dgramPtr, unsigned code,
+                     bool mandatory, unsigned vendorId,
+                     size_t lprefix, const void *prefix,
+                     DGramSegment *segment, const byte *data, size_t len);
     // }}}
 
     // Methods for parsing DIAMETER messages. {{{
@@ -724,6 +1325,41 @@ struct Diameter: public DGram {
                           size_t gapAt = 0, size_t gapSize = 0);
 
     // These are not in DiaLBS.
+    // A non-owning view of an AVP: @data points to @len bytes of AVP data
+    // right in the buffer of the message, so it's only valid as long as
+    // the message is.  @vendor is 0 unless @flags has FLAG_VENDOR.
+    struct AVP {
+        unsigned code, flags, vendor;
+        const byte *data;
+        size_t len;
+
+        bool equals(const char *str) const;
+        bool __attribute__((nonnull)) getInt32(uint32_t *valuep) const;
+        bool __attribute__((nonnull)) getInt64(uint64_t *valuep) const;
+    };
+
+    // Iterates over the AVPs of a message or a grouped AVP without
+    // copying anything.  next() returns false at the end or on a parse
+    // error, in which case failed() returns true.
+    class AVPIterator {
+    public:
+        AVPIterator(const Diameter *dia, const byte *pos, size_t rem):
+            mDia(dia), mPos(pos), mRem(rem), mFailed(false)
+            NOP();
+        AVPIterator(const Diameter *dia, const AVP &group):
+            mDia(dia), mPos(group.data), mRem(group.len), mFailed(false)
+            NOP();
+
+        bool __attribute__((nonnull)) next(AVP *avp);
+        bool failed() const                     { return mFailed; }
+
+    protected:
+        const Diameter *mDia;
+        const byte *mPos;
+        size_t mRem;
+        bool mFailed;
+    };
+
     static const byte * __attribute__((nonnull))
         dumpAVP(const Diameter *dia, const byte *pos, size_t *remp,
                 unsigned depth = 0);
@@ -754,6 +1390,420 @@ protected: // Methods {{{
 }; // }}}
 // }}}
 
+// Dictionary {{{
+// The AVPs we know about: those of the base protocol (RFC 6733), of the
+// 3GPP Sh interface (TS 29.329, including what it borrows from Cx) and
+// the grouped ones of Credit-Control (RFC 4006) and 3GPP charging.
+// The tables are compiled into a perfect hash (see mkDictIndex()),
+// so lookupAVP() is a multiplication, a shift and a comparison.
+enum AVPType {
+    OCTET_STRING, INTEGER32, INTEGER64, UNSIGNED32, UNSIGNED64,
+    FLOAT32, FLOAT64, GROUPED, ADDRESS, TIME, UTF8_STRING,
+    DIAMETER_IDENTITY, DIAMETER_URI, ENUMERATED,
+};
+
+// An AVP is identified by its code and Vendor-Id (0 if it has none).
+struct DictKey {
+    unsigned code, vendor;
+};
+
+// @mandatory tells whether the M flag should be set, and the members of
+// GROUPED AVPs are listed in @members, which has @nmembers elements.
+// The layout of groups with arbitrary content is empty.
+struct DictAVP {
+    unsigned code, vendor;
+    const char *name;
+    AVPType type;
+    bool mandatory;
+    const DictKey *members;
+    unsigned nmembers;
+};
+
+#define DICT_MEMBERS(group)         group, sizeof(group) / sizeof(group[0])
+
+// The layout of the grouped AVPs. {{{
+static constexpr DictKey DictVendorSpecificApplicationId[] = {
+    { 266, 0 }, { 258, 0 }, { 259, 0 },
+};
+static constexpr DictKey DictExperimentalResult[] = {
+    { 266, 0 }, { 298, 0 },
+};
+static constexpr DictKey DictProxyInfo[] = {
+    { 280, 0 }, { 33, 0 },
+};
+static constexpr DictKey DictUserIdentity[] = {
+    { 601, 10415 }, { 701, 10415 },
+};
+static constexpr DictKey DictSupportedFeatures[] = {
+    { 266, 0 }, { 629, 10415 }, { 630, 10415 },
+};
+static constexpr DictKey DictRepositoryDataId[] = {
+    { 704, 10415 }, { 716, 10415 },
+};
+static constexpr DictKey DictCallReferenceInfo[] = {
+    { 721, 10415 }, { 722, 10415 },
+};
+static constexpr DictKey DictServiceUnit[] = {
+    { 420, 0 }, { 421, 0 }, { 412, 0 }, { 414, 0 }, { 417, 0 },
+};
+static constexpr DictKey DictMultipleServicesCC[] = {
+    { 437, 0 }, { 446, 0 }, { 439, 0 }, { 432, 0 }, { 268, 0 },
+    { 448, 0 },
+};
+static constexpr DictKey DictSubscriptionId[] = {
+    { 450, 0 }, { 444, 0 },
+};
+static constexpr DictKey DictUserEquipmentInfo[] = {
+    { 459, 0 }, { 460, 0 },
+};
+static constexpr DictKey DictServiceInformation[] = {
+    { 874, 10415 }, { 2000, 10415 },
+};
+// }}}
+
+static constexpr DictAVP Dictionary[] = {
+    // RFC 6733 {{{
+    { 1,    0,      "User-Name",                UTF8_STRING,      true },
+    { 25,   0,      "Class",                    OCTET_STRING,     true },
+    { 27,   0,      "Session-Timeout",          UNSIGNED32,       true },
+    { 33,   0,      "Proxy-State",              OCTET_STRING,     true },
+    { 44,   0,      "Acct-Session-Id",          OCTET_STRING,     true },
+    { 50,   0,      "Acct-Multi-Session-Id",    UTF8_STRING,      true },
+    { 55,   0,      "Event-Timestamp",          TIME,             true },
+    { 85,   0,      "Acct-Interim-Interval",    UNSIGNED32,       true },
+    { 257,  0,      "Host-IP-Address",          ADDRESS,          true },
+    { 258,  0,      "Auth-Application-Id",      UNSIGNED32,       true },
+    { 259,  0,      "Acct-Application-Id",      UNSIGNED32,       true },
+    { 260,  0,      "Vendor-Specific-Application-Id", GROUPED, true,
+      DICT_MEMBERS(DictVendorSpecificApplicationId) },
+    { 261,  0,      "Redirect-Host-Usage",      ENUMERATED,       true },
+    { 262,  0,      "Redirect-Max-Cache-Time",  UNSIGNED32,       true },
+    { 263,  0,      "Session-Id",               UTF8_STRING,      true },
+    { 264,  0,      "Origin-Host",              DIAMETER_IDENTITY, true },
+    { 265,  0,      "Supported-Vendor-Id",      UNSIGNED32,       true },
+    { 266,  0,      "Vendor-Id",                UNSIGNED32,       true },
+    { 267,  0,      "Firmware-Revision",        UNSIGNED32,       false },
+    { 268,  0,      "Result-Code",              UNSIGNED32,       true },
+    { 269,  0,      "Product-Name",             UTF8_STRING,      false },
+    { 270,  0,      "Session-Binding",          UNSIGNED32,       true },
+    { 271,  0,      "Session-Server-Failover",  ENUMERATED,       true },
+    { 272,  0,      "Multi-Round-Time-Out",     UNSIGNED32,       true },
+    { 273,  0,      "Disconnect-Cause",         ENUMERATED,       true },
+    { 274,  0,      "Auth-Request-Type",        ENUMERATED,       true },
+    { 276,  0,      "Auth-Grace-Period",        UNSIGNED32,       true },
+    { 277,  0,      "Auth-Session-State",       ENUMERATED,       true },
+    { 278,  0,      "Origin-State-Id",          UNSIGNED32,       true },
+    { 279,  0,      "Failed-AVP",               GROUPED,          true },
+    { 280,  0,      "Proxy-Host",               DIAMETER_IDENTITY, true },
+    { 281,  0,      "Error-Message",            UTF8_STRING,      false },
+    { 282,  0,      "Route-Record",             DIAMETER_IDENTITY, true },
+    { 283,  0,      "Destination-Realm",        DIAMETER_IDENTITY, true },
+    { 284,  0,      "Proxy-Info",               GROUPED,          true,
+      DICT_MEMBERS(DictProxyInfo) },
+    { 285,  0,      "Re-Auth-Request-Type",     ENUMERATED,       true },
+    { 287,  0,      "Accounting-Sub-Session-Id", UNSIGNED64,       true },
+    { 291,  0,      "Authorization-Lifetime",   UNSIGNED32,       true },
+    { 292,  0,      "Redirect-Host",            DIAMETER_URI,     true },
+    { 293,  0,      "Destination-Host",         DIAMETER_IDENTITY, true },
+    { 294,  0,      "Error-Reporting-Host",     DIAMETER_IDENTITY, false },
+    { 295,  0,      "Termination-Cause",        ENUMERATED,       true },
+    { 296,  0,      "Origin-Realm",             DIAMETER_IDENTITY, true },
+    { 297,  0,      "Experimental-Result",      GROUPED,          true,
+      DICT_MEMBERS(DictExperimentalResult) },
+    { 298,  0,      "Experimental-Result-Code", UNSIGNED32,       true },
+    { 299,  0,      "Inband-Security-Id",       UNSIGNED32,       true },
+    { 480,  0,      "Accounting-Record-Type",   ENUMERATED,       true },
+    { 483,  0,      "Accounting-Realtime-Required", ENUMERATED, true },
+    { 485,  0,      "Accounting-Record-Number", UNSIGNED32,       true },
+    // }}}
+
+    // 3GPP TS 29.329 (Sh) and 29.229 (Cx) {{{
+    { 601,  10415,  "Public-Identity",          UTF8_STRING,      true },
+    { 602,  10415,  "Server-Name",              UTF8_STRING,      true },
+    { 628,  10415,  "Supported-Features",       GROUPED,          false,
+      DICT_MEMBERS(DictSupportedFeatures) },
+    { 629,  10415,  "Feature-List-ID",          UNSIGNED32,       false },
+    { 630,  10415,  "Feature-List",             UNSIGNED32,       false },
+    { 634,  10415,  "Wildcarded-Public-Identity", UTF8_STRING, false },
+    { 700,  10415,  "User-Identity",            GROUPED,          true,
+      DICT_MEMBERS(DictUserIdentity) },
+    { 701,  10415,  "MSISDN",                   OCTET_STRING,     true },
+    { 702,  10415,  "User-Data",                OCTET_STRING,     true },
+    { 703,  10415,  "Data-Reference",           ENUMERATED,       true },
+    { 704,  10415,  "Service-Indication",       OCTET_STRING,     true },
+    { 705,  10415,  "Subs-Req-Type",            ENUMERATED,       true },
+    { 706,  10415,  "Requested-Domain",         ENUMERATED,       true },
+    { 707,  10415,  "Current-Location",         ENUMERATED,       true },
+    { 708,  10415,  "Identity-Set",             ENUMERATED,       false },
+    { 709,  10415,  "Expiry-Time",              TIME,             false },
+    { 710,  10415,  "Send-Data-Indication",     ENUMERATED,       false },
+    { 711,  10415,  "DSAI-Tag",                 OCTET_STRING,     true },
+    { 712,  10415,  "One-Time-Notification",    ENUMERATED,       false },
+    { 713,  10415,  "Requested-Nodes",          UNSIGNED32,       false },
+    { 714,  10415,  "Serving-Node-Indication",  ENUMERATED,       false },
+    { 715,  10415,  "Repository-Data-ID",       GROUPED,          false,
+      DICT_MEMBERS(DictRepositoryDataId) },
+    { 716,  10415,  "Sequence-Number",          UNSIGNED32,       false },
+    { 717,  10415,  "Pre-paging-Supported",     ENUMERATED,       false },
+    { 718,  10415,  "Local-Time-Zone-Indication", ENUMERATED, false },
+    { 719,  10415,  "UDR-Flags",                UNSIGNED32,       false },
+    { 720,  10415,  "Call-Reference-Info",      GROUPED,          false,
+      DICT_MEMBERS(DictCallReferenceInfo) },
+    { 721,  10415,  "Call-Reference-Number",    OCTET_STRING,     false },
+    { 722,  10415,  "AS-Number",                OCTET_STRING,     false },
+    // }}}
+
+    // RFC 4006 and 3GPP TS 32.299 {{{
+    { 412,  0,      "CC-Input-Octets",          UNSIGNED64,       true },
+    { 414,  0,      "CC-Output-Octets",         UNSIGNED64,       true },
+    { 417,  0,      "CC-Service-Specific-Units", UNSIGNED64,       true },
+    { 420,  0,      "CC-Time",                  UNSIGNED32,       true },
+    { 421,  0,      "CC-Total-Octets",          UNSIGNED64,       true },
+    { 432,  0,      "Rating-Group",             UNSIGNED32,       true },
+    { 437,  0,      "Requested-Service-Unit",   GROUPED,          true,
+      DICT_MEMBERS(DictServiceUnit) },
+    { 439,  0,      "Service-Identifier",       UNSIGNED32,       true },
+    { 443,  0,      "Subscription-Id",          GROUPED,          true,
+      DICT_MEMBERS(DictSubscriptionId) },
+    { 444,  0,      "Subscription-Id-Data",     UTF8_STRING,      true },
+    { 446,  0,      "Used-Service-Unit",        GROUPED,          true,
+      DICT_MEMBERS(DictServiceUnit) },
+    { 448,  0,      "Validity-Time",            UNSIGNED32,       true },
+    { 450,  0,      "Subscription-Id-Type",     ENUMERATED,       true },
+    { 456,  0,      "Multiple-Services-Credit-Control", GROUPED, true,
+      DICT_MEMBERS(DictMultipleServicesCC) },
+    { 458,  0,      "User-Equipment-Info",      GROUPED,          false,
+      DICT_MEMBERS(DictUserEquipmentInfo) },
+    { 459,  0,      "User-Equipment-Info-Type", ENUMERATED,       false },
+    { 460,  0,      "User-Equipment-Info-Value", OCTET_STRING,     false },
+    { 873,  10415,  "Service-Information",      GROUPED,          true,
+      DICT_MEMBERS(DictServiceInformation) },
+    { 874,  10415,  "PS-Information",           GROUPED,          true },
+    { 2000, 10415,  "SMS-Information",          GROUPED,          true },
+    // }}}
+};
+
+#undef DICT_MEMBERS
+
+// The perfect hash of the Dictionary: @slots[dictSlot(<key>, @seed)] is
+// the index of the entry of <key> + 1, or 0 if we don't know that AVP.
+// DICT_BITS is chosen so that a collision-free @seed is found quickly.
+#define DICT_BITS                   12
+#define NDICT               (sizeof(Dictionary) / sizeof(Dictionary[0]))
+
+struct DictIndex {
+    uint64_t seed;
+    uint8_t slots[1 << DICT_BITS];
+};
+
+static constexpr uint64_t dictKey(unsigned code, unsigned vendor) {
+    return (uint64_t)vendor << 32 | code;
+}
+
+static constexpr unsigned dictSlot(uint64_t key, uint64_t seed) {
+    return (key * seed) >> (64 - DICT_BITS);
+}
+
+// Try multipliers until one maps all AVPs of the Dictionary to different
+// slots.  Evaluated by the compiler.
+static constexpr DictIndex mkDictIndex() {
+    DictIndex idx = { };
+    uint64_t seed = 0x9E3779B97F4A7C15ull;
+
+    for (unsigned attempt = 0; attempt < 256; attempt++) {
+        bool ok = true;
+
+        for (unsigned i = 0; i < (1 << DICT_BITS); i++)
+            idx.slots[i] = 0;
+        for (unsigned i = 0; ok && i < NDICT; i++) {
+            unsigned slot = dictSlot(dictKey(Dictionary[i].code,
+                                             Dictionary[i].vendor), seed);
+            if (idx.slots[slot])
+                ok = false;
+            else
+                idx.slots[slot] = i + 1;
+        }
+        if (ok) {
+            idx.seed = seed;
+            return idx;
+        }
+
+        // Next odd multiplier from an LCG.
+        seed = (seed * 6364136223846793005ull + 1442695040888963407ull)
+            | 1;
+    }
+
+    return idx;
+}
+
+static constexpr DictIndex DictHash = mkDictIndex();
+static_assert(NDICT < 256, "the Dictionary is too large for DictIndex");
+static_assert(DictHash.seed, "the Dictionary has duplicate AVPs");
+
+// Return what we know about the AVP @code of @vendor, or NULL.
+static inline const DictAVP *lookupAVP(unsigned code, unsigned vendor) {
+    unsigned i = DictHash.slots[dictSlot(dictKey(code, vendor),
+                                         DictHash.seed)];
+    const DictAVP *avp;
+
+    if (!i)
+        return NULL;
+    avp = &Dictionary[i - 1];
+    return avp->code == code && avp->vendor == vendor ? avp : NULL;
+}
+// }}}
+
+// Struct Histogram {{{
+// A log-bucketed histogram of (typically nanosecond) values in the spirit
+// of HdrHistogram.  Values below SUB are counted exactly, and above that
+// every power-of-two range is divided into HALF buckets, so the relative
+// error of the reported values is less than 1/HALF.
+struct Histogram {
+    static const unsigned SUB_BITS  = 7;
+    static const unsigned SUB       = 1 << SUB_BITS;
+    static const unsigned HALF      = SUB / 2;
+    static const unsigned NBUCKETS  = SUB + (64 - SUB_BITS) * HALF;
+
+    void        reset()                 { memset(this, 0, sizeof(*this)); }
+    void        record(uint64_t value);
+    void        merge(const Histogram *other);
+    uint64_t    percentile(double pct) const;
+
+    static unsigned bucketOf(uint64_t value);
+    static uint64_t highestValueOf(unsigned bucket);
+
+    // @count:  the number of recorded values
+    // @sum:    their sum, to calculate the average
+    // @max:    the largest of them, exactly
+    uint64_t count, sum, max;
+    uint64_t buckets[NBUCKETS];
+}; // }}}
+
+// Struct Metrics {{{
+// Traffic counters served by the metrics endpoint (--metrics).  Every
+// thread which sends or receives messages has its own set, which only
+// that thread writes, with relaxed atomic stores, so counting is as cheap
+// as plain increments.  snapshot() sums up the sets of all threads
+// without locking them.  The sets are never freed.
+struct Metrics {
+    enum { RECEIVED, SENT };
+    enum { NSLOTS = 64 };
+
+    // The command code of requests is keyed with REQUEST or'ed to it.
+    // Keys which don't fit in a Table are accounted for under OTHER.
+    static const uint32_t REQUEST   = 1 << 24;
+    static const uint32_t OTHER     = 0xFFFFFFFF;
+
+    // A small open-addressing table of the messages and bytes RECEIVED
+    // and SENT by a key: a command code, an SCTP stream or a Result-Code.
+    // @keys are stored +1, so that 0 designates an empty slot.
+    struct Table {
+        uint64_t keys[NSLOTS];
+        uint64_t messages[NSLOTS][2], bytes[NSLOTS][2];
+
+        unsigned    slot(uint32_t key);
+        uint32_t    keyOf(unsigned slot) const  { return keys[slot] - 1; }
+        void        add(const Table *other);
+    };
+
+    static void     count(unsigned dir, const Diameter *dia,
+                          const byte *msg, unsigned stream);
+    static void     roundTrip(uint64_t nsecs);
+    static void     snapshot(Metrics *sum);
+    static bool     resultCode(const Diameter *dia, const byte *pos,
+                               size_t rem, uint32_t *rcp);
+
+    // @enabled:    whether to count anything at all
+    // @rtt:        the round-trip times of the answered requests
+    static bool enabled;
+    Table commands, streams, results;
+    Histogram rtt;
+
+protected:
+    static Metrics *mine();
+    static void     bump(uint64_t *counter, uint64_t n)
+                    { __atomic_store_n(counter,
+                            __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                            __ATOMIC_RELAXED); }
+
+    // @local is the set of the current thread, and @all are linked
+    // through @next.
+    Metrics *next;
+    static thread_local Metrics *local;
+    static Metrics *all;
+}; // }}}
+
+// Struct InFlight {{{
+// Open-addressing (linear probing) hash table of the requests sent on
+// a connection, keyed by their (Hop-by-Hop, End-to-End) Id:s.  Entries
+// are stamped when the request is sent, and are kept around even after
+// they've been answered until they expire, so that duplicate answers
+// can be recognized.  All methods are thread-safe.
+struct InFlight {
+    enum { MATCHED, REORDERED, DUPLICATE, UNMATCHED };
+
+    // @seq:        per-connection sequence number of the request,
+    //              0 designates an empty slot
+    // @sent:       CLOCK_MONOTONIC time of sending in nanoseconds
+    // @sessionId:  the numeric part of the request's Session-Id
+    struct Entry {
+        uint32_t hbh, ete;
+        bool answered;
+        uint64_t seq, sent, sessionId;
+    };
+
+    InFlight();
+    ~InFlight();
+
+    void        add(uint32_t hbh, uint32_t ete,
+                    uint64_t sessionId, uint64_t sent);
+    void        cancel(uint32_t hbh, uint32_t ete);
+    int         answer(uint32_t hbh, uint32_t ete, Entry *entryp);
+    unsigned    expire(uint64_t sentBefore,
+                       void (*timedOut)(void *arg, const Entry *entry),
+                       void *arg);
+    size_t      outstanding() const     { return mOutstanding; }
+
+protected:
+    size_t      home(uint32_t hbh, uint32_t ete) const;
+    Entry      *lookup(uint32_t hbh, uint32_t ete);
+    void        remove(size_t idx);
+    bool        grow();
+
+    // @mEntries has @mMask+1 slots, @mUsed of which are occupied,
+    // and @mOutstanding of those are not answered yet.  @mLastAnswered
+    // is the highest sequence number of the answered requests.
+    pthread_mutex_t mLock;
+    Entry *mEntries;
+    size_t mMask, mUsed, mOutstanding;
+    uint64_t mSeq, mLastAnswered;
+}; // }}}
+
+// Struct MsgTemplate {{{
+// A message built once and instantiated many times by memcpy()ing it
+// into a pooled DGram and patching a few fixed-width fields: the
+// Hop-by-Hop and End-to-End Ids in the header and the numeric part of
+// the Session-Id.  Alternatively a Session-Id AVP can be inserted right
+// after the header.  The caller may append more AVPs to the instance,
+// in which case it has to finishMessage() it.
+struct MsgTemplate {
+    MsgTemplate(DGram *dgram);
+    ~MsgTemplate();
+
+    DGram  *instantiate(unsigned hbh, unsigned ete, uint64_t sessionId,
+                        size_t reserve = 0) const;
+    DGram  *instantiate(unsigned hbh, unsigned ete, unsigned flags,
+                        const Diameter::AVP &sessionId,
+                        size_t reserve = 0) const;
+    bool    find(unsigned code, Diameter::AVP *avp) const;
+
+    // @mDGram:         the message, owned by the template
+    // @mSessionIdAt:   the offset of "<%.8x>;<%.8x>" in the Session-Id
+    //                  of @mDGram, or 0 if it doesn't have one
+    DGram *mDGram;
+    size_t mSessionIdAt;
+}; // }}}
+
 // Struct DMXEndPoint {{{
 // struct sockaddr type conversion functions {{{
 // Cast @saddr to const struct sockaddr *.
@@ -1013,12 +2063,59 @@ bool DMXEndPoint::isSockaddr(const struct sockaddr *saddr) const {
 // }}}
 
 // Struct DGram {{{
+// Return a new DGramSegment of @size bytes with a single reference,
+// or NULL if there's not enough memory.
+DGramSegment *DGramSegment::alloc(size_t size) {
+    DGramSegment *segment;
+
+    if (!(segment = static_cast<DGramSegment *>(
+                            malloc(sizeof(*segment) + size)))) {
+        ERR("malloc(%zu): %m", sizeof(*segment) + size);
+        return NULL;
+    }
+
+    segment->mRefs = 1;
+    segment->mSize = size;
+    return segment;
+}
+
+// Drop a reference to @segment, and free it if it was the last one.
+void DGramSegment::unref(DGramSegment *segment) {
+    if (segment && !__atomic_sub_fetch(&segment->mRefs, 1, __ATOMIC_ACQ_REL))
+        free(segment);
+}
+
 // Allocate or change the capacity of @dgram.  Returns a pointer
-// to the new location of the DGram or NULL on failure.
+// to the new location of the DGram or NULL on failure.  DGram:s which
+// fit in one of DGramPool's size classes come from there, and their
+// capacity is rounded up to the size of the class.
 DGram *DGram::alloc(size_t size, DGram *dgram) {
     DGram *newDGram;
     size_t newTotal;
 
+    if (dgram && dgram->mPool) {
+        // Does it still fit?
+        if (size <= DGramPool::Sizes[dgram->mPool - 1]) {
+            if (dgram->mUsed > size)
+                dgram->mUsed = size;
+            return dgram;
+        }
+
+        // Move it to a larger buffer.
+        if (!(newDGram = alloc(size)))
+            return NULL;
+        memcpy(newDGram->mData, dgram->mData, dgram->mTotal);
+        newDGram->mUsed = dgram->mUsed;
+        newDGram->mStreamId = dgram->mStreamId;
+        newDGram->mTail = dgram->mTail;
+        newDGram->mTailData = dgram->mTailData;
+        newDGram->mTailLen = dgram->mTailLen;
+        newDGram->mTailPad = dgram->mTailPad;
+        DGramPool::put(dgram);
+        return newDGram;
+    } else if (!dgram && size <= DGramPool::Sizes[DGramPool::NCLASSES-1])
+        return DGramPool::get(size);
+
     newTotal = size;
     size += sizeof(*dgram);
     if (!(newDGram = static_cast<DGram *>(realloc(
@@ -1038,6 +2135,18 @@ DGram *DGram::alloc(size_t size, DGram *dgram) {
     return newDGram;
 }
 
+// Free @dgram or return it to its pool.
+void DGram::release(DGram *dgram) {
+    if (!dgram)
+        return;
+
+    DGramSegment::unref(dgram->mTail);
+    if (dgram->mPool)
+        DGramPool::put(dgram);
+    else
+        free(dgram);
+}
+
 // Allocate a new DGram or increase *dgramPtr's capacity by @amount.
 // *dgramPtr is only overwritten on success.  Returns whether the
 // allocation was successful.
@@ -1072,19 +2181,89 @@ bool DGram::ensure(DGram **dgramPtr, size_t needed) {
     return true;
 }
 
-// Return a slim duplicate of this DGram with only @mUsed bytes of capacity.
+// Return a duplicate of this DGram with at least size() bytes of
+// capacity.  The @mTail is copied into the duplicate's @mData.
 DGram *DGram::dupe() const {
     DGram *dgram;
 
-    if (!(dgram = alloc(mUsed)))
+    if (!(dgram = alloc(size())))
         return NULL;
 
-    memcpy(dgram, this, sizeof(*this) + mUsed);
-    dgram->mTotal = mUsed;
+    memcpy(dgram->mData, mData, mUsed);
+    dgram->mUsed = mUsed;
+    if (mTail) {
+        memcpy(dgram->firstUnused(), mTailData, mTailLen);
+        memset(dgram->at(mUsed + mTailLen), 0, mTailPad);
+        dgram->mUsed += mTailLen + mTailPad;
+    }
+    dgram->mStreamId = mStreamId;
 
     return dgram;
 }
 
+// Point @iov at this DGram as it's sent, except its first @skip bytes.
+// Returns the number of iovec:s filled, at most 3.
+unsigned DGram::gather(struct iovec *iov, size_t skip) const {
+    static const byte zeros[sizeof(uint32_t)] = { 0 };
+    const void *parts[3] = { mData, mTailData, zeros };
+    size_t lengths[3] = { mUsed, mTailLen, mTailPad };
+    unsigned niov;
+
+    niov = 0;
+    for (unsigned i = 0; i < MEMBS_OF(parts); i++) {
+        if (skip >= lengths[i]) {
+            skip -= lengths[i];
+            continue;
+        }
+
+        iov[niov].iov_base = (byte *)parts[i] + skip;
+        iov[niov].iov_len  = lengths[i] - skip;
+        niov++;
+        skip = 0;
+    }
+
+    return niov;
+}
+
+// Let @len bytes at @data in @segment follow @mData, taking a reference
+// to @segment, and pad them to a multiple of 4 bytes together with the
+// unaligned end of @mData.
+void DGram::attach(DGramSegment *segment, const byte *data, size_t len) {
+    DIAASSERT(!mTail);
+    DIAASSERT(data >= segment->mData);
+    DIAASSERT(data + len <= &segment->mData[segment->mSize]);
+
+    mTail = segment->ref();
+    mTailData = data;
+    mTailLen = len;
+    mTailPad = PAD4(mUsed + len);
+}
+
+// Copy the @mTail of *@dgramPtr into its @mData if it has one, for the
+// code which needs to see the whole message in one piece.  *dgramPtr is
+// only overwritten on success.  Returns whether it's contiguous now.
+bool DGram::flatten(DGram **dgramPtr) {
+    DGram *dgram = *dgramPtr;
+    DGramSegment *tail;
+
+    if (!(tail = dgram->mTail))
+        return true;
+    if (!ensure(dgramPtr, dgram->mTailLen + dgram->mTailPad))
+        return false;
+    dgram = *dgramPtr;
+
+    memcpy(dgram->firstUnused(), dgram->mTailData, dgram->mTailLen);
+    dgram->mUsed += dgram->mTailLen;
+    memset(dgram->firstUnused(), 0, dgram->mTailPad);
+    dgram->mUsed += dgram->mTailPad;
+
+    dgram->mTail = NULL;
+    dgram->mTailData = NULL;
+    dgram->mTailLen = dgram->mTailPad = 0;
+    DGramSegment::unref(tail);
+    return true;
+}
+
 // Split a DGram into two halves at @splitAt.  If @splitAt points right
 // outside the used area of @mData, nothing is allocated and *second is
 // set to NULL.  Otherwise the head of the DGram remains unaltered, but
@@ -1269,6 +2448,121 @@ DGram *DGram::moveSpace(byte *pos, size_t size, byte *from, size_t lfrom) {
 }
 // }}}
 
+// DGramPool {{{
+const size_t DGramPool::Sizes[DGramPool::NCLASSES] = { 512, 4096, 65536 };
+thread_local DGramPool::Cache DGramPool::cache;
+pthread_mutex_t DGramPool::depotLock = PTHREAD_MUTEX_INITIALIZER;
+DGram *DGramPool::depot[DGramPool::NCLASSES];
+DGramPool::Stats DGramPool::stats[DGramPool::NCLASSES];
+
+// Give the buffers of an exiting thread to the others.
+DGramPool::Cache::~Cache() {
+    for (unsigned cls = 0; cls < NCLASSES; cls++)
+        spill(this, cls, count[cls]);
+}
+
+// Move @n buffers of @cls from @c to the depot.
+void DGramPool::spill(Cache *c, unsigned cls, unsigned n) {
+    DGram *first, *last;
+
+    if (!n)
+        return;
+
+    first = last = c->head[cls];
+    for (unsigned i = 1; i < n; i++)
+        last = next(last);
+    c->head[cls] = next(last);
+    c->count[cls] -= n;
+
+    pthread_mutex_lock(&depotLock);
+    link(last, depot[cls]);
+    depot[cls] = first;
+    pthread_mutex_unlock(&depotLock);
+}
+
+// Return a DGram with at least @size bytes of capacity, which must not
+// be larger than the largest class.
+DGram *DGramPool::get(size_t size) {
+    unsigned cls;
+    DGram *dgram;
+    uint64_t outstanding, highWater;
+
+    for (cls = 0; Sizes[cls] < size; cls++)
+        DIAASSERT(cls + 1 < NCLASSES);
+
+    if (!cache.head[cls]) {
+        unsigned n;
+
+        // Refill the cache from the depot.
+        pthread_mutex_lock(&depotLock);
+        for (n = 0; n < BATCH && (dgram = depot[cls]) != NULL; n++) {
+            depot[cls] = next(dgram);
+            link(dgram, cache.head[cls]);
+            cache.head[cls] = dgram;
+        }
+        pthread_mutex_unlock(&depotLock);
+        cache.count[cls] += n;
+    }
+
+    if ((dgram = cache.head[cls]) != NULL) {
+        cache.head[cls] = next(dgram);
+        cache.count[cls]--;
+        __atomic_add_fetch(&stats[cls].hits, 1, __ATOMIC_RELAXED);
+    } else if ((dgram = static_cast<DGram *>(
+                        malloc(sizeof(*dgram) + Sizes[cls]))) != NULL) {
+        __atomic_add_fetch(&stats[cls].misses, 1, __ATOMIC_RELAXED);
+    } else {
+        ERR("malloc(%zu): %m", sizeof(*dgram) + Sizes[cls]);
+        return NULL;
+    }
+
+    outstanding = __atomic_add_fetch(&stats[cls].outstanding, 1,
+                                     __ATOMIC_RELAXED);
+    highWater = __atomic_load_n(&stats[cls].high_water, __ATOMIC_RELAXED);
+    while (outstanding > highWater
+           && !__atomic_compare_exchange_n(&stats[cls].high_water,
+                                           &highWater, outstanding, true,
+                                           __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED))
+        ;
+
+    new (dgram) DGram(Sizes[cls]);
+    dgram->mPool = cls + 1;
+    return dgram;
+}
+
+// Return @dgram to the cache of the current thread.
+void DGramPool::put(DGram *dgram) {
+    unsigned cls = dgram->mPool - 1;
+
+    __atomic_sub_fetch(&stats[cls].outstanding, 1, __ATOMIC_RELAXED);
+    link(dgram, cache.head[cls]);
+    cache.head[cls] = dgram;
+    if (++cache.count[cls] > CACHE_MAX)
+        spill(&cache, cls, BATCH);
+}
+
+// Return the number of buffers allocated from all classes so far.
+uint64_t DGramPool::allocations() {
+    uint64_t n;
+
+    n = 0;
+    for (unsigned cls = 0; cls < NCLASSES; cls++)
+        n += __atomic_load_n(&stats[cls].hits, __ATOMIC_RELAXED)
+            + __atomic_load_n(&stats[cls].misses, __ATOMIC_RELAXED);
+    return n;
+}
+
+// Print the statistics of all size classes.
+void DGramPool::show() {
+    for (unsigned cls = 0; cls < NCLASSES; cls++)
+        LOG("DGram pool of %zu bytes: hits: %lu, misses: %lu, "
+            "outstanding: %lu, high water: %lu",
+            Sizes[cls], stats[cls].hits, stats[cls].misses,
+            stats[cls].outstanding, stats[cls].high_water);
+}
+// }}}
+
 // Struct Diameter {{{
 // Private methods {{{
 // Check whether both the DIAMETER message and its containing DGram
@@ -1428,6 +2722,30 @@ bool Diameter::addAVP(DGram **dgramPtr, unsigned code,
 
     return true;
 }
+
+// Add an AVP to *dgramPtr whose data is @lprefix bytes of @prefix,
+// which are copied, followed by the @len bytes at @data in @segment,
+// which are not, but sent from where they are.  This has to be the
+// last AVP of the message.
+bool Diameter::addSharedAVP(DGram **dgramPtr, unsigned code,
+                            bool mandatory, unsigned vendorId,
+                            size_t lprefix, const void *prefix,
+                            DGramSegment *segment, const byte *data,
+                            size_t len) {
+    DGram *dgram;
+
+    DIAASSERT(!(*dgramPtr)->mTail);
+    if (!addAVPHeader(dgramPtr, code, mandatory, lprefix + len, vendorId)
+        || !ensure(dgramPtr, lprefix))
+        return false;
+    dgram = *dgramPtr;
+
+    memcpy(dgram->firstUnused(), prefix, lprefix);
+    dgram->mUsed += lprefix;
+    dgram->attach(segment, data, len);
+
+    return true;
+}
 // }}}
 
 // Message construction {{{
@@ -1494,8 +2812,9 @@ bool Diameter::startAVPGroup(DGram **dgramPtr, unsigned code, size_t *cookiep,
 // Close an AVP group.
 void Diameter::finishAVPGroup(DGram *dgram, size_t cookie) {
     // @cookie points to the start of the AVP group.
-    // We want to finalize that AVP's size.
-    writeInt24(dgram, cookie + sizeof(uint32_t), dgram->mUsed - cookie);
+    // We want to finalize that AVP's size, which includes the @mTail
+    // if it was added to the group, without moving it.
+    writeInt24(dgram, cookie + sizeof(uint32_t), dgram->size() - cookie);
 }
 
 // Start a DIAMETER message by writing its header.  All values should be
@@ -1544,8 +2863,8 @@ bool Diameter::startMessage(DGram **dgramPtr,
 // Finish a DIAMETER message by finalizing its header.
 void Diameter::finishMessage(DGram *dgram, size_t cookie) {
     // Write the final message length to the message header.
-    writeInt8_24(dgram, cookie, PROTOCOL_VERSION, dgram->mUsed);
-    DIAASSERT(dgram->mUsed % sizeof(uint32_t) == 0);
+    writeInt8_24(dgram, cookie, PROTOCOL_VERSION, dgram->size());
+    DIAASSERT(dgram->size() % sizeof(uint32_t) == 0);
 }
 
 // Create a simple DIAMETER message in @dgramPtr with the indicated
@@ -2126,6 +3445,71 @@ const byte *Diameter::skipAVPData(const byte *pos, size_t *msgRemPtr,
     return pos;
 }
 
+// Return whether the AVP's data is exactly @str.
+bool Diameter::AVP::equals(const char *str) const {
+    return len == strlen(str) && !memcmp(data, str, len);
+}
+
+// Decode a 32-bit integer-valued AVP.  Returns false if it has
+// a different length.
+bool Diameter::AVP::getInt32(uint32_t *valuep) const {
+    uint32_t value;
+
+    if (len != sizeof(value)) {
+        ERR("Invalid AVP data length %zu", len);
+        return false;
+    }
+
+    memcpy(&value, data, sizeof(value));
+    *valuep = ntohl(value);
+    return true;
+}
+
+// Likewise for 64-bit integers.
+bool Diameter::AVP::getInt64(uint64_t *valuep) const {
+    uint32_t value[2];
+
+    if (len != sizeof(value)) {
+        ERR("Invalid AVP data length %zu", len);
+        return false;
+    }
+
+    memcpy(value, data, sizeof(value));
+    *valuep = (uint64_t)ntohl(value[0]) << 32 | ntohl(value[1]);
+    return true;
+}
+
+// Parse the header of the next AVP into *@avp and step over its data.
+bool Diameter::AVPIterator::next(AVP *avp) {
+    const byte *data;
+
+    if (mFailed || !mRem)
+        return false;
+
+    if (!(data = mDia->parseAVPHeader(mPos, &mRem, &avp->code, &avp->flags,
+                                      &avp->len))) {
+        mFailed = true;
+        return false;
+    }
+
+    // parseAVPHeader() has checked that the Vendor-Id is there.
+    if (avp->flags & FLAG_VENDOR) {
+        uint32_t vendor;
+
+        memcpy(&vendor, data - sizeof(vendor), sizeof(vendor));
+        avp->vendor = ntohl(vendor);
+    } else
+        avp->vendor = 0;
+    avp->data = data;
+
+    if (!(mPos = mDia->skipAVPData(data, &mRem, avp->len))) {
+        mFailed = true;
+        return false;
+    }
+
+    return true;
+}
+
 // Checks whether @dgram (potentially) contains a DIAMETER message.
 // If so, it returns a pointer right after it.  Otherwise if the
 // data in the @dgram cannot possibly be a DIAMETER message (ie.
@@ -2153,42 +3537,149 @@ const byte *Diameter::isMessageComplete(const DGram *dgram,
 // }}}
 
 // Message dumping {{{
-// LOG() the raw details of the AVP at @pos in @dia.  *@remp is the number
-// of bytes this AVP may occupy.
-const byte *Diameter::dumpAVP(const Diameter *dia, const byte *pos,
-                              size_t *remp, unsigned depth) {
-    size_t datalen;
-    unsigned avp, flags, indent;
-
-    if (!(pos = dia->parseAVPHeader(pos, remp, &avp, &flags, &datalen)))
-        // Parse error.
-        return NULL;
+// LOG() the @len bytes of @data of an AVP of @type with @indent:ation.
+// What can't be decoded according to @type is shown in hex.
+static void dumpAVPValue(AVPType type, const byte *data, size_t len,
+                         unsigned indent) {
+    // Seconds between the NTP epoch (1900) and the Unix epoch.
+    static const uint32_t NTP_TO_UNIX = 2208988800u;
+    char str[3*32 + 4];
+    uint32_t u32[2];
+    uint64_t u64;
+    unsigned family;
+
+    switch (type) {
+    case INTEGER32:
+    case UNSIGNED32:
+    case ENUMERATED:
+    case TIME:
+    case FLOAT32:
+        if (len != sizeof(u32[0]))
+            break;
+        memcpy(u32, data, sizeof(u32[0]));
+        u32[0] = ntohl(u32[0]);
+        if (type == INTEGER32)
+            LOG("%*svalue: %d", indent, "", (int32_t)u32[0]);
+        else if (type == TIME) {
+            time_t t = (time_t)u32[0] - NTP_TO_UNIX;
+            struct tm tm;
+
+            strftime(str, sizeof(str), "%Y-%m-%d %H:%M:%S UTC",
+                     gmtime_r(&t, &tm));
+            LOG("%*svalue: %u (%s)", indent, "", u32[0], str);
+        } else if (type == FLOAT32) {
+            float f;
+
+            memcpy(&f, u32, sizeof(f));
+            LOG("%*svalue: %g", indent, "", f);
+        } else
+            LOG("%*svalue: %u", indent, "", u32[0]);
+        return;
 
-    // Print the AVP header with @intent:ataion.
-    indent = (depth + 1) * 2;
-    LOG("%*savp: %u, flags: %.2x", indent, "", avp, flags);
-    LOG("%*sdata size: %zu, remaining: %zu bytes of %zu", indent, "",
-        datalen, *remp, dia->firstUnused() - pos);
+    case INTEGER64:
+    case UNSIGNED64:
+    case FLOAT64:
+        if (len != sizeof(u32))
+            break;
+        memcpy(u32, data, sizeof(u32));
+        u64 = (uint64_t)ntohl(u32[0]) << 32 | ntohl(u32[1]);
+        if (type == INTEGER64)
+            LOG("%*svalue: %ld", indent, "", (int64_t)u64);
+        else if (type == FLOAT64) {
+            double d;
+
+            memcpy(&d, &u64, sizeof(d));
+            LOG("%*svalue: %g", indent, "", d);
+        } else
+            LOG("%*svalue: %lu", indent, "", u64);
+        return;
 
-    switch (avp) {
-    case REQUESTED_SERVICE_UNIT:
-    case SUBSCRIPTION_ID:
-    case USED_SERVICE_UNIT:
-    case MULTIPLE_SERVICES_CC:
-    case USER_EQUIPMENT_INFO:
-    case SERVICE_INFORMATION:
-    case PS_INFORMATION:
-    case SMS_INFORMATION:
+    case ADDRESS:
+        // RFC 6733 4.3.1: a 2-byte AddressType and the address.
+        if (len < 2)
+            break;
+        family = data[0] << 8 | data[1];
+        if (!((family == Diameter::ADDR_IPV4 && len == 2 + 4
+               && inet_ntop(AF_INET, &data[2], str, sizeof(str)))
+              || (family == Diameter::ADDR_IPV6 && len == 2 + 16
+                  && inet_ntop(AF_INET6, &data[2], str, sizeof(str)))))
+            break;
+        LOG("%*svalue: %s", indent, "", str);
+        return;
+
+    case OCTET_STRING:
+    case UTF8_STRING:
+    case DIAMETER_IDENTITY:
+    case DIAMETER_URI: {
+        size_t i;
+
+        for (i = 0; i < len; i++)
+            if (!isprint(data[i]))
+                break;
+        if (i < len)
+            break;
+        LOG("%*svalue: \"%.*s\"", indent, "", (int)len, data);
+        return;
+    }
+
+    case GROUPED:
+        break;
+    }
+
+    // Show the first 32 bytes.
+    str[0] = '\0';
+    for (size_t i = 0, off = 0; i < len && i < 32; i++)
+        off += sprintf(&str[off], "%s%.2x", i ? " " : "", data[i]);
+    LOG("%*svalue: %s%s", indent, "", str, len > 32 ? " ..." : "");
+}
+
+// LOG() the details of the AVP at @pos in @dia, decoding its value if we
+// know its type from the Dictionary.  *@remp is the number of bytes this
+// AVP may occupy.
+const byte *Diameter::dumpAVP(const Diameter *dia, const byte *pos,
+                              size_t *remp, unsigned depth) {
+    size_t datalen;
+    unsigned avp, flags, vendor, indent;
+    const DictAVP *def;
+    const byte *data;
+
+    if (!(pos = dia->parseAVPHeader(pos, remp, &avp, &flags, &datalen)))
+        // Parse error.
+        return NULL;
+
+    // parseAVPHeader() has checked that the Vendor-Id is there.
+    if (flags & FLAG_VENDOR) {
+        uint32_t vendor32;
+
+        memcpy(&vendor32, pos - sizeof(vendor32), sizeof(vendor32));
+        vendor = ntohl(vendor32);
+    } else
+        vendor = 0;
+    def = lookupAVP(avp, vendor);
+
+    // Print the AVP header with @intent:ataion.
+    indent = (depth + 1) * 2;
+    if (vendor)
+        LOG("%*savp: %u (%s), vendor: %u, flags: %.2x", indent, "",
+            avp, def ? def->name : "unknown", vendor, flags);
+    else
+        LOG("%*savp: %u (%s), flags: %.2x", indent, "",
+            avp, def ? def->name : "unknown", flags);
+    LOG("%*sdata size: %zu, remaining: %zu bytes of %zu", indent, "",
+        datalen, *remp, dia->firstUnused() - pos);
+
+    if (def && def->type == GROUPED) {
         // Dump AVP groups recursively.
         *remp -= datalen;
         while (datalen > 0)
             if (!(pos = dia->dumpAVP(dia, pos, &datalen, depth+1)))
                 return NULL;
-        break;
-    default: // One day we might parse and print integers, strings etc.
+    } else {
+        data = pos;
         if (!(pos = dia->skipAVPData(pos, remp, datalen)))
             return NULL;
-        break;
+        dumpAVPValue(def ? def->type : OCTET_STRING, data, datalen,
+                     indent);
     }
 
     // AVP has been parsed successfully.
@@ -2227,1630 +3718,8348 @@ void Diameter::dumpMessage(const Diameter *dia, const byte *pos) {
 // }}}
 // }}}
 
-// Private variables {{{
-// State variable of our rand() implementation.  It's intentionally not
-// in the TLS as random number generation needn't be thread-safe--we just
-// want a non-trivial sequenece of numbers.
-static int32_t MyRanda;
+// Struct Histogram {{{
+// Return the index of the bucket @value belongs to.
+unsigned Histogram::bucketOf(uint64_t value) {
+    unsigned shift;
 
-// Jump to @Quit when a SIGINT or SIGTERM is caught.
-static jmp_buf Quit;
+    if (value < SUB)
+        return value;
 
-// @Verbosity is the flag changed with the -vq flags.
-// -- level 0: don't print anything traffic-related
-// -- level 1: print the sent and received messages
-// -- level 2: print the sent and received bytes
-// -- level 3: decode and dump the sent and received messages
-static unsigned Verbosity = 1;
+    // @shift >= 1, and @value >> @shift is in [HALF, SUB[.
+    shift = (63 - __builtin_clzll(value)) - (SUB_BITS - 1);
+    return SUB + (shift - 1) * HALF + ((value >> shift) - HALF);
+}
 
-// The file descriptors to write all @Input and @Output DGram:s to.
-static int Input = -1, Output = -1;
+// Return the largest value which falls into @bucket.
+uint64_t Histogram::highestValueOf(unsigned bucket) {
+    unsigned shift;
+    uint64_t top;
 
-// @SessionIdCounter is the Session-Id of the last UDR or PNR sent.
-// @LastSessionId is the Session-Id of the last message examined by
-// msgFromPeer().
-//
-// If @StartOfMeasurement is not zero, it designates the time proc_stdin()
-// commenced a measurement of transaction speed.  When @LastMessageSent,
-// its time is recorded.  The measurement ends and its duration is displayed
-// when @LastSessionId reaches @SessionIdCounter.
-static pthread_mutex_t MeasurementLock;
-static uint64_t SessionIdCounter, LastSessionId;
-static struct timespec StartOfMeasurement, LastMessageSent;
-// }}}
+    if (bucket < SUB)
+        return bucket;
 
-// Classless functions {{{
-static void sigint(int) {
-    // Wake up the main thread when SIGINT or SIGTERM is received.
-	longjmp(Quit, 1);
+    bucket -= SUB;
+    shift = bucket / HALF + 1;
+    top = bucket % HALF + HALF;
+    return ((top + 1) << shift) - 1;
 }
 
-// Return a random integer from [@min, @max].  @max-@min must be < UINT_MAX.
-static unsigned rndint(unsigned min, unsigned max) {
-    return min < max ? min + rand() % (max - min + 1) : min;
+void Histogram::record(uint64_t value) {
+    buckets[bucketOf(value)]++;
+    count++;
+    sum += value;
+    if (max < value)
+        max = value;
 }
 
-// Fill @str in with up to @max-1 randomly chosen alphabethical characters
-// and a NUL terminator.  If @max is 0 @str is left alone.
-static void mkRandomString(char *str, unsigned max, unsigned min = 0) {
-    unsigned i, sstr;
+void Histogram::merge(const Histogram *other) {
+    for (unsigned i = 0; i < NBUCKETS; i++)
+        buckets[i] += other->buckets[i];
+    count += other->count;
+    sum += other->sum;
+    if (max < other->max)
+        max = other->max;
+}
 
-    if (!max)
-        return;
+// Return the value below which @pct percent of the recorded values fall.
+uint64_t Histogram::percentile(double pct) const {
+    uint64_t want, seen;
 
-    sstr = rndint(min, max-1);
-    for (i = 0; i < sstr; i++) {
-        unsigned n;
+    if (!count)
+        return 0;
 
-        n = rand() % (('9'-'0'+1) + ('z'-'a'+1) + ('Z'-'A'+1));
-        if (n <= '9'-'0') {
-            // Digit
-            str[i] = '0' + n;
-            continue;
-        }
+    want = pct / 100.0 * count + 0.5;
+    if (!want)
+        want = 1;
 
-        n -= '9'-'0' + 1;
-        if (n <= 'z'-'a') {
-            // Lower letter
-            str[i] = 'a' + n;
-            continue;
+    seen = 0;
+    for (unsigned i = 0; i < NBUCKETS; i++)
+        if ((seen += buckets[i]) >= want) {
+            uint64_t value = highestValueOf(i);
+            return value < max ? value : max;
         }
 
-        // Capital letter
-        n -= 'z'-'a' + 1;
-        str[i] = n + 'A';
-    }
+    return max;
+}
+// }}}
 
-    str[i] = '\0';
+// Struct Metrics {{{
+bool Metrics::enabled;
+thread_local Metrics *Metrics::local;
+Metrics *Metrics::all;
+
+// Return the slot of @key, claiming an empty one if it's not in the
+// table yet.  Only the owner of the table may call it.
+unsigned Metrics::Table::slot(uint32_t key) {
+    unsigned i;
+
+    if (key == OTHER)
+        return NSLOTS - 1;
+
+    // The last slot is reserved for OTHER.
+    i = (key * 0x9E3779B9u) % (NSLOTS - 1);
+    for (unsigned n = 0; n < NSLOTS - 1; n++, i = (i + 1) % (NSLOTS - 1))
+        if (keys[i] == (uint64_t)key + 1)
+            return i;
+        else if (!keys[i]) {
+            __atomic_store_n(&keys[i], (uint64_t)key + 1,
+                             __ATOMIC_RELEASE);
+            return i;
+        }
+
+    if (!keys[NSLOTS - 1])
+        __atomic_store_n(&keys[NSLOTS - 1], (uint64_t)OTHER + 1,
+                         __ATOMIC_RELEASE);
+    return NSLOTS - 1;
 }
 
-// Open @fname and write a PCAP header.
-static int open_pcap(char const *fname) {
-    int hfd;
-    pcap_hdr_t pcap;
+// Add the counters of @other, which may be being updated by its owner.
+void Metrics::Table::add(const Table *other) {
+    for (unsigned i = 0; i < NSLOTS; i++) {
+        uint64_t key;
+        unsigned j;
 
-    if (!fname || (fname[0] == '-' && !fname[1]))
-        hfd = STDOUT_FILENO;
-    else if ((hfd = open(fname, O_CREAT|O_TRUNC|O_WRONLY|O_APPEND,
-                        0666)) < 0) {
-        ERR("open_pcap(%s): %s", fname, strerror(errno));
-        return -1;
+        if (!(key = __atomic_load_n(&other->keys[i], __ATOMIC_ACQUIRE)))
+            continue;
+        j = slot(key - 1);
+        for (unsigned dir = RECEIVED; dir <= SENT; dir++) {
+            messages[j][dir] += __atomic_load_n(&other->messages[i][dir],
+                                                __ATOMIC_RELAXED);
+            bytes[j][dir] += __atomic_load_n(&other->bytes[i][dir],
+                                             __ATOMIC_RELAXED);
+        }
     }
+}
 
-    memset(&pcap, 0, sizeof(pcap));
-    pcap.magic_number   = PCAP_MAGIC;
-    pcap.version_major  = PCAP_VERSION_MAJOR;
-    pcap.version_minor  = PCAP_VERSION_MINOR;
-    pcap.snaplen        = PCAP_MAX_SNAPLEN;
-    pcap.network        = PCAP_DLT_RAW_IPV4;
-    if (write(hfd, &pcap, sizeof(pcap)) < 0) {
-        ERR("open_pcap(): %s", strerror(errno));
-        close(hfd);
-        return -1;
+// Return the counters of the current thread, allocating them if it
+// hasn't got any yet.
+Metrics *Metrics::mine() {
+    Metrics *head;
+
+    if (local)
+        return local;
+    if (!(local = static_cast<Metrics *>(calloc(1, sizeof(*local))))) {
+        ERR("calloc(%zu): %m", sizeof(*local));
+        return NULL;
     }
 
-	return hfd;
+    head = __atomic_load_n(&all, __ATOMIC_RELAXED);
+    do
+        local->next = head;
+    while (!__atomic_compare_exchange_n(&all, &head, local, true,
+                                        __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED));
+    return local;
 }
 
-// Write a PCAP packet header, IP header, SCTP DATA header and @payload
-// to @hfd.  We use SCTP, because Wireshark doesn't decode DIAMETER in
-// UDP, and TCP looks more complicated than SCTP.
-static void write_pcap(int hfd, unsigned sport, unsigned dport,
-                       const void *payload, size_t spayload) {
-    net_hdr_t pkt;
-    unsigned checksum;
-    struct timeval now;
-    struct iovec iov[2];
+// Find the Result-Code or the Experimental-Result-Code among the @rem
+// bytes of AVPs at @pos in @dia.
+bool Metrics::resultCode(const Diameter *dia, const byte *pos, size_t rem,
+                         uint32_t *rcp) {
+    Diameter::AVP avp, sub;
+    Diameter::AVPIterator it(dia, pos, rem);
 
-    memset(&pkt, 0, sizeof(pkt));
-    gettimeofday(&now, NULL);
-    pkt.pcap.ts_sec   = now.tv_sec;
-    pkt.pcap.ts_usec  = now.tv_usec;
-    pkt.pcap.incl_len = sizeof(pkt.ip) + sizeof(pkt.sctp) + spayload;
-    pkt.pcap.orig_len = pkt.pcap.incl_len;
-
-    pkt.ip.version  = 4;
-    pkt.ip.ihl      = sizeof(pkt.ip) / sizeof(uint32_t);
-    pkt.ip.tot_len  = htons(pkt.pcap.incl_len);
-    pkt.ip.ttl      = 16;
-    pkt.ip.protocol = IPPROTO_SCTP;
-    pkt.ip.saddr    = htonl(INADDR_LOOPBACK);
-    pkt.ip.daddr    = htonl(INADDR_LOOPBACK);
+    while (it.next(&avp)) {
+        if (avp.vendor)
+            continue;
+        if (avp.code == Diameter::RESULT_CODE)
+            return avp.getInt32(rcp);
+        if (avp.code == Diameter::EXPERIMENTAL_RESULT) {
+            Diameter::AVPIterator group(dia, avp);
+
+            while (group.next(&sub))
+                if (sub.code == Diameter::EXPERIMENTAL_RESULT_CODE)
+                    return sub.getInt32(rcp);
+        }
+    }
 
-#if __BYTE_ORDER != __LITTLE_ENDIAN
-# warning "This code has only be tested on little-endian machines,"
-# warning "and is likely to break on machines with other bytesex."
-#endif
-    checksum = ntohs((pkt.ip.version << 12)
-            + (pkt.ip.ihl << 8)
-            + (pkt.ip.tos << 0))
-        + pkt.ip.tot_len
-        + pkt.ip.id
-        + pkt.ip.frag_off
-        + ntohs((pkt.ip.ttl << 8) + pkt.ip.protocol)
-        + pkt.ip.check
-        + ((pkt.ip.saddr >> 16) & 0xFFFF) + (pkt.ip.saddr & 0xFFFF)
-        + ((pkt.ip.daddr >> 16) & 0xFFFF) + (pkt.ip.daddr & 0xFFFF);
-    checksum += (uint16_t)(checksum >> 16);
-    pkt.ip.check = ~(uint16_t)checksum;
-
-    pkt.sctp.common.src_port = htons(sport);
-    pkt.sctp.common.dst_port = htons(dport);
-
-    pkt.sctp.data.first_fragment = 1;
-    pkt.sctp.data.final_fragment = 1;
-    pkt.sctp.data.chunk_length = htons(sizeof(pkt.sctp.data) + spayload);
-    pkt.sctp.data.payload_protocol_identifier = htonl(SCTP_PPID_DIAMETER);
-
-    iov[0].iov_base = &pkt;
-    iov[0].iov_len  = sizeof(pkt);
-    iov[1].iov_base = const_cast<void *>(payload);
-    iov[1].iov_len  = spayload;
-    if (writev(hfd, iov, MEMBS_OF(iov)) < 0)
-        ERR("write_pcap(): %s", strerror(errno));
-}
-
-// Send @dgram through @sfd and free it afterwards.
-static void sendDGram(int sfd, unsigned sport, unsigned dport,
-                      DGram *dgram, unsigned stream = 0,
-                      bool freeDGram = true) {
-    bool okay;
+    return false;
+}
 
-    if (!dgram)
+// Account for the message at @msg in @dia, which is being sent or has
+// been received (@dir) on @stream.
+void Metrics::count(unsigned dir, const Diameter *dia,
+                    const byte *msg, unsigned stream) {
+    Metrics *m;
+    uint32_t rc;
+    const byte *pos;
+    size_t rem, len;
+    unsigned cmd, flags, i;
+
+    rem = 0;
+    if (!(m = mine())
+        || !(pos = dia->parseMessageHeader(msg, &rem, &cmd, &flags))
+        || pos == msg)
         return;
+    len = (pos - msg) + rem;
 
-    if (Verbosity > 2)
-        Diameter::dumpMessage(Diameter::fromDGram(dgram));
+    i = m->commands.slot(flags & Diameter::FLAG_REQUEST
+                         ? cmd | REQUEST : cmd);
+    bump(&m->commands.messages[i][dir], 1);
+    bump(&m->commands.bytes[i][dir], len);
 
-    okay = true;
-    if (sfd >= 0) {
-        if (stream == 0) {
-            static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-
-            // Ensure atomicity if transmitting through TCP, because another
-            // thread may want to send something at the same time.  SCTP does
-            // not have this problem.
-            pthread_mutex_lock(&lock);
-            if (write(sfd, dgram->mData, dgram->mUsed) < 0) {
-                ERR("write: %s", strerror(errno));
-                okay = false;
-            }
-            pthread_mutex_unlock(&lock);
-        } else {
-            struct sctp_sndrcvinfo sinfo;
+    i = m->streams.slot(stream);
+    bump(&m->streams.messages[i][dir], 1);
+    bump(&m->streams.bytes[i][dir], len);
 
-            memset(&sinfo, 0, sizeof(sinfo));
-            sinfo.sinfo_stream = stream;
-            if (sctp_send(sfd, dgram->mData, dgram->mUsed, &sinfo, 0) < 0) {
-                ERR("sctp_send(%u): %s", stream, strerror(errno));
-                okay = false;
-            }
-        }
+    if (!(flags & Diameter::FLAG_REQUEST)
+        && resultCode(dia, pos, rem, &rc)) {
+        i = m->results.slot(rc);
+        bump(&m->results.messages[i][dir], 1);
+        bump(&m->results.bytes[i][dir], len);
     }
+}
 
-    if (Output >= 0)
-        write_pcap(Output, sport, dport, dgram->mData, dgram->mUsed);
-    if (okay && Verbosity > 1)
-        LOG("write() %lu", dgram->mUsed);
+// Record the round-trip time of an answered request.
+void Metrics::roundTrip(uint64_t nsecs) {
+    Metrics *m;
 
-    if (freeDGram)
-        free(dgram);
-}
+    if (!(m = mine()))
+        return;
 
-// Return a human-readable translation of @cmd.
-static const char *translate(unsigned cmd, unsigned flags) {
-    static char str[32];
-    const char *cc;
-    bool isRequest = !!(flags & Diameter::FLAG_REQUEST);
-    bool isError   = !!(flags & Diameter::FLAG_ERROR);
+    bump(&m->rtt.buckets[Histogram::bucketOf(nsecs)], 1);
+    bump(&m->rtt.count, 1);
+    bump(&m->rtt.sum, nsecs);
+    if (m->rtt.max < nsecs)
+        __atomic_store_n(&m->rtt.max, nsecs, __ATOMIC_RELAXED);
+}
 
-    if (cmd == Diameter::CER)
-        cc = "CE";
-    else if (cmd == Diameter::DWR)
-        cc = "DW";
-    else if (cmd == Diameter::DPR)
-        cc = "DP";
-    else if (cmd == Diameter::UDR)
-        cc = "UD";
-    else if (cmd == Diameter::PNR)
-        cc = "PN";
-    else {
-        snprintf(str, sizeof(str), "CC%u %s%s", cmd,
-                 isRequest ? "request" : "response",
-                 isError ? " (E)" : "");
-        return str;
+// Sum up the counters of all threads in @sum.
+void Metrics::snapshot(Metrics *sum) {
+    memset(sum, 0, sizeof(*sum));
+    for (const Metrics *m = __atomic_load_n(&all, __ATOMIC_ACQUIRE);
+         m; m = m->next) {
+        uint64_t max;
+
+        sum->commands.add(&m->commands);
+        sum->streams.add(&m->streams);
+        sum->results.add(&m->results);
+
+        for (unsigned i = 0; i < Histogram::NBUCKETS; i++)
+            sum->rtt.buckets[i] += __atomic_load_n(&m->rtt.buckets[i],
+                                                   __ATOMIC_RELAXED);
+        sum->rtt.count += __atomic_load_n(&m->rtt.count,
+                                          __ATOMIC_RELAXED);
+        sum->rtt.sum += __atomic_load_n(&m->rtt.sum, __ATOMIC_RELAXED);
+        max = __atomic_load_n(&m->rtt.max, __ATOMIC_RELAXED);
+        if (sum->rtt.max < max)
+            sum->rtt.max = max;
     }
+}
+// }}}
 
-    snprintf(str, sizeof(str), "%s%c%s",
-             cc, isRequest ? 'R' : 'A', isError ? " (E)" : "");
-    return str;
+// Struct InFlight {{{
+InFlight::InFlight():
+    mEntries(NULL), mMask(0), mUsed(0), mOutstanding(0),
+    mSeq(0), mLastAnswered(0) {
+    pthread_mutex_init(&mLock, NULL);
 }
 
-// Create a simple DIAMETER message with @cmd, Result-Code (unless
-// it's a request), Origin-Host and Origin-Realm.
-static DGram *createSimpleMessage(const ConnectionCtx *ctx,
-                                  unsigned cmd, bool isRequest = true,
-                                  unsigned hbh = 0, unsigned ete = 0,
-                                  unsigned rc = 0) {
-    DGram *dgram;
-    unsigned flags;
+InFlight::~InFlight() {
+    free(mEntries);
+    pthread_mutex_destroy(&mLock);
+}
 
-    if (!hbh)
-        hbh = ctx->hop_by_hop;
-    if (!ete)
-        ete = ctx->end_to_end;
+// Return the preferred slot of the (@hbh, @ete) key.
+size_t InFlight::home(uint32_t hbh, uint32_t ete) const {
+    uint64_t key = ((uint64_t)hbh << 32) | ete;
+    return (key * 0x9E3779B97F4A7C15ull) >> 32 & mMask;
+}
 
-    dgram = NULL;
-    flags = isRequest ? Diameter::FLAG_REQUEST : 0;
-    if (!Diameter::createSimpleMessage(&dgram, cmd, flags,
-                                       hbh, ete,
-                                       ctx->origin.host, ctx->origin.realm,
-                                       rc))
+// Return the entry of (@hbh, @ete) or NULL.
+InFlight::Entry *InFlight::lookup(uint32_t hbh, uint32_t ete) {
+    if (!mEntries)
         return NULL;
 
-    if (Verbosity > 0)
-        LOG("-> %s", translate(cmd, flags));
-    return dgram;
-}
-
-// Add a random Int32 @avp to *@dgramPtr with @vendor as Vendor-ID.
-// If it failes and the AVP was to be a part of a group, roll it back.
-static bool addRandomInt32AVP(DGram **dgramPtr, unsigned avp,
-                               unsigned vendor = 0, unsigned groupStart = 0,
-                               bool mandatory = true) {
-    if (Diameter::addInt32AVP(dgramPtr, avp, rand(), mandatory, vendor))
-        return true;
-    else if (groupStart)
-        (*dgramPtr)->mUsed = groupStart;
-    return false;
+    for (size_t i = home(hbh, ete); mEntries[i].seq; i = (i + 1) & mMask)
+        if (mEntries[i].hbh == hbh && mEntries[i].ete == ete)
+            return &mEntries[i];
+    return NULL;
 }
 
-// Like addRandomInt32AVP(), except that a random string is added.
-static bool addRandomStringAVP(DGram **dgramPtr, unsigned avp,
-                               unsigned vendor = 0, unsigned groupStart = 0,
-                               bool mandatory = true) {
-    char str[64+1];
+// Delete the entry at @idx, and shift the following entries of the cluster
+// back if they'd be closer to their home that way, so lookups don't need
+// tombstones.
+void InFlight::remove(size_t idx) {
+    size_t i, j;
+
+    DIAASSERT(mEntries[idx].seq);
+    for (i = idx, j = (idx + 1) & mMask; mEntries[j].seq;
+         j = (j + 1) & mMask) {
+        size_t k = home(mEntries[j].hbh, mEntries[j].ete);
+
+        // Can @j be moved to @i, ie. is @k cyclically outside ]@i, @j]?
+        if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+            mEntries[i] = mEntries[j];
+            i = j;
+        }
+    }
 
-    mkRandomString(str, sizeof(str));
-    if (Diameter::addStringAVP(dgramPtr, avp, str, mandatory, vendor))
-        return true;
-    else if (groupStart)
-        (*dgramPtr)->mUsed = groupStart;
-    return false;
+    mEntries[i].seq = 0;
+    mUsed--;
 }
 
-// Add Vendor-Id = LBSDIA_SUPPORTED_VENDOR_ID to *@dgramPtr.
-// This is used as the first AVP in a group.
-static bool addVendorId(DGram **dgramPtr, unsigned groupStart) {
-    if (!Diameter::addInt32AVP(dgramPtr, Diameter::VENDOR_ID,
-                               LBSDIA_SUPPORTED_VENDOR_ID)) {
-        (*dgramPtr)->mUsed = groupStart;
+// Double the capacity of the table (or create it).
+bool InFlight::grow() {
+    Entry *old;
+    size_t oldSize, newSize;
+
+    old = mEntries;
+    oldSize = old ? mMask + 1 : 0;
+    newSize = old ? oldSize * 2 : 1024;
+    if (!(mEntries = static_cast<Entry *>(calloc(newSize, sizeof(*old))))) {
+        ERR("calloc(%zu): %m", newSize * sizeof(*old));
+        mEntries = old;
         return false;
-    } else
-        return true;
-}
+    }
 
-// Add Session-Id (<DiameterIdentity>;<high 32 bits>;<low 32 bits>)
-// to *@dgramPtr @at the specified position (or at the end of the dgram).
-// If @dgramPtr is NULL, just return the size of the AVP.
-static size_t addSessionId(DGram **dgramPtr, const ConnectionCtx *ctx,
-                           uint64_t sessionId, size_t at = 0) {
-    char str[64];
-    size_t size, was;
+    mMask = newSize - 1;
+    for (size_t i = 0; i < oldSize; i++) {
+        size_t j;
 
-    if (!dgramPtr) {
-        size = strlen(ctx->origin.host) + 1 + 8 + 1 + 8;
-        return Diameter::MIN_AVP_SIZE + ALIGN4(size);
+        if (!old[i].seq)
+            continue;
+        for (j = home(old[i].hbh, old[i].ete); mEntries[j].seq;
+             j = (j + 1) & mMask)
+            ;
+        mEntries[j] = old[i];
     }
 
-    // 72 bytes
-    size = snprintf(str, sizeof(str), "%s;%.8lx;%.8lx",
-                    ctx->origin.host,
-                    sessionId >> 32, sessionId & 0xFFFFFFFF);
-    size = ALIGN4(size);
-    size += Diameter::MIN_AVP_SIZE;
+    free(old);
+    return true;
+}
+
+// Stamp a request being sent.  If (@hbh, @ete) is already in the table
+// the old request is forgotten.
+void InFlight::add(uint32_t hbh, uint32_t ete,
+                   uint64_t sessionId, uint64_t sent) {
+    Entry *entry;
 
-    if (at) {
-        was = (*dgramPtr)->mUsed;
-        (*dgramPtr)->mUsed = at;
+    pthread_mutex_lock(&mLock);
+    if ((entry = lookup(hbh, ete)) != NULL) {
+        if (!entry->answered)
+            mOutstanding--;
+    } else {
+        size_t i;
+
+        // Keep the load factor below 1/2.
+        if ((mUsed + 1) * 2 > (mEntries ? mMask + 1 : 0) && !grow()) {
+            pthread_mutex_unlock(&mLock);
+            return;
+        }
+
+        for (i = home(hbh, ete); mEntries[i].seq; i = (i + 1) & mMask)
+            ;
+        entry = &mEntries[i];
+        entry->hbh = hbh;
+        entry->ete = ete;
+        mUsed++;
     }
 
-    if (!Diameter::addStringAVP(dgramPtr, Diameter::SESSION_ID, str))
-        size = 0;
+    entry->seq = ++mSeq;
+    entry->sent = sent;
+    entry->sessionId = sessionId;
+    entry->answered = false;
+    mOutstanding++;
+    pthread_mutex_unlock(&mLock);
+}
 
-    if (at)
-        (*dgramPtr)->mUsed = was;
+// Forget a request which couldn't be sent after all.
+void InFlight::cancel(uint32_t hbh, uint32_t ete) {
+    Entry *entry;
 
-    return size;
+    pthread_mutex_lock(&mLock);
+    if ((entry = lookup(hbh, ete)) != NULL) {
+        if (!entry->answered)
+            mOutstanding--;
+        remove(entry - mEntries);
+    }
+    pthread_mutex_unlock(&mLock);
 }
 
-// Add Vendor-Specific-Applicaion-Id to *@dgramPtr.
-static bool addVESA(DGram **dgramPtr) {
-    size_t group;
+// Match an answer with its request, and return a copy of it in *@entryp
+// unless it's UNMATCHED.  REORDERED answers are MATCHED too, but a later
+// request has been answered earlier.
+int InFlight::answer(uint32_t hbh, uint32_t ete, Entry *entryp) {
+    int ret;
+    Entry *entry;
+
+    pthread_mutex_lock(&mLock);
+    if (!(entry = lookup(hbh, ete)))
+        ret = UNMATCHED;
+    else if (entry->answered)
+        ret = DUPLICATE;
+    else {
+        entry->answered = true;
+        mOutstanding--;
+        if (entry->seq > mLastAnswered) {
+            mLastAnswered = entry->seq;
+            ret = MATCHED;
+        } else
+            ret = REORDERED;
+    }
 
-    if (!Diameter::startAVPGroup(dgramPtr, Diameter::VENDOR_SPECIFIC_APP_ID,
-                                 &group))                       // 8 bytes
-        return false;
-    if (!addVendorId(dgramPtr, group))                          // 12 bytes
-        return false;
-    if (!Diameter::addInt32AVP(dgramPtr, Diameter::AUTH_APPLICATION_ID,
-                               Diameter::TGPP_SH))              // 12 bytes
-        return false;
-    Diameter::finishAVPGroup(*dgramPtr, group);
+    if (entry)
+        *entryp = *entry;
+    pthread_mutex_unlock(&mLock);
 
-    // Total: 32 bytes.
-    return true;
+    return ret;
 }
 
-// Add a Random User-Identity { Public-Identity, MSISDN } to *@dgramPtr.
-static bool addUserIdentity(DGram **dgramPtr) {
-    size_t userIdentity;
+// Drop the requests sent before @sentBefore, and call @timedOut for those
+// which haven't been answered.  Returns the number of such requests.
+unsigned InFlight::expire(uint64_t sentBefore,
+                          void (*timedOut)(void *arg, const Entry *entry),
+                          void *arg) {
+    unsigned n;
+
+    n = 0;
+    pthread_mutex_lock(&mLock);
+    for (size_t i = 0; mUsed > 0 && i <= mMask; ) {
+        if (!mEntries[i].seq || mEntries[i].sent >= sentBefore) {
+            i++;
+            continue;
+        }
 
-    if (Diameter::startAVPGroup(dgramPtr, Diameter::USER_IDENTITY,
-                                 &userIdentity, true,   // 12 bytes
-                                 Diameter::VENDOR_3GPP)
-        && addRandomStringAVP(dgramPtr, Diameter::PUBLIC_IDENTITY,
-                              Diameter::VENDOR_3GPP)    // 44 bytes
-        && addRandomStringAVP(dgramPtr, Diameter::MSISDN,
-                              Diameter::VENDOR_3GPP)) {
-        Diameter::finishAVPGroup(*dgramPtr, userIdentity);
-        return true;
-    } else
-        return false;
-}
+        if (!mEntries[i].answered) {
+            timedOut(arg, &mEntries[i]);
+            mOutstanding--;
+            n++;
+        }
 
-// Add a randomly generated User-Data to *@dgramPtr.
-static bool addUserData(DGram **dgramPtr,
-                        size_t minUserData, size_t maxUserData,
-                        const char *publicId, const char *msISDN = NULL) {
-    size_t n;
+        // remove() may move another entry to @i, so look at it again.
+        remove(i);
+    }
+    pthread_mutex_unlock(&mLock);
 
-    // How large User-Data to add?
-    n = rndint(minUserData, maxUserData);
+    return n;
+}
+// }}}
 
-    // Generate @userData and add it to *@dgramPtr.
-    if (msISDN) {
-        const char prefix[] = "Dear %s (%s), your user data is: ";
-        const size_t lprefix = strlen(prefix)
-            -2+strlen(publicId) + -2+strlen(msISDN);
-        char userData[lprefix + n + 1];
+// Session-Id codec {{{
+// Tables of the Session-Id codec: @pairs[b] are the two lowercase
+// hexadecimal digits of the byte b, and @values[c] is the value of the
+// hexadecimal digit c, or 0xFF if c is not one.  Evaluated by the compiler.
+struct HexTables {
+    char pairs[256][2];
+    uint8_t values[256];
+};
 
-        sprintf(userData, prefix, publicId, msISDN);
-        mkRandomString(&userData[lprefix], n+1, n+1);
-        return Diameter::addStringAVP(dgramPtr, Diameter::USER_DATA, userData,
-                                      true, Diameter::VENDOR_3GPP);
-    } else {
-        const char prefix[] = "Dear %s, your user data is: ";
-        const size_t lprefix = strlen(prefix) + -2+strlen(publicId);
-        char userData[lprefix + n + 1];
+static constexpr HexTables mkHexTables() {
+    HexTables tab = { };
+    const char digits[] = "0123456789abcdef";
 
-        sprintf(userData, prefix, publicId);
-        mkRandomString(&userData[lprefix], n+1, n+1);
-        return Diameter::addStringAVP(dgramPtr, Diameter::USER_DATA, userData,
-                                      true, Diameter::VENDOR_3GPP);
+    for (unsigned i = 0; i < 256; i++) {
+        tab.pairs[i][0] = digits[i >> 4];
+        tab.pairs[i][1] = digits[i & 0xF];
+        tab.values[i] = 0xFF;
     }
-}
+    for (unsigned i = 0; i < 10; i++)
+        tab.values['0' + i] = i;
+    for (unsigned i = 0; i < 6; i++)
+        tab.values['a' + i] = tab.values['A' + i] = 10 + i;
 
-// Construct and send a CER on @task, and set up @ctx->cerTimer.
-// Returns whether both duties have been completed successfully.
-static DGram *mkCERorCEA(const ConnectionCtx *ctx, bool isRequest = true) {
-    DGram *cer;
+    return tab;
+}
 
-    // Construct CER.  300 bytes are thought to be enough for it.
-    if (!(cer = DGram::alloc(300)))
-        return NULL;
-    if (!Diameter::startMessage(&cer, Diameter::CER,            // 20 bytes
-                                isRequest ? Diameter::FLAG_REQUEST : 0,
-                                0, ctx->hop_by_hop, ctx->end_to_end))
-        goto out;
-    if (!Diameter::addInt32AVP(&cer, Diameter::RESULT_CODE,     // 12 bytes
-                               Diameter::RC_SUCCESS))
-        goto out;
-    if (!Diameter::addStringAVP(&cer, Diameter::ORIGIN_HOST,    // ~40 bytes
-                                ctx->origin.host))
-        goto out;
-    if (!Diameter::addStringAVP(&cer, Diameter::ORIGIN_REALM,   // ~40 bytes
-                                ctx->origin.realm))
-        goto out;
+static constexpr HexTables HexTab = mkHexTables();
 
-    // Discover our addresses and add them to @cer as Host-IP-Address.
-    if (ctx-> sfd < 0)
-        /* NOP */;
-    else if (ctx->is_sctp) {
-        int n;
-        struct sockaddr *saddrs;
-        const struct sockaddr *saddr;
+// Write @value as 8 lowercase hexadecimal digits to @dst.
+static inline void putHex32(byte *dst, uint32_t value) {
+    memcpy(&dst[6], HexTab.pairs[value         & 0xFF], 2);
+    memcpy(&dst[4], HexTab.pairs[(value >>  8) & 0xFF], 2);
+    memcpy(&dst[2], HexTab.pairs[(value >> 16) & 0xFF], 2);
+    memcpy(&dst[0], HexTab.pairs[value >> 24], 2);
+}
 
-        if ((n = sctp_getladdrs(ctx->sfd, 0, &saddrs)) < 0) {
-            ERR("sctp_getladdrs(): %s", strerror(errno));
-            goto out;
-        } else
-            saddr = saddrs;
-        for (; n > 0; n--) {
-            DMXEndPoint addr;
+// Parse 8 hexadecimal digits at @src into *@valuep.  The digits are
+// accumulated unconditionally, and whether any of them was invalid is
+// only checked at the end.
+static inline bool getHex32(const byte *src, uint32_t *valuep) {
+    uint32_t value;
+    unsigned bad;
 
-            // Max 28 bytes.
-            saddr = addr.fromSockaddr(saddr);
-            if (!Diameter::addAddrAVP(&cer, Diameter::HOST_IP_ADDR,
-                                      &addr.addr)) {
-                sctp_freeladdrs(saddrs);
-                goto out;
-            }
-        }
-        sctp_freeladdrs(saddrs);
-    } else {
-        DMXEndPoint addr;
-        socklen_t ssaddr;
-        struct sockaddr_storage saddr;
+    value = bad = 0;
+    for (unsigned i = 0; i < 8; i++) {
+        unsigned digit = HexTab.values[src[i]];
 
-        if (getsockname(ctx->sfd, (struct sockaddr *)&saddr, &ssaddr) < 0)
-            ERR("getsockname(): %s", strerror(errno));
-        addr.fromSockaddr((struct sockaddr *)&saddr);
-        if (!Diameter::addAddrAVP(&cer, Diameter::HOST_IP_ADDR,
-                                  &addr.addr))
-            goto out;
+        value = value << 4 | (digit & 0xF);
+        bad  |= digit;
     }
 
-    if (!Diameter::addInt32AVP(&cer, Diameter::VENDOR_ID,       // 12 bytes
-                               LBSDIA_VENDOR_ID))
-        goto out;
-    if (!Diameter::addStringAVP(&cer, Diameter::PRODUCT_NAME,   // 16 bytes
-                                LBSDIA_PRODUCT_NAME, false))
-        goto out;
-    if (!Diameter::addInt32AVP(&cer, Diameter::SUPPORTED_VENDOR_ID,
-                               LBSDIA_SUPPORTED_VENDOR_ID))     // 12 bytes
-        goto out;
-    if (!addVESA(&cer))                                         // 32 bytes
-        goto out;
-    if (!Diameter::addInt32AVP(&cer, Diameter::FIRMWARE_REVISION, // 12 bytes
-                               LBSDIA_FIRMWARE_REVISION, false))
-        goto out;
+    *valuep = value;
+    return !(bad & 0xF0);
+}
 
-    // Total: ~252 bytes.
-    Diameter::finishMessage(cer);
+// Parse the numeric part of a Session-Id ("<DiameterIdentity>;<high 32
+// bits>;<low 32 bits>") of @len bytes at @str into *@sessionIdp.
+static bool parseSessionId(const byte *str, size_t len,
+                           uint64_t *sessionIdp) {
+    uint32_t hi, lo;
+    bool ok;
 
-    if (Verbosity > 0)
-        LOG("-> %s", isRequest ? "CER" : "CEA");
-    return cer;
+    if (len < 1+8+1+8 || str[len - (1+8+1+8)] != ';'
+        || str[len - (1+8)] != ';')
+        return false;
+    ok  = getHex32(&str[len - (8+1+8)], &hi);
+    ok &= getHex32(&str[len - 8], &lo);
+    if (!ok)
+        return false;
 
-out:
-    free(cer);
-    return NULL;
+    *sessionIdp = (uint64_t)hi << 32 | lo;
+    return true;
 }
+// }}}
 
-// Add AVPs to *@dgramPtr common in UDR and PNR.
-//  Session-Id:                     addSessionId()
-//  Vendor-Specific-Application-Id: addVESA()
-//  Auth-Session-State:             AUTH_STATE_MAINTAINED
-//  Origin-Host:                    @ctx->origin.host
-//  Origin-Realm:                   @ctx->origin.realm
-//  Destination-Host:               @ctx->destination.host
-//  Destination-Realm:              @ctx->destination.realm
-static bool startUDRorPNR(DGram **dgramPtr, const ConnectionCtx *ctx,
-                          unsigned cmd, unsigned hopByHop = 0,
-                          uint64_t sessionId = 0) {
-    if (!hopByHop)
-        hopByHop = ctx->hop_by_hop;
-    if (!Diameter::startMessage(dgramPtr, cmd, Diameter::FLAG_REQUEST,
-                                Diameter::TGPP_SH,      // 20 bytes
-                                hopByHop, ctx->end_to_end))
-        return false;
+// Struct MsgTemplate {{{
+// Take ownership of @dgram and look for its Session-Id.
+MsgTemplate::MsgTemplate(DGram *dgram): mDGram(dgram), mSessionIdAt(0) {
+    Diameter::AVP avp;
+    uint64_t sessionId;
 
-    // Session-Id, VESA, ASS
-    if (!addSessionId(dgramPtr, ctx, sessionId))        // 72 bytes
-        return false;
-    if (!addVESA(dgramPtr))                             // 32 bytes
-        return false;
-    if (!Diameter::addInt32AVP(dgramPtr, Diameter::AUTH_SESSION_STATE,
-                               Diameter::AUTH_STATE_MAINTAINED))
-        return false;                                   // 12 bytes
+    if (find(Diameter::SESSION_ID, &avp)
+        && parseSessionId(avp.data, avp.len, &sessionId))
+        mSessionIdAt = mDGram->offsetOf(avp.data + avp.len - (8+1+8));
+}
 
-    // {Origin,Destination}-{Host,Realm}                // ~4*40 bytes
-    if (!Diameter::addStringAVP(dgramPtr, Diameter::ORIGIN_HOST,
-                                ctx->origin.host))
-        return false;
-    if (!Diameter::addStringAVP(dgramPtr, Diameter::ORIGIN_REALM,
-                                ctx->origin.realm))
-        return false;
-    if (!Diameter::addStringAVP(dgramPtr, Diameter::DESTINATION_HOST,
-                                ctx->destination.host))
-        return false;
-    if (!Diameter::addStringAVP(dgramPtr, Diameter::DESTINATION_REALM,
-                                ctx->destination.realm))
-        return false;
+MsgTemplate::~MsgTemplate() {
+    DGram::release(mDGram);
+}
 
-    // Total: 296 bytes.
-    return true;
+// Find the first top-level AVP with @code in the template.
+bool MsgTemplate::find(unsigned code, Diameter::AVP *avp) const {
+    Diameter::AVPIterator it(Diameter::fromDGram(mDGram),
+                             mDGram->at(Diameter::HEADER_SIZE),
+                             mDGram->mUsed - Diameter::HEADER_SIZE);
+
+    while (it.next(avp))
+        if (avp->code == code)
+            return true;
+    return false;
 }
 
-// Generate a random User-Data-Request.
-//  User-Identity:
-//      Public-Identity:            mkRandomString()
-//      MSISDN:                     mkRandomString()
-//  Data-Reference:                 REPOSITORY_DATA
-static DGram *mkUDR(const ConnectionCtx *ctx, uint64_t sessionId) {
-    DGram *udr;
+// Return a copy of the template with @hbh, @ete and @sessionId patched in,
+// and with room for at least @reserve more bytes.
+DGram *MsgTemplate::instantiate(unsigned hbh, unsigned ete,
+                                uint64_t sessionId, size_t reserve) const {
+    DGram *dgram;
+    uint32_t ids[2];
 
-    if (!(udr = DGram::alloc(512)))
+    if (!(dgram = DGram::alloc(mDGram->mUsed + reserve)))
         return NULL;
-    if (!startUDRorPNR(&udr, ctx, Diameter::UDR, 0, sessionId)) // 296 bytes
-        goto out;
+    memcpy(dgram->mData, mDGram->mData, mDGram->mUsed);
+    dgram->mUsed = mDGram->mUsed;
+
+    ids[0] = htonl(hbh);
+    ids[1] = htonl(ete);
+    memcpy(dgram->at(12), ids, sizeof(ids));
+    if (mSessionIdAt) {
+        putHex32(dgram->at(mSessionIdAt), sessionId >> 32);
+        putHex32(dgram->at(mSessionIdAt + 8+1), sessionId & 0xFFFFFFFF);
+    }
 
-    // User-Identity, Data-Reference
-    if (!addUserIdentity(&udr))
-        goto out;
-    if (!Diameter::addInt32AVP(&udr, Diameter::DATA_REFERENCE,
-                               Diameter::REPOSITORY_DATA,
-                               true, Diameter::VENDOR_3GPP))
-        goto out;                                       // 16 bytes
+    return dgram;
+}
 
-    // Total: 412 bytes.
-    Diameter::finishMessage(udr);
+// Return a copy of the template with @hbh and @ete patched in, the P bit
+// of the request's header @flags carried over, and the @sessionId AVP
+// (of another message) inserted after the header.
+DGram *MsgTemplate::instantiate(unsigned hbh, unsigned ete, unsigned flags,
+                                const Diameter::AVP &sessionId,
+                                size_t reserve) const {
+    DGram *dgram;
+    const byte *avp;
+    size_t lavp, lheader;
+    uint32_t ids[2];
 
-    if (Verbosity > 0)
-        LOG("-> UDR");
-    return udr;
+    // Copy the whole AVP including its header and padding.
+    lheader = Diameter::MIN_AVP_SIZE
+        + (sessionId.flags & Diameter::FLAG_VENDOR ? sizeof(uint32_t) : 0);
+    avp  = sessionId.data - lheader;
+    lavp = lheader + ALIGN4(sessionId.len);
 
-out:
-    free(udr);
-    return NULL;
+    if (!(dgram = DGram::alloc(mDGram->mUsed + lavp + reserve)))
+        return NULL;
+    memcpy(dgram->mData, mDGram->mData, Diameter::HEADER_SIZE);
+    memcpy(dgram->at(Diameter::HEADER_SIZE), avp, lavp);
+    memcpy(dgram->at(Diameter::HEADER_SIZE + lavp),
+           mDGram->at(Diameter::HEADER_SIZE),
+           mDGram->mUsed - Diameter::HEADER_SIZE);
+    dgram->mUsed = mDGram->mUsed + lavp;
+
+    ids[0] = htonl(hbh);
+    ids[1] = htonl(ete);
+    memcpy(dgram->at(12), ids, sizeof(ids));
+    dgram->mData[sizeof(uint32_t)] |= flags & Diameter::FLAG_PROXIABLE;
+    Diameter::finishMessage(dgram);
+
+    return dgram;
 }
+// }}}
 
-// Generate a random Push-Notification-Request.
-static DGram *mkPNR(const ConnectionCtx *ctx,
-                    unsigned hopByHop, uint64_t sessionId) {
-    DGram *pnr;
-    char publicIdentity[32+1];
+// Struct TimerWheel {{{
+TimerWheel::TimerWheel(): mTick(0), mPending(0) {
+    for (unsigned l = 0; l < LEVELS; l++)
+        for (unsigned i = 0; i < SLOTS; i++)
+            mSlots[l][i].next = mSlots[l][i].prev = &mSlots[l][i];
+}
 
-    if (!(pnr = DGram::alloc(412 + ctx->max_user_data)))
-        return NULL;
-    if (!startUDRorPNR(&pnr, ctx, Diameter::PNR, hopByHop, sessionId))
-        goto out;                   // 296 bytes
+// Put @timer in the slot of the lowest level which reaches its due tick.
+void TimerWheel::link(Timer *timer) {
+    Timer *head;
+    uint64_t due;
+    unsigned level;
+
+    // Round up, so that timers never fire early.
+    due = (timer->due + TICK - 1) / TICK;
+    if (due < mTick)
+        due = mTick;
+    for (level = 0; level < LEVELS - 1; level++)
+        if (due - mTick < (uint64_t)SLOTS << (level * LEVEL_BITS))
+            break;
+    if (due - mTick >= (uint64_t)SLOTS << (level * LEVEL_BITS))
+        // Too far in the future, park it in the last slot we can.
+        due = mTick + ((uint64_t)SLOTS << (level * LEVEL_BITS)) - 1;
+
+    // Append it, so that timers due at the same tick fire in order.
+    head = &mSlots[level][(due >> (level * LEVEL_BITS)) & (SLOTS - 1)];
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
 
-    // Public-Identity              // 44 bytes
-    mkRandomString(publicIdentity, sizeof(publicIdentity));
-    if (!Diameter::addStringAVP(&pnr, Diameter::PUBLIC_IDENTITY,
-                                publicIdentity, true,
-                                Diameter::VENDOR_3GPP))
-        goto out;
-    // User-Data                    12 + 29 + 31 + @maxUserData bytes
-    if (!addUserData(&pnr, ctx->min_user_data, ctx->max_user_data,
-                     publicIdentity))
-        goto out;
+// Schedule @timer at @timer->due.  If it's pending already, it's moved.
+void TimerWheel::add(Timer *timer) {
+    if (timer->pending())
+        cancel(timer);
+    link(timer);
+    mPending++;
+}
 
-    // Total: 412 + @maxUserData.
-    Diameter::finishMessage(pnr);
+void TimerWheel::cancel(Timer *timer) {
+    if (!timer->pending())
+        return;
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+    DIAASSERT(mPending > 0);
+    mPending--;
+}
 
-    if (Verbosity > 0)
-        LOG("-> PNR");
-    return pnr;
+// Redistribute the timers of a slot among the lower levels.
+void TimerWheel::cascade(unsigned level, unsigned slot) {
+    Timer *head, *timer;
 
-out:
-    free(pnr);
-    return NULL;
+    head = &mSlots[level][slot];
+    while ((timer = head->next) != head) {
+        head->next = timer->next;
+        timer->next->prev = head;
+        link(timer);
+    }
 }
 
-// Return a randomly generated User-Data response.
-static DGram *mkUDA(const ConnectionCtx *ctx, const Diameter *dia,
-                    const byte *udr, size_t rem) {
-    DGram *reply;
-    size_t datalen;
-    unsigned avp, flags;
-    bool sessionIdFound;
-    char *publicId, *msISDN;
+// Fire the timers due until @now.
+void TimerWheel::advance(uint64_t now) {
+    uint64_t until;
 
-    // Retrieve Session-Id, Public-Identity and MSISDN from @dia.
-    reply = NULL;
-    sessionIdFound = false;
-    publicId = msISDN = NULL;
-    while ((udr = dia->parseAVPHeader(udr, &rem, &avp, &flags, &datalen))) {
-       if (avp == Diameter::USER_IDENTITY) {
-            size_t group;
-
-            group = datalen;
-            if (rem < group) {
-                ERR("Invalid USER_IDENTITY data length");
-                goto out;
-            }
-            rem -= group;
+    until = now / TICK;
+    if (!mPending) {
+        // Nothing to do, just catch up.
+        if (mTick <= until)
+            mTick = until + 1;
+        return;
+    }
 
-            // This is a group AVP.
-            if (!(udr = dia->parseAVPHeader(udr, &group,
-                                            &avp, &flags, &datalen)))
-                goto out;
-            if (!(udr = dia->parseString(udr, &group, datalen, &publicId)))
-                goto out;
-            if (!(udr = dia->parseAVPHeader(udr, &group,
-                                            &avp, &flags, &datalen)))
-                goto out;
-            if (!(udr = dia->parseString(udr, &group, datalen, &msISDN)))
-                goto out;
+    for (; mTick <= until; mTick++) {
+        Timer *head, *timer;
+        unsigned top;
 
-            if (sessionIdFound)
+        // Cascade from the highest level whose slot boundary we're at.
+        for (top = 0; top + 1 < LEVELS; top++)
+            if (mTick & ((1ull << ((top + 1) * LEVEL_BITS)) - 1))
                 break;
-        } else {
-            if (avp == Diameter::SESSION_ID) {
-                sessionIdFound = true;
-                if (publicId && msISDN)
-                    break;
-            }
-            if (!(udr = dia->skipAVPData(udr, &rem, datalen)))
-                goto out;
+        for (unsigned level = top; level > 0; level--)
+            cascade(level, (mTick >> (level * LEVEL_BITS)) & (SLOTS - 1));
+
+        // @fun may add timers to this very slot.
+        head = &mSlots[0][mTick & (SLOTS - 1)];
+        while ((timer = head->next) != head) {
+            cancel(timer);
+            timer->fun(timer->arg);
         }
-    } // for each AVP
+    }
+}
 
-    // Create a response.
-    if (!(reply = dia->dupe()))
-        goto out;
+// Tell when advance() needs to be called next if there's any timer.
+// It may be earlier than when the next timer is due, because it may
+// need to be cascaded first.
+bool TimerWheel::next(uint64_t *duep) const {
+    uint64_t best;
 
-    // Have we found every AVP we were looking for?
-    if (!sessionIdFound || !publicId || !msISDN) {
-        // Reply an error message.
-        if (!dia->makeResponse(&reply, true,
-                               Diameter::RC_MISSING_AVP,
-                               ctx->origin.host, ctx->origin.realm))
-            goto out;
-    } else {
-        if (!dia->makeResponse(&reply, false,
-                               Diameter::RC_SUCCESS,
-                               ctx->origin.host, ctx->origin.realm))
-            goto out;
-        if (!addUserData(&reply, ctx->min_user_data, ctx->max_user_data,
-                         publicId, msISDN))
-            goto out;
-        Diameter::finishMessage(reply);
-    }
+    if (!mPending)
+        return false;
 
-    if (Verbosity > 0)
-        LOG("-> UDA");
-    free(publicId);
-    free(msISDN);
-    return reply;
+    // Find the first non-empty slot on each level.
+    best = UINT64_MAX;
+    for (unsigned level = 0; level < LEVELS; level++) {
+        uint64_t unit, tick;
 
-out:
-    free(publicId);
-    free(msISDN);
-    free(reply);
-    return NULL;
+        unit = 1ull << (level * LEVEL_BITS);
+        tick = (mTick + unit - 1) & ~(unit - 1);
+        for (unsigned i = 0; i < SLOTS && tick < best; i++, tick += unit) {
+            const Timer *head;
+
+            head = &mSlots[level][(tick >> (level * LEVEL_BITS))
+                                  & (SLOTS - 1)];
+            if (head->next != head) {
+                best = tick;
+                break;
+            }
+        }
+    }
+
+    *duep = best * TICK;
+    return true;
 }
+// }}}
 
-// Returns whether we're waiting for the end of a measurement of
-// the round-trip time of multiple transactions.  During this period
-// the user can't send messages.
-static bool measurementInProgress() {
-    return StartOfMeasurement.tv_sec || StartOfMeasurement.tv_nsec;
+// Struct IoRing {{{
+// Set up a ring with @entries SQE:s and register the receive buffers.
+// Fails if the kernel doesn't support anything we need, like multishot
+// receive, which came with Linux 6.0.
+bool IoRing::init(unsigned entries) {
+    struct io_uring_params params;
+
+    // Ask for more CQE:s, because a multishot receive can post many
+    // of them.  Retry without the flags old kernels don't know.
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL
+        | IORING_SETUP_SINGLE_ISSUER;
+    params.cq_entries = 4 * entries;
+    if ((mFd = syscall(__NR_io_uring_setup, entries, &params)) < 0
+        && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = 4 * entries;
+        mFd = syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (mFd < 0) {
+        ERR("io_uring_setup(): %s", strerror(errno));
+        return false;
+    } else if (!(params.features & IORING_FEAT_SINGLE_MMAP)
+               || !(params.features & IORING_FEAT_NODROP)) {
+        ERR("io_uring: the kernel is too old");
+        destroy();
+        return false;
+    }
+
+    if (!mapRings(&params) || !provideBuffers() || !probeMultishot()) {
+        destroy();
+        return false;
+    }
+
+    return true;
 }
 
-// Return the time in seconds elapsed @since.  If @nowp is not NULL,
-// the current CLOCK_MONOTONIC time is taken from there.
-static double measurementTime(
-                        const struct timespec *since = &StartOfMeasurement,
-                        struct timespec *nowp = NULL) {
-    double elapsed;
-    struct timespec now;
+// Map the submission and completion rings of @params and the SQE:s.
+bool IoRing::mapRings(const struct io_uring_params *params) {
+    unsigned *array;
+    byte *rings;
+
+    mRingsSize = params->sq_off.array + params->sq_entries*sizeof(unsigned);
+    if (mRingsSize < params->cq_off.cqes
+                     + params->cq_entries*sizeof(struct io_uring_cqe))
+        mRingsSize = params->cq_off.cqes
+            + params->cq_entries*sizeof(struct io_uring_cqe);
+    if ((mRings = mmap(NULL, mRingsSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, mFd,
+                       IORING_OFF_SQ_RING)) == MAP_FAILED) {
+        mRings = NULL;
+        ERR("io_uring: mmap(): %m");
+        return false;
+    }
 
-    if (!nowp) {
-        nowp = &now;
-        clock_gettime(CLOCK_MONOTONIC, &now);
+    mSqesSize = params->sq_entries * sizeof(struct io_uring_sqe);
+    if ((mSqes = static_cast<struct io_uring_sqe *>(
+                    mmap(NULL, mSqesSize, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, mFd,
+                         IORING_OFF_SQES))) == MAP_FAILED) {
+        mSqes = NULL;
+        ERR("io_uring: mmap(): %m");
+        return false;
     }
 
-    elapsed  = (nowp->tv_sec  - since->tv_sec);
-    elapsed += (nowp->tv_nsec - since->tv_nsec) / 1000000000.0;
+    rings = static_cast<byte *>(mRings);
+    mSqKHead = reinterpret_cast<unsigned *>(&rings[params->sq_off.head]);
+    mSqKTail = reinterpret_cast<unsigned *>(&rings[params->sq_off.tail]);
+    mSqMask = *reinterpret_cast<unsigned *>(
+                                    &rings[params->sq_off.ring_mask]);
+    mSqEntries = params->sq_entries;
+    mSqTail = mSqSubmitted = *mSqKTail;
+    mCqKHead = reinterpret_cast<unsigned *>(&rings[params->cq_off.head]);
+    mCqKTail = reinterpret_cast<unsigned *>(&rings[params->cq_off.tail]);
+    mCqMask = *reinterpret_cast<unsigned *>(
+                                    &rings[params->cq_off.ring_mask]);
+    mCqes = reinterpret_cast<struct io_uring_cqe *>(
+                                    &rings[params->cq_off.cqes]);
+
+    // SQE:s are submitted in order, so the indirection is the identity.
+    array = reinterpret_cast<unsigned *>(&rings[params->sq_off.array]);
+    for (unsigned i = 0; i < mSqEntries; i++)
+        array[i] = i;
 
-    return elapsed;
+    return true;
 }
 
-// Depending on @ctx->is_client, return either an UDR or a PNR.
-static DGram *mkUDRorPNR(const ConnectionCtx *ctx, uint64_t sessionId) {
-    unsigned hbh;
+// Allocate the receive buffers and register them with the kernel
+// as buffer group 0.
+bool IoRing::provideBuffers() {
+    struct io_uring_buf_reg reg;
+
+    if ((mBufRing = static_cast<struct io_uring_buf *>(
+                    mmap(NULL, URING_RECV_BUFS*sizeof(struct io_uring_buf),
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)))
+            == MAP_FAILED) {
+        mBufRing = NULL;
+        ERR("io_uring: mmap(): %m");
+        return false;
+    } else if ((mBufs = static_cast<byte *>(
+                    mmap(NULL, URING_RECV_BUFS*URING_RECV_BUF_SIZE,
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)))
+            == MAP_FAILED) {
+        mBufs = NULL;
+        ERR("io_uring: mmap(): %m");
+        return false;
+    }
 
-    if (ctx->is_client)
-        return mkUDR(ctx, sessionId);
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)mBufRing;
+    reg.ring_entries = URING_RECV_BUFS;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, mFd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) < 0) {
+        ERR("io_uring_register(PBUF_RING): %s", strerror(errno));
+        return false;
+    }
 
-    // If we're talking to DiaLBS the high 16-bit of the Hop-by-Hop Id
-    // will decide which client gets our message.
-    hbh  = rndint(ctx->min_lga, ctx->max_lga) << 16;
-    hbh |= ctx->hop_by_hop & 0xF;
-    return mkPNR(ctx, hbh, sessionId);
+    mBufTail = 0;
+    for (unsigned bid = 0; bid < URING_RECV_BUFS; bid++)
+        recycle(bid);
+
+    return true;
 }
 
-// Compile a DIAMETER message with randomly chosen AVPs.
-static DGram *mkRandom(const ConnectionCtx *ctx, uint64_t sessionId) {
-    DGram *dgram;
-    unsigned navps;
+// See whether multishot receive works on a socket pair.
+bool IoRing::probeMultishot() {
+    int fds[2];
+    struct io_uring_sqe *sqe;
+    const struct io_uring_cqe *cqe;
+    bool ok;
 
-    if (!(dgram = DGram::alloc(512)))
-        return NULL;
-    if (!Diameter::startMessage(&dgram,
-                                ctx->is_client
-                                    ? Diameter::UDR
-                                    : Diameter::PNR,
-                                Diameter::FLAG_REQUEST,
-                                Diameter::TGPP_SH,
-                                ctx->hop_by_hop, ctx->end_to_end)) {
-        free(dgram);
-        return NULL;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        ERR("socketpair(): %m");
+        return false;
     }
 
-    if (measurementInProgress() && !addSessionId(&dgram, ctx, sessionId))
-        return NULL;
+    sqe = get();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fds[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    if (write(fds[1], "", 1) < 0 || !submit(1)) {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
 
-    // The return values of the add*() functions are not checked
-    // intentionally, because their failure doesn't block the whole
-    // operation.
-    for (navps = rand() % 25; navps > 0; navps--) {
-        size_t group;
+    // Closing the other end terminates the receive.
+    close(fds[1]);
+    ok = true;
+    for (;;) {
+        bool more;
 
-        switch (rand() % 20) {
-		case 0:  /* AUTH_SESSION_STATE */
-            Diameter::addInt32AVP(&dgram,
-                                  Diameter::AUTH_SESSION_STATE,
-                                  rand() % 2);
-            break;
-		case 1:  /* DATA_REFERENCE */
-            Diameter::addInt32AVP(&dgram,
-                                  Diameter::DATA_REFERENCE,
-                                  Diameter::REPOSITORY_DATA,
-                                  true, Diameter::VENDOR_3GPP);
-            break;
-		case 2:  /* DESTINATION_HOST */
-            addRandomStringAVP(&dgram, Diameter::DESTINATION_HOST);
-            break;
-		case 3:  /* DESTINATION_REALM */
-            addRandomStringAVP(&dgram, Diameter::DESTINATION_REALM);
-            break;
-		case 4:  /* ERROR_MESSAGE */
-            addRandomStringAVP(&dgram, Diameter::ERROR_MESSAGE);
-            break;
-		case 5:  /* ERROR_REPORTING_HOST */
-            addRandomStringAVP(&dgram, Diameter::ERROR_REPORTING_HOST);
-            break;
-		case 6:  /* EXPERIMENTAL_RESULT */
-            if (Diameter::startAVPGroup(&dgram,
-                                         Diameter::EXPERIMENTAL_RESULT,
-                                         &group)
-                && addVendorId(&dgram, group)
-                && addRandomInt32AVP(&dgram,
-                                     Diameter::EXPERIMENTAL_RESULT_CODE,
-                                     0, group))
-                Diameter::finishAVPGroup(dgram, group);
-            break;
-		case 7:  /* EXPIRY_TIME */
-            addRandomInt32AVP(&dgram, Diameter::EXPIRY_TIME,
-                              Diameter::VENDOR_3GPP, 0, false);
-            break;
-		case 8:  /* FAILED_AVP */
-            if (Diameter::startAVPGroup(&dgram, Diameter::FAILED_AVP, &group)
-                && addRandomStringAVP(&dgram,Diameter::PRODUCT_NAME,0,group))
-                Diameter::finishAVPGroup(dgram, group);
-            break;
-		case 9:  /* ORIGIN_HOST */
-            addRandomStringAVP(&dgram, Diameter::ORIGIN_HOST);
-            break;
-		case 10: /* ORIGIN_REALM */
-            addRandomStringAVP(&dgram, Diameter::ORIGIN_REALM);
-            break;
-		case 11: /* ORIGIN_STATE_ID */
-            addRandomInt32AVP(&dgram, Diameter::ORIGIN_STATE_ID);
-            break;
-		case 12: /* PROXY_INFO */
-            if (Diameter::startAVPGroup(&dgram, Diameter::PROXY_INFO, &group)
-                && addRandomStringAVP(&dgram, Diameter::PROXY_HOST, 0, group)
-                && addRandomStringAVP(&dgram,Diameter::PROXY_STATE,0,group))
-                Diameter::finishAVPGroup(dgram, group);
-            break;
-		case 13: /* RESULT_CODE */
-            addRandomInt32AVP(&dgram, Diameter::RESULT_CODE);
-            break;
-		case 14: /* SEND_DATA_INDICATION */
-            addRandomInt32AVP(&dgram, Diameter::SEND_DATA_INDICATION,
-                              Diameter::VENDOR_3GPP, 0, false);
-            break;
-		case 15: /* SESSION_ID */
-            addSessionId(&dgram, ctx, rndint(0, UINT_MAX-1));
-            break;
-		case 16: /* SUBS_REQ_TYPE */
-            addRandomInt32AVP(&dgram, Diameter::SUBS_REQ_TYPE,
-                              Diameter::VENDOR_3GPP);
-            break;
-		case 17: /* SUPPORTED_FEATURES */
-            if (Diameter::startAVPGroup(&dgram, Diameter::SUPPORTED_FEATURES,
-                                         &group, false, Diameter::VENDOR_3GPP)
-                && addVendorId(&dgram, group)
-                && addRandomInt32AVP(&dgram, Diameter::FEATURE_LIST_ID,
-                                     Diameter::VENDOR_3GPP, group, false)
-                && addRandomInt32AVP(&dgram, Diameter::FEATURE_LIST,
-                                     Diameter::VENDOR_3GPP, group, false))
-                Diameter::finishAVPGroup(dgram, group);
-            break;
-		case 18: /* USER_IDENTITY */
-            addUserIdentity(&dgram);
-            break;
-		case 19: /* VENDOR_SPECIFIC_APP_ID */
-            addVESA(&dgram);
-            break;
+        if (!(cqe = peek())) {
+            if (!submit(1))
+                break;
+            continue;
         }
+
+        if (cqe->res < 0)
+            ok = false;
+        if (cqe->flags & IORING_CQE_F_BUFFER)
+            recycle(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        more = cqe->flags & IORING_CQE_F_MORE;
+        seen();
+        if (!more)
+            break;
     }
+    close(fds[0]);
 
-    Diameter::finishMessage(dgram);
-    if (Verbosity > 0)
-        LOG("-> %s", ctx->is_client ? "UDR" : "PNR");
-    return dgram;
+    if (!ok)
+        ERR("io_uring: multishot receive is not supported");
+    return ok;
 }
 
-// Just allocate a DGram and start a DIAMETER message.
-static DGram *mkEmpty(const ConnectionCtx *ctx) {
-    DGram *dgram;
-    unsigned cmd, hbh;
+void IoRing::destroy() {
+    if (mFd < 0)
+        return;
+    close(mFd);
+    mFd = -1;
+    if (mRings)
+        munmap(mRings, mRingsSize);
+    if (mSqes)
+        munmap(mSqes, mSqesSize);
+    if (mBufRing)
+        munmap(mBufRing, URING_RECV_BUFS*sizeof(struct io_uring_buf));
+    if (mBufs)
+        munmap(mBufs, URING_RECV_BUFS*URING_RECV_BUF_SIZE);
+    mRings = mSqes = NULL;
+    mBufRing = NULL;
+    mBufs = NULL;
+}
 
-    if (ctx->is_client) {
-        cmd  = Diameter::UDR;
-        hbh  = ctx->hop_by_hop;
-    } else {
-        cmd  = Diameter::PNR;
-        hbh  = rndint(ctx->min_lga, ctx->max_lga) << 16;
-        hbh |= ctx->hop_by_hop & 0xF;
-    }
+// Return a cleared SQE, submitting the pending ones if the queue is full.
+struct io_uring_sqe *IoRing::get() {
+    struct io_uring_sqe *sqe;
 
-    if (!(dgram = DGram::alloc(512)))
-        return NULL;
-    if (!Diameter::startMessage(&dgram, cmd, Diameter::FLAG_REQUEST,
-                                Diameter::TGPP_SH,
-                                hbh, ctx->end_to_end)) {
-        free(dgram);
-        return NULL;
+    while (mSqTail - __atomic_load_n(mSqKHead, __ATOMIC_ACQUIRE)
+           >= mSqEntries)
+        if (!submit())
+            return NULL;
+
+    sqe = &mSqes[mSqTail++ & mSqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// Submit the SQE:s gotten since the last time, and wait for @wait CQE:s.
+bool IoRing::submit(unsigned wait) {
+    int n;
+
+    if (mSqTail == mSqSubmitted && !wait)
+        return true;
+    __atomic_store_n(mSqKTail, mSqTail, __ATOMIC_RELEASE);
+    do
+        n = syscall(__NR_io_uring_enter, mFd, mSqTail - mSqSubmitted,
+                    wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        ERR("io_uring_enter(): %m");
+        return false;
     }
 
-    return dgram;
+    mSqSubmitted += n;
+    return true;
 }
 
-// If we're a client talking to DiaLBS the output stream will decide
-// which server our message is meant for.
-static void sendMessage(const ConnectionCtx *ctx, DGram *dgram,
-                        bool freeDGram = true) {
-    if (ctx->is_client)
-        sendDGram(ctx->sfd, DIAMETER_CLIENT_PORT, DIAMETER_SERVER_PORT,
-                  dgram, rndint(ctx->min_stream, ctx->max_stream),
-                  freeDGram);
-    else // server
-        sendDGram(ctx->sfd, DIAMETER_SERVER_PORT, DIAMETER_CLIENT_PORT,
-                  dgram, 0, freeDGram);
+// Return the next CQE or NULL.  It's valid until seen().
+const struct io_uring_cqe *IoRing::peek() const {
+    unsigned head = *mCqKHead;
+
+    return head != __atomic_load_n(mCqKTail, __ATOMIC_ACQUIRE)
+        ? &mCqes[head & mCqMask] : NULL;
 }
 
-// Handle incoming DIAMETER requests and replies.
-static bool msgFromPeer(ConnectionCtx *ctx, const DGram *dgram) {
-    const Diameter *dia;
-    const byte *ptr;
-    size_t rem;
-    unsigned cmd, flags, hbh, ete;
+// Let the kernel reuse the CQE returned by peek().
+void IoRing::seen() {
+    __atomic_store_n(mCqKHead, *mCqKHead + 1, __ATOMIC_RELEASE);
+}
 
-    // The caller has made sure that we have a complete DIAMETER message.
-    rem = 0;
-    dia = Diameter::fromDGram(dgram);
-    ptr = dia->parseMessageHeader(NULL, &rem, &cmd, &flags, NULL, &hbh, &ete);
-    DIAASSERT(ptr && dgram->begin() < ptr && ptr <= dgram->firstUnused());
+// Give the kernel back the receive buffer @bid.  The ring is indexed
+// by hand, because in C++ the empty struct before the flexible @bufs
+// of struct io_uring_buf_ring takes space.  Its tail overlays the @resv
+// of the first buffer.
+void IoRing::recycle(unsigned bid) {
+    struct io_uring_buf *buf;
+
+    buf = &mBufRing[mBufTail & (URING_RECV_BUFS - 1)];
+    buf->addr = (uintptr_t)buffer(bid);
+    buf->len = URING_RECV_BUF_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&mBufRing[0].resv, ++mBufTail, __ATOMIC_RELEASE);
+}
+// }}}
 
-    if (Verbosity > 0)
-        LOG("<- %s", translate(cmd, flags));
-    if (Verbosity > 2)
-        Diameter::dumpMessage(dia);
-    switch (cmd) {
-    case Diameter::CER: { // {{{
-        unsigned avp;
-        char *str;
-        size_t datalen;
-        unsigned resultCode;
-        bool gotOriginHost, gotOriginRealm;
+// Private variables {{{
+// State variable of our rand() implementation.  It's intentionally not
+// in the TLS as random number generation needn't be thread-safe--we just
+// want a non-trivial sequenece of numbers.
+static int32_t MyRanda;
 
-        // Reply to CER.
-        if (flags & Diameter::FLAG_REQUEST) {
-            sendDGram(ctx->sfd, DIAMETER_PORTS(ctx), mkCERorCEA(ctx, false),
-                      dgram->mStreamId);
-            return true;
-        }
+// State of xorshift(), the generator of the fuzzer.  Unlike rand(), every
+// thread has its own, so that a fuzz run is reproducible from its seed.
+static thread_local uint64_t Xorshift;
 
-        // Parse the AVP:s looking for Origin-Host, Origin-Realm (which
-        // must be present and equal to what we expect) and Result-Code
-        // (which should be 2xxx).
-        resultCode = 0;
-        gotOriginHost = gotOriginRealm = false;
-        while ((ptr = dia->parseAVPHeader(ptr, &rem, &avp, &flags,
-                                          &datalen))) {
-            switch (avp) {
-            case Diameter::RESULT_CODE:
-                if (!(ptr = dia->parseInt32(ptr, &rem, datalen,
-                                            &resultCode)))
-                    return true;
-                break;
-            case Diameter::ORIGIN_HOST:
-                if (!(ptr = dia->parseString(ptr, &rem, datalen, &str)))
-                    return true;
-                if (strcmp(str, ctx->destination.host)) {
-                    ERR("Origin-Host mismatch (%s vs. %s)",
-                        str, ctx->destination.host);
-                    free(str);
-                    return true;
-                } else {
-                    free(str);
-                    gotOriginHost = true;
-                }
-                break;
-            case Diameter::ORIGIN_REALM:
-                if (!(ptr = dia->parseString(ptr, &rem, datalen, &str)))
-                    return true;
-                if (strcmp(str, ctx->destination.realm)) {
-                    ERR("Origin-Realm mismatch (%s vs. %s)",
-                        str, ctx->destination.realm);
-                    free(str);
-                    return true;
-                } else {
-                    free(str);
-                    gotOriginRealm = true;
-                }
-                break;
-            default:
-                if (!(ptr = dia->skipAVPData(ptr, &rem, datalen)))
-                    return true;
-                break;
-            }
+// Jump to @Quit when a SIGINT or SIGTERM is caught.
+static jmp_buf Quit;
 
-            // Stop as soon as we've got we're looking for.
-            if (resultCode && gotOriginHost && gotOriginRealm) {
-                if (flags & Diameter::FLAG_ERROR)
-                    break;
-                if (resultCode / 1000 != 2)
-                    break;
-                return true;
-            }
-        } // parse CEA
+// @Verbosity is the flag changed with the -vq flags.
+// -- level 0: don't print anything traffic-related
+// -- level 1: print the sent and received messages
+// -- level 2: print the sent and received bytes
+// -- level 3: decode and dump the sent and received messages
+static unsigned Verbosity = 1;
 
-        // Log what went wrong.
-        ERR("Bogus CEA");
-        if (!(flags & Diameter::FLAG_PARSE_ERROR)) {
-            if (flags & Diameter::FLAG_ERROR)
-                ERR("Error %u", resultCode);
-            else if (resultCode)
-                ERR("Result-Code %u", resultCode);
-            if (!gotOriginHost)
-                ERR("Origin-Host missing from CEA");
-            if (!gotOriginRealm)
-                ERR("Origin-Realm missing from CEA");
-        }
-        return true; // }}}
-    } case Diameter::DPR: { // {{{
-        unsigned avp;
-        size_t datalen;
-        bool rebooting;
+// The file descriptors to write all @Input and @Output DGram:s to,
+// and both of them to the binary @Trace.
+static int Input = -1, Output = -1, Trace = -1;
+
+// Captured messages are queued on @ring by the thread which sent or
+// received them, and written to @Input or @Output by the @writer thread.
+// @ring is a bounded multi-producer queue: producers claim @tail, and
+// a cell is ready for the writer when its @seq is one more than its
+// position.  The timestamps are CLOCK_MONOTONIC, which @realtime converts
+// to wall clock time.  If @ring is full and @drop, the message is not
+// captured, and it's counted in @dropped.
+//
+// A record is the message @dgram @sent or received through @ctx at @ts,
+// and its @latency in nanoseconds if it's known.  The stream is the
+// @dgram's.
+struct CaptureRecord {
+    uint64_t seq, ts, latency;
+    int hfd;
+    bool sent;
+    const ConnectionCtx *ctx;
+    DGram *dgram;
+};
 
-        // Disconnect-Peer
-        if (!(flags & Diameter::FLAG_REQUEST))
-            return false;
+static struct {
+    CaptureRecord ring[CAPTURE_RING_SIZE];
+    uint64_t head, tail;
 
-        // Is Disconnect-Cause == REBOOTING?
-        // Nevermind parse errors.
-        rebooting = false;
-        while ((ptr = dia->parseAVPHeader(ptr, &rem, &avp, &flags,
-                                          &datalen))) {
-            if (avp == Diameter::DISCONNECT_CAUSE) {
-                unsigned code;
+    pthread_t writer;
+    bool running, stopping, drop;
+    int64_t realtime;
+    uint64_t written, dropped;
+} Capture;
 
-                if ((ptr = dia->parseInt32(ptr, &rem, datalen, &code)))
-                    rebooting = (code == Diameter::REBOOTING);
-                break;
-            } else if (!(ptr = dia->skipAVPData(ptr, &rem, datalen)))
-                break;
-        }
-        if (rebooting)
-            LOG("Server is rebooting.");
+// The UNIX domain socket at @path the @server thread serves Metrics on.
+// The socket file is removed at exit.
+static struct {
+    const char *path;
+    int fd;
+    pthread_t server;
+} MetricsEndpoint = { NULL, -1 };
 
-        // Reply if we can, but no para if we can't.
-        sendDGram(ctx->sfd, DIAMETER_PORTS(ctx),
-                  createSimpleMessage(ctx, Diameter::DPR, false, hbh, ete),
-                  dgram->mStreamId);
-        ctx->is_eof = true;
-        return false; // }}}
-    } case Diameter::DWR: // {{{
+// @SessionIdCounter is the Session-Id of the last UDR or PNR sent.
+// @LastSessionId is the Session-Id of the last request answered.
+//
+// If @StartOfMeasurement is not zero, it designates the time proc_stdin()
+// commenced a measurement of transaction speed.  When @LastMessageSent,
+// its time is recorded.  The requests of the measurement have Session-Id:s
+// in ]@MeasurementBase..@SessionIdCounter], and @Measured counts how many
+// of them have been answered or timed out so far.  When all of them have,
+// the measurement ends and its duration and the round-trip times of the
+// transactions, collected in @MeasuredRTT, are displayed.
+static pthread_mutex_t MeasurementLock;
+static uint64_t SessionIdCounter, LastSessionId, MeasurementBase;
+static struct timespec StartOfMeasurement, LastMessageSent;
+static struct {
+    uint64_t answered, timeouts;
+    uint64_t unmatched, duplicates, reordered;
+} Measured;
+static Histogram MeasuredRTT;
+
+// State of the open-loop load generator (the "rate" command).  While @tps
+// is non-zero, a measurement of @count requests with Session-Id:s from
+// ]@base..@base+@count] is in progress, and the i-th of them is due at
+// @StartOfMeasurement + i/@tps seconds.  The network thread sends them
+// on schedule.  The latency of an answer is measured from the due time
+// of its request rather than from the time it was actually sent, so that
+// stalls of the peer (or of the network thread) are not hidden by
+// coordinated omission.  Everything is protected by @MeasurementLock,
+// except for @sent and @last_sent, which are only touched by the network
+// thread.  The "replay" command uses the same fields except for @tps
+// and @latency.
+//
+// A scenario is a rate run whose offered rate changes according to its
+// @phases.  Then @tps is their average rate, and @applied is the number
+// of phases whose settings the network thread has applied so far.
+//
+// In a phase @count requests are due in @secs seconds from @start ns
+// after the start of the scenario, at a rate changing linearly from @from
+// to @to TPS, and the first of them is the @first-th of the scenario.
+// @what is "ramp", "hold" or "spike".  Before the phase starts, the ranges
+// which are @set are applied as the "user-data", "streams" and "lga"
+// commands would.  The rest is the outcome of the phase, like in @Rate.
+struct Phase {
+    char what[8];
+    double from, to, secs;
+    uint64_t start, first, count;
+    struct { bool set; unsigned min, max; } user_data, streams, lga;
+
+    uint64_t sent, answered, timeouts;
+    struct timespec last_sent, last_answer;
+    Histogram latency;
+};
+
+static struct {
+    double tps;
+    uint64_t base, count, sent;
+    bool cancelled;
+    struct timespec last_sent, last_answer;
+    Histogram latency;
+    std::vector<Phase> phases;
+    size_t applied;
+} Rate;
+
+// The scenario of --scenario, which proc_scenario() runs.
+static std::vector<Phase> Scenario;
+
+// The capture loaded by the "replay" command.  @map is the mmap()ed file
+// of @size bytes, and @msgs are the requests found in it, most of them
+// pointing into @map.  Those which were split between TCP segments are
+// reassembled in @copies.  The network thread sends @msgs[i] at
+// @StartOfMeasurement + (@msgs[i].ts - @msgs[0].ts) / @speed, or right
+// away if @speed is 0.
+struct ReplayMessage {
+    uint64_t ts;
+    const byte *msg;
+    size_t len;
+};
+
+static struct {
+    void *map;
+    size_t size;
+    std::vector<ReplayMessage> msgs;
+    std::vector<byte *> copies;
+    double speed;
+} Replay;
+
+// State of the fuzzer (the "fuzz" command).  The fuzz cases are the
+// requests of @Replay if @captured, or our own UDR/PNR otherwise, mutated
+// randomly by xorshift() seeded with @seed.  The network thread sends them
+// as fast as the connections take them, and keeps the last FUZZ_HISTORY
+// in @history, indexed by their Session-Id, the @last of which was sent
+// last.  A case is @done when it's answered or has timed out.  When the
+// peer disconnects or misses a DWA, the cases not done on that connection
+// are the suspects, and they are @saved in files, just like those which
+// were answered with an unexpected Result-Code.  @running tells whether
+// a fuzz run is being measured, and it's protected by @MeasurementLock
+// along with the reset of the counters.  Otherwise only the network
+// thread touches @Fuzz.
+struct FuzzCase {
+    uint64_t sessionId;
+    const ConnectionCtx *ctx;
+    DGram *dgram;
+    bool done, saved;
+};
+
+static struct {
+    bool running, captured;
+    uint64_t seed, last;
+    uint64_t disconnects, hangs, oddities, saved;
+    FuzzCase history[FUZZ_HISTORY];
+} Fuzz;
+
+// State of the closed-loop load generator (the "window" command).  While
+// it's @running, the network thread keeps @depth requests in flight on
+// every connection, sending a new one whenever one is answered or times
+// out.  The run is made of @steps of @secs seconds, in which @depth is
+// doubled until it would exceed @max_depth, then no more requests are
+// sent while @draining.  A step records the answers arrived and the
+// requests timed out between its @start and @end, and the round-trip
+// times of the answers in @rtt.  Everything is protected by
+// @MeasurementLock, but fillWindow() looks at @depth without it, so it's
+// zeroed as soon as no more requests are to be sent.
+struct WindowStep {
+    unsigned depth;
+    uint64_t answered, timeouts;
+    struct timespec start, end;
+    Histogram rtt;
+};
+
+static struct {
+    bool running, draining;
+    unsigned depth, max_depth;
+    double secs;
+    std::vector<WindowStep> steps;
+} Window;
+
+// The random User-Data of the messages we send.  @data has @size random
+// characters, and @blobs are USER_DATA_POOL (offset, size) pairs in it,
+// whose sizes have been drawn from [@min..@max] in advance.  @next is the
+// blob to use next.  The messages refer to the blobs rather than copying
+// them, and every thread has its own @UserDataPool, which it rebuilds
+// when the sizes change, leaving the old @data to the messages still
+// referring to it.
+struct UserDataBlob {
+    unsigned offset, size;
+};
+
+static thread_local struct {
+    DGramSegment *data;
+    size_t size;
+    unsigned min, max, next;
+    UserDataBlob blobs[USER_DATA_POOL];
+} UserDataPool;
+
+// All the connections we have ever had.  They are added by main() and by
+// the network thread when accepting one, but never freed, so pointers to
+// them remain valid until the end of the program.  @ConnectionsLock guards
+// the vector itself and @NextConnection, which pickConnection() uses to
+// distribute requests.  @LiveConnections is the number of connections
+// not closed yet.
+static pthread_mutex_t ConnectionsLock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<ConnectionCtx *> Connections;
+static unsigned NextConnection, LiveConnections;
+
+// The traffic counters of a set of connections summed up.
+struct TrafficTotals {
+    unsigned connections, up;
+    uint64_t sent, bytes_sent, syscalls;
+    uint64_t received, bytes_received;
+    uint64_t requests, answers;
+    uint64_t errors, dwa_missed;
+    uint64_t inflight, timeouts, unmatched, duplicates, reordered;
+};
+
+// With --workers the parent process forks @count workers, each listening
+// on the same address with its own SO_REUSEPORT socket, so the kernel
+// distributes the incoming connections among them.  A worker is pinned
+// to a CPU and has all the state of a normal radiator to itself.  @idx is
+// the ordinal number of the worker, and at exit it writes its
+// TrafficTotals to @pipe for the parent to sum up.  @pids are the
+// workers of the parent.
+static struct {
+    unsigned count, idx;
+    int pipe;
+    std::vector<pid_t> pids;
+} Workers = { 0, 0, -1 };
+
+// The roles of our threads whose CPUs --affinity can choose.  The network
+// thread receives, sends and paces the rate runs, the command thread
+// reads the standard input and sends what it's told to, the scenario
+// thread moves between the phases, the capture thread writes the pcaps
+// and the metrics thread serves --metrics.
+enum {
+    THREAD_NETWORK, THREAD_COMMAND, THREAD_SCENARIO,
+    THREAD_CAPTURE, THREAD_METRICS, NTHREAD_ROLES,
+};
+static const char *const ThreadRoles[NTHREAD_ROLES] = {
+    "network", "command", "scenario", "capture", "metrics",
+};
+
+// The CPUs we were @allowed to run on at startup, and the @cpus of each
+// thread role, if --affinity has @set them.  The others run on any of
+// the @allowed CPUs.  @nodes are the online NUMA nodes and their CPUs.
+struct NUMANode {
+    unsigned id;
+    cpu_set_t cpus;
+};
+
+static struct {
+    cpu_set_t allowed;
+    cpu_set_t cpus[NTHREAD_ROLES];
+    bool set[NTHREAD_ROLES], any;
+    std::vector<NUMANode> nodes;
+} Affinity;
+
+// The epoll instance of the network thread and the listening socket (-l).
+static int Epoll = -1, ListenFd = -1;
+
+// The io_uring of the network thread with --io-uring.  It's watched by
+// @Epoll, and an op's user_data is its ConnectionCtx or'ed with URING_RECV
+// or URING_SEND.
+static IoRing Uring;
+enum { URING_RECV, URING_SEND, URING_OP_MASK = 1 };
+
+// Transmission is done by the @NetworkThread.  Other threads queue their
+// DGram:s (see sendDGram()), push the connection onto @ReadyConnections,
+// and wake the network thread up through the @WakeupFd eventfd unless
+// @WakeupPending says it has been done already.  @Lingering are the
+// connections whose send queue is waiting for more messages to write
+// them in one go.
+static pthread_t NetworkThread;
+static ConnectionCtx *ReadyConnections;
+static int WakeupFd = -1;
+static bool WakeupPending;
+static std::vector<ConnectionCtx *> Lingering;
+
+// The timers of the network thread and the timerfd which wakes it up
+// when the next one is due at @TimerFdArmed.  @PacerPending is set by
+// startRate() for the network thread to (re)start the @PacerTimer.
+static TimerWheel Timers;
+static int TimerFd = -1;
+static uint64_t TimerFdArmed;
+static Timer PacerTimer, WatchdogTimer, ExpiryTimer;
+static bool PacerPending;
+// }}}
+
+// Classless functions {{{
+static void sigint(int) {
+    // Wake up the main thread when SIGINT or SIGTERM is received.
+	longjmp(Quit, 1);
+}
+
+// Return a random integer from [@min, @max].  @max-@min must be < UINT_MAX.
+static unsigned rndint(unsigned min, unsigned max) {
+    return min < max ? min + rand() % (max - min + 1) : min;
+}
+
+// Fill @str in with up to @max-1 randomly chosen alphabethical characters
+// and a NUL terminator.  If @max is 0 @str is left alone.
+static void mkRandomString(char *str, unsigned max, unsigned min = 0) {
+    unsigned i, sstr;
+
+    if (!max)
+        return;
+
+    sstr = rndint(min, max-1);
+    for (i = 0; i < sstr; i++) {
+        unsigned n;
+
+        n = rand() % (('9'-'0'+1) + ('z'-'a'+1) + ('Z'-'A'+1));
+        if (n <= '9'-'0') {
+            // Digit
+            str[i] = '0' + n;
+            continue;
+        }
+
+        n -= '9'-'0' + 1;
+        if (n <= 'z'-'a') {
+            // Lower letter
+            str[i] = 'a' + n;
+            continue;
+        }
+
+        // Capital letter
+        n -= 'z'-'a' + 1;
+        str[i] = n + 'A';
+    }
+
+    str[i] = '\0';
+}
+
+// Append an option with @code and @value to @buf and return its size
+// (including the padding).
+static size_t putPcapOption(byte *buf, unsigned code,
+                            const void *value, size_t length) {
+    pcapng_opt_t opt;
+
+    opt.code   = code;
+    opt.length = length;
+    memcpy(buf, &opt, sizeof(opt));
+    memcpy(&buf[sizeof(opt)], value, length);
+    memset(&buf[sizeof(opt) + length], 0, PAD4(length));
+
+    return sizeof(opt) + ALIGN4(length);
+}
+
+// Open @fname and write a PCAP-NG Section Header Block.
+static int open_pcap(char const *fname) {
+    int hfd;
+    size_t len;
+    pcapng_shb_t shb;
+    byte block[sizeof(shb) + 32];
+
+    if (!fname || (fname[0] == '-' && !fname[1]))
+        hfd = STDOUT_FILENO;
+    else if ((hfd = open(fname, O_CREAT|O_TRUNC|O_WRONLY|O_APPEND,
+                        0666)) < 0) {
+        ERR("open_pcap(%s): %s", fname, strerror(errno));
+        return -1;
+    }
+
+    len  = sizeof(shb);
+    len += putPcapOption(&block[len], PCAPNG_SHB_USERAPPL,
+                         "radiator", strlen("radiator"));
+    len += putPcapOption(&block[len], PCAPNG_OPT_ENDOFOPT, "", 0);
+    len += sizeof(shb.block_length);
+
+    shb.block_type       = PCAPNG_SHB;
+    shb.block_length     = len;
+    shb.byte_order_magic = PCAPNG_BYTE_ORDER_MAGIC;
+    shb.version_major    = PCAPNG_VERSION_MAJOR;
+    shb.version_minor    = PCAPNG_VERSION_MINOR;
+    shb.section_length   = -1;
+    memcpy(block, &shb, sizeof(shb));
+    memcpy(&block[len - sizeof(shb.block_length)],
+           &shb.block_length, sizeof(shb.block_length));
+
+    if (write(hfd, block, len) < 0) {
+        ERR("open_pcap(): %s", strerror(errno));
+        close(hfd);
+        return -1;
+    }
+
+	return hfd;
+}
+
+// Open @fname for --trace and write the header of the trace file.
+static int open_trace(char const *fname) {
+    int hfd;
+    trace_hdr_t hdr;
+
+    if ((hfd = open(fname, O_CREAT|O_TRUNC|O_WRONLY|O_APPEND, 0666)) < 0) {
+        ERR("open_trace(%s): %s", fname, strerror(errno));
+        return -1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    if (write(hfd, &hdr, sizeof(hdr)) < 0) {
+        ERR("open_trace(): %s", strerror(errno));
+        close(hfd);
+        return -1;
+    }
+
+    return hfd;
+}
+
+// Convert @ts to nanoseconds.
+static uint64_t nsecs(const struct timespec *ts) {
+    return ts->tv_sec * 1000000000ull + ts->tv_nsec;
+}
+
+// Write the IP and SCTP DATA headers of a @spayload long message @sent or
+// received through @ctx on @stream to @buf, and return their size.  We use
+// SCTP even for TCP connections, because Wireshark doesn't decode DIAMETER
+// in UDP, and TCP looks more complicated than SCTP.
+static size_t mkPacketHeaders(byte *buf, const ConnectionCtx *ctx,
+                              bool sent, unsigned stream,
+                              size_t spayload) {
+    size_t len;
+    sctp_hdr_t sctp;
+    const struct sockaddr_storage *src, *dst;
+
+    src = sent ? &ctx->local_addr : &ctx->peer_addr;
+    dst = sent ? &ctx->peer_addr  : &ctx->local_addr;
+    memset(&sctp, 0, sizeof(sctp));
+
+    if (src->ss_family == AF_INET6) {
+        struct ip6_hdr ip6;
+
+        memset(&ip6, 0, sizeof(ip6));
+        ip6.ip6_flow = htonl(6 << 28);
+        ip6.ip6_plen = htons(sizeof(sctp) + spayload);
+        ip6.ip6_nxt  = IPPROTO_SCTP;
+        ip6.ip6_hlim = 16;
+        ip6.ip6_src  = DMXEndPoint::toCS6(src)->sin6_addr;
+        ip6.ip6_dst  = DMXEndPoint::toCS6(dst)->sin6_addr;
+        sctp.common.src_port = DMXEndPoint::toCS6(src)->sin6_port;
+        sctp.common.dst_port = DMXEndPoint::toCS6(dst)->sin6_port;
+
+        memcpy(buf, &ip6, sizeof(ip6));
+        len = sizeof(ip6);
+    } else {
+        struct iphdr ip;
+        unsigned checksum;
+
+        memset(&ip, 0, sizeof(ip));
+        ip.version  = 4;
+        ip.ihl      = sizeof(ip) / sizeof(uint32_t);
+        ip.tot_len  = htons(sizeof(ip) + sizeof(sctp) + spayload);
+        ip.ttl      = 16;
+        ip.protocol = IPPROTO_SCTP;
+        ip.saddr    = DMXEndPoint::toCS4(src)->sin_addr.s_addr;
+        ip.daddr    = DMXEndPoint::toCS4(dst)->sin_addr.s_addr;
+        sctp.common.src_port = DMXEndPoint::toCS4(src)->sin_port;
+        sctp.common.dst_port = DMXEndPoint::toCS4(dst)->sin_port;
+
+#if __BYTE_ORDER != __LITTLE_ENDIAN
+# warning "This code has only be tested on little-endian machines,"
+# warning "and is likely to break on machines with other bytesex."
+#endif
+        checksum = ntohs((ip.version << 12)
+                + (ip.ihl << 8)
+                + (ip.tos << 0))
+            + ip.tot_len
+            + ip.id
+            + ip.frag_off
+            + ntohs((ip.ttl << 8) + ip.protocol)
+            + ip.check
+            + ((ip.saddr >> 16) & 0xFFFF) + (ip.saddr & 0xFFFF)
+            + ((ip.daddr >> 16) & 0xFFFF) + (ip.daddr & 0xFFFF);
+        checksum += (uint16_t)(checksum >> 16);
+        ip.check = ~(uint16_t)checksum;
+
+        memcpy(buf, &ip, sizeof(ip));
+        len = sizeof(ip);
+    }
+
+    sctp.data.first_fragment = 1;
+    sctp.data.final_fragment = 1;
+    sctp.data.chunk_length = htons(sizeof(sctp.data) + spayload);
+    sctp.data.stream_identifier = htons(stream);
+    sctp.data.payload_protocol_identifier = htonl(SCTP_PPID_DIAMETER);
+    memcpy(&buf[len], &sctp, sizeof(sctp));
+
+    return len + sizeof(sctp);
+}
+
+// Queue @dgram, which has been @sent or received through @ctx at @ts,
+// to be written to @hfd by the capture writer thread, which takes
+// ownership of it.  If @since is not zero, it's when the message was
+// queued for sending or when the request it answers was sent.
+static void capture(int hfd, const ConnectionCtx *ctx, bool sent,
+                    DGram *dgram, uint64_t ts, uint64_t since) {
+    uint64_t pos;
+    int64_t diff;
+    CaptureRecord *rec;
+
+    pos = __atomic_load_n(&Capture.tail, __ATOMIC_RELAXED);
+    for (;;) {
+        rec = &Capture.ring[pos % CAPTURE_RING_SIZE];
+        diff = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) - pos;
+        if (!diff) {
+            if (__atomic_compare_exchange_n(&Capture.tail, &pos, pos + 1,
+                                            true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if (diff > 0) {
+            // Someone else has claimed @pos.
+            pos = __atomic_load_n(&Capture.tail, __ATOMIC_RELAXED);
+        } else if (Capture.drop) {
+            __atomic_add_fetch(&Capture.dropped, 1, __ATOMIC_RELAXED);
+            DGram::release(dgram);
+            return;
+        } else {
+            // Full, wait for the writer.
+            usleep(100);
+            pos = __atomic_load_n(&Capture.tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    rec->ts = ts;
+    rec->latency = since && since <= ts ? ts - since : 0;
+    rec->hfd = hfd;
+    rec->sent = sent;
+    rec->ctx = ctx;
+    rec->dgram = dgram;
+    __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+// Loading captures for replay {{{
+// The TCP streams of a capture being loaded, keyed by their addresses
+// and ports, and the beginning of the message continued in the next
+// segment of each.
+typedef std::map<std::string, std::vector<byte> > ReplayStreams;
+
+// Return the length of the DIAMETER message at @msg if all of it is in
+// the @len bytes, 0 if more is needed, or -1 if it's not a message.
+static ssize_t diameterLength(const byte *msg, size_t len) {
+    size_t mlen;
+
+    if (len < sizeof(uint32_t))
+        return 0;
+    if (msg[0] != Diameter::PROTOCOL_VERSION)
+        return -1;
+    mlen = (msg[1] << 16) | (msg[2] << 8) | msg[3];
+    if (mlen < Diameter::HEADER_SIZE)
+        return -1;
+    return mlen <= len ? mlen : 0;
+}
+
+// Add the DIAMETER message at @msg of @len bytes captured at @ts to
+// @Replay if it's a request.  Base protocol requests are left out,
+// because we do Capability-Exchange and watchdogging ourselves.
+static bool addReplayMessage(uint64_t ts, const byte *msg, size_t len) {
+    unsigned cmd;
+    ReplayMessage m;
+
+    if (diameterLength(msg, len) != (ssize_t)len
+        || len < Diameter::HEADER_SIZE
+        || !(msg[4] & Diameter::FLAG_REQUEST))
+        return false;
+    cmd = (msg[5] << 16) | (msg[6] << 8) | msg[7];
+    if (cmd == Diameter::CER || cmd == Diameter::DWR
+        || cmd == Diameter::DPR)
+        return false;
+
+    m.ts  = ts;
+    m.msg = msg;
+    m.len = len;
+    Replay.msgs.push_back(m);
+    return true;
+}
+
+// Add the messages of the unfragmented DATA chunks of the SCTP packet
+// at @pkt to @Replay.
+static void replaySCTP(uint64_t ts, const byte *pkt, size_t len) {
+    size_t clen;
+
+    if (len < sizeof(sctp_common_header_t))
+        return;
+    pkt += sizeof(sctp_common_header_t);
+    len -= sizeof(sctp_common_header_t);
+
+    while (len >= sizeof(uint32_t)) {
+        clen = (pkt[2] << 8) | pkt[3];
+        if (clen < sizeof(uint32_t) || clen > len)
+            break;
+        // DATA chunk with the B and E flags.
+        if (pkt[0] == 0 && (pkt[1] & 3) == 3
+            && clen > sizeof(sctp_data_header_t))
+            addReplayMessage(ts, &pkt[sizeof(sctp_data_header_t)],
+                             clen - sizeof(sctp_data_header_t));
+        clen = ALIGN4(clen);
+        if (clen >= len)
+            break;
+        pkt += clen;
+        len -= clen;
+    }
+}
+
+// Add the messages of the TCP segment at @pkt to @Replay.  The segments
+// of the stream identified by @key are expected to be captured in order
+// and without loss.  If a message continues in the next segment, the
+// part we have is kept in @streams until then.
+static void replayTCP(ReplayStreams *streams, const std::string &key,
+                      uint64_t ts, const byte *pkt, size_t len) {
+    size_t hlen;
+    ssize_t mlen;
+
+    hlen = len >= 20 ? (pkt[12] >> 4) * sizeof(uint32_t) : 0;
+    if (hlen < 20 || hlen >= len)
+        return;
+    pkt += hlen;
+    len -= hlen;
+
+    std::vector<byte> &pending = (*streams)[key];
+    if (!pending.empty()) {
+        pending.insert(pending.end(), pkt, pkt + len);
+        while ((mlen = diameterLength(&pending[0], pending.size())) > 0) {
+            byte *copy;
+
+            copy = static_cast<byte *>(malloc(mlen));
+            memcpy(copy, &pending[0], mlen);
+            if (addReplayMessage(ts, copy, mlen))
+                Replay.copies.push_back(copy);
+            else
+                free(copy);
+            pending.erase(pending.begin(), pending.begin() + mlen);
+        }
+        // Lost track of the messages if @mlen < 0.
+        if (mlen < 0)
+            pending.clear();
+        return;
+    }
+
+    while ((mlen = diameterLength(pkt, len)) > 0) {
+        addReplayMessage(ts, pkt, mlen);
+        pkt += mlen;
+        len -= mlen;
+    }
+    if (!mlen && len > 0)
+        pending.assign(pkt, pkt + len);
+}
+
+// Add the messages in the IP packet at @pkt to @Replay.  IP fragments
+// and IPv6 extension headers are not supported.
+static void replayIP(ReplayStreams *streams, uint64_t ts,
+                     const byte *pkt, size_t len) {
+    unsigned proto;
+    size_t hlen, tlen;
+    std::string key;
+
+    if (len >= 20 && pkt[0] >> 4 == 4) {
+        hlen = (pkt[0] & 0xF) * sizeof(uint32_t);
+        tlen = (pkt[2] << 8) | pkt[3];
+        if (hlen < 20 || tlen < hlen || tlen > len)
+            return;
+        if (((pkt[6] << 8) | pkt[7]) & 0x3FFF)
+            // More fragments or fragment offset.
+            return;
+        proto = pkt[9];
+        key.assign(reinterpret_cast<const char *>(&pkt[12]), 8);
+    } else if (len >= 40 && pkt[0] >> 4 == 6) {
+        hlen = 40;
+        tlen = hlen + ((pkt[4] << 8) | pkt[5]);
+        if (tlen > len)
+            return;
+        proto = pkt[6];
+        key.assign(reinterpret_cast<const char *>(&pkt[8]), 32);
+    } else
+        return;
+
+    // Ignore the link layer padding, if any.
+    pkt += hlen;
+    len  = tlen - hlen;
+    if (proto == IPPROTO_SCTP)
+        replaySCTP(ts, pkt, len);
+    else if (proto == IPPROTO_TCP && len >= sizeof(uint32_t)) {
+        key.append(reinterpret_cast<const char *>(pkt), sizeof(uint32_t));
+        replayTCP(streams, key, ts, pkt, len);
+    }
+}
+
+// Strip the link layer header of @linktype from the packet at @pkt,
+// then add its messages to @Replay.
+static void replayPacket(ReplayStreams *streams, unsigned linktype,
+                         uint64_t ts, const byte *pkt, size_t len) {
+    size_t hlen;
+    unsigned ethertype;
+
+    switch (linktype) {
+    case PCAP_LINKTYPE_RAW:
+    case PCAP_LINKTYPE_IPV4:
+    case PCAP_LINKTYPE_IPV6:
+        replayIP(streams, ts, pkt, len);
+        return;
+    case PCAP_LINKTYPE_ETHERNET:
+        hlen = 14;
+        if (len < hlen)
+            return;
+        ethertype = (pkt[12] << 8) | pkt[13];
+        if (ethertype == ETHERTYPE_VLAN && len >= hlen + 4) {
+            ethertype = (pkt[16] << 8) | pkt[17];
+            hlen += 4;
+        }
+        break;
+    case PCAP_LINKTYPE_LINUX_SLL:
+        hlen = 16;
+        if (len < hlen)
+            return;
+        ethertype = (pkt[14] << 8) | pkt[15];
+        break;
+    case PCAP_LINKTYPE_LINUX_SLL2:
+        hlen = 20;
+        if (len < hlen)
+            return;
+        ethertype = (pkt[0] << 8) | pkt[1];
+        break;
+    default:
+        return;
+    }
+
+    if (ethertype == ETHERTYPE_IPV4 || ethertype == ETHERTYPE_IPV6)
+        replayIP(streams, ts, &pkt[hlen], len - hlen);
+}
+
+// Parse the classic PCAP file @fname at @data of @size bytes.
+static bool parsePcap(const char *fname, const byte *data, size_t size) {
+    size_t pos;
+    unsigned tsmul;
+    pcap_hdr_t hdr;
+    pcap_pkt_hdr_t pkt;
+    ReplayStreams streams;
+
+    if (size < sizeof(hdr)) {
+        ERR("%s: truncated PCAP header", fname);
+        return false;
+    }
+    memcpy(&hdr, data, sizeof(hdr));
+    tsmul = hdr.magic_number == PCAP_MAGIC_NSEC ? 1 : 1000;
+
+    for (pos = sizeof(hdr); pos + sizeof(pkt) <= size;
+         pos += sizeof(pkt) + pkt.incl_len) {
+        memcpy(&pkt, &data[pos], sizeof(pkt));
+        if (pkt.incl_len > size - pos - sizeof(pkt)) {
+            ERR("%s: truncated packet at offset %zu", fname, pos);
+            break;
+        }
+        replayPacket(&streams, hdr.network,
+                     pkt.ts_sec * 1000000000ull + pkt.ts_usec * tsmul,
+                     &data[pos + sizeof(pkt)], pkt.incl_len);
+    }
+
+    return true;
+}
+
+// Parse the PCAP-NG file @fname at @data of @size bytes.  Only Enhanced
+// Packet Blocks are considered, and the file must be in our byte order.
+static bool parsePcapNG(const char *fname, const byte *data, size_t size) {
+    // The link layer and the timestamp resolution of an interface:
+    // 10^-@resol or 2^-@resol seconds if @binary.
+    struct Interface {
+        unsigned linktype, resol;
+        bool binary;
+    };
+
+    size_t pos, len;
+    ReplayStreams streams;
+    std::vector<Interface> interfaces;
+
+    for (pos = 0; pos + 3*sizeof(uint32_t) <= size; pos += len) {
+        uint32_t hdr[2];
+        const byte *body;
+
+        memcpy(hdr, &data[pos], sizeof(hdr));
+        len = hdr[1];
+        if (len < 3*sizeof(uint32_t) || len % sizeof(uint32_t)
+            || len > size - pos) {
+            ERR("%s: invalid block at offset %zu", fname, pos);
+            break;
+        }
+        body = &data[pos];
+
+        if (hdr[0] == PCAPNG_SHB) {
+            pcapng_shb_t shb;
+
+            if (len < sizeof(shb))
+                break;
+            memcpy(&shb, body, sizeof(shb));
+            if (shb.byte_order_magic != PCAPNG_BYTE_ORDER_MAGIC) {
+                ERR("%s: foreign byte order", fname);
+                return false;
+            }
+            interfaces.clear();
+        } else if (hdr[0] == PCAPNG_IDB && len >= sizeof(pcapng_idb_t)) {
+            size_t opos;
+            pcapng_idb_t idb;
+            pcapng_opt_t opt;
+            Interface iface;
+
+            memcpy(&idb, body, sizeof(idb));
+            iface.linktype = idb.linktype;
+            iface.resol = 6;
+            iface.binary = false;
+            for (opos = sizeof(idb);
+                 opos + sizeof(opt) <= len - sizeof(uint32_t);
+                 opos += sizeof(opt) + ALIGN4(opt.length)) {
+                memcpy(&opt, &body[opos], sizeof(opt));
+                if (opt.code == PCAPNG_OPT_ENDOFOPT)
+                    break;
+                if (opt.code == PCAPNG_IF_TSRESOL && opt.length >= 1) {
+                    iface.resol  = body[opos + sizeof(opt)] & 0x7F;
+                    iface.binary = body[opos + sizeof(opt)] & 0x80;
+                }
+            }
+            interfaces.push_back(iface);
+        } else if (hdr[0] == PCAPNG_EPB && len >= sizeof(pcapng_epb_t)) {
+            uint64_t ts;
+            pcapng_epb_t epb;
+            const Interface *iface;
+
+            memcpy(&epb, body, sizeof(epb));
+            if (epb.interface_id >= interfaces.size()
+                || epb.captured_len > len - sizeof(epb) - sizeof(uint32_t))
+                continue;
+            iface = &interfaces[epb.interface_id];
+
+            // Convert the timestamp to nanoseconds.
+            ts = ((uint64_t)epb.ts_high << 32) | epb.ts_low;
+            if (iface->binary)
+                ts = (unsigned __int128)ts * 1000000000 >> iface->resol;
+            else
+                for (unsigned i = iface->resol; i != 9; )
+                    if (i < 9) {
+                        ts *= 10;
+                        i++;
+                    } else {
+                        ts /= 10;
+                        i--;
+                    }
+
+            replayPacket(&streams, iface->linktype, ts,
+                         &body[sizeof(epb)], epb.captured_len);
+        }
+    }
+
+    return true;
+}
+
+// Forget the capture loaded last.
+static void unloadReplay() {
+    if (Replay.map)
+        munmap(Replay.map, Replay.size);
+    Replay.map = NULL;
+    Replay.msgs.clear();
+    for (size_t i = 0; i < Replay.copies.size(); i++)
+        free(Replay.copies[i]);
+    Replay.copies.clear();
+}
+
+// mmap() @fname, a PCAP or PCAP-NG file, and collect the requests in it
+// in @Replay.
+static bool loadReplay(const char *fname) {
+    int fd;
+    bool ok;
+    uint32_t magic;
+    struct stat st;
+    const byte *data;
+
+    unloadReplay();
+    if ((fd = open(fname, O_RDONLY)) < 0) {
+        ERR("%s: %m", fname);
+        return false;
+    } else if (fstat(fd, &st) < 0) {
+        ERR("%s: %m", fname);
+        close(fd);
+        return false;
+    } else if (st.st_size < (off_t)sizeof(magic)) {
+        ERR("%s: not a PCAP or PCAP-NG file", fname);
+        close(fd);
+        return false;
+    }
+
+    Replay.size = st.st_size;
+    Replay.map = mmap(NULL, Replay.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (Replay.map == MAP_FAILED) {
+        ERR("mmap(%s): %m", fname);
+        Replay.map = NULL;
+        return false;
+    }
+    madvise(Replay.map, Replay.size, MADV_SEQUENTIAL);
+
+    data = static_cast<const byte *>(Replay.map);
+    memcpy(&magic, data, sizeof(magic));
+    if (magic == PCAPNG_SHB)
+        ok = parsePcapNG(fname, data, Replay.size);
+    else if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NSEC)
+        ok = parsePcap(fname, data, Replay.size);
+    else {
+        ERR("%s: not a PCAP or PCAP-NG file", fname);
+        ok = false;
+    }
+
+    if (ok && Replay.msgs.empty()) {
+        ERR("%s: no requests to replay", fname);
+        ok = false;
+    }
+    if (!ok)
+        unloadReplay();
+    return ok;
+} // }}}
+
+// Loading scenarios {{{
+// Parse a duration in seconds, or in minutes or hours if @str has
+// an 'm' or 'h' suffix.
+static bool parseDuration(const char *str, double *secsp) {
+    char *end;
+
+    *secsp = strtod(str, &end);
+    if (end == str || *secsp < 0)
+        return false;
+    if (*end == 'm')
+        *secsp *= 60;
+    else if (*end == 'h')
+        *secsp *= 60 * 60;
+    else if (*end != 's')
+        return !*end;
+    return !end[1];
+}
+
+// Load the scenario in @fname into @phases.  Every line is a phase:
+//   ramp <from-tps> <to-tps> <duration>
+//   hold <tps> <duration>
+//   spike <tps> <duration>
+// or a setting which takes effect from the next phase on:
+//   user-data | streams | lga <exact>|<min> <max>
+// Empty lines and those starting with '#' are ignored.
+static bool loadScenario(const char *fname, std::vector<Phase> *phases) {
+    FILE *st;
+    Phase phase;
+    char line[256], what[16], dur[32];
+    unsigned lineno, min, max;
+    uint64_t first, start;
+    bool settings;
+    int n, nargs;
+
+    if (!(st = fopen(fname, "r"))) {
+        ERR("%s: %m", fname);
+        return false;
+    }
+
+    phases->clear();
+    memset(&phase, 0, sizeof(phase));
+    first = start = 0;
+    settings = false;
+    for (lineno = 1; fgets(line, sizeof(line), st); lineno++) {
+        if (sscanf(line, "%15s %n", what, &n) < 1 || what[0] == '#')
+            continue;
+
+        if (!strcmp(what, "ramp"))
+            nargs = sscanf(&line[n], "%lf %lf %31s",
+                           &phase.from, &phase.to, dur) - 3;
+        else if (!strcmp(what, "hold") || !strcmp(what, "spike")) {
+            nargs = sscanf(&line[n], "%lf %31s", &phase.from, dur) - 2;
+            phase.to = phase.from;
+        } else if (!strcmp(what, "user-data") || !strcmp(what, "streams")
+                   || !strcmp(what, "lga")) {
+            if ((nargs = sscanf(&line[n], "%u %u", &min, &max)) == 1)
+                max = min;
+            if (nargs < 1 || min > max) {
+                ERR("%s:%u: usage: %s {<exact>|<min> <max>}",
+                    fname, lineno, what);
+                break;
+            }
+
+            if (what[0] == 'u') {
+                phase.user_data.set = true;
+                phase.user_data.min = min;
+                phase.user_data.max = max;
+            } else if (what[0] == 's') {
+                phase.streams.set = true;
+                phase.streams.min = min;
+                phase.streams.max = max;
+            } else {
+                phase.lga.set = true;
+                phase.lga.min = min;
+                phase.lga.max = max;
+            }
+            settings = true;
+            continue;
+        } else {
+            ERR("%s:%u: %s: unknown phase", fname, lineno, what);
+            break;
+        }
+
+        if (nargs || phase.from < 0 || phase.to < 0
+            || !parseDuration(dur, &phase.secs)) {
+            ERR("%s:%u: usage: %s", fname, lineno, what[0] == 'r'
+                ? "ramp <from-tps> <to-tps> <duration>"
+                : "{hold|spike} <tps> <duration>");
+            break;
+        }
+
+        strcpy(phase.what, what);
+        phase.first = first;
+        phase.start = start;
+        phase.count = llround((phase.from + phase.to) / 2 * phase.secs);
+        phases->push_back(phase);
+
+        first += phase.count;
+        start += phase.secs * 1000000000.0;
+        memset(&phase, 0, sizeof(phase));
+        settings = false;
+    }
+
+    if (!feof(st))
+        /* Error. */;
+    else if (settings)
+        ERR("%s: no phase follows the last setting", fname);
+    else if (!first)
+        ERR("%s: no requests to send", fname);
+    else {
+        fclose(st);
+        return true;
+    }
+
+    fclose(st);
+    phases->clear();
+    return false;
+} // }}}
+
+// Account for @dgram having been sent through @ctx, then free it
+// (or let the capture writer do it).
+static void sentDGram(ConnectionCtx *ctx, DGram *dgram) {
+    struct timespec now;
+    DGram *copy;
+
+    ctx->stats.sent++;
+    ctx->stats.bytes_sent += dgram->size();
+    if (Metrics::enabled)
+        Metrics::count(Metrics::SENT, Diameter::fromDGram(dgram),
+                       dgram->mData, dgram->mStreamId);
+
+    if (Verbosity > 1)
+        LOG("write() %lu", dgram->size());
+
+    if (Output >= 0 || Trace >= 0)
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    if (Trace >= 0 && (copy = dgram->dupe()) != NULL)
+        capture(Trace, ctx, true, copy, nsecs(&now), dgram->mQueued);
+    if (Output >= 0)
+        capture(Output, ctx, true, dgram, nsecs(&now), dgram->mQueued);
+    else
+        DGram::release(dgram);
+}
+
+// Free @dgram, which couldn't be sent.  If it was a request, forget it,
+// so it won't time out.
+static void droppedDGram(ConnectionCtx *ctx, DGram *dgram) {
+    size_t rem;
+    unsigned hbh, ete;
+
+    ctx->stats.errors++;
+    rem = dgram->mUsed;
+    if (dgram->mUsed >= Diameter::HEADER_SIZE
+        && Diameter::fromDGram(dgram)->parseMessageHeader(
+                        NULL, &rem, NULL, NULL, NULL, &hbh, &ete))
+        ctx->inflight->cancel(hbh, ete);
+    DGram::release(dgram);
+}
+
+// Interrupt the epoll_wait() of the network thread unless it's been done
+// already.
+static void wakeNetworkThread() {
+    if (!__atomic_exchange_n(&WakeupPending, true, __ATOMIC_ACQ_REL))
+        eventfd_write(WakeupFd, 1);
+}
+
+// Push @dgram onto the send queue of @ctx, and make sure the network
+// thread will get to it.  Lock-free, so the threads don't contend.
+static void enqueueDGram(ConnectionCtx *ctx, DGram *dgram) {
+    DGram *top;
+    ConnectionCtx *ready;
+
+    top = __atomic_load_n(&ctx->tx_stack, __ATOMIC_RELAXED);
+    do
+        dgram->mNext = top;
+    while (!__atomic_compare_exchange_n(&ctx->tx_stack, &top, dgram,
+                                        true, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED));
+
+    // Has someone scheduled @ctx already?
+    if (__atomic_exchange_n(&ctx->tx_scheduled, true, __ATOMIC_ACQ_REL))
+        return;
+
+    ready = __atomic_load_n(&ReadyConnections, __ATOMIC_RELAXED);
+    do
+        ctx->tx_next = ready;
+    while (!__atomic_compare_exchange_n(&ReadyConnections, &ready, ctx,
+                                        true, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED));
+
+    // The network thread looks at @ReadyConnections before it sleeps,
+    // so it only needs to be woken up by others.
+    if (!pthread_equal(pthread_self(), NetworkThread))
+        wakeNetworkThread();
+}
+
+// Send @dgram through @ctx on @stream, then free it unless told otherwise.
+// The actual write() is done by the network thread, possibly together
+// with other messages.  If @sessionId is not zero, @dgram is a request
+// whose answer we're going to wait for, so make a note of it in
+// @ctx->inflight.
+static void sendDGram(ConnectionCtx *ctx, DGram *dgram, unsigned stream = 0,
+                      bool freeDGram = true, uint64_t sessionId = 0) {
+    if (!dgram)
+        return;
+
+    // The network thread will free what we queue.
+    if (!freeDGram && !(dgram = dgram->dupe()))
+        return;
+    dgram->mStreamId = stream;
+
+    // The dump and the capture want the message in one piece.
+    if ((Verbosity > 2 || Output >= 0) && !DGram::flatten(&dgram)) {
+        DGram::release(dgram);
+        return;
+    }
+
+    // With --trace the message is dumped offline.
+    if (Verbosity > 2 && Trace < 0)
+        Diameter::dumpMessage(Diameter::fromDGram(dgram));
+
+    // Note the time for the capture to tell how long the DGram has been
+    // in the queue.
+    if (Output >= 0 || Trace >= 0) {
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        dgram->mQueued = nsecs(&now);
+    }
+
+    // Stamp the request before it's sent, because the answer may arrive
+    // before write() returns.
+    if (sessionId) {
+        size_t rem;
+        unsigned hbh, ete;
+        struct timespec now;
+
+        rem = dgram->mUsed;
+        if (dgram->mUsed >= Diameter::HEADER_SIZE
+            && Diameter::fromDGram(dgram)->parseMessageHeader(
+                            NULL, &rem, NULL, NULL, NULL, &hbh, &ete)) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            ctx->inflight->add(hbh, ete, sessionId, nsecs(&now));
+        }
+    }
+
+    if (ctx->sfd >= 0)
+        enqueueDGram(ctx, dgram);
+    else if (!ctx->is_eof)
+        // -N: pretend it's been sent.
+        sentDGram(ctx, dgram);
+    else
+        DGram::release(dgram);
+}
+
+// An answer held back because of -U.
+struct DelayedAnswer {
+    Timer timer;
+    ConnectionCtx *ctx;
+    DGram *answer;
+    unsigned stream;
+};
+
+// The DelayedAnswer:s sent already, kept for sendAnswer() to reuse, so
+// delaying an answer doesn't cost a malloc() and a free().  Only the
+// network thread touches them.
+static std::vector<DelayedAnswer *> SpareDelayedAnswers;
+
+// Timer callback of sendAnswer().
+static void sendDelayedAnswer(void *arg) {
+    DelayedAnswer *delayed = static_cast<DelayedAnswer *>(arg);
+
+    sendDGram(delayed->ctx, delayed->answer, delayed->stream);
+    SpareDelayedAnswers.push_back(delayed);
+}
+
+// Send @answer through @ctx on @stream after @ctx->recv_delay.  The
+// network thread keeps receiving in the meantime, so any number of
+// answers can be delayed at once.
+static void sendAnswer(ConnectionCtx *ctx, DGram *answer,
+                       unsigned stream) {
+    DelayedAnswer *delayed;
+    struct timespec now;
+
+    if (!answer)
+        return;
+    else if (!ctx->recv_delay) {
+        sendDGram(ctx, answer, stream);
+        return;
+    }
+
+    if (!SpareDelayedAnswers.empty()) {
+        delayed = SpareDelayedAnswers.back();
+        SpareDelayedAnswers.pop_back();
+    } else
+        delayed = new DelayedAnswer;
+    delayed->ctx = ctx;
+    delayed->answer = answer;
+    delayed->stream = stream;
+    delayed->timer.fun = sendDelayedAnswer;
+    delayed->timer.arg = delayed;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    delayed->timer.due = nsecs(&now) + ctx->recv_delay * 1000ull;
+    Timers.add(&delayed->timer);
+}
+
+// Return a human-readable translation of @cmd.
+static const char *translate(unsigned cmd, unsigned flags) {
+    static thread_local char str[32];
+    const char *cc;
+    bool isRequest = !!(flags & Diameter::FLAG_REQUEST);
+    bool isError   = !!(flags & Diameter::FLAG_ERROR);
+
+    if (cmd == Diameter::CER)
+        cc = "CE";
+    else if (cmd == Diameter::DWR)
+        cc = "DW";
+    else if (cmd == Diameter::DPR)
+        cc = "DP";
+    else if (cmd == Diameter::UDR)
+        cc = "UD";
+    else if (cmd == Diameter::PNR)
+        cc = "PN";
+    else {
+        snprintf(str, sizeof(str), "CC%u %s%s", cmd,
+                 isRequest ? "request" : "response",
+                 isError ? " (E)" : "");
+        return str;
+    }
+
+    snprintf(str, sizeof(str), "%s%c%s",
+             cc, isRequest ? 'R' : 'A', isError ? " (E)" : "");
+    return str;
+}
+
+// Create a simple DIAMETER message with @cmd, Result-Code (unless
+// it's a request), Origin-Host and Origin-Realm.
+static DGram *createSimpleMessage(const ConnectionCtx *ctx,
+                                  unsigned cmd, bool isRequest = true,
+                                  unsigned hbh = 0, unsigned ete = 0,
+                                  unsigned rc = 0) {
+    DGram *dgram;
+    unsigned flags;
+
+    if (!hbh)
+        hbh = ctx->hop_by_hop;
+    if (!ete)
+        ete = ctx->end_to_end;
+
+    dgram = NULL;
+    flags = isRequest ? Diameter::FLAG_REQUEST : 0;
+    if (!Diameter::createSimpleMessage(&dgram, cmd, flags,
+                                       hbh, ete,
+                                       ctx->origin.host, ctx->origin.realm,
+                                       rc))
+        return NULL;
+
+    if (Verbosity > 0)
+        LOG("-> %s", translate(cmd, flags));
+    return dgram;
+}
+
+// Add a random Int32 @avp to *@dgramPtr with @vendor as Vendor-ID.
+// If it failes and the AVP was to be a part of a group, roll it back.
+static bool addRandomInt32AVP(DGram **dgramPtr, unsigned avp,
+                               unsigned vendor = 0, unsigned groupStart = 0,
+                               bool mandatory = true) {
+    if (Diameter::addInt32AVP(dgramPtr, avp, rand(), mandatory, vendor))
+        return true;
+    else if (groupStart)
+        (*dgramPtr)->mUsed = groupStart;
+    return false;
+}
+
+// Like addRandomInt32AVP(), except that a random string is added.
+static bool addRandomStringAVP(DGram **dgramPtr, unsigned avp,
+                               unsigned vendor = 0, unsigned groupStart = 0,
+                               bool mandatory = true) {
+    char str[64+1];
+
+    mkRandomString(str, sizeof(str));
+    if (Diameter::addStringAVP(dgramPtr, avp, str, mandatory, vendor))
+        return true;
+    else if (groupStart)
+        (*dgramPtr)->mUsed = groupStart;
+    return false;
+}
+
+// Add an AVP described by @def to *@dgramPtr with a random value of its
+// type.  Groups are filled in with all their members, recursively.  If it
+// fails and the AVP was to be a part of a group, roll it back.
+static bool addRandomAVP(DGram **dgramPtr, const DictAVP *def,
+                         unsigned groupStart = 0) {
+    bool ok = false;
+    size_t group;
+    uint32_t u32[2];
+    byte addr[2 + 4];
+    char host[16+1], domain[16+1], str[64];
+
+    switch (def->type) {
+    case INTEGER32:
+    case UNSIGNED32:
+        return addRandomInt32AVP(dgramPtr, def->code, def->vendor,
+                                 groupStart, def->mandatory);
+    case OCTET_STRING:
+    case UTF8_STRING:
+        return addRandomStringAVP(dgramPtr, def->code, def->vendor,
+                                  groupStart, def->mandatory);
+
+    case ENUMERATED:
+        // Most enumerations start from 0 and have a few values.
+        ok = Diameter::addInt32AVP(dgramPtr, def->code, rand() % 4,
+                                   def->mandatory, def->vendor);
+        break;
+    case TIME:
+        // NTP seconds in the next day.
+        ok = Diameter::addInt32AVP(dgramPtr, def->code,
+                                   time(NULL) + 2208988800u
+                                        + rand() % (24*60*60),
+                                   def->mandatory, def->vendor);
+        break;
+    case INTEGER64:
+    case UNSIGNED64:
+        u32[0] = htonl(rand());
+        u32[1] = htonl(rand());
+        ok = Diameter::addAVP(dgramPtr, def->code, def->mandatory,
+                              def->vendor, sizeof(u32), u32);
+        break;
+    case FLOAT32: {
+        float f = (float)rand() / RAND_MAX;
+
+        memcpy(u32, &f, sizeof(f));
+        u32[0] = htonl(u32[0]);
+        ok = Diameter::addAVP(dgramPtr, def->code, def->mandatory,
+                              def->vendor, sizeof(u32[0]), u32);
+        break;
+    }
+    case FLOAT64: {
+        double d = (double)rand() / RAND_MAX;
+        uint64_t u64;
+
+        memcpy(&u64, &d, sizeof(d));
+        u32[0] = htonl(u64 >> 32);
+        u32[1] = htonl(u64 & 0xFFFFFFFF);
+        ok = Diameter::addAVP(dgramPtr, def->code, def->mandatory,
+                              def->vendor, sizeof(u32), u32);
+        break;
+    }
+    case ADDRESS:
+        addr[0] = 0;
+        addr[1] = Diameter::ADDR_IPV4;
+        u32[0] = rand();
+        memcpy(&addr[2], u32, sizeof(u32[0]));
+        ok = Diameter::addAVP(dgramPtr, def->code, def->mandatory,
+                              def->vendor, sizeof(addr), addr);
+        break;
+    case DIAMETER_IDENTITY:
+    case DIAMETER_URI:
+        mkRandomString(host, sizeof(host), 1);
+        mkRandomString(domain, sizeof(domain), 1);
+        snprintf(str, sizeof(str),
+                 def->type == DIAMETER_URI ? "aaa://%s.%s:3868" : "%s.%s",
+                 host, domain);
+        ok = Diameter::addStringAVP(dgramPtr, def->code, str,
+                                    def->mandatory, def->vendor);
+        break;
+
+    case GROUPED:
+        if (!(ok = Diameter::startAVPGroup(dgramPtr, def->code, &group,
+                                           def->mandatory, def->vendor)))
+            break;
+        for (unsigned i = 0; ok && i < def->nmembers; i++) {
+            const DictAVP *member = lookupAVP(def->members[i].code,
+                                              def->members[i].vendor);
+            if (member)
+                ok = addRandomAVP(dgramPtr, member, group);
+        }
+        if (ok)
+            Diameter::finishAVPGroup(*dgramPtr, group);
+        break;
+    }
+
+    if (!ok && groupStart)
+        (*dgramPtr)->mUsed = groupStart;
+    return ok;
+}
+
+// Add Vendor-Id = LBSDIA_SUPPORTED_VENDOR_ID to *@dgramPtr.
+// This is used as the first AVP in a group.
+static bool addVendorId(DGram **dgramPtr, unsigned groupStart) {
+    if (!Diameter::addInt32AVP(dgramPtr, Diameter::VENDOR_ID,
+                               LBSDIA_SUPPORTED_VENDOR_ID)) {
+        (*dgramPtr)->mUsed = groupStart;
+        return false;
+    } else
+        return true;
+}
+
+// Add Session-Id (<DiameterIdentity>;<high 32 bits>;<low 32 bits>)
+// to *@dgramPtr @at the specified position (or at the end of the dgram).
+// If @dgramPtr is NULL, just return the size of the AVP.  If @ctx has
+// its Session-Id prerendered, it's copied and only the counter is
+// written, otherwise the AVP is built from scratch.
+static size_t addSessionId(DGram **dgramPtr, const ConnectionCtx *ctx,
+                           uint64_t sessionId, size_t at = 0) {
+    size_t size, was, lhost;
+
+    if (!dgramPtr && ctx->session_id)
+        return ctx->session_id->mUsed;
+    else if (!dgramPtr) {
+        size = strlen(ctx->origin.host) + 1 + 8 + 1 + 8;
+        return Diameter::MIN_AVP_SIZE + ALIGN4(size);
+    }
+
+    if (at) {
+        was = (*dgramPtr)->mUsed;
+        (*dgramPtr)->mUsed = at;
+    }
+
+    if (ctx->session_id) {
+        byte *avp;
+
+        // 72 bytes
+        size = ctx->session_id->mUsed;
+        if (DGram::ensure(dgramPtr, size)) {
+            avp = (*dgramPtr)->firstUnused();
+            memcpy(avp, ctx->session_id->mData, size);
+            putHex32(&avp[ctx->session_id_at], sessionId >> 32);
+            putHex32(&avp[ctx->session_id_at + 8+1],
+                     sessionId & 0xFFFFFFFF);
+            (*dgramPtr)->mUsed += size;
+        } else
+            size = 0;
+    } else {
+        lhost = strlen(ctx->origin.host);
+        char str[lhost + 1+8+1+8];
+
+        memcpy(str, ctx->origin.host, lhost);
+        str[lhost] = ';';
+        putHex32(CAST(byte *, &str[lhost + 1]), sessionId >> 32);
+        str[lhost + 1+8] = ';';
+        putHex32(CAST(byte *, &str[lhost + 1+8+1]), sessionId & 0xFFFFFFFF);
+
+        size = Diameter::MIN_AVP_SIZE + ALIGN4(sizeof(str));
+        if (!Diameter::addAVP(dgramPtr, Diameter::SESSION_ID, true, 0,
+                              sizeof(str), str))
+            size = 0;
+    }
+
+    if (at)
+        (*dgramPtr)->mUsed = was;
+
+    return size;
+}
+
+// Add Vendor-Specific-Applicaion-Id to *@dgramPtr.
+static bool addVESA(DGram **dgramPtr) {
+    size_t group;
+
+    if (!Diameter::startAVPGroup(dgramPtr, Diameter::VENDOR_SPECIFIC_APP_ID,
+                                 &group))                       // 8 bytes
+        return false;
+    if (!addVendorId(dgramPtr, group))                          // 12 bytes
+        return false;
+    if (!Diameter::addInt32AVP(dgramPtr, Diameter::AUTH_APPLICATION_ID,
+                               Diameter::TGPP_SH))              // 12 bytes
+        return false;
+    Diameter::finishAVPGroup(*dgramPtr, group);
+
+    // Total: 32 bytes.
+    return true;
+}
+
+// Add a Random User-Identity { Public-Identity, MSISDN } to *@dgramPtr.
+static bool addUserIdentity(DGram **dgramPtr) {
+    size_t userIdentity;
+
+    if (Diameter::startAVPGroup(dgramPtr, Diameter::USER_IDENTITY,
+                                 &userIdentity, true,   // 12 bytes
+                                 Diameter::VENDOR_3GPP)
+        && addRandomStringAVP(dgramPtr, Diameter::PUBLIC_IDENTITY,
+                              Diameter::VENDOR_3GPP)    // 44 bytes
+        && addRandomStringAVP(dgramPtr, Diameter::MSISDN,
+                              Diameter::VENDOR_3GPP)) {
+        Diameter::finishAVPGroup(*dgramPtr, userIdentity);
+        return true;
+    } else
+        return false;
+}
+
+// Add a randomly generated User-Data to *@dgramPtr.
+// @publicId and @msISDN are @lpublicId and @lmsISDN bytes long,
+// and they needn't be NUL-terminated.
+static bool addUserData(DGram **dgramPtr,
+                        size_t minUserData, size_t maxUserData,
+                        const char *publicId, int lpublicId,
+                        const char *msISDN = NULL, int lmsISDN = 0) {
+    size_t n;
+
+    // How large User-Data to add?
+    n = rndint(minUserData, maxUserData);
+
+    // Generate @userData and add it to *@dgramPtr.  The strings may
+    // contain NULs, so take the length of the prefix from sprintf().
+    if (msISDN) {
+        const char prefix[] = "Dear %.*s (%.*s), your user data is: ";
+        char userData[sizeof(prefix) + lpublicId + lmsISDN + n];
+        int lprefix;
+
+        lprefix = sprintf(userData, prefix, lpublicId, publicId,
+                          lmsISDN, msISDN);
+        mkRandomString(&userData[lprefix], n+1, n+1);
+        return Diameter::addStringAVP(dgramPtr, Diameter::USER_DATA, userData,
+                                      true, Diameter::VENDOR_3GPP);
+    } else {
+        const char prefix[] = "Dear %.*s, your user data is: ";
+        char userData[sizeof(prefix) + lpublicId + n];
+        int lprefix;
+
+        lprefix = sprintf(userData, prefix, lpublicId, publicId);
+        mkRandomString(&userData[lprefix], n+1, n+1);
+        return Diameter::addStringAVP(dgramPtr, Diameter::USER_DATA, userData,
+                                      true, Diameter::VENDOR_3GPP);
+    }
+}
+
+// Return the next User-Data blob of @UserDataPool, (re)building it first
+// if it's not for [@minUserData..@maxUserData].  Returns NULL if there's
+// not enough memory.
+static const UserDataBlob *nextUserData(unsigned minUserData,
+                                        unsigned maxUserData) {
+    UserDataBlob *blob;
+
+    if (!UserDataPool.data || UserDataPool.min != minUserData
+        || UserDataPool.max != maxUserData) {
+        size_t size;
+
+        // mkRandomString() writes @size characters and a NUL.
+        size = (size_t)maxUserData + USER_DATA_SLACK;
+        DGramSegment::unref(UserDataPool.data);
+        if (!(UserDataPool.data = DGramSegment::alloc(size + 1)))
+            return NULL;
+        mkRandomString((char *)UserDataPool.data->mData, size, size);
+        UserDataPool.size = size;
+        UserDataPool.min = minUserData;
+        UserDataPool.max = maxUserData;
+        UserDataPool.next = 0;
+        for (unsigned i = 0; i < USER_DATA_POOL; i++) {
+            UserDataPool.blobs[i].offset = rand() % USER_DATA_SLACK;
+            UserDataPool.blobs[i].size = rndint(minUserData, maxUserData);
+        }
+    }
+
+    blob = &UserDataPool.blobs[UserDataPool.next++ % USER_DATA_POOL];
+    return blob;
+}
+
+// Like addUserData(), except that the random part is a blob of
+// @UserDataPool, which is not copied but referred to by the DGram's
+// @mTail, and the rest is put together without sprintf().  User-Data
+// has to be the last AVP of the message then.
+static bool addPooledUserData(DGram **dgramPtr,
+                              unsigned minUserData, unsigned maxUserData,
+                              const char *publicId, int lpublicId,
+                              const char *msISDN = NULL, int lmsISDN = 0) {
+    static const char dear[] = "Dear ";
+    static const char open[] = " (", close[] = ")";
+    static const char yours[] = ", your user data is: ";
+    const UserDataBlob *blob;
+    size_t len;
+
+    if (!(blob = nextUserData(minUserData, maxUserData)))
+        return addUserData(dgramPtr, minUserData, maxUserData,
+                           publicId, lpublicId, msISDN, lmsISDN);
+
+    char userData[sizeof(dear) + lpublicId + sizeof(open) + lmsISDN
+                  + sizeof(close) + sizeof(yours)];
+
+    len = 0;
+    memcpy(&userData[len], dear, sizeof(dear) - 1);
+    len += sizeof(dear) - 1;
+    memcpy(&userData[len], publicId, lpublicId);
+    len += lpublicId;
+    if (msISDN) {
+        memcpy(&userData[len], open, sizeof(open) - 1);
+        len += sizeof(open) - 1;
+        memcpy(&userData[len], msISDN, lmsISDN);
+        len += lmsISDN;
+        memcpy(&userData[len], close, sizeof(close) - 1);
+        len += sizeof(close) - 1;
+    }
+    memcpy(&userData[len], yours, sizeof(yours) - 1);
+    len += sizeof(yours) - 1;
+
+    return Diameter::addSharedAVP(dgramPtr, Diameter::USER_DATA,
+                                  true, Diameter::VENDOR_3GPP,
+                                  len, userData, UserDataPool.data,
+                                  &UserDataPool.data->mData[blob->offset],
+                                  blob->size);
+}
+
+// Construct and send a CER on @task, and set up @ctx->cerTimer.
+// Returns whether both duties have been completed successfully.
+static DGram *mkCERorCEA(const ConnectionCtx *ctx, bool isRequest = true) {
+    DGram *cer;
+
+    // Construct CER.  300 bytes are thought to be enough for it.
+    if (!(cer = DGram::alloc(300)))
+        return NULL;
+    if (!Diameter::startMessage(&cer, Diameter::CER,            // 20 bytes
+                                isRequest ? Diameter::FLAG_REQUEST : 0,
+                                0, ctx->hop_by_hop, ctx->end_to_end))
+        goto out;
+    if (!Diameter::addInt32AVP(&cer, Diameter::RESULT_CODE,     // 12 bytes
+                               Diameter::RC_SUCCESS))
+        goto out;
+    if (!Diameter::addStringAVP(&cer, Diameter::ORIGIN_HOST,    // ~40 bytes
+                                ctx->origin.host))
+        goto out;
+    if (!Diameter::addStringAVP(&cer, Diameter::ORIGIN_REALM,   // ~40 bytes
+                                ctx->origin.realm))
+        goto out;
+
+    // Discover our addresses and add them to @cer as Host-IP-Address.
+    if (ctx-> sfd < 0)
+        /* NOP */;
+    else if (ctx->is_sctp) {
+        int n;
+        struct sockaddr *saddrs;
+        const struct sockaddr *saddr;
+
+        if ((n = sctp_getladdrs(ctx->sfd, 0, &saddrs)) < 0) {
+            ERR("sctp_getladdrs(): %s", strerror(errno));
+            goto out;
+        } else
+            saddr = saddrs;
+        for (; n > 0; n--) {
+            DMXEndPoint addr;
+
+            // Max 28 bytes.
+            saddr = addr.fromSockaddr(saddr);
+            if (!Diameter::addAddrAVP(&cer, Diameter::HOST_IP_ADDR,
+                                      &addr.addr)) {
+                sctp_freeladdrs(saddrs);
+                goto out;
+            }
+        }
+        sctp_freeladdrs(saddrs);
+    } else {
+        DMXEndPoint addr;
+        socklen_t ssaddr;
+        struct sockaddr_storage saddr;
+
+        if (getsockname(ctx->sfd, (struct sockaddr *)&saddr, &ssaddr) < 0)
+            ERR("getsockname(): %s", strerror(errno));
+        addr.fromSockaddr((struct sockaddr *)&saddr);
+        if (!Diameter::addAddrAVP(&cer, Diameter::HOST_IP_ADDR,
+                                  &addr.addr))
+            goto out;
+    }
+
+    if (!Diameter::addInt32AVP(&cer, Diameter::VENDOR_ID,       // 12 bytes
+                               LBSDIA_VENDOR_ID))
+        goto out;
+    if (!Diameter::addStringAVP(&cer, Diameter::PRODUCT_NAME,   // 16 bytes
+                                LBSDIA_PRODUCT_NAME, false))
+        goto out;
+    if (!Diameter::addInt32AVP(&cer, Diameter::SUPPORTED_VENDOR_ID,
+                               LBSDIA_SUPPORTED_VENDOR_ID))     // 12 bytes
+        goto out;
+    if (!addVESA(&cer))                                         // 32 bytes
+        goto out;
+    if (!Diameter::addInt32AVP(&cer, Diameter::FIRMWARE_REVISION, // 12 bytes
+                               LBSDIA_FIRMWARE_REVISION, false))
+        goto out;
+
+    // Total: ~252 bytes.
+    Diameter::finishMessage(cer);
+
+    if (Verbosity > 0)
+        LOG("-> %s", isRequest ? "CER" : "CEA");
+    return cer;
+
+out:
+    DGram::release(cer);
+    return NULL;
+}
+
+// Add AVPs to *@dgramPtr common in UDR and PNR.
+//  Session-Id:                     addSessionId()
+//  Vendor-Specific-Application-Id: addVESA()
+//  Auth-Session-State:             AUTH_STATE_MAINTAINED
+//  Origin-Host:                    @ctx->origin.host
+//  Origin-Realm:                   @ctx->origin.realm
+//  Destination-Host:               @ctx->destination.host
+//  Destination-Realm:              @ctx->destination.realm
+static bool startUDRorPNR(DGram **dgramPtr, const ConnectionCtx *ctx,
+                          unsigned cmd, unsigned hopByHop = 0,
+                          uint64_t sessionId = 0) {
+    if (!hopByHop)
+        hopByHop = ctx->hop_by_hop;
+    if (!Diameter::startMessage(dgramPtr, cmd, Diameter::FLAG_REQUEST,
+                                Diameter::TGPP_SH,      // 20 bytes
+                                hopByHop, ctx->end_to_end + sessionId))
+        return false;
+
+    // Session-Id, VESA, ASS
+    if (!addSessionId(dgramPtr, ctx, sessionId))        // 72 bytes
+        return false;
+    if (!addVESA(dgramPtr))                             // 32 bytes
+        return false;
+    if (!Diameter::addInt32AVP(dgramPtr, Diameter::AUTH_SESSION_STATE,
+                               Diameter::AUTH_STATE_MAINTAINED))
+        return false;                                   // 12 bytes
+
+    // {Origin,Destination}-{Host,Realm}                // ~4*40 bytes
+    if (!Diameter::addStringAVP(dgramPtr, Diameter::ORIGIN_HOST,
+                                ctx->origin.host))
+        return false;
+    if (!Diameter::addStringAVP(dgramPtr, Diameter::ORIGIN_REALM,
+                                ctx->origin.realm))
+        return false;
+    if (!Diameter::addStringAVP(dgramPtr, Diameter::DESTINATION_HOST,
+                                ctx->destination.host))
+        return false;
+    if (!Diameter::addStringAVP(dgramPtr, Diameter::DESTINATION_REALM,
+                                ctx->destination.realm))
+        return false;
+
+    // Total: 296 bytes.
+    return true;
+}
+
+// Generate a random User-Data-Request.
+//  User-Identity:
+//      Public-Identity:            mkRandomString()
+//      MSISDN:                     mkRandomString()
+//  Data-Reference:                 REPOSITORY_DATA
+static DGram *mkUDR(const ConnectionCtx *ctx, uint64_t sessionId) {
+    DGram *udr;
+
+    if (!(udr = DGram::alloc(512)))
+        return NULL;
+    if (!startUDRorPNR(&udr, ctx, Diameter::UDR, 0, sessionId)) // 296 bytes
+        goto out;
+
+    // User-Identity, Data-Reference
+    if (!addUserIdentity(&udr))
+        goto out;
+    if (!Diameter::addInt32AVP(&udr, Diameter::DATA_REFERENCE,
+                               Diameter::REPOSITORY_DATA,
+                               true, Diameter::VENDOR_3GPP))
+        goto out;                                       // 16 bytes
+
+    // Total: 412 bytes.
+    Diameter::finishMessage(udr);
+    return udr;
+
+out:
+    DGram::release(udr);
+    return NULL;
+}
+
+// Generate a random Push-Notification-Request.
+static DGram *mkPNR(const ConnectionCtx *ctx,
+                    unsigned hopByHop, uint64_t sessionId) {
+    DGram *pnr;
+    char publicIdentity[32+1];
+
+    if (!(pnr = DGram::alloc(412)))
+        return NULL;
+    if (!startUDRorPNR(&pnr, ctx, Diameter::PNR, hopByHop, sessionId))
+        goto out;                   // 296 bytes
+
+    // Public-Identity              // 44 bytes
+    mkRandomString(publicIdentity, sizeof(publicIdentity));
+    if (!Diameter::addStringAVP(&pnr, Diameter::PUBLIC_IDENTITY,
+                                publicIdentity, true,
+                                Diameter::VENDOR_3GPP))
+        goto out;
+    // User-Data                    12 + 58 + @maxUserData bytes,
+    //                              the latter not copied
+    if (!addPooledUserData(&pnr, ctx->min_user_data, ctx->max_user_data,
+                           publicIdentity, strlen(publicIdentity)))
+        goto out;
+
+    // Total: 412 + @maxUserData.
+    Diameter::finishMessage(pnr);
+    return pnr;
+
+out:
+    DGram::release(pnr);
+    return NULL;
+}
+
+// Copy the @len bytes long message at @msg into a new DGram.
+static DGram *dupeMessage(const byte *msg, size_t len) {
+    DGram *dgram;
+
+    if (!(dgram = DGram::alloc(len)))
+        return NULL;
+    memcpy(dgram->mData, msg, len);
+    dgram->mUsed = len;
+
+    return dgram;
+}
+
+// Return a randomly generated User-Data response to the UDR in @dia,
+// whose AVP:s start at @udr and take @rem bytes.
+static DGram *mkUDA(const ConnectionCtx *ctx, const Diameter *dia,
+                    const byte *udr, size_t rem) {
+    DGram *reply;
+    bool proxied;
+    const byte *msg = udr - Diameter::HEADER_SIZE;
+    Diameter::AVP avp, sessionId, publicId, msISDN;
+    Diameter::AVPIterator it(dia, udr, rem);
+
+    // Retrieve Session-Id, Public-Identity and MSISDN from @dia.
+    // They're only looked at, not copied.  Proxy-Info:s must be echoed,
+    // which only makeResponse() does.
+    proxied = false;
+    sessionId.data = publicId.data = msISDN.data = NULL;
+    while (it.next(&avp)) {
+        if (avp.code == Diameter::USER_IDENTITY) {
+            Diameter::AVPIterator group(dia, avp);
+
+            // This is a group AVP.
+            if (!group.next(&publicId) || !group.next(&msISDN))
+                return NULL;
+        } else if (avp.code == Diameter::SESSION_ID)
+            sessionId = avp;
+        else if (avp.code == Diameter::PROXY_INFO)
+            proxied = true;
+    } // for each AVP
+    if (it.failed())
+        return NULL;
+
+    // If everything is in place and we have a template, fill it in.
+    if (ctx->answer_tmpl && !proxied
+        && sessionId.data && publicId.data && msISDN.data) {
+        size_t hrem;
+        unsigned flags, hbh, ete;
+
+        hrem = 0;
+        dia->parseMessageHeader(msg, &hrem, NULL, &flags, NULL, &hbh, &ete);
+        if (!(reply = ctx->answer_tmpl->instantiate(hbh, ete, flags,
+                                        sessionId,
+                                        64 + publicId.len + msISDN.len)))
+            return NULL;
+        if (!addPooledUserData(&reply,
+                               ctx->min_user_data, ctx->max_user_data,
+                               (const char *)publicId.data, publicId.len,
+                               (const char *)msISDN.data, msISDN.len))
+            goto out;
+        Diameter::finishMessage(reply);
+        if (Verbosity > 0)
+            LOG("-> UDA");
+        return reply;
+    }
+
+    // Create a response.  @dia may contain other messages as well.
+    if (!(reply = dupeMessage(msg, Diameter::HEADER_SIZE + rem)))
+        return NULL;
+
+    // Have we found every AVP we were looking for?
+    if (!sessionId.data || !publicId.data || !msISDN.data) {
+        // Reply an error message.
+        if (!dia->makeResponse(&reply, true,
+                               Diameter::RC_MISSING_AVP,
+                               ctx->origin.host, ctx->origin.realm))
+            goto out;
+    } else {
+        if (!dia->makeResponse(&reply, false,
+                               Diameter::RC_SUCCESS,
+                               ctx->origin.host, ctx->origin.realm))
+            goto out;
+        if (!addPooledUserData(&reply,
+                               ctx->min_user_data, ctx->max_user_data,
+                               (const char *)publicId.data, publicId.len,
+                               (const char *)msISDN.data, msISDN.len))
+            goto out;
+        Diameter::finishMessage(reply);
+    }
+
+    if (Verbosity > 0)
+        LOG("-> UDA");
+    return reply;
+
+out:
+    DGram::release(reply);
+    return NULL;
+}
+
+// Construct a PNA to the PNR in @dia at @msg whose AVPs are at @pnr.
+// If it has a Session-Id but no Proxy-Info and we have a template, that's
+// instantiated, otherwise the PNR is turned into an answer with
+// makeResponse().
+static DGram *mkPNA(const ConnectionCtx *ctx, const Diameter *dia,
+                    const byte *msg, const byte *pnr, size_t rem) {
+    DGram *reply;
+    bool proxied;
+    Diameter::AVP avp, sessionId;
+    Diameter::AVPIterator it(dia, pnr, rem);
+
+    proxied = false;
+    sessionId.data = NULL;
+    if (ctx->pna_tmpl) {
+        while (it.next(&avp))
+            if (avp.code == Diameter::SESSION_ID)
+                sessionId = avp;
+            else if (avp.code == Diameter::PROXY_INFO)
+                proxied = true;
+    }
+
+    if (sessionId.data && !proxied && !it.failed()) {
+        size_t hrem;
+        unsigned flags, hbh, ete;
+
+        hrem = 0;
+        dia->parseMessageHeader(msg, &hrem, NULL, &flags, NULL, &hbh, &ete);
+        return ctx->pna_tmpl->instantiate(hbh, ete, flags, sessionId);
+    }
+
+    reply = dupeMessage(msg, (pnr - msg) + rem);
+    if (reply && dia->makeResponse(&reply, false,
+                                   Diameter::RC_SUCCESS,
+                                   ctx->origin.host,
+                                   ctx->origin.realm))
+        return reply;
+
+    DGram::release(reply);
+    return NULL;
+}
+
+// Build the template of a successful Sh answer to @command, with no
+// Session-Id, which will be inserted right after the header.
+static MsgTemplate *compileAnswer(const ConnectionCtx *ctx, unsigned command) {
+    DGram *dgram;
+
+    if (!(dgram = DGram::alloc(256)))
+        return NULL;
+    if (!Diameter::startMessage(&dgram, command, 0, Diameter::TGPP_SH, 0, 0)
+        || !addVESA(&dgram)
+        || !Diameter::addInt32AVP(&dgram, Diameter::AUTH_SESSION_STATE,
+                                  Diameter::AUTH_STATE_MAINTAINED)
+        || !Diameter::addStringAVP(&dgram, Diameter::ORIGIN_HOST,
+                                   ctx->origin.host)
+        || !Diameter::addStringAVP(&dgram, Diameter::ORIGIN_REALM,
+                                   ctx->origin.realm)
+        || !Diameter::addInt32AVP(&dgram, Diameter::RESULT_CODE,
+                                  Diameter::RC_SUCCESS)) {
+        DGram::release(dgram);
+        return NULL;
+    }
+
+    Diameter::finishMessage(dgram);
+    return new MsgTemplate(dgram);
+}
+
+// Precompile the messages @ctx sends the most: the UDR (with a random
+// User-Identity) or the PNR (with a random Public-Identity, but without
+// User-Data), the UDA (without Session-Id and User-Data) and the PNA
+// (without Session-Id).  Without templates the messages are built from
+// scratch every time.
+static void compileTemplates(ConnectionCtx *ctx) {
+    DGram *dgram;
+
+    ctx->request_tmpl = ctx->answer_tmpl = ctx->pna_tmpl = NULL;
+
+    // Prerender the Session-Id first, so the templates are built with it.
+    ctx->session_id = NULL;
+    if ((dgram = DGram::alloc(addSessionId(NULL, ctx, 0))) != NULL) {
+        if (addSessionId(&dgram, ctx, 0)) {
+            ctx->session_id = dgram;
+            ctx->session_id_at = Diameter::MIN_AVP_SIZE
+                + strlen(ctx->origin.host) + 1;
+        } else
+            DGram::release(dgram);
+    }
+
+    if (ctx->is_client)
+        dgram = mkUDR(ctx, 0);
+    else if ((dgram = DGram::alloc(512)) != NULL) {
+        char publicIdentity[32+1];
+
+        mkRandomString(publicIdentity, sizeof(publicIdentity));
+        if (startUDRorPNR(&dgram, ctx, Diameter::PNR)
+            && Diameter::addStringAVP(&dgram, Diameter::PUBLIC_IDENTITY,
+                                      publicIdentity, true,
+                                      Diameter::VENDOR_3GPP))
+            Diameter::finishMessage(dgram);
+        else {
+            DGram::release(dgram);
+            dgram = NULL;
+        }
+    }
+    if (dgram)
+        ctx->request_tmpl = new MsgTemplate(dgram);
+
+    // The PNA is the same as the UDA, just without User-Data.
+    ctx->answer_tmpl = compileAnswer(ctx, Diameter::UDR);
+    ctx->pna_tmpl = compileAnswer(ctx, Diameter::PNR);
+}
+
+// Returns whether we're waiting for the end of a measurement of
+// the round-trip time of multiple transactions.  During this period
+// the user can't send messages.
+static bool measurementInProgress() {
+    return StartOfMeasurement.tv_sec || StartOfMeasurement.tv_nsec;
+}
+
+// Return the time in seconds elapsed @since.  If @nowp is not NULL,
+// the current CLOCK_MONOTONIC time is taken from there.
+static double measurementTime(
+                        const struct timespec *since = &StartOfMeasurement,
+                        const struct timespec *nowp = NULL) {
+    double elapsed;
+    struct timespec now;
+
+    if (!nowp) {
+        nowp = &now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+
+    elapsed  = (nowp->tv_sec  - since->tv_sec);
+    elapsed += (nowp->tv_nsec - since->tv_nsec) / 1000000000.0;
+
+    return elapsed;
+}
+
+// Print the percentiles of @h, which is in nanoseconds, in milliseconds.
+static void logHistogram(const char *what, const Histogram *h) {
+    if (h->count)
+        LOG("%s (ms): avg %.3f, p50 %.3f, p90 %.3f, p99 %.3f, "
+            "p99.9 %.3f, max %.3f", what,
+            h->sum / 1000000.0 / h->count,
+            h->percentile(50) / 1000000.0, h->percentile(90) / 1000000.0,
+            h->percentile(99) / 1000000.0, h->percentile(99.9) / 1000000.0,
+            h->max / 1000000.0);
+}
+
+// Return the phase of the scenario in which the @i-th request of the run
+// is due.  Phases with no requests are skipped over.
+static Phase *phaseOf(uint64_t i) {
+    size_t lo, hi;
+
+    // Find the last phase with @first <= @i.
+    lo = 0;
+    hi = Rate.phases.size();
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+
+        if (Rate.phases[mid].first <= i)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return &Rate.phases[lo];
+}
+
+// Return when the @i-th request of the rate run is due, in nanoseconds
+// from the start of the measurement.  In a ramp the rate is linear in
+// time, so the number of requests due by @t is quadratic, and we solve
+// it for @t.
+static uint64_t dueOffset(uint64_t i) {
+    const Phase *phase;
+    double k, slope, disc;
+
+    if (Rate.phases.empty())
+        return i * 1000000000.0 / Rate.tps;
+
+    phase = phaseOf(i);
+    k = i - phase->first;
+    if (phase->from == phase->to)
+        return phase->start + k * 1000000000.0 / phase->from;
+
+    slope = (phase->to - phase->from) / phase->secs;
+    disc  = phase->from * phase->from + 2 * slope * k;
+    if (disc < 0)
+        // Rounding at the end of a ramp down.
+        disc = 0;
+    return phase->start
+        + (sqrt(disc) - phase->from) / slope * 1000000000.0;
+}
+
+// Return the seconds elapsed between the start of @phase and @ts.
+static double phaseTime(const Phase *phase, const struct timespec *ts) {
+    int64_t elapsed;
+
+    elapsed = nsecs(ts) - nsecs(&StartOfMeasurement) - phase->start;
+    return elapsed > 0 ? elapsed / 1000000000.0 : 0;
+}
+
+// Print the outcome of each phase of the scenario.  The caller must hold
+// @MeasurementLock.
+static void reportScenario() {
+    for (size_t i = 0; i < Rate.phases.size(); i++) {
+        const Phase *phase = &Rate.phases[i];
+        double period, sendTime, answerTime;
+
+        if (!phase->count) {
+            LOG("Phase %zu: %s %.0f TPS for %.3fs.", i + 1,
+                phase->what, phase->from, phase->secs);
+            continue;
+        }
+
+        // Like in reportRate().
+        period      = phase->secs / phase->count;
+        sendTime    = phase->sent
+            ? phaseTime(phase, &phase->last_sent) : 0;
+        sendTime   += period;
+        answerTime  = phase->answered
+            ? phaseTime(phase, &phase->last_answer) : 0;
+        answerTime += period;
+
+        if (phase->from == phase->to)
+            LOG("Phase %zu: %s %.0f TPS for %.3fs: sent %lu requests "
+                "at %.0f TPS, %lu answered at %.0f TPS, %lu timed out.",
+                i + 1, phase->what, phase->from, phase->secs,
+                phase->sent, phase->sent / sendTime,
+                phase->answered, phase->answered / answerTime,
+                phase->timeouts);
+        else
+            LOG("Phase %zu: %s %.0f..%.0f TPS for %.3fs: sent %lu "
+                "requests at %.0f TPS, %lu answered at %.0f TPS, "
+                "%lu timed out.",
+                i + 1, phase->what, phase->from, phase->to, phase->secs,
+                phase->sent, phase->sent / sendTime,
+                phase->answered, phase->answered / answerTime,
+                phase->timeouts);
+        logHistogram("Latency", &phase->latency);
+    }
+}
+
+// Print the outcome of the rate run.  The caller must hold
+// @MeasurementLock.
+static void reportRate() {
+    double sendTime, answerTime;
+
+    // Add one period to the durations, so if everything went by the
+    // schedule the achieved rate equals to the offered one.
+    sendTime    = Rate.sent
+        ? measurementTime(&StartOfMeasurement, &Rate.last_sent) : 0;
+    sendTime   += 1 / Rate.tps;
+    answerTime  = Measured.answered
+        ? measurementTime(&StartOfMeasurement, &Rate.last_answer) : 0;
+    answerTime += 1 / Rate.tps;
+
+    LOG("Offered %.0f TPS for %.3fs: sent %lu requests at %.0f TPS, "
+        "%lu answered at %.0f TPS.",
+        Rate.tps, Rate.count / Rate.tps,
+        Rate.sent, Rate.sent / sendTime,
+        Measured.answered, Measured.answered / answerTime);
+    logHistogram("Latency", &Rate.latency);
+}
+
+// Print how the peer reacted to the fuzz run.  The caller must hold
+// @MeasurementLock.
+static void reportFuzz() {
+    LOG("Fuzzed with seed %lu: %lu disconnect(s), %lu missed DWA(s), "
+        "%lu unexpected Result-Code(s), %lu case(s) saved.",
+        Fuzz.seed, Fuzz.disconnects, Fuzz.hangs, Fuzz.oddities,
+        Fuzz.saved);
+}
+
+// Print the throughput and the round-trip times of each step of the
+// window run, then the same as CSV for plotting the latency against the
+// throughput.  The caller must hold @MeasurementLock.
+static void reportWindow() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (size_t i = 0; i < Window.steps.size(); i++) {
+        const WindowStep *step = &Window.steps[i];
+        double secs;
+
+        // The last step may have been cancelled.
+        secs = measurementTime(&step->start,
+                               step->end.tv_sec ? &step->end : &now);
+        LOG("Window %u: %lu answered at %.0f TPS, %lu timed out.",
+            step->depth, step->answered, step->answered / secs,
+            step->timeouts);
+        logHistogram("RTT", &step->rtt);
+    }
+
+    LOG("depth,tps,avg_ms,p50_ms,p90_ms,p99_ms,p99.9_ms,max_ms");
+    for (size_t i = 0; i < Window.steps.size(); i++) {
+        const WindowStep *step = &Window.steps[i];
+        const Histogram *h = &step->rtt;
+        double secs;
+
+        if (!h->count)
+            continue;
+        secs = measurementTime(&step->start,
+                               step->end.tv_sec ? &step->end : &now);
+        LOG("%u,%.0f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f",
+            step->depth, step->answered / secs,
+            h->sum / 1000000.0 / h->count,
+            h->percentile(50) / 1000000.0, h->percentile(90) / 1000000.0,
+            h->percentile(99) / 1000000.0, h->percentile(99.9) / 1000000.0,
+            h->max / 1000000.0);
+    }
+}
+
+// Print the fate of the requests of the measurement and their round-trip
+// times.  The caller must hold @MeasurementLock.
+static void reportMeasurement() {
+    LOG("%lu answered, %lu timed out, %lu unmatched, %lu duplicate and "
+        "%lu reordered answer(s).",
+        Measured.answered, Measured.timeouts,
+        Measured.unmatched, Measured.duplicates, Measured.reordered);
+    logHistogram("RTT", &MeasuredRTT);
+    if (Rate.tps && !Rate.phases.empty())
+        reportScenario();
+    if (Rate.tps)
+        reportRate();
+    if (Fuzz.running)
+        reportFuzz();
+    if (Window.running)
+        reportWindow();
+}
+
+// Print the results of the measurement which has ended @now, and stop it.
+// The caller must hold @MeasurementLock.
+static void stopMeasurement(const struct timespec *now) {
+    LOG("Test took %.3fs (%.3fs since the last message sent).",
+        measurementTime(&StartOfMeasurement, now),
+        measurementTime(Rate.tps ? &Rate.last_sent : &LastMessageSent, now));
+    reportMeasurement();
+    Rate.tps = 0;
+    Fuzz.running = false;
+    Window.running = false;
+    Window.depth = 0;
+    StartOfMeasurement.tv_sec = StartOfMeasurement.tv_nsec = 0;
+}
+
+// Take note that the request of @entry has been answered @now, or that it
+// has timed out unless @answered.  If it was the last request of the
+// measurement we've been waiting for, stop the measurement and print its
+// results.  The caller must hold @MeasurementLock.
+static void requestDone(const InFlight::Entry *entry,
+                        const struct timespec *now, bool answered) {
+    uint64_t sessionId = entry->sessionId;
+
+    if (!measurementInProgress()
+        || sessionId <= MeasurementBase || sessionId > SessionIdCounter)
+        // Not one of ours (eg. a late answer from an earlier run).
+        return;
+
+    if (answered) {
+        LastSessionId = sessionId;
+        Measured.answered++;
+        MeasuredRTT.record(nsecs(now) - entry->sent);
+        if (Rate.tps) {
+            uint64_t due, arrived, latency;
+
+            // Measure latency from the due time of the request.
+            due  = nsecs(&StartOfMeasurement);
+            due += dueOffset(sessionId - Rate.base - 1);
+            arrived = nsecs(now);
+            latency = arrived > due ? arrived - due : 0;
+            Rate.latency.record(latency);
+            Rate.last_answer = *now;
+
+            if (!Rate.phases.empty()) {
+                Phase *phase = phaseOf(sessionId - Rate.base - 1);
+
+                phase->answered++;
+                phase->latency.record(latency);
+                phase->last_answer = *now;
+            }
+        }
+    } else {
+        Measured.timeouts++;
+        if (Rate.tps && !Rate.phases.empty())
+            phaseOf(sessionId - Rate.base - 1)->timeouts++;
+    }
+
+    if (Window.running && !Window.draining) {
+        WindowStep *step = &Window.steps.back();
+
+        if (answered) {
+            step->answered++;
+            step->rtt.record(nsecs(now) - entry->sent);
+        } else
+            step->timeouts++;
+
+        // More requests are to come.
+        return;
+    }
+
+    if (Measured.answered + Measured.timeouts
+        < SessionIdCounter - MeasurementBase)
+        return;
+    stopMeasurement(now);
+}
+
+// Match the answer (@hbh, @ete) arrived on @ctx with its request,
+// and account for it.  Returns the Session-Id of the request, or 0
+// if it's not known.
+static uint64_t answerArrived(ConnectionCtx *ctx,
+                              unsigned hbh, unsigned ete) {
+    int ret;
+    InFlight::Entry entry;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ret = ctx->inflight->answer(hbh, ete, &entry);
+    if (ret == InFlight::UNMATCHED) {
+        ctx->stats.unmatched++;
+        if (Verbosity > 0)
+            ERR("Unmatched answer (Hop-by-Hop: 0x%x, End-to-End: 0x%x)",
+                hbh, ete);
+    } else if (ret == InFlight::DUPLICATE) {
+        ctx->stats.duplicates++;
+        if (Verbosity > 0)
+            ERR("Duplicate answer (Hop-by-Hop: 0x%x, End-to-End: 0x%x)",
+                hbh, ete);
+    } else if (ret == InFlight::REORDERED)
+        ctx->stats.reordered++;
+    if (ret == InFlight::MATCHED || ret == InFlight::REORDERED) {
+        ctx->request_sent = entry.sent;
+        if (Metrics::enabled)
+            Metrics::roundTrip(nsecs(&now) - entry.sent);
+    }
+
+    pthread_mutex_lock(&MeasurementLock);
+    if (measurementInProgress()) {
+        if (ret == InFlight::UNMATCHED)
+            Measured.unmatched++;
+        else if (ret == InFlight::DUPLICATE)
+            Measured.duplicates++;
+        else {
+            if (ret == InFlight::REORDERED)
+                Measured.reordered++;
+            requestDone(&entry, &now, true);
+        }
+    }
+    pthread_mutex_unlock(&MeasurementLock);
+
+    return ret == InFlight::MATCHED || ret == InFlight::REORDERED
+        ? entry.sessionId : 0;
+}
+
+// Depending on @ctx->is_client, return either an UDR or a PNR.
+// Instantiate @ctx->request_tmpl if we have it, otherwise build
+// the message from scratch.
+static DGram *mkUDRorPNR(const ConnectionCtx *ctx, uint64_t sessionId) {
+    DGram *dgram;
+    unsigned hbh;
+
+    if (ctx->is_client) {
+        dgram = ctx->request_tmpl
+            ? ctx->request_tmpl->instantiate(ctx->hop_by_hop,
+                                             ctx->end_to_end + sessionId,
+                                             sessionId)
+            : mkUDR(ctx, sessionId);
+        if (dgram && Verbosity > 0)
+            LOG("-> UDR");
+        return dgram;
+    }
+
+    // If we're talking to DiaLBS the high 16-bit of the Hop-by-Hop Id
+    // will decide which client gets our message.
+    hbh  = rndint(ctx->min_lga, ctx->max_lga) << 16;
+    hbh |= ctx->hop_by_hop & 0xF;
+
+    if (ctx->request_tmpl) {
+        Diameter::AVP publicId;
+
+        // Only User-Data is missing from the template.
+        if (!ctx->request_tmpl->find(Diameter::PUBLIC_IDENTITY, &publicId))
+            return NULL;
+        if (!(dgram = ctx->request_tmpl->instantiate(hbh,
+                                            ctx->end_to_end + sessionId,
+                                            sessionId, 116)))
+            return NULL;
+        if (!addPooledUserData(&dgram,
+                               ctx->min_user_data, ctx->max_user_data,
+                               (const char *)publicId.data, publicId.len)) {
+            DGram::release(dgram);
+            return NULL;
+        }
+        Diameter::finishMessage(dgram);
+    } else if (!(dgram = mkPNR(ctx, hbh, sessionId)))
+        return NULL;
+
+    if (Verbosity > 0)
+        LOG("-> PNR");
+    return dgram;
+}
+
+// Compile a DIAMETER message with AVPs randomly chosen from the
+// Dictionary.
+static DGram *mkRandom(const ConnectionCtx *ctx, uint64_t sessionId) {
+    DGram *dgram;
+    unsigned navps;
+
+    if (!(dgram = DGram::alloc(512)))
+        return NULL;
+    if (!Diameter::startMessage(&dgram,
+                                ctx->is_client
+                                    ? Diameter::UDR
+                                    : Diameter::PNR,
+                                Diameter::FLAG_REQUEST,
+                                Diameter::TGPP_SH,
+                                ctx->hop_by_hop,
+                                ctx->end_to_end + sessionId)) {
+        DGram::release(dgram);
+        return NULL;
+    }
+
+    if (measurementInProgress() && !addSessionId(&dgram, ctx, sessionId))
+        return NULL;
+
+    // The return values of the add*() functions are not checked
+    // intentionally, because their failure doesn't block the whole
+    // operation.
+    for (navps = rand() % 25; navps > 0; navps--)
+        addRandomAVP(&dgram, &Dictionary[rand() % NDICT]);
+
+    Diameter::finishMessage(dgram);
+    if (Verbosity > 0)
+        LOG("-> %s", ctx->is_client ? "UDR" : "PNR");
+    return dgram;
+}
+
+// Just allocate a DGram and start a DIAMETER message.
+static DGram *mkEmpty(const ConnectionCtx *ctx, uint64_t sessionId) {
+    DGram *dgram;
+    unsigned cmd, hbh;
+
+    if (ctx->is_client) {
+        cmd  = Diameter::UDR;
+        hbh  = ctx->hop_by_hop;
+    } else {
+        cmd  = Diameter::PNR;
+        hbh  = rndint(ctx->min_lga, ctx->max_lga) << 16;
+        hbh |= ctx->hop_by_hop & 0xF;
+    }
+
+    if (!(dgram = DGram::alloc(512)))
+        return NULL;
+    if (!Diameter::startMessage(&dgram, cmd, Diameter::FLAG_REQUEST,
+                                Diameter::TGPP_SH,
+                                hbh, ctx->end_to_end + sessionId)) {
+        DGram::release(dgram);
+        return NULL;
+    }
+
+    return dgram;
+}
+
+// Change the End-to-End Id of the message in @dgram.
+static void setEndToEnd(DGram *dgram, uint32_t ete) {
+    ete = htonl(ete);
+    memcpy(&dgram->mData[16], &ete, sizeof(ete));
+}
+
+// Rebuild the request @msg of @len bytes found in a capture for @ctx with
+// our own Hop-by-Hop and End-to-End Ids, and with our @sessionId, Origin-
+// and Destination-Host in place of the original ones.  If the message
+// can't be parsed, only the Id:s are changed.
+static DGram *mkReplayed(const ConnectionCtx *ctx, const byte *msg,
+                         size_t len, uint64_t sessionId) {
+    bool ok;
+    size_t rem, hlen;
+    unsigned cmd, flags, app, hbh, ete;
+    const byte *avps;
+    DGram *orig, *dgram;
+    const Diameter *dia;
+    Diameter::AVP avp;
+
+    if (ctx->is_client)
+        hbh  = ctx->hop_by_hop;
+    else {
+        hbh  = rndint(ctx->min_lga, ctx->max_lga) << 16;
+        hbh |= ctx->hop_by_hop & 0xF;
+    }
+    ete = ctx->end_to_end + sessionId;
+
+    if (!(orig = dupeMessage(msg, len)))
+        return NULL;
+    dia = Diameter::fromDGram(orig);
+    rem = 0;
+    avps = dia->parseMessageHeader(NULL, &rem, &cmd, &flags, &app);
+    DIAASSERT(avps && avps > orig->mData);
+
+    ok = false;
+    dgram = NULL;
+    if (Diameter::startMessage(&dgram, cmd, flags, app, hbh, ete)) {
+        Diameter::AVPIterator it(dia, avps, rem);
+
+        ok = true;
+        while (ok && it.next(&avp)) {
+            if (avp.vendor)
+                /* Copy it as it is. */;
+            else if (avp.code == Diameter::SESSION_ID) {
+                ok = addSessionId(&dgram, ctx, sessionId) > 0;
+                continue;
+            } else if (avp.code == Diameter::ORIGIN_HOST) {
+                ok = Diameter::addStringAVP(&dgram, Diameter::ORIGIN_HOST,
+                                            ctx->origin.host);
+                continue;
+            } else if (avp.code == Diameter::DESTINATION_HOST) {
+                ok = Diameter::addStringAVP(&dgram,
+                                            Diameter::DESTINATION_HOST,
+                                            ctx->destination.host);
+                continue;
+            }
+
+            hlen = avp.flags & Diameter::FLAG_VENDOR
+                ? Diameter::MAX_AVP_SIZE : Diameter::MIN_AVP_SIZE;
+            if (!(ok = DGram::ensure(&dgram, ALIGN4(hlen + avp.len))))
+                break;
+            memcpy(dgram->firstUnused(), avp.data - hlen, hlen + avp.len);
+            dgram->mUsed += hlen + avp.len;
+            memset(dgram->firstUnused(), 0, PAD4(hlen + avp.len));
+            dgram->mUsed += PAD4(hlen + avp.len);
+        }
+        ok = ok && !it.failed();
+    }
+
+    if (ok) {
+        Diameter::finishMessage(dgram);
+        DGram::release(orig);
+    } else {
+        // Send the original with our Id:s.
+        if (dgram)
+            DGram::release(dgram);
+        dgram = orig;
+        hbh = htonl(hbh);
+        memcpy(&dgram->mData[12], &hbh, sizeof(hbh));
+        setEndToEnd(dgram, ete);
+    }
+
+    if (Verbosity > 0)
+        LOG("-> %s", translate(cmd, flags));
+    return dgram;
+}
+
+// Fuzzing {{{
+// The ways fuzzMessage() can mutate a message.
+enum {
+    FUZZ_DUPLICATE  = 1 << 0,   // repeat an AVP a few times
+    FUZZ_NEST       = 1 << 1,   // bury an AVP in groups deeply
+    FUZZ_FLAGS      = 1 << 2,   // flip a flag of the header or an AVP
+    FUZZ_LENGTH     = 1 << 3,   // corrupt the length of an AVP
+    FUZZ_TRUNCATE   = 1 << 4,   // cut the message short
+    FUZZ_ALL        = (1 << 5) - 1,
+};
+
+// Return a random number from the xorshift64* generator of this thread.
+static uint64_t xorshift() {
+    uint64_t x = Xorshift;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    Xorshift = x;
+
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+// Get and set the 24-bit length of a message or an AVP at @p.
+static size_t getLength(const byte *p) {
+    return (p[0] << 16) | (p[1] << 8) | p[2];
+}
+
+static void setLength(byte *p, size_t len) {
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+}
+
+// Store the offsets of the first @max top-level AVPs of the message in
+// @dgram in @offs, and return how many there are.  Stop at the first one
+// which doesn't fit in the message.
+static unsigned findAVPs(const DGram *dgram, size_t *offs, unsigned max) {
+    size_t pos, len;
+    unsigned n;
+
+    n = 0;
+    pos = Diameter::HEADER_SIZE;
+    while (n < max && pos + Diameter::MIN_AVP_SIZE <= dgram->mUsed) {
+        len = ALIGN4(getLength(dgram->at(pos + 5)));
+        if (len < Diameter::MIN_AVP_SIZE || pos + len > dgram->mUsed)
+            break;
+        offs[n++] = pos;
+        pos += len;
+    }
+
+    return n;
+}
+
+// Make room for @len bytes at @pos in *@dgramPtr.
+static bool insertSpace(DGram **dgramPtr, size_t pos, size_t len) {
+    DGram *dgram;
+
+    if (!DGram::ensure(dgramPtr, len))
+        return false;
+    dgram = *dgramPtr;
+    memmove(dgram->at(pos + len), dgram->at(pos), dgram->mUsed - pos);
+    dgram->mUsed += len;
+
+    return true;
+}
+
+// Mutate the request in *@dgramPtr with a random selection of FUZZ_*.
+// The Hop-by-Hop and End-to-End Id:s are left alone, so the answer can
+// be matched, and the message stays padded, so "file -bH" can resend it.
+// The Message-Length is only corrupted on SCTP (@sctp), because on TCP
+// the peer would lose track of where the next message starts.
+static bool fuzzMessage(DGram **dgramPtr, bool sctp) {
+    DGram *dgram;
+    unsigned ops, navps, i;
+    size_t offs[64], pos, len;
+    bool keepLength;
+
+    dgram = *dgramPtr;
+    keepLength = false;
+    ops = 1 + xorshift() % FUZZ_ALL;
+    navps = findAVPs(dgram, offs, MEMBS_OF(offs));
+
+    if ((ops & FUZZ_DUPLICATE) && navps > 0) {
+        unsigned copies;
+
+        pos = offs[xorshift() % navps];
+        len = ALIGN4(getLength(dgram->at(pos + 5)));
+        copies = 1 + xorshift() % 16;
+        if (!insertSpace(dgramPtr, pos + len, copies * len))
+            return false;
+        dgram = *dgramPtr;
+        for (i = 1; i <= copies; i++)
+            memcpy(dgram->at(pos + i * len), dgram->at(pos), len);
+        navps = findAVPs(dgram, offs, MEMBS_OF(offs));
+    }
+
+    if ((ops & FUZZ_NEST) && navps > 0) {
+        uint32_t code;
+        unsigned depth, hlen;
+        const DictAVP *def;
+
+        // Wrap the AVP in the same group over and over again.
+        do
+            def = &Dictionary[xorshift() % NDICT];
+        while (def->type != GROUPED);
+        hlen = def->vendor
+            ? Diameter::MAX_AVP_SIZE : Diameter::MIN_AVP_SIZE;
+        depth = 1 + xorshift() % FUZZ_MAX_DEPTH;
+
+        pos = offs[xorshift() % navps];
+        len = ALIGN4(getLength(dgram->at(pos + 5)));
+        if (!insertSpace(dgramPtr, pos, depth * hlen))
+            return false;
+        dgram = *dgramPtr;
+        for (; depth > 0; depth--, pos += hlen) {
+            byte *p = dgram->at(pos);
+
+            code = htonl(def->code);
+            memcpy(p, &code, sizeof(code));
+            p[4] = def->mandatory ? Diameter::FLAG_MANDATORY : 0;
+            setLength(&p[5], depth * hlen + len);
+            if (def->vendor) {
+                p[4] |= Diameter::FLAG_VENDOR;
+                code = htonl(def->vendor);
+                memcpy(&p[8], &code, sizeof(code));
+            }
+        }
+        navps = findAVPs(dgram, offs, MEMBS_OF(offs));
+    }
+
+    if (ops & FUZZ_FLAGS) {
+        byte bit = 1 << (xorshift() % 8);
+
+        // Any flag of an AVP, or of the header except for R, which would
+        // make it an answer.
+        i = xorshift() % (navps + 1);
+        if (i < navps)
+            dgram->at(offs[i] + 4)[0] ^= bit;
+        else if (bit != Diameter::FLAG_REQUEST)
+            dgram->at(4)[0] ^= bit;
+        else
+            dgram->at(4)[0] ^= Diameter::FLAG_ERROR;
+    }
+
+    if ((ops & FUZZ_LENGTH) && (navps > 0 || sctp)) {
+        byte *p;
+
+        i = xorshift() % (navps + sctp);
+        p = i < navps ? dgram->at(offs[i] + 5) : dgram->at(1);
+        len = getLength(p);
+        switch (xorshift() % 6) {
+        case 0:  len = 0;                                       break;
+        case 1:  len = xorshift() % Diameter::MIN_AVP_SIZE;     break;
+        case 2:  len--;                                         break;
+        case 3:  len++;                                         break;
+        case 4:  len += 4 * (1 + xorshift() % 16);              break;
+        default: len = 0xFFFFFF;                                break;
+        }
+        setLength(p, len);
+        keepLength = i == navps;
+    }
+
+    // Unaligned messages from a capture may not have a whole word after
+    // the header.
+    if ((ops & FUZZ_TRUNCATE)
+        && dgram->mUsed >= Diameter::HEADER_SIZE + sizeof(uint32_t)) {
+        len = (dgram->mUsed - Diameter::HEADER_SIZE) / sizeof(uint32_t);
+        dgram->mUsed = Diameter::HEADER_SIZE
+            + sizeof(uint32_t) * (xorshift() % len);
+        if (sctp && xorshift() % 2)
+            // Let it claim to be longer than it is.
+            keepLength = true;
+    }
+
+    if (!keepLength)
+        Diameter::finishMessage(dgram);
+    return true;
+}
+
+// Build a fuzz case for @ctx with @sessionId from a random request of
+// @Replay or from our own UDR/PNR.
+static DGram *mkFuzzed(const ConnectionCtx *ctx, uint64_t sessionId) {
+    DGram *dgram;
+
+    if (Fuzz.captured) {
+        const ReplayMessage *m;
+
+        m = &Replay.msgs[xorshift() % Replay.msgs.size()];
+        dgram = mkReplayed(ctx, m->msg, m->len, sessionId);
+    } else
+        dgram = mkUDRorPNR(ctx, sessionId);
+
+    // fuzzMessage() mangles the AVPs in place.
+    if (dgram && (!DGram::flatten(&dgram)
+                  || !fuzzMessage(&dgram, ctx->is_sctp))) {
+        DGram::release(dgram);
+        return NULL;
+    }
+
+    return dgram;
+}
+
+// Remember @dgram, the fuzz case with @sessionId sent through @ctx,
+// in place of the one sent FUZZ_HISTORY earlier.
+static void rememberFuzzCase(const ConnectionCtx *ctx, DGram *dgram,
+                             uint64_t sessionId) {
+    FuzzCase *fc = &Fuzz.history[sessionId % FUZZ_HISTORY];
+
+    DGram::release(fc->dgram);
+    fc->sessionId = sessionId;
+    fc->ctx = ctx;
+    fc->dgram = dgram;
+    fc->done = fc->saved = false;
+    Fuzz.last = sessionId;
+}
+
+// Return the fuzz case with @sessionId if we still remember it.
+static FuzzCase *fuzzCase(uint64_t sessionId) {
+    FuzzCase *fc = &Fuzz.history[sessionId % FUZZ_HISTORY];
+
+    return Fuzz.last && fc->dgram && fc->sessionId == sessionId
+        ? fc : NULL;
+}
+
+// Write @fc to a file, which "file -bH" can send again, and say @why.
+static void saveFuzzCase(FuzzCase *fc, const char *why) {
+    int fd;
+    char fname[64];
+
+    fc->saved = true;
+    snprintf(fname, sizeof(fname), "fuzz-%lu-%lu.bin",
+             Fuzz.seed, fc->sessionId);
+    if ((fd = open(fname, O_CREAT|O_TRUNC|O_WRONLY, 0666)) < 0) {
+        ERR("%s: %m", fname);
+        return;
+    }
+
+    if (write(fd, fc->dgram->mData, fc->dgram->mUsed) < 0)
+        ERR("%s: %m", fname);
+    else {
+        LOG("Connection %u: %s, saved %s.", fc->ctx->idx, why, fname);
+        Fuzz.saved++;
+    }
+    close(fd);
+}
+
+// Take note that the fuzz case with @sessionId has timed out.
+static void fuzzTimedOut(uint64_t sessionId) {
+    FuzzCase *fc;
+
+    if ((fc = fuzzCase(sessionId)) != NULL)
+        fc->done = true;
+}
+
+// Check the answer to the fuzz case with @sessionId, whose @flags are
+// given and whose AVPs are the @rem bytes at @avps in @dia.  It should
+// have a Result-Code, and the E bit should be set iff it's a protocol
+// error (3xxx).
+static void fuzzAnswered(uint64_t sessionId, const Diameter *dia,
+                         unsigned flags, const byte *avps, size_t rem) {
+    FuzzCase *fc;
+    uint32_t rc;
+    char why[64];
+
+    if (!(fc = fuzzCase(sessionId)))
+        return;
+    fc->done = true;
+
+    if (!Metrics::resultCode(dia, avps, rem, &rc))
+        snprintf(why, sizeof(why), "no Result-Code");
+    else if (rc < 1000 || rc >= 6000)
+        snprintf(why, sizeof(why), "Result-Code %u", rc);
+    else if (!(flags & Diameter::FLAG_ERROR) != (rc / 1000 != 3))
+        snprintf(why, sizeof(why), "Result-Code %u with%s E bit", rc,
+                 flags & Diameter::FLAG_ERROR ? "" : "out");
+    else
+        return;
+
+    if (Fuzz.oddities++ < FUZZ_MAX_ODDITIES)
+        saveFuzzCase(fc, why);
+}
+
+// @ctx has gone away or stopped answering DWRs, as the @why says: save
+// the oldest FUZZ_SUSPECTS fuzz cases sent through it which haven't been
+// answered yet, and count it in *@counter if there was any.
+static void fuzzCrashed(const ConnectionCtx *ctx, const char *why,
+                        uint64_t *counter) {
+    unsigned n;
+    uint64_t sessionId;
+
+    if (!Fuzz.last)
+        return;
+
+    n = 0;
+    sessionId = Fuzz.last > FUZZ_HISTORY ? Fuzz.last - FUZZ_HISTORY : 0;
+    while (++sessionId <= Fuzz.last && n < FUZZ_SUSPECTS) {
+        FuzzCase *fc = fuzzCase(sessionId);
+
+        if (fc && fc->ctx == ctx && !fc->done && !fc->saved) {
+            saveFuzzCase(fc, why);
+            n++;
+        }
+    }
+
+    if (n > 0)
+        (*counter)++;
+}
+// }}}
+
+// Send a request with @sessionId.  If we're a client talking to DiaLBS
+// the output stream will decide which server our message is meant for.
+static void sendMessage(ConnectionCtx *ctx, DGram *dgram, uint64_t sessionId,
+                        bool freeDGram = true) {
+    sendDGram(ctx, dgram,
+              ctx->is_client ? rndint(ctx->min_stream, ctx->max_stream) : 0,
+              freeDGram, sessionId);
+}
+
+// Top up the requests in flight on @ctx to @Window.depth during a window
+// run.  Only the network thread may call it.
+static void fillWindow(ConnectionCtx *ctx) {
+    uint64_t sessionId;
+    size_t outstanding;
+    unsigned n;
+
+    if (ctx->is_eof || ctx->is_connecting)
+        return;
+    outstanding = ctx->inflight->outstanding();
+    if (outstanding >= Window.depth)
+        return;
+
+    pthread_mutex_lock(&MeasurementLock);
+    if (!Window.running || Window.draining) {
+        pthread_mutex_unlock(&MeasurementLock);
+        return;
+    }
+    n = Window.depth - outstanding;
+    sessionId = SessionIdCounter;
+    SessionIdCounter += n;
+    pthread_mutex_unlock(&MeasurementLock);
+
+    for (; n > 0; n--) {
+        sessionId++;
+        sendMessage(ctx, mkUDRorPNR(ctx, sessionId), sessionId);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &LastMessageSent);
+}
+
+// Handle the incoming DIAMETER request or reply at @msg in @dgram.
+// It's parsed right in the receive buffer, which may hold other messages
+// too, so the message is only copied if it's needed as a whole.
+static bool msgFromPeer(ConnectionCtx *ctx, const DGram *dgram,
+                        const byte *msg) {
+    const Diameter *dia;
+    const byte *ptr;
+    size_t rem;
+    unsigned cmd, flags, hbh, ete;
+    uint64_t sessionId;
+
+    // The caller has made sure that we have a complete DIAMETER message.
+    rem = 0;
+    dia = Diameter::fromDGram(dgram);
+    ptr = dia->parseMessageHeader(msg, &rem, &cmd, &flags, NULL, &hbh, &ete);
+    DIAASSERT(ptr && msg < ptr && ptr + rem <= dgram->firstUnused());
+
+    if (flags & Diameter::FLAG_REQUEST)
+        ctx->stats.requests++;
+    else {
+        ctx->stats.answers++;
+        if (cmd != Diameter::CER && cmd != Diameter::DWR
+            && cmd != Diameter::DPR
+            && (sessionId = answerArrived(ctx, hbh, ete)) != 0) {
+            fuzzAnswered(sessionId, dia, flags, ptr, rem);
+            fillWindow(ctx);
+        }
+    }
+
+    if (Verbosity > 0)
+        LOG("<- %s", translate(cmd, flags));
+    if (Verbosity > 2 && Trace < 0)
+        Diameter::dumpMessage(dia, msg);
+    switch (cmd) {
+    case Diameter::CER: { // {{{
+        Diameter::AVP avp;
+        Diameter::AVPIterator it(dia, ptr, rem);
+        unsigned resultCode;
+        bool gotOriginHost, gotOriginRealm;
+
+        // Reply to CER.
+        if (flags & Diameter::FLAG_REQUEST) {
+            sendDGram(ctx, mkCERorCEA(ctx, false), dgram->mStreamId);
+            ctx->ce_state = ConnectionCtx::CE_OK;
+            return true;
+        }
+
+        // Parse the AVP:s looking for Origin-Host, Origin-Realm (which
+        // must be present and equal to what we expect) and Result-Code
+        // (which should be 2xxx).  Until then consider the CEA bogus.
+        ctx->ce_state = ConnectionCtx::CE_FAILED;
+        resultCode = 0;
+        gotOriginHost = gotOriginRealm = false;
+        while (it.next(&avp)) {
+            switch (avp.code) {
+            case Diameter::RESULT_CODE:
+                if (!avp.getInt32(&resultCode))
+                    return true;
+                break;
+            case Diameter::ORIGIN_HOST:
+                if (!avp.equals(ctx->destination.host)) {
+                    ERR("Origin-Host mismatch (%.*s vs. %s)",
+                        (int)avp.len, avp.data, ctx->destination.host);
+                    return true;
+                }
+                gotOriginHost = true;
+                break;
+            case Diameter::ORIGIN_REALM:
+                if (!avp.equals(ctx->destination.realm)) {
+                    ERR("Origin-Realm mismatch (%.*s vs. %s)",
+                        (int)avp.len, avp.data, ctx->destination.realm);
+                    return true;
+                }
+                gotOriginRealm = true;
+                break;
+            }
+
+            // Stop as soon as we've got we're looking for.
+            if (resultCode && gotOriginHost && gotOriginRealm) {
+                if (flags & Diameter::FLAG_ERROR)
+                    break;
+                if (resultCode / 1000 != 2)
+                    break;
+                ctx->ce_state = ConnectionCtx::CE_OK;
+                return true;
+            }
+        } // parse CEA
+
+        // Log what went wrong.
+        ERR("Bogus CEA");
+        if (!it.failed()) {
+            if (flags & Diameter::FLAG_ERROR)
+                ERR("Error %u", resultCode);
+            else if (resultCode)
+                ERR("Result-Code %u", resultCode);
+            if (!gotOriginHost)
+                ERR("Origin-Host missing from CEA");
+            if (!gotOriginRealm)
+                ERR("Origin-Realm missing from CEA");
+        }
+        return true; // }}}
+    } case Diameter::DPR: { // {{{
+        Diameter::AVP avp;
+        Diameter::AVPIterator it(dia, ptr, rem);
+        bool rebooting;
+
+        // Disconnect-Peer
+        if (!(flags & Diameter::FLAG_REQUEST))
+            return false;
+
+        // Is Disconnect-Cause == REBOOTING?
+        // Nevermind parse errors.
+        rebooting = false;
+        while (it.next(&avp))
+            if (avp.code == Diameter::DISCONNECT_CAUSE) {
+                unsigned code;
+
+                if (avp.getInt32(&code))
+                    rebooting = (code == Diameter::REBOOTING);
+                break;
+            }
+        if (rebooting)
+            LOG("Server is rebooting.");
+
+        // Reply if we can, but no para if we can't.
+        sendDGram(ctx,
+                  createSimpleMessage(ctx, Diameter::DPR, false, hbh, ete),
+                  dgram->mStreamId);
+        ctx->is_eof = true;
+        return false; // }}}
+    } case Diameter::DWR: // {{{
         // Device-Watchdog
         if (flags & Diameter::FLAG_REQUEST)
-            sendDGram(ctx->sfd, DIAMETER_PORTS(ctx),
+            sendDGram(ctx,
                   createSimpleMessage(ctx, Diameter::DWR, false, hbh, ete),
                   dgram->mStreamId);
+        else
+            ctx->dwr_pending = 0;
         return true; // }}}
     case Diameter::UDR: // {{{
         if (flags & Diameter::FLAG_REQUEST) {
-            if (ctx->recv_delay)
-                usleep(ctx->recv_delay);
             if (ctx->no_reply)
                 return true;
-            sendDGram(ctx->sfd, DIAMETER_PORTS(ctx),
-                      mkUDA(ctx, dia, ptr, rem), dgram->mStreamId);
+            sendAnswer(ctx, mkUDA(ctx, dia, ptr, rem), dgram->mStreamId);
+            return true;
+        }
+        break; // }}}
+    case Diameter::PNR: // {{{
+        if (flags & Diameter::FLAG_REQUEST) {
+            if (ctx->no_reply)
+                return true;
+
+            DGram *reply = mkPNA(ctx, dia, msg, ptr, rem);
+            if (reply) {
+                if (Verbosity > 0)
+                    LOG("-> PNA");
+                sendAnswer(ctx, reply, dgram->mStreamId);
+            }
+            return true;
+        }
+        break; // }}}
+    default: // ?
+        return true;
+    } // switch @cmd
+
+    return true;
+}
+// }}}
+
+// Connection management {{{
+// Register or modify @fd in @Epoll to be notified about @events.
+static bool watchFd(int op, int fd, unsigned events, void *ptr) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = ptr;
+    if (epoll_ctl(Epoll, op, fd, &ev) < 0) {
+        ERR("epoll_ctl(%d): %s", fd, strerror(errno));
+        return false;
+    } else
+        return true;
+}
+
+// Move the DGram:s queued by enqueueDGram() to the end of the transmit
+// queue of @ctx in the order they were sent.  @now is when the network
+// thread noticed them.  Returns whether there's anything to transmit.
+static bool collectQueue(ConnectionCtx *ctx, uint64_t now) {
+    DGram *dgram, *first, *last, *next;
+
+    if (!(dgram = __atomic_exchange_n(&ctx->tx_stack, (DGram *)NULL,
+                                      __ATOMIC_ACQUIRE)))
+        return ctx->txq_head != NULL;
+
+    // @tx_stack is LIFO, reverse it.
+    first = NULL;
+    last = dgram;
+    for (; dgram; dgram = next) {
+        next = dgram->mNext;
+        dgram->mNext = first;
+        first = dgram;
+        ctx->txq_bytes += dgram->size();
+    }
+
+    if (ctx->txq_head)
+        ctx->txq_tail->mNext = first;
+    else {
+        ctx->txq_head = first;
+        ctx->txq_since = now;
+    }
+    ctx->txq_tail = last;
+
+    return true;
+}
+
+// Remove the first @n messages from the transmit queue of @ctx
+// and account for them.
+static void dequeueSent(ConnectionCtx *ctx, unsigned n) {
+    for (; n > 0; n--) {
+        DGram *dgram = ctx->txq_head;
+
+        ctx->txq_head = dgram->mNext;
+        ctx->txq_bytes -= dgram->size();
+        sentDGram(ctx, dgram);
+    }
+}
+
+// Throw away the transmit queue of @ctx.
+static void dropQueue(ConnectionCtx *ctx) {
+    DGram *dgram, *next;
+
+    for (dgram = ctx->txq_head; dgram; dgram = next) {
+        next = dgram->mNext;
+        droppedDGram(ctx, dgram);
+    }
+
+    ctx->txq_head = ctx->txq_tail = NULL;
+    ctx->txq_bytes = ctx->tx_offset = 0;
+}
+
+// Point @iov at the unwritten part of the first messages of the transmit
+// queue of TCP connection @ctx, as many as fit in IOV_MAX iovec:s.
+// Returns the number of iovec:s filled.
+static unsigned gatherTCP(const ConnectionCtx *ctx, struct iovec *iov) {
+    unsigned niov;
+    const DGram *dgram;
+
+    // The first @tx_offset bytes of @txq_head are gone already.
+    // A DGram takes at most 3 iovec:s.
+    niov = 0;
+    for (dgram = ctx->txq_head; dgram && niov + 3 <= IOV_MAX;
+         dgram = dgram->mNext)
+        niov += dgram->gather(&iov[niov],
+                              dgram == ctx->txq_head ? ctx->tx_offset : 0);
+
+    return niov;
+}
+
+// Account for @n bytes of the transmit queue of @ctx written.
+static void wroteTCP(ConnectionCtx *ctx, size_t n) {
+    unsigned done;
+    const DGram *dgram;
+
+    // Find out how many messages have been written completely.
+    done = 0;
+    for (dgram = ctx->txq_head; dgram; dgram = dgram->mNext) {
+        size_t left = dgram->size() - (done ? 0 : ctx->tx_offset);
+
+        if (n < left)
+            break;
+        n -= left;
+        done++;
+    }
+    ctx->tx_offset = done > 0 ? n : ctx->tx_offset + n;
+    dequeueSent(ctx, done);
+}
+
+// Write as many messages from the head of the transmit queue of TCP
+// connection @ctx as possible with a single writev().  Returns what
+// writev() did.
+static ssize_t writeTCP(ConnectionCtx *ctx) {
+    ssize_t n;
+    unsigned niov;
+    struct iovec iov[IOV_MAX];
+
+    niov = gatherTCP(ctx, iov);
+    if ((n = writev(ctx->sfd, iov, niov)) >= 0)
+        wroteTCP(ctx, n);
+    return n;
+}
+
+// Like writeTCP(), but use sendmmsg() on SCTP connections, so that each
+// message can go on its own stream.
+static ssize_t writeSCTP(ConnectionCtx *ctx) {
+    static const unsigned BATCH = 64;
+    int n;
+    unsigned nmsgs;
+    const DGram *dgram;
+    struct iovec iov[BATCH][3];
+    struct mmsghdr msgs[BATCH];
+    union {
+        char buf[CMSG_SPACE(sizeof(struct sctp_sndinfo))];
+        struct cmsghdr align;
+    } cmsgs[BATCH];
+
+    nmsgs = 0;
+    memset(msgs, 0, sizeof(msgs));
+    for (dgram = ctx->txq_head; dgram && nmsgs < BATCH;
+         dgram = dgram->mNext) {
+        struct msghdr *msg = &msgs[nmsgs].msg_hdr;
+
+        msg->msg_iov = iov[nmsgs];
+        msg->msg_iovlen = dgram->gather(iov[nmsgs]);
+
+        // The default stream is 0.
+        if (dgram->mStreamId) {
+            struct cmsghdr *cmsg;
+            struct sctp_sndinfo *sinfo;
+
+            memset(&cmsgs[nmsgs], 0, sizeof(cmsgs[nmsgs]));
+            msg->msg_control = cmsgs[nmsgs].buf;
+            msg->msg_controllen = sizeof(cmsgs[nmsgs].buf);
+            cmsg = CMSG_FIRSTHDR(msg);
+            cmsg->cmsg_level = IPPROTO_SCTP;
+            cmsg->cmsg_type = SCTP_SNDINFO;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(*sinfo));
+            sinfo = reinterpret_cast<struct sctp_sndinfo *>(
+                                                        CMSG_DATA(cmsg));
+            sinfo->snd_sid = dgram->mStreamId;
+        }
+
+        nmsgs++;
+    }
+
+    // SCTP doesn't write partial messages.
+    if ((n = sendmmsg(ctx->sfd, msgs, nmsgs, 0)) > 0)
+        dequeueSent(ctx, n);
+    return n;
+}
+
+// Return a cleared SQE for @op on @ctx.
+static struct io_uring_sqe *uringOp(ConnectionCtx *ctx, unsigned op) {
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = Uring.get()) != NULL)
+        sqe->user_data = (uintptr_t)ctx | op;
+    return sqe;
+}
+
+// Queue a writev() of the transmit queue of the io_uring connection @ctx
+// for the network thread to submit along with the others.  uringSent()
+// continues when it has completed.
+static void uringFlush(ConnectionCtx *ctx) {
+    struct io_uring_sqe *sqe;
+
+    if (ctx->sfd < 0) {
+        dropQueue(ctx);
+        return;
+    } else if (!ctx->txq_head) {
+        ctx->txq_tail = NULL;
+        return;
+    }
+
+    if (!ctx->uring_iov)
+        ctx->uring_iov = new struct iovec[IOV_MAX];
+    ctx->uring_niov = gatherTCP(ctx, ctx->uring_iov);
+
+    if (!(sqe = uringOp(ctx, URING_SEND))) {
+        ctx->uring_niov = 0;
+        dropQueue(ctx);
+        return;
+    }
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = ctx->sfd;
+    sqe->addr = (uintptr_t)ctx->uring_iov;
+    sqe->len = ctx->uring_niov;
+}
+
+// The writev() of @ctx returned @res.  Dequeue what has been written
+// and write the rest.
+static void uringSent(ConnectionCtx *ctx, int res) {
+    ctx->uring_niov = 0;
+    if (res >= 0) {
+        ctx->stats.syscalls++;
+        wroteTCP(ctx, res);
+    } else if (res != -EINTR && res != -EAGAIN && ctx->sfd >= 0) {
+        ERR("writev(%d): %s", ctx->sfd, strerror(-res));
+        dropQueue(ctx);
+        return;
+    }
+
+    uringFlush(ctx);
+}
+
+// Write out the transmit queue of @ctx as far as the socket lets us.
+// If it's full, the rest will be written when EPOLLOUT says there's
+// space again.
+static void flushConnection(ConnectionCtx *ctx) {
+    if (ctx->uring) {
+        // Only one writev() can be in flight.
+        if (!ctx->uring_niov)
+            uringFlush(ctx);
+        return;
+    }
+
+    while (ctx->txq_head) {
+        ssize_t n;
+
+        if (ctx->sfd < 0) {
+            dropQueue(ctx);
+            return;
+        } else if (ctx->is_connecting)
+            // finishConnect() will call us again.
+            return;
+
+        n = ctx->is_sctp ? writeSCTP(ctx) : writeTCP(ctx);
+        if (n >= 0) {
+            ctx->stats.syscalls++;
+            continue;
+        } else if (errno == EINTR)
+            continue;
+        else if (errno != EAGAIN) {
+            ERR("%s(%d): %s", ctx->is_sctp ? "sendmmsg" : "writev",
+                ctx->sfd, strerror(errno));
+            dropQueue(ctx);
+            break;
+        }
+
+        if (!ctx->tx_blocked) {
+            ctx->tx_blocked = true;
+            watchFd(EPOLL_CTL_MOD, ctx->sfd, EPOLLIN | EPOLLOUT, ctx);
+        }
+        return;
+    }
+
+    ctx->txq_tail = NULL;
+    if (ctx->tx_blocked) {
+        ctx->tx_blocked = false;
+        watchFd(EPOLL_CTL_MOD, ctx->sfd, EPOLLIN, ctx);
+    }
+}
+
+// Called by the network thread to write what the others have queued.
+// A connection is flushed right away unless -W asks to wait for more
+// messages.  Returns the number of milliseconds until the earliest
+// of the waiting ones is due, or -1 if none.
+static int transmit() {
+    int timeout;
+    uint64_t now;
+    ConnectionCtx *ctx, *next;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = nsecs(&ts);
+
+    ctx = __atomic_exchange_n(&ReadyConnections, (ConnectionCtx *)NULL,
+                              __ATOMIC_ACQUIRE);
+    for (; ctx; ctx = next) {
+        next = ctx->tx_next;
+
+        // Let enqueueDGram() schedule @ctx again if it needs to,
+        // then see what it has queued so far.
+        __atomic_store_n(&ctx->tx_scheduled, false, __ATOMIC_SEQ_CST);
+        if (collectQueue(ctx, now) && !ctx->tx_lingering) {
+            ctx->tx_lingering = true;
+            Lingering.push_back(ctx);
+        }
+    }
+
+    timeout = -1;
+    for (size_t i = 0; i < Lingering.size(); ) {
+        ctx = Lingering[i];
+        if (ctx->txq_head && !ctx->tx_blocked && ctx->sfd >= 0
+            && ctx->txq_bytes < ctx->flush_bytes
+            && now < ctx->txq_since + ctx->flush_delay * 1000ull) {
+            int due;
+
+            // Round up, lest we spin.
+            due = (ctx->txq_since + ctx->flush_delay * 1000ull
+                   - now + 999999) / 1000000;
+            if (timeout < 0 || due < timeout)
+                timeout = due;
+            i++;
+            continue;
+        }
+
+        // Blocked connections are flushed on EPOLLOUT.
+        if (!ctx->tx_blocked)
+            flushConnection(ctx);
+        ctx->tx_lingering = false;
+        Lingering[i] = Lingering.back();
+        Lingering.pop_back();
+    }
+
+    return timeout;
+}
+
+// Wait for the writev()s in flight on @Uring and those they lead to,
+// ignoring what's received meanwhile.  The caller holds @ConnectionsLock.
+static void uringDrain() {
+    const struct io_uring_cqe *cqe;
+
+    for (;;) {
+        bool busy;
+
+        busy = false;
+        for (size_t i = 0; i < Connections.size() && !busy; i++)
+            busy = Connections[i]->uring_niov > 0;
+        if (!busy || !Uring.submit(1))
+            break;
+
+        while ((cqe = Uring.peek()) != NULL) {
+            int res;
+            unsigned op, flags;
+            ConnectionCtx *ctx;
+
+            ctx = reinterpret_cast<ConnectionCtx *>(
+                            cqe->user_data & ~(uint64_t)URING_OP_MASK);
+            op = cqe->user_data & URING_OP_MASK;
+            res = cqe->res;
+            flags = cqe->flags;
+            Uring.seen();
+
+            if (op == URING_SEND)
+                uringSent(ctx, res);
+            else if (flags & IORING_CQE_F_BUFFER)
+                Uring.recycle(flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+    }
+}
+
+// Write out everything still queued, blocking if need be.  Used when the
+// network thread has stopped, to get the DPR:s through before exiting.
+static void drainConnections() {
+    pthread_mutex_lock(&ConnectionsLock);
+    for (size_t i = 0; i < Connections.size(); i++) {
+        ConnectionCtx *ctx = Connections[i];
+
+        if (ctx->sfd < 0 || ctx->is_connecting)
+            continue;
+        fcntl(ctx->sfd, F_SETFL, fcntl(ctx->sfd, F_GETFL) & ~O_NONBLOCK);
+        ctx->tx_blocked = false;
+        collectQueue(ctx, 0);
+        flushConnection(ctx);
+    }
+    if (Uring.fd() >= 0)
+        uringDrain();
+    pthread_mutex_unlock(&ConnectionsLock);
+}
+
+// Resolve "<host>[:<port>]" or "[<IPv6>][:<port>]".  An empty <host>
+// means any address if @passive.  Returns NULL on failure, otherwise
+// the result should be freeaddrinfo()d.
+static struct addrinfo *resolve(const char *str, bool passive) {
+    int err;
+    char buf[strlen(str) + 1];
+    const char *host, *port;
+    struct addrinfo hints, *res;
+    char *p;
+
+    strcpy(buf, str);
+    host = buf;
+    port = NULL;
+    if (buf[0] == '[' && (p = strchr(buf, ']')) != NULL) {
+        // [<IPv6>][:<port>]
+        host++;
+        *p++ = '\0';
+        if (*p == ':')
+            port = p + 1;
+    } else if ((p = strchr(buf, ':')) != NULL && !strchr(p + 1, ':')) {
+        // <host>:<port>, but not a bare IPv6 address
+        *p = '\0';
+        port = p + 1;
+    }
+
+    if (!host[0])
+        host = NULL;
+    if (!port || !port[0])
+        port = "3868";
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (passive)
+        hints.ai_flags = AI_PASSIVE;
+    if ((err = getaddrinfo(host, port, &hints, &res)) != 0) {
+        ERR("%s: %s", str, gai_strerror(err));
+        return NULL;
+    } else
+        return res;
+}
+
+// Make @saddr the IPv4 loopback address with @port.
+static void loopbackAddress(struct sockaddr_storage *saddr,
+                            unsigned port) {
+    struct sockaddr_in *saddr4;
+
+    memset(saddr, 0, sizeof(*saddr));
+    saddr4 = DMXEndPoint::toNS4(saddr);
+    saddr4->sin_family = AF_INET;
+    saddr4->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    saddr4->sin_port = htons(port);
+}
+
+// Create the state of a new connection based on @tmpl and add it to
+// @Connections.  Returns NULL if we're out of memory.
+static ConnectionCtx *newConnection(const ConnectionCtx *tmpl, int sfd) {
+    ConnectionCtx *ctx;
+
+    ctx = new ConnectionCtx(*tmpl);
+    ctx->sfd = sfd;
+    ctx->is_eof = ctx->is_connecting = false;
+    ctx->tx_stack = ctx->txq_head = ctx->txq_tail = NULL;
+    ctx->tx_next = NULL;
+    ctx->tx_scheduled = ctx->tx_blocked = ctx->tx_lingering = false;
+    ctx->txq_bytes = ctx->tx_offset = 0;
+    ctx->uring = false;
+    ctx->uring_niov = 0;
+    ctx->uring_iov = NULL;
+    ctx->ce_state = ConnectionCtx::CE_NONE;
+    ctx->dwr_pending = ctx->dwa_missed = 0;
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->request_sent = 0;
+    loopbackAddress(&ctx->local_addr, ctx->is_client
+                    ? DIAMETER_CLIENT_PORT : DIAMETER_SERVER_PORT);
+    loopbackAddress(&ctx->peer_addr, ctx->is_client
+                    ? DIAMETER_SERVER_PORT : DIAMETER_CLIENT_PORT);
+    ctx->rpos = 0;
+    if (!(ctx->rbuf = DGram::alloc(RECV_BUFFER_SIZE))) {
+        delete ctx;
+        return NULL;
+    }
+    ctx->inflight = new InFlight;
+    compileTemplates(ctx);
+
+    pthread_mutex_lock(&ConnectionsLock);
+    ctx->idx = Connections.size();
+    Connections.push_back(ctx);
+    pthread_mutex_unlock(&ConnectionsLock);
+
+    // Only the network thread writes the socket, and it must not block.
+    if (sfd >= 0) {
+        fcntl(sfd, F_SETFL, fcntl(sfd, F_GETFL) | O_NONBLOCK);
+        LiveConnections++;
+    }
+    return ctx;
+}
+
+// Propagate the settings changeable at run-time from @tmpl to all
+// connections.  The ranges a scenario changes are under @MeasurementLock.
+static void updateConnections(const ConnectionCtx *tmpl) {
+    pthread_mutex_lock(&MeasurementLock);
+    pthread_mutex_lock(&ConnectionsLock);
+    for (size_t i = 0; i < Connections.size(); i++) {
+        ConnectionCtx *ctx = Connections[i];
+
+        ctx->no_reply           = tmpl->no_reply;
+        ctx->watchdog_timeout   = tmpl->watchdog_timeout;
+        ctx->min_stream         = tmpl->min_stream;
+        ctx->max_stream         = tmpl->max_stream;
+        ctx->min_lga            = tmpl->min_lga;
+        ctx->max_lga            = tmpl->max_lga;
+        ctx->min_user_data      = tmpl->min_user_data;
+        ctx->max_user_data      = tmpl->max_user_data;
+        ctx->send_delay         = tmpl->send_delay;
+        ctx->recv_delay         = tmpl->recv_delay;
+    }
+    pthread_mutex_unlock(&ConnectionsLock);
+    pthread_mutex_unlock(&MeasurementLock);
+}
+
+// Set a range of the template of the connections to @min..@max under
+// @MeasurementLock, because the phases of a scenario may be changing it
+// in the network thread at the same time.
+static void setRange(unsigned *minp, unsigned *maxp,
+                     unsigned min, unsigned max) {
+    pthread_mutex_lock(&MeasurementLock);
+    *minp = min;
+    *maxp = max;
+    pthread_mutex_unlock(&MeasurementLock);
+}
+
+// Get a range of the template set by setRange().
+static void getRange(const unsigned *minp, const unsigned *maxp,
+                     unsigned *min, unsigned *max) {
+    pthread_mutex_lock(&MeasurementLock);
+    *min = *minp;
+    *max = *maxp;
+    pthread_mutex_unlock(&MeasurementLock);
+}
+
+// Choose the connection to send the next request on in round-robin,
+// or return NULL if there's none to send on.
+static ConnectionCtx *pickConnection() {
+    ConnectionCtx *ctx;
+
+    ctx = NULL;
+    pthread_mutex_lock(&ConnectionsLock);
+    for (size_t i = 0; i < Connections.size(); i++) {
+        ConnectionCtx *candidate;
+
+        candidate = Connections[NextConnection++ % Connections.size()];
+        if (!candidate->is_eof && !candidate->is_connecting) {
+            ctx = candidate;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ConnectionsLock);
+
+    return ctx;
+}
+
+// Learn the details of @ctx->sfd: whether it's SCTP and what is our local
+// port.  Returns false if the connection is not usable with the current
+// settings.
+static bool setupConnection(ConnectionCtx *ctx) {
+    int proto;
+    socklen_t slen;
+    struct sockaddr_storage saddr;
+
+    slen = sizeof(saddr);
+    if (ctx->sfd < 0
+        || getsockname(ctx->sfd, (struct sockaddr *)&saddr, &slen) < 0)
+        // Not a socket, we can't know anything about it.
+        return true;
+
+    // Set the low 16 bits of our Hop-by-Hop Id to our local port number.
+    if (ctx->hop_by_hop <= 0xffff) {
+        if (saddr.ss_family == AF_INET) {
+            const struct sockaddr_in *saddr4;
+
+            saddr4 = DMXEndPoint::toCS4(&saddr);
+            ctx->hop_by_hop |= ntohs(saddr4->sin_port) << 16;
+        } else if (saddr.ss_family == AF_INET6) {
+            const struct sockaddr_in6 *saddr6;
+
+            saddr6 = DMXEndPoint::toCS6(&saddr);
+            ctx->hop_by_hop |= ntohs(saddr6->sin6_port) << 16;
+        }
+    }
+
+    // Is @ctx->sfd SCTP?
+    slen = sizeof(proto);
+    if (getsockopt(ctx->sfd, SOL_SOCKET, SO_PROTOCOL, &proto, &slen) < 0) {
+        ERR("getsockopt(%d, SO_PROTOCOL): %s", ctx->sfd, strerror(errno));
+        return false;
+    } else {
+        ctx->is_sctp = proto == IPPROTO_SCTP;
+        if (!ctx->is_sctp && ctx->min_stream > 0) {
+            ERR("can only use more than one streams on SCTP");
+            return false;
+        }
+    }
+
+    // If we're a client, the server is DiaLBS and we're running
+    // over SCTP, subscribe to sctp_sndrcvinfo data.  This is
+    // necessary in order to see on which stream we got a request.
+    if (ctx->is_client && ctx->is_sctp && ctx->to_lbsdia) {
+        struct sctp_event_subscribe events;
+
+        memset(&events, 0, sizeof(events));
+        events.sctp_data_io_event = 1;
+        if (setsockopt(ctx->sfd, SOL_SCTP, SCTP_EVENTS,
+                       &events, sizeof(events)) < 0) {
+            ERR("setsockopt(%d, SCTP_EVENTS): %s",
+                ctx->sfd, strerror(errno));
+            return false;
+        }
+    } // we're a client and DiaLBS is the server
+
+    return true;
+}
+
+// Remember the addresses of @ctx for the capture if it's an IP socket.
+// Otherwise keep the loopback addresses newConnection() made up.
+static void learnAddresses(ConnectionCtx *ctx) {
+    socklen_t slen;
+    struct sockaddr_storage local, peer;
+
+    if (ctx->sfd < 0)
+        return;
+
+    slen = sizeof(local);
+    if (getsockname(ctx->sfd, DMXEndPoint::toNSA(&local), &slen) < 0)
+        return;
+    slen = sizeof(peer);
+    if (getpeername(ctx->sfd, DMXEndPoint::toNSA(&peer), &slen) < 0)
+        return;
+
+    if ((local.ss_family == AF_INET || local.ss_family == AF_INET6)
+        && peer.ss_family == local.ss_family) {
+        ctx->local_addr = local;
+        ctx->peer_addr  = peer;
+    }
+}
+
+// Finish setting up a newly established connection and say hello to
+// the server unless we're talking to DiaLBS, which doesn't expect it.
+static bool connectionUp(ConnectionCtx *ctx) {
+    socklen_t slen;
+    struct sockaddr_storage saddr;
+
+    if (!setupConnection(ctx))
+        return false;
+    learnAddresses(ctx);
+
+    slen = sizeof(saddr);
+    if (Verbosity > 0 && ctx->sfd >= 0
+        && !getpeername(ctx->sfd, (struct sockaddr *)&saddr, &slen)) {
+        char addrstr[DMXEndPoint::STRLEN];
+
+        LOG("Connection %u up with %s.", ctx->idx,
+            DMXEndPoint::sockaddrToString(addrstr,
+                                          DMXEndPoint::toCSA(&saddr)));
+    }
+
+    if (ctx->is_client && !ctx->to_lbsdia) {
+        sendDGram(ctx, mkCERorCEA(ctx));
+        ctx->ce_state = ConnectionCtx::CE_SENT;
+    }
+
+    return true;
+}
+
+// Say proper good-bye to the peer.  Stupid DiaLBS forwards *all* requests
+// to the server, so sending DPR would cause the server to disconnect.
+static void sayGoodbye(ConnectionCtx *ctx) {
+    if (!ctx->is_eof && !ctx->is_connecting
+        && (!ctx->is_client || !ctx->to_lbsdia))
+        sendDGram(ctx, createSimpleMessage(ctx, Diameter::DPR));
+}
+
+// Say good-bye to the peer if it's still there, then close the connection.
+static void closeConnection(ConnectionCtx *ctx) {
+    if (ctx->sfd < 0)
+        return;
+
+    // Try to get out what's queued, but don't wait for it.
+    sayGoodbye(ctx);
+    collectQueue(ctx, 0);
+    flushConnection(ctx);
+    if (ctx->uring) {
+        // The ops in flight hold the socket open until they complete,
+        // which shutdown() hastens.
+        Uring.submit();
+        shutdown(ctx->sfd, SHUT_RDWR);
+    } else
+        epoll_ctl(Epoll, EPOLL_CTL_DEL, ctx->sfd, NULL);
+
+    close(ctx->sfd);
+    ctx->sfd = -1;
+    ctx->is_eof = true;
+    ctx->is_connecting = false;
+    if (!ctx->uring_niov)
+        // Otherwise uringSent() will drop it.
+        dropQueue(ctx);
+
+    DIAASSERT(LiveConnections > 0);
+    LiveConnections--;
+    if (Verbosity > 0)
+        LOG("Connection %u closed.", ctx->idx);
+}
+
+// Start the multishot receive of @ctx on @Uring.
+static bool uringRecv(ConnectionCtx *ctx) {
+    struct io_uring_sqe *sqe;
+
+    if (!(sqe = uringOp(ctx, URING_RECV)))
+        return false;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = ctx->sfd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    return true;
+}
+
+// Start receiving on the established connection @ctx: through @Uring if
+// we have one and it's TCP, otherwise by epoll.  @op is EPOLL_CTL_ADD if
+// @ctx is new to @Epoll, or EPOLL_CTL_MOD if it's been connecting.
+static bool watchConnection(ConnectionCtx *ctx, int op) {
+    if (Uring.fd() < 0 || ctx->is_sctp)
+        return watchFd(op, ctx->sfd, EPOLLIN, ctx);
+
+    if (op == EPOLL_CTL_MOD)
+        epoll_ctl(Epoll, EPOLL_CTL_DEL, ctx->sfd, NULL);
+    ctx->uring = true;
+    return uringRecv(ctx);
+}
+
+// Start connecting to @ai in the background.  The network thread will
+// be notified when the connection is established.
+static ConnectionCtx *openConnection(const ConnectionCtx *tmpl,
+                                     const struct addrinfo *ai) {
+    int sfd;
+    ConnectionCtx *ctx;
+
+    if ((sfd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK,
+                      tmpl->is_sctp ? IPPROTO_SCTP : IPPROTO_TCP)) < 0) {
+        ERR("socket(): %s", strerror(errno));
+        return NULL;
+    } else if (connect(sfd, ai->ai_addr, ai->ai_addrlen) < 0
+               && errno != EINPROGRESS) {
+        ERR("connect(): %s", strerror(errno));
+        close(sfd);
+        return NULL;
+    } else if (!(ctx = newConnection(tmpl, sfd))) {
+        close(sfd);
+        return NULL;
+    }
+
+    ctx->is_connecting = true;
+    if (!watchFd(EPOLL_CTL_ADD, sfd, EPOLLOUT, ctx)) {
+        closeConnection(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+// Called when the non-blocking connect() of @ctx has finished.
+static void finishConnect(ConnectionCtx *ctx) {
+    int err;
+    socklen_t lerr;
+
+    lerr = sizeof(err);
+    if (getsockopt(ctx->sfd, SOL_SOCKET, SO_ERROR, &err, &lerr) < 0)
+        err = errno;
+    if (err) {
+        ERR("connect(): %s", strerror(err));
+        closeConnection(ctx);
+        return;
+    }
+
+    // The socket stays non-blocking, partial writes are handled
+    // by flushConnection().
+    ctx->is_connecting = false;
+    if (!watchConnection(ctx, EPOLL_CTL_MOD) || !connectionUp(ctx))
+        closeConnection(ctx);
+    else
+        flushConnection(ctx);
+}
+
+// Bind to @ai and listen for new connections.  Returns the socket
+// or -1 on failure.
+static int openListener(const struct addrinfo *ai, bool sctp) {
+    int sfd, one;
+
+    if ((sfd = socket(ai->ai_family, SOCK_STREAM,
+                      sctp ? IPPROTO_SCTP : IPPROTO_TCP)) < 0) {
+        ERR("socket(): %s", strerror(errno));
+        return -1;
+    }
+
+    one = 1;
+    setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (Workers.count
+        && setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        ERR("setsockopt(SO_REUSEPORT): %s", strerror(errno));
+        close(sfd);
+        return -1;
+    } else if (bind(sfd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        ERR("bind(): %s", strerror(errno));
+        close(sfd);
+        return -1;
+    } else if (listen(sfd, SOMAXCONN) < 0) {
+        ERR("listen(): %s", strerror(errno));
+        close(sfd);
+        return -1;
+    }
+
+    return sfd;
+}
+
+// Accept a new connection on @ListenFd.
+static void acceptConnection(const ConnectionCtx *tmpl) {
+    int sfd;
+    ConnectionCtx *ctx;
+
+    if ((sfd = accept(ListenFd, NULL, NULL)) < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+            ERR("accept(): %s", strerror(errno));
+        return;
+    } else if (!(ctx = newConnection(tmpl, sfd))) {
+        close(sfd);
+        return;
+    }
+
+    if (!watchConnection(ctx, EPOLL_CTL_ADD) || !connectionUp(ctx))
+        closeConnection(ctx);
+}
+
+// Process the complete Diameter messages in @dgram from offset *@posp
+// and advance it past them.  If the last message is incomplete, *@needp
+// is set to its full length as far as we know it, otherwise to 0.
+// Returns false if the connection should be closed.
+static bool processMessages(ConnectionCtx *ctx, const DGram *dgram,
+                            size_t *posp, size_t *needp) {
+    const Diameter *dia = Diameter::fromDGram(dgram);
+
+    *needp = 0;
+    while (*posp < dgram->mUsed) {
+        bool ok;
+        size_t rem, len;
+        const byte *msg, *next;
+        struct timespec now;
+        DGram *copy;
+
+        rem = 0;
+        msg = dgram->at(*posp);
+        if (!(next = dia->parseMessageHeader(msg, &rem))) {
+            ERR("Invalid message received.");
+            return false;
+        } else if (next == msg) {
+            *needp = Diameter::HEADER_SIZE;
+            break;
+        } else if ((len = (next - msg) + rem) > dgram->mUsed - *posp) {
+            *needp = len;
+            break;
+        }
+
+        ctx->stats.received++;
+        ctx->stats.bytes_received += len;
+        if (Metrics::enabled)
+            Metrics::count(Metrics::RECEIVED, dia, msg, dgram->mStreamId);
+        if (Input >= 0 || Trace >= 0)
+            clock_gettime(CLOCK_MONOTONIC, &now);
+
+        // Capture the message after processing it, so we know the
+        // round-trip time if it's an answer.
+        *posp += len;
+        ctx->request_sent = 0;
+        ok = msgFromPeer(ctx, dgram, msg);
+        if (Input >= 0 && (copy = dupeMessage(msg, len)) != NULL) {
+            copy->mStreamId = dgram->mStreamId;
+            capture(Input, ctx, false, copy,
+                    nsecs(&now), ctx->request_sent);
+        }
+        if (Trace >= 0 && (copy = dupeMessage(msg, len)) != NULL) {
+            copy->mStreamId = dgram->mStreamId;
+            capture(Trace, ctx, false, copy,
+                    nsecs(&now), ctx->request_sent);
+        }
+        if (!ok)
+            return false;
+    }
+
+    return true;
+}
+
+// Process the complete messages received on the TCP connection @ctx
+// in place.  The partial message at the end of @rbuf is only moved to
+// the front when it wouldn't fit or there's little space left after it,
+// and the buffer grows if the message is larger, so there's always free
+// space left.  Returns false if the connection should be closed.
+static bool processTCP(ConnectionCtx *ctx) {
+    size_t need;
+    DGram *dgram = ctx->rbuf;
+
+    dgram->mStreamId = 0;
+    if (!processMessages(ctx, dgram, &ctx->rpos, &need))
+        return false;
+
+    // Start over if nothing is left, and give back the memory we might
+    // have needed for a large message.
+    if (ctx->rpos >= dgram->mUsed) {
+        ctx->rpos = dgram->mUsed = 0;
+        if (dgram->mTotal > RECV_BUFFER_SIZE
+            && (dgram = DGram::alloc(RECV_BUFFER_SIZE)) != NULL) {
+            DGram::release(ctx->rbuf);
+            ctx->rbuf = dgram;
+        }
+        return true;
+    }
+
+    if (ctx->rpos > 0
+        && (ctx->rpos + need > dgram->mTotal
+            || dgram->freeSpace() < RECV_MIN_FREE)) {
+        dgram->mUsed -= ctx->rpos;
+        memmove(dgram->begin(), dgram->at(ctx->rpos), dgram->mUsed);
+        ctx->rpos = 0;
+    }
+
+    if (need > dgram->mTotal) {
+        if (!(dgram = DGram::alloc(need, dgram)))
+            return false;
+        ctx->rbuf = dgram;
+    }
+
+    return true;
+}
+
+// Read what's available on the TCP connection @ctx and process it.
+// Returns false if the connection should be closed.
+static bool readTCP(ConnectionCtx *ctx) {
+    ssize_t n;
+    DGram *dgram = ctx->rbuf;
+
+    n = read(ctx->sfd, dgram->firstUnused(), dgram->freeSpace());
+    if (n < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+            return true;
+        ERR("read(%d): %s", ctx->sfd, strerror(errno));
+        return false;
+    } else if (!n) {
+        if (Verbosity > 0)
+            LOG("<- EOF");
+        ctx->is_eof = true;
+        return false;
+    }
+
+    dgram->mUsed += n;
+    return processTCP(ctx);
+}
+
+// Receive a batch of messages on the SCTP connection @ctx with a single
+// recvmmsg() and process them.  Every message is parsed where it has been
+// received, except for those which didn't fit in one slot: they're
+// collected in @rbuf.  Returns false if the connection should be closed.
+static bool readSCTP(ConnectionCtx *ctx) {
+    // Only the network thread reads, so the slots can be shared
+    // among the connections.
+    static DGram *slots[SCTP_RECV_BATCH];
+    int n;
+    struct iovec iov[SCTP_RECV_BATCH];
+    struct mmsghdr msgs[SCTP_RECV_BATCH];
+    union {
+        char buf[CMSG_SPACE(sizeof(struct sctp_sndrcvinfo))];
+        struct cmsghdr align;
+    } cmsgs[SCTP_RECV_BATCH];
+
+    memset(msgs, 0, sizeof(msgs));
+    for (unsigned i = 0; i < SCTP_RECV_BATCH; i++) {
+        if (!slots[i] && !(slots[i] = DGram::alloc(SCTP_RECV_SLOT)))
+            return false;
+        iov[i].iov_base = slots[i]->begin();
+        iov[i].iov_len  = slots[i]->mTotal;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = cmsgs[i].buf;
+        msgs[i].msg_hdr.msg_controllen = sizeof(cmsgs[i].buf);
+    }
+
+    if ((n = recvmmsg(ctx->sfd, msgs, SCTP_RECV_BATCH, 0, NULL)) < 0) {
+        if (errno == EINTR || errno == EAGAIN)
             return true;
+        ERR("recvmmsg(%d): %s", ctx->sfd, strerror(errno));
+        return false;
+    }
+
+    for (int i = 0; i < n; i++) {
+        size_t pos, need;
+        DGram *dgram;
+        struct cmsghdr *cmsg;
+        struct msghdr *msg = &msgs[i].msg_hdr;
+
+        if (!msgs[i].msg_len) {
+            if (Verbosity > 0)
+                LOG("<- EOF");
+            ctx->is_eof = true;
+            return false;
+        } else if (msg->msg_flags & MSG_NOTIFICATION)
+            continue;
+
+        dgram = slots[i];
+        dgram->mUsed = msgs[i].msg_len;
+        dgram->mStreamId = 0;
+        for (cmsg = CMSG_FIRSTHDR(msg); cmsg;
+             cmsg = CMSG_NXTHDR(msg, cmsg))
+            if (cmsg->cmsg_level == IPPROTO_SCTP
+                && cmsg->cmsg_type == SCTP_SNDRCV) {
+                struct sctp_sndrcvinfo sinfo;
+
+                memcpy(&sinfo, CMSG_DATA(cmsg), sizeof(sinfo));
+                dgram->mStreamId = sinfo.sinfo_stream;
+            }
+
+        // Is it (the continuation of) a message larger than a slot?
+        if (ctx->rbuf->mUsed || !(msg->msg_flags & MSG_EOR)) {
+            if (!DGram::ensure(&ctx->rbuf, dgram->mUsed))
+                return false;
+            memcpy(ctx->rbuf->firstUnused(), dgram->begin(), dgram->mUsed);
+            ctx->rbuf->mUsed += dgram->mUsed;
+            if (!(msg->msg_flags & MSG_EOR))
+                continue;
+            ctx->rbuf->mStreamId = dgram->mStreamId;
+            dgram = ctx->rbuf;
+        }
+
+        pos = 0;
+        if (!processMessages(ctx, dgram, &pos, &need))
+            return false;
+        else if (need) {
+            ERR("Incomplete message received.");
+            return false;
+        }
+
+        if (dgram == ctx->rbuf) {
+            dgram->mUsed = 0;
+            if (dgram->mTotal > RECV_BUFFER_SIZE
+                && (dgram = DGram::alloc(RECV_BUFFER_SIZE)) != NULL) {
+                DGram::release(ctx->rbuf);
+                ctx->rbuf = dgram;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Read what's available on @ctx and process the complete messages.
+// Returns false if the connection should be closed.
+static bool readFromPeer(ConnectionCtx *ctx) {
+    return ctx->is_sctp ? readSCTP(ctx) : readTCP(ctx);
+}
+
+// The multishot receive of @ctx returned @res with @flags.  Process
+// what has been received into the buffer like readTCP(), and rearm
+// the receive if the kernel has stopped it.  Returns false if the
+// connection should be closed.
+static bool uringReceived(ConnectionCtx *ctx, int res, unsigned flags) {
+    const byte *data;
+    unsigned bid;
+
+    if (res > 0) {
+        DIAASSERT(flags & IORING_CQE_F_BUFFER);
+        bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        data = Uring.buffer(bid);
+        while (res > 0) {
+            DGram *dgram = ctx->rbuf;
+            size_t n = dgram->freeSpace();
+
+            if (n > (size_t)res)
+                n = res;
+            memcpy(dgram->firstUnused(), data, n);
+            dgram->mUsed += n;
+            data += n;
+            res -= n;
+            if (!processTCP(ctx)) {
+                Uring.recycle(bid);
+                return false;
+            }
+        }
+        Uring.recycle(bid);
+    } else if (!res) {
+        if (Verbosity > 0)
+            LOG("<- EOF");
+        ctx->is_eof = true;
+        return false;
+    } else if (res != -ENOBUFS && res != -EINTR && res != -EAGAIN) {
+        ERR("recv(%d): %s", ctx->sfd, strerror(-res));
+        return false;
+    } // else we've run out of buffers or got interrupted
+
+    return (flags & IORING_CQE_F_MORE) || uringRecv(ctx);
+}
+
+// Handle the completed ops of @Uring.
+static void uringCompleted() {
+    const struct io_uring_cqe *cqe;
+
+    while ((cqe = Uring.peek()) != NULL) {
+        int res;
+        unsigned op, flags;
+        ConnectionCtx *ctx;
+
+        ctx = reinterpret_cast<ConnectionCtx *>(
+                            cqe->user_data & ~(uint64_t)URING_OP_MASK);
+        op = cqe->user_data & URING_OP_MASK;
+        res = cqe->res;
+        flags = cqe->flags;
+        Uring.seen();
+
+        if (op == URING_SEND)
+            uringSent(ctx, res);
+        else if (ctx->sfd < 0) {
+            // Closed already.
+            if (flags & IORING_CQE_F_BUFFER)
+                Uring.recycle(flags >> IORING_CQE_BUFFER_SHIFT);
+        } else if (!uringReceived(ctx, res, flags)) {
+            fuzzCrashed(ctx, "disconnected", &Fuzz.disconnects);
+            closeConnection(ctx);
+        }
+    }
+}
+
+// Send a DWR on all established connections and take note of the ones
+// which haven't answered the previous one.
+static void sendWatchdogs() {
+    pthread_mutex_lock(&ConnectionsLock);
+    for (size_t i = 0; i < Connections.size(); i++) {
+        ConnectionCtx *ctx = Connections[i];
+
+        if (ctx->is_eof || ctx->is_connecting)
+            continue;
+        if (ctx->dwr_pending) {
+            ctx->dwa_missed++;
+            ERR("Connection %u hasn't answered %u DWR(s).",
+                ctx->idx, ctx->dwr_pending);
+            fuzzCrashed(ctx, "DWA missed", &Fuzz.hangs);
+        }
+
+        ctx->dwr_pending++;
+        sendDGram(ctx, createSimpleMessage(ctx, Diameter::DWR));
+    }
+    pthread_mutex_unlock(&ConnectionsLock);
+}
+
+// InFlight::expire() callback: count the request of @entry timed out.
+struct Expiry { ConnectionCtx *ctx; const struct timespec *now; };
+static void requestTimedOut(void *arg, const InFlight::Entry *entry) {
+    const Expiry *expiry = static_cast<const Expiry *>(arg);
+
+    expiry->ctx->stats.timeouts++;
+    fuzzTimedOut(entry->sessionId);
+    pthread_mutex_lock(&MeasurementLock);
+    requestDone(entry, expiry->now, false);
+    pthread_mutex_unlock(&MeasurementLock);
+}
+
+// Forget the requests sent more than @timeout microseconds before @now
+// on all connections.  Only the network thread adds connections, so it
+// can iterate over them without @ConnectionsLock.
+static void expireRequests(unsigned timeout, const struct timespec *now) {
+    uint64_t deadline;
+
+    deadline = nsecs(now);
+    if (deadline < timeout * 1000ull)
+        return;
+    deadline -= timeout * 1000ull;
+
+    for (size_t i = 0; i < Connections.size(); i++) {
+        Expiry expiry = { Connections[i], now };
+        unsigned n;
+
+        if ((n = Connections[i]->inflight->expire(deadline,
+                                        requestTimedOut, &expiry)) > 0) {
+            ERR("Connection %u: %u request(s) timed out.",
+                Connections[i]->idx, n);
+            // Replace them if it's a window run.  InFlight is unlocked
+            // by now.
+            fillWindow(Connections[i]);
+        }
+    }
+}
+
+// Return the average number of messages sent with one system call.
+static double perSyscall(uint64_t sent, uint64_t syscalls) {
+    return syscalls ? (double)sent / syscalls : 0;
+}
+
+// Print the sum of the traffic counters of @t connections.
+static void logTraffic(const char *what, const TrafficTotals *t) {
+    LOG("%s: %u connection(s), %u up, DWA missed: %lu, "
+        "sent: %lu (%lu bytes, %.1f per syscall), "
+        "received: %lu (%lu bytes, %lu requests, %lu answers), "
+        "in flight: %lu, timeouts: %lu, unmatched: %lu, "
+        "duplicates: %lu, reordered: %lu, errors: %lu",
+        what, t->connections, t->up, t->dwa_missed,
+        t->sent, t->bytes_sent, perSyscall(t->sent, t->syscalls),
+        t->received, t->bytes_received, t->requests, t->answers,
+        t->inflight, t->timeouts, t->unmatched, t->duplicates,
+        t->reordered, t->errors);
+}
+
+// Add the traffic counters of @src to @dst.
+static void addTraffic(TrafficTotals *dst, const TrafficTotals *src) {
+    dst->connections    += src->connections;
+    dst->up             += src->up;
+    dst->sent           += src->sent;
+    dst->bytes_sent     += src->bytes_sent;
+    dst->syscalls       += src->syscalls;
+    dst->received       += src->received;
+    dst->bytes_received += src->bytes_received;
+    dst->requests       += src->requests;
+    dst->answers        += src->answers;
+    dst->errors         += src->errors;
+    dst->dwa_missed     += src->dwa_missed;
+    dst->inflight       += src->inflight;
+    dst->timeouts       += src->timeouts;
+    dst->unmatched      += src->unmatched;
+    dst->duplicates     += src->duplicates;
+    dst->reordered      += src->reordered;
+}
+
+// Sum the traffic counters of all connections into @t, and print them
+// one by one if @all.
+static void sumConnections(TrafficTotals *t, bool all) {
+    static const char *const ceStates[] = { "none", "sent", "ok", "failed" };
+
+    memset(t, 0, sizeof(*t));
+    pthread_mutex_lock(&ConnectionsLock);
+    t->connections = Connections.size();
+    for (size_t i = 0; i < Connections.size(); i++) {
+        const ConnectionCtx *ctx = Connections[i];
+
+        if (all)
+            LOG("Connection %u: %s, CE %s, DWA missed: %u, "
+                "sent: %lu (%lu bytes, %.1f per syscall), "
+                "received: %lu (%lu bytes, %lu requests, %lu answers), "
+                "in flight: %zu, timeouts: %lu, unmatched: %lu, "
+                "duplicates: %lu, reordered: %lu, errors: %lu",
+                ctx->idx,
+                ctx->is_connecting ? "connecting"
+                    : ctx->is_eof ? "closed" : "up",
+                ceStates[ctx->ce_state], ctx->dwa_missed,
+                ctx->stats.sent, ctx->stats.bytes_sent,
+                perSyscall(ctx->stats.sent, ctx->stats.syscalls),
+                ctx->stats.received, ctx->stats.bytes_received,
+                ctx->stats.requests, ctx->stats.answers,
+                ctx->inflight->outstanding(), ctx->stats.timeouts,
+                ctx->stats.unmatched, ctx->stats.duplicates,
+                ctx->stats.reordered, ctx->stats.errors);
+
+        if (!ctx->is_eof && !ctx->is_connecting)
+            t->up++;
+        t->sent             += ctx->stats.sent;
+        t->bytes_sent       += ctx->stats.bytes_sent;
+        t->syscalls         += ctx->stats.syscalls;
+        t->received         += ctx->stats.received;
+        t->bytes_received   += ctx->stats.bytes_received;
+        t->requests         += ctx->stats.requests;
+        t->answers          += ctx->stats.answers;
+        t->errors           += ctx->stats.errors;
+        t->dwa_missed       += ctx->dwa_missed;
+        t->inflight         += ctx->inflight->outstanding();
+        t->timeouts         += ctx->stats.timeouts;
+        t->unmatched        += ctx->stats.unmatched;
+        t->duplicates       += ctx->stats.duplicates;
+        t->reordered        += ctx->stats.reordered;
+    }
+    pthread_mutex_unlock(&ConnectionsLock);
+}
+
+// Print the state and the traffic counters of all connections if @all,
+// and their sum.
+static void showConnections(bool all) {
+    TrafficTotals totals;
+
+    sumConnections(&totals, all);
+    logTraffic("Total", &totals);
+}
+// }}}
+
+// Microbenchmarks {{{
+// The requests mkUDA() and mkPNA() answer in the benchmarks.
+static const Diameter *BenchUDR, *BenchPNR;
+
+// Construct and drop a UDR or PNR.
+static void benchRequest(const ConnectionCtx *ctx, uint64_t i) {
+    DGram::release(mkUDRorPNR(ctx, i + 1));
+}
+
+// Construct and drop a UDA to @BenchUDR.
+static void benchAnswer(const ConnectionCtx *ctx, uint64_t) {
+    DGram::release(mkUDA(ctx, BenchUDR,
+                         BenchUDR->at(Diameter::HEADER_SIZE),
+                         BenchUDR->mUsed - Diameter::HEADER_SIZE));
+}
+
+// Construct and drop a PNA to @BenchPNR.
+static void benchPNA(const ConnectionCtx *ctx, uint64_t) {
+    DGram::release(mkPNA(ctx, BenchPNR, BenchPNR->at(0),
+                         BenchPNR->at(Diameter::HEADER_SIZE),
+                         BenchPNR->mUsed - Diameter::HEADER_SIZE));
+}
+
+// The DGram the Session-Id benchmarks write to, the Session-Id they parse
+// and where they leave the result, so it's not optimized away.
+static DGram *BenchDGram;
+static Diameter::AVP BenchSessionId;
+static uint64_t BenchSink;
+
+// Add a Session-Id to @BenchDGram like addSessionId() used to.
+static void benchPrintSessionId(const ConnectionCtx *ctx, uint64_t i) {
+    char str[64];
+
+    snprintf(str, sizeof(str), "%s;%.8lx;%.8lx",
+             ctx->origin.host, i >> 32, i & 0xFFFFFFFF);
+    BenchDGram->mUsed = 0;
+    Diameter::addStringAVP(&BenchDGram, Diameter::SESSION_ID, str);
+}
+
+// Add a Session-Id to @BenchDGram with addSessionId().
+static void benchEncodeSessionId(const ConnectionCtx *ctx, uint64_t i) {
+    BenchDGram->mUsed = 0;
+    addSessionId(&BenchDGram, ctx, i);
+}
+
+// Parse @BenchSessionId with sscanf().
+static void benchScanSessionId(const ConnectionCtx *, uint64_t) {
+    char str[64];
+    unsigned long hi, lo;
+
+    snprintf(str, sizeof(str), "%.*s",
+             (int)BenchSessionId.len, BenchSessionId.data);
+    if (sscanf(str, "%*[^;];%8lx;%8lx", &hi, &lo) == 2)
+        BenchSink += hi << 32 | lo;
+}
+
+// Parse @BenchSessionId with parseSessionId().
+static void benchDecodeSessionId(const ConnectionCtx *, uint64_t) {
+    uint64_t sessionId;
+
+    if (parseSessionId(BenchSessionId.data, BenchSessionId.len,
+                       &sessionId))
+        BenchSink += sessionId;
+}
+
+// Connect @fds[0] to @fds[1] over TCP on the loopback interface.
+static bool benchConnect(int fds[2]) {
+    int lfd;
+    socklen_t slen;
+    struct sockaddr_in sin;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    slen = sizeof(sin);
+    fds[0] = fds[1] = -1;
+    if ((lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0
+        || bind(lfd, (struct sockaddr *)&sin, sizeof(sin)) < 0
+        || listen(lfd, 1) < 0
+        || getsockname(lfd, (struct sockaddr *)&sin, &slen) < 0
+        || (fds[0] = socket(AF_INET, SOCK_STREAM, 0)) < 0
+        || connect(fds[0], (struct sockaddr *)&sin, sizeof(sin)) < 0
+        || (fds[1] = accept(lfd, NULL, NULL)) < 0) {
+        ERR("loopback: %m");
+        if (lfd >= 0)
+            close(lfd);
+        if (fds[0] >= 0)
+            close(fds[0]);
+        return false;
+    }
+
+    close(lfd);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    return true;
+}
+
+// Send @len bytes of @batch, which consists of @nmsgs messages, from
+// @fds[@from] to the other end, and receive them there with writev(),
+// read() and @epoll, or through @ring if it's not NULL.  The ring's
+// multishot receives are armed already.
+static bool benchBounce(const int fds[2], unsigned from, int epoll,
+                        IoRing *ring, const byte *batch, size_t len,
+                        size_t msglen) {
+    static byte rbuf[RECV_BUFFER_SIZE];
+    struct iovec iov[IOV_MAX];
+    size_t sent, received;
+    unsigned niov;
+    bool sending;
+
+    // Like writeTCP(), every message is in an iovec of its own.
+    niov = 0;
+    for (size_t pos = 0; pos < len && niov < IOV_MAX; pos += msglen) {
+        iov[niov].iov_base = const_cast<byte *>(&batch[pos]);
+        iov[niov].iov_len  = msglen;
+        niov++;
+    }
+
+    sent = received = 0;
+    sending = false;
+    while (sent < len || received < len) {
+        const struct io_uring_cqe *cqe;
+        struct epoll_event event;
+        ssize_t n;
+
+        if (!ring) {
+            // Write what the socket takes, then wait for the other end.
+            if (sent < len) {
+                if ((n = writev(fds[from], iov, niov)) < 0) {
+                    if (errno != EAGAIN) {
+                        ERR("writev(): %m");
+                        return false;
+                    }
+                } else if ((sent += n) < len) {
+                    iov[0].iov_base = const_cast<byte *>(&batch[sent]);
+                    iov[0].iov_len  = len - sent;
+                    niov = 1;
+                }
+            }
+
+            if (epoll_wait(epoll, &event, 1, -1) < 0) {
+                if (errno == EINTR)
+                    continue;
+                ERR("epoll_wait(): %m");
+                return false;
+            }
+            while ((n = read(fds[!from], rbuf, sizeof(rbuf))) > 0)
+                received += n;
+            if (!n || errno != EAGAIN) {
+                ERR("read(): %s", n ? strerror(errno) : "EOF");
+                return false;
+            }
+            continue;
+        }
+
+        if (sent < len && !sending) {
+            struct io_uring_sqe *sqe;
+
+            if (!(sqe = ring->get()))
+                return false;
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->fd = fds[from];
+            sqe->addr = (uintptr_t)iov;
+            sqe->len = niov;
+            sqe->user_data = URING_SEND;
+            sending = true;
+        }
+
+        if (!ring->submit(1))
+            return false;
+        while ((cqe = ring->peek()) != NULL) {
+            if (cqe->user_data == URING_SEND) {
+                sending = false;
+                if (cqe->res < 0 && cqe->res != -EAGAIN) {
+                    ERR("writev(): %s", strerror(-cqe->res));
+                    return false;
+                } else if (cqe->res > 0 && (sent += cqe->res) < len) {
+                    iov[0].iov_base = const_cast<byte *>(&batch[sent]);
+                    iov[0].iov_len  = len - sent;
+                    niov = 1;
+                }
+            } else if (cqe->res > 0) {
+                received += cqe->res;
+                ring->recycle(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            } else if (cqe->res != -ENOBUFS) {
+                ERR("recv(): %s", cqe->res ? strerror(-cqe->res) : "EOF");
+                return false;
+            }
+
+            // The receive needs to be rearmed.
+            if (cqe->user_data != URING_SEND
+                && !(cqe->flags & IORING_CQE_F_MORE)) {
+                struct io_uring_sqe *sqe;
+
+                if (!(sqe = ring->get()))
+                    return false;
+                sqe->opcode = IORING_OP_RECV;
+                sqe->fd = fds[cqe->user_data >> 1];
+                sqe->ioprio = IORING_RECV_MULTISHOT;
+                sqe->flags = IOSQE_BUFFER_SELECT;
+                sqe->user_data = cqe->user_data;
+            }
+            ring->seen();
+        }
+    }
+
+    return true;
+}
+
+// Bounce batches of @nmsgs copies of @msg over a loopback TCP connection
+// back and forth for about @secs seconds, with epoll or an io_uring if
+// @uring.  Returns the number of batches answered per second times
+// @nmsgs (TPS), or -1, and sets *@cpup to the CPU time used per message
+// in microseconds.
+static double benchLoopback(const DGram *msg, unsigned nmsgs, bool uring,
+                            double secs, double *cpup) {
+    int fds[2], epoll;
+    uint64_t n;
+    double elapsed;
+    IoRing ioring, *ring;
+    std::vector<byte> batch;
+    struct timespec start, now, cpu0, cpu1;
+    bool ok;
+
+    // Destroying @ioring cancels what's left in it.
+    ring = NULL;
+    if (uring) {
+        if (!ioring.init(64))
+            return -1;
+        ring = &ioring;
+    }
+    if (!benchConnect(fds))
+        return -1;
+
+    batch.resize(msg->mUsed * nmsgs);
+    for (unsigned i = 0; i < nmsgs; i++)
+        memcpy(&batch[i * msg->mUsed], msg->begin(), msg->mUsed);
+
+    // Both ends receive all the time.
+    epoll = -1;
+    if (!ring) {
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        if ((epoll = epoll_create1(0)) < 0
+            || epoll_ctl(epoll, EPOLL_CTL_ADD, fds[0], &ev) < 0
+            || epoll_ctl(epoll, EPOLL_CTL_ADD, fds[1], &ev) < 0)
+            ERR("epoll: %m");
+    } else
+        for (unsigned i = 0; i < 2; i++) {
+            struct io_uring_sqe *sqe;
+
+            if (!(sqe = ring->get()))
+                break;
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = fds[i];
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->user_data = i << 1 | URING_RECV;
+        }
+
+    n = 0;
+    ok = true;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        // Requests one way and answers the other.
+        for (unsigned i = 0; i < 100 && ok; i++, n++)
+            ok = benchBounce(fds, 0, epoll, ring, &batch[0], batch.size(),
+                             msg->mUsed)
+                && benchBounce(fds, 1, epoll, ring, &batch[0],
+                               batch.size(), msg->mUsed);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (ok && (elapsed = measurementTime(&start, &now)) < secs);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu1);
+
+    if (epoll >= 0)
+        close(epoll);
+    close(fds[0]);
+    close(fds[1]);
+
+    if (!ok)
+        return -1;
+    *cpup = measurementTime(&cpu0, &cpu1) * 1000000.0 / (2 * n * nmsgs);
+    return n * nmsgs / elapsed;
+}
+
+// Call @fun with @ctx repeatedly for about @secs seconds and return
+// the number of calls per second.
+static double benchmark(void (*fun)(const ConnectionCtx *, uint64_t),
+                        const ConnectionCtx *ctx, double secs) {
+    uint64_t n;
+    double elapsed;
+    struct timespec start, now;
+
+    n = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        for (unsigned i = 0; i < 1000; i++, n++)
+            fun(ctx, n);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((elapsed = measurementTime(&start, &now)) < secs);
+
+    return n / elapsed;
+}
+
+// Compare the rate of building messages from scratch with that of
+// instantiating templates, and the Session-Id codec with the standard
+// library.  @tmpl provides the settings.
+static int runBenchmarks(const ConnectionCtx *tmpl) {
+    DGram *pnr;
+    ConnectionCtx client, server, clientTmpl, serverTmpl;
+    const struct {
+        const char *name;
+        void (*fun)(const ConnectionCtx *, uint64_t);
+        const ConnectionCtx *builder, *templated;
+    } cases[] = {
+        { "UDR", benchRequest, &client, &clientTmpl },
+        { "PNR", benchRequest, &server, &serverTmpl },
+        { "UDA", benchAnswer,  &server, &serverTmpl },
+        { "PNA", benchPNA,     &client, &clientTmpl },
+    };
+
+    // The messages would be logged otherwise.
+    Verbosity = 0;
+
+    client = *tmpl;
+    client.is_client = true;
+    client.request_tmpl = client.answer_tmpl = client.pna_tmpl = NULL;
+    server = client;
+    server.is_client = false;
+    clientTmpl = client;
+    compileTemplates(&clientTmpl);
+    serverTmpl = server;
+    compileTemplates(&serverTmpl);
+    if (!clientTmpl.request_tmpl || !serverTmpl.request_tmpl
+        || !serverTmpl.answer_tmpl || !clientTmpl.pna_tmpl) {
+        ERR("couldn't compile the templates");
+        return 1;
+    }
+
+    // mkPNA() parses @BenchPNR as if it had been received.
+    if (!(BenchUDR = Diameter::fromDGram(mkUDR(&client, 1)))
+        || !(pnr = mkPNR(&server, 0, 1)) || !DGram::flatten(&pnr))
+        return 1;
+    BenchPNR = Diameter::fromDGram(pnr);
+
+    for (unsigned i = 0; i < MEMBS_OF(cases); i++) {
+        double builder, templated;
+
+        builder   = benchmark(cases[i].fun, cases[i].builder,   1);
+        templated = benchmark(cases[i].fun, cases[i].templated, 1);
+        printf("%s: builder %.0f msg/s, template %.0f msg/s (%.2fx)\n",
+               cases[i].name, builder, templated, templated / builder);
+    }
+
+    // The Session-Id of the UDR is the first AVP.
+    if (!(BenchDGram = DGram::alloc(256)))
+        return 1;
+    Diameter::AVPIterator it(BenchUDR, BenchUDR->at(Diameter::HEADER_SIZE),
+                             BenchUDR->mUsed - Diameter::HEADER_SIZE);
+    if (!it.next(&BenchSessionId)
+        || BenchSessionId.code != Diameter::SESSION_ID) {
+        ERR("couldn't find the Session-Id");
+        return 1;
+    }
+
+    for (unsigned i = 0; i < 2; i++) {
+        double stdlib, codec;
+
+        stdlib = benchmark(i ? benchScanSessionId : benchPrintSessionId,
+                           &clientTmpl, 1);
+        codec  = benchmark(i ? benchDecodeSessionId : benchEncodeSessionId,
+                           &clientTmpl, 1);
+        printf("Session-Id %s: %s %.0f/s, codec %.0f/s (%.2fx)\n",
+               i ? "parsing" : "generation", i ? "sscanf" : "snprintf",
+               stdlib, codec, codec / stdlib);
+    }
+
+    // Compare the network backends with batches of UDRs, which are
+    // about as large as the UDAs.
+    for (unsigned batch = 1; batch <= 64; batch *= 8) {
+        double epoll, uring, epollCpu, uringCpu;
+
+        if ((epoll = benchLoopback(BenchUDR, batch, false, 1,
+                                   &epollCpu)) < 0)
+            return 1;
+        printf("Loopback TCP, %u request(s) at a time: "
+               "epoll %.0f TPS, %.2f us CPU/msg",
+               batch, epoll, epollCpu);
+        if ((uring = benchLoopback(BenchUDR, batch, true, 1,
+                                   &uringCpu)) < 0) {
+            printf(", io_uring unavailable\n");
+            break;
+        }
+        printf(", io_uring %.0f TPS, %.2f us CPU/msg (%.2fx)\n",
+               uring, uringCpu, uring / epoll);
+    }
+
+    return 0;
+} // }}}
+
+// Codec benchmarks {{{
+// A message of --bench-codec to encode and parse: its header, its
+// top-level AVPs, the NUL-terminated values of the string ones and the
+// grouped ones.  @work is where it's re-encoded.
+struct CodecCorpus {
+    const char *name;
+    const Diameter *msg;
+    unsigned cmd, flags, app, hbh, ete;
+    std::vector<Diameter::AVP> avps, groups;
+    std::vector<std::pair<const Diameter::AVP *, std::string> > strings;
+    DGram *work;
+};
+
+// An operation of --bench-codec: @fun does @ops operations on @corpus
+// and returns the number of bytes produced or consumed.
+struct CodecOp {
+    const char *name;
+    size_t (*fun)(CodecCorpus *corpus);
+    size_t (*ops)(const CodecCorpus *corpus);
+};
+
+static size_t codecOne(const CodecCorpus *)     { return 1; }
+static size_t codecAVPs(const CodecCorpus *c)   { return c->avps.size(); }
+static size_t codecGroups(const CodecCorpus *c) { return c->groups.size(); }
+static size_t codecStrings(const CodecCorpus *c)
+    { return c->strings.size(); }
+static size_t codecRequest(const CodecCorpus *c)
+    { return c->flags & Diameter::FLAG_REQUEST ? 1 : 0; }
+
+static size_t codecStartMessage(CodecCorpus *c) {
+    c->work->mUsed = 0;
+    Diameter::startMessage(&c->work, c->cmd, c->flags, c->app,
+                           c->hbh, c->ete);
+    return c->work->mUsed;
+}
+
+static size_t codecAddAVP(CodecCorpus *c) {
+    c->work->mUsed = Diameter::HEADER_SIZE;
+    for (size_t i = 0; i < c->avps.size(); i++) {
+        const Diameter::AVP *avp = &c->avps[i];
+
+        Diameter::addAVP(&c->work, avp->code,
+                         avp->flags & Diameter::FLAG_MANDATORY,
+                         avp->vendor, avp->len, avp->data);
+    }
+    return c->work->mUsed - Diameter::HEADER_SIZE;
+}
+
+static size_t codecAddStringAVP(CodecCorpus *c) {
+    c->work->mUsed = Diameter::HEADER_SIZE;
+    for (size_t i = 0; i < c->strings.size(); i++) {
+        const Diameter::AVP *avp = c->strings[i].first;
+
+        Diameter::addStringAVP(&c->work, avp->code,
+                               c->strings[i].second.c_str(),
+                               avp->flags & Diameter::FLAG_MANDATORY,
+                               avp->vendor);
+    }
+    return c->work->mUsed - Diameter::HEADER_SIZE;
+}
+
+static size_t codecAVPGroup(CodecCorpus *c) {
+    c->work->mUsed = Diameter::HEADER_SIZE;
+    for (size_t i = 0; i < c->groups.size(); i++) {
+        const Diameter::AVP *avp = &c->groups[i];
+        size_t group;
+
+        Diameter::startAVPGroup(&c->work, avp->code, &group,
+                                avp->flags & Diameter::FLAG_MANDATORY,
+                                avp->vendor);
+        Diameter::finishAVPGroup(c->work, group);
+    }
+    return c->work->mUsed - Diameter::HEADER_SIZE;
+}
+
+static size_t codecParseMessageHeader(CodecCorpus *c) {
+    size_t rem;
+    unsigned cmd, flags, app, hbh, ete;
+
+    cmd = flags = app = hbh = ete = 0;
+    if (c->msg->parseMessageHeader(NULL, &rem, &cmd, &flags, &app,
+                                   &hbh, &ete)
+        != c->msg->at(Diameter::HEADER_SIZE))
+        return 0;
+    BenchSink += cmd + flags + app + hbh + ete;
+    return Diameter::HEADER_SIZE;
+}
+
+// Including skipAVPData().
+static size_t codecParseAVPHeader(CodecCorpus *c) {
+    const byte *pos;
+    size_t rem, len;
+    unsigned code, flags;
+
+    pos = c->msg->at(Diameter::HEADER_SIZE);
+    rem = c->msg->mUsed - Diameter::HEADER_SIZE;
+    while (rem > 0 && pos) {
+        if (!(pos = c->msg->parseAVPHeader(pos, &rem, &code, &flags, &len)))
+            break;
+        BenchSink += code;
+        pos = c->msg->skipAVPData(pos, &rem, len);
+    }
+    return c->msg->mUsed - Diameter::HEADER_SIZE;
+}
+
+static size_t codecIsMessageComplete(CodecCorpus *c) {
+    BenchSink += Diameter::isMessageComplete(c->msg) - c->msg->begin();
+    return c->msg->mUsed;
+}
+
+// Including copying the request.
+static size_t codecMakeResponse(CodecCorpus *c) {
+    if (!(c->flags & Diameter::FLAG_REQUEST))
+        return 0;
+    memcpy(c->work->begin(), c->msg->begin(), c->msg->mUsed);
+    c->work->mUsed = c->msg->mUsed;
+    Diameter::makeResponse(&c->work, false, Diameter::RC_SUCCESS, NULL,
+                           "radiator-server-host", "radiator-server-realm");
+    return c->work->mUsed;
+}
+
+// Take @msg apart for @corpus.
+static bool codecCorpus(CodecCorpus *corpus, const char *name,
+                        DGram *msg) {
+    Diameter::AVP avp;
+    size_t rem;
+
+    // It's parsed as if it had been received.
+    if (!msg || !DGram::flatten(&msg))
+        return false;
+    corpus->name = name;
+    corpus->msg = Diameter::fromDGram(msg);
+    if (corpus->msg->parseMessageHeader(NULL, &rem, &corpus->cmd,
+                                        &corpus->flags, &corpus->app,
+                                        &corpus->hbh, &corpus->ete)
+        != msg->at(Diameter::HEADER_SIZE)) {
+        ERR("%s: invalid message header", name);
+        return false;
+    }
+
+    Diameter::AVPIterator it(corpus->msg,
+                             corpus->msg->at(Diameter::HEADER_SIZE),
+                             corpus->msg->mUsed - Diameter::HEADER_SIZE);
+    while (it.next(&avp)) {
+        const DictAVP *def = lookupAVP(avp.code, avp.vendor);
+
+        corpus->avps.push_back(avp);
+        if (!def)
+            continue;
+        if (def->type == GROUPED)
+            corpus->groups.push_back(avp);
+        else if (def->type == UTF8_STRING
+                 || def->type == DIAMETER_IDENTITY
+                 || def->type == DIAMETER_URI)
+            corpus->strings.push_back(std::make_pair(
+                        static_cast<const Diameter::AVP *>(NULL),
+                        std::string((const char *)avp.data, avp.len)));
+    }
+
+    // Now that @avps won't move, point the @strings at them.
+    for (size_t i = 0, j = 0; i < corpus->avps.size(); i++) {
+        const DictAVP *def;
+
+        def = lookupAVP(corpus->avps[i].code, corpus->avps[i].vendor);
+        if (def && (def->type == UTF8_STRING
+                    || def->type == DIAMETER_IDENTITY
+                    || def->type == DIAMETER_URI))
+            corpus->strings[j++].first = &corpus->avps[i];
+    }
+
+    // Large enough for any re-encoding, so it's never reallocated.
+    return (corpus->work = DGram::alloc(4 * msg->mUsed
+                                        + Diameter::HEADER_SIZE)) != NULL;
+}
+
+// A measurement of --bench-codec or of its --baseline.
+struct CodecResult {
+    std::string name;
+    double ns, bytes, allocs;
+};
+
+// Load the results --bench-codec printed to @fname earlier.  Returns
+// false if it can't be read.
+static bool loadCodecBaseline(const char *fname,
+                              std::map<std::string, CodecResult> *results) {
+    FILE *st;
+    char line[256];
+
+    if (!(st = fopen(fname, "r"))) {
+        ERR("%s: %m", fname);
+        return false;
+    }
+
+    // Every result is on a line of its own.
+    while (fgets(line, sizeof(line), st)) {
+        char name[128];
+        CodecResult result;
+
+        if (sscanf(line, " { \"name\": \"%127[^\"]\", \"ns_per_op\": %lf, "
+                   "\"bytes_per_op\": %lf, \"allocs_per_op\": %lf",
+                   name, &result.ns, &result.bytes, &result.allocs) != 4)
+            continue;
+        result.name = name;
+        (*results)[name] = result;
+    }
+    fclose(st);
+
+    if (results->empty()) {
+        ERR("%s: no results found", fname);
+        return false;
+    }
+    return true;
+}
+
+// Measure the cost of the encoder and parser primitives on CER, UDR, UDA
+// and PNR like ours, and print the time, bytes and DGram allocations per
+// operation as JSON.  If there's a @baseline from an earlier run, compare
+// with that and fail if any operation has become slower by more than
+// CODEC_BENCH_TOLERANCE percent or allocates more.
+static int runCodecBenchmarks(const ConnectionCtx *tmpl,
+                              const char *baseline) {
+    static const CodecOp ops[] = {
+        { "startMessage",       codecStartMessage,      codecOne        },
+        { "addAVP",             codecAddAVP,            codecAVPs       },
+        { "addStringAVP",       codecAddStringAVP,      codecStrings    },
+        { "startAVPGroup+finishAVPGroup", codecAVPGroup, codecGroups    },
+        { "parseMessageHeader", codecParseMessageHeader, codecOne       },
+        { "parseAVPHeader",     codecParseAVPHeader,    codecAVPs       },
+        { "isMessageComplete",  codecIsMessageComplete, codecOne        },
+        { "makeResponse",       codecMakeResponse,      codecRequest    },
+    };
+    ConnectionCtx client, server;
+    CodecCorpus corpora[4];
+    const Diameter *udr;
+    std::vector<CodecResult> results;
+    std::map<std::string, CodecResult> base;
+    unsigned regressions;
+    bool ok;
+
+    if (baseline && !loadCodecBaseline(baseline, &base))
+        return 1;
+
+    // The messages would be logged otherwise.
+    Verbosity = 0;
+
+    client = *tmpl;
+    client.is_client = true;
+    client.request_tmpl = client.answer_tmpl = client.pna_tmpl = NULL;
+    client.session_id = NULL;
+    server = client;
+    server.is_client = false;
+
+    // mkCERorCEA() adds a Host-IP-Address of the socket.
+    if ((client.sfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        ERR("socket(): %m");
+        return 1;
+    }
+    ok = codecCorpus(&corpora[0], "CER", mkCERorCEA(&client));
+    close(client.sfd);
+    client.sfd = -1;
+    if (!ok || !codecCorpus(&corpora[1], "UDR", mkUDR(&client, 1)))
+        return 1;
+    udr = corpora[1].msg;
+    if (!codecCorpus(&corpora[2], "UDA",
+                     mkUDA(&server, udr, udr->at(Diameter::HEADER_SIZE),
+                           udr->mUsed - Diameter::HEADER_SIZE))
+        || !codecCorpus(&corpora[3], "PNR", mkPNR(&server, 0, 1)))
+        return 1;
+
+    for (unsigned i = 0; i < MEMBS_OF(corpora); i++)
+        for (unsigned j = 0; j < MEMBS_OF(ops); j++) {
+            CodecCorpus *corpus = &corpora[i];
+            uint64_t n, bytes, allocs, total;
+            struct timespec start, now;
+            double elapsed;
+            size_t nops;
+            CodecResult result;
+
+            if (!(nops = ops[j].ops(corpus)))
+                continue;
+
+            result.name = std::string(corpus->name) + "/" + ops[j].name;
+            result.ns = 0;
+            total = bytes = 0;
+            allocs = DGramPool::allocations();
+            for (unsigned round = 0; round < CODEC_BENCH_ROUNDS; round++) {
+                n = 0;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                do {
+                    for (unsigned k = 0; k < 1000; k++, n++)
+                        bytes += ops[j].fun(corpus);
+                    clock_gettime(CLOCK_MONOTONIC, &now);
+                } while ((elapsed = measurementTime(&start, &now))
+                         < CODEC_BENCH_SECS);
+
+                elapsed = elapsed * 1e9 / (n * nops);
+                if (!round || elapsed < result.ns)
+                    result.ns = elapsed;
+                total += n;
+            }
+            allocs = DGramPool::allocations() - allocs;
+
+            result.bytes = (double)bytes / (total * nops);
+            result.allocs = (double)allocs / (total * nops);
+            results.push_back(result);
+        }
+
+    // One result per line, so loadCodecBaseline() can read it back.
+    printf("{\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); i++)
+        printf("    { \"name\": \"%s\", \"ns_per_op\": %.2f, "
+               "\"bytes_per_op\": %.1f, \"allocs_per_op\": %.3f }%s\n",
+               results[i].name.c_str(), results[i].ns, results[i].bytes,
+               results[i].allocs, i + 1 < results.size() ? "," : "");
+    printf("  ]\n}\n");
+
+    if (!baseline)
+        return 0;
+
+    regressions = 0;
+    for (size_t i = 0; i < results.size(); i++) {
+        std::map<std::string, CodecResult>::const_iterator it;
+        const CodecResult *result = &results[i];
+        double change;
+        bool slower, fatter;
+
+        if ((it = base.find(result->name)) == base.end()) {
+            LOG("%s: not in the baseline", result->name.c_str());
+            continue;
+        }
+
+        change = (result->ns - it->second.ns) * 100 / it->second.ns;
+        slower = change > CODEC_BENCH_TOLERANCE;
+        fatter = result->allocs > it->second.allocs + 0.0005;
+        if (slower || fatter)
+            regressions++;
+        if (slower || fatter || Verbosity > 0)
+            LOG("%s: %.2f ns/op (%+.1f%%), %.3f allocs/op (was %.3f)%s",
+                result->name.c_str(), result->ns, change,
+                result->allocs, it->second.allocs,
+                slower || fatter ? ": REGRESSION" : "");
+    }
+
+    if (regressions)
+        LOG("%u regression(s) compared to %s.", regressions, baseline);
+    else
+        LOG("No regression compared to %s.", baseline);
+    return regressions ? 1 : 0;
+} // }}}
+
+// Thread entry points
+// Send the requests of a rate run on schedule. {{{
+// Apply the settings of the phases of the scenario which have started
+// by the @i-th request to the template @tmpl and all connections.  @tmpl
+// is shared with the command thread, hence @MeasurementLock.
+static void applyPhases(ConnectionCtx *tmpl, uint64_t i) {
+    bool changed;
+
+    changed = false;
+    pthread_mutex_lock(&MeasurementLock);
+    for (; Rate.applied < Rate.phases.size()
+           && Rate.phases[Rate.applied].first <= i; Rate.applied++) {
+        const Phase *phase = &Rate.phases[Rate.applied];
+
+        if (phase->user_data.set) {
+            tmpl->min_user_data = phase->user_data.min;
+            tmpl->max_user_data = phase->user_data.max;
+            changed = true;
+        }
+        if (phase->streams.set) {
+            tmpl->min_stream = phase->streams.min;
+            tmpl->max_stream = phase->streams.max;
+            changed = true;
+        }
+        if (phase->lga.set) {
+            tmpl->min_lga = phase->lga.min;
+            tmpl->max_lga = phase->lga.max;
+            changed = true;
+        }
+        if (Verbosity > 0)
+            LOG("Phase %zu: %s.", Rate.applied + 1, phase->what);
+    }
+    pthread_mutex_unlock(&MeasurementLock);
+
+    if (changed)
+        updateConnections(tmpl);
+}
+
+// Timer callback of @PacerTimer: send the requests which are due by now,
+// then wait for the next one.  If we're late, don't wait but don't skip
+// requests either.  @arg is the template of the connections, which the
+// phases of a scenario reconfigure.
+static void pace(void *arg) {
+    ConnectionCtx *tmpl = static_cast<ConnectionCtx *>(arg);
+    uint64_t start, now;
+    struct timespec ts;
+
+    start = nsecs(&StartOfMeasurement);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = nsecs(&ts);
+    while (Rate.sent < Rate.count && !Rate.cancelled) {
+        ConnectionCtx *conn;
+        Phase *phase;
+        uint64_t i, due;
+
+        i = Rate.sent;
+        due = start + dueOffset(i);
+        if (due > now) {
+            PacerTimer.due = due;
+            Timers.add(&PacerTimer);
+            return;
+        }
+
+        if (!(conn = pickConnection())) {
+            ERR("no connection");
+            break;
+        }
+
+        phase = NULL;
+        if (!Rate.phases.empty()) {
+            applyPhases(tmpl, i);
+            phase = phaseOf(i);
+        }
+
+        sendMessage(conn, mkUDRorPNR(conn, Rate.base + i + 1),
+                    Rate.base + i + 1);
+        clock_gettime(CLOCK_MONOTONIC, &Rate.last_sent);
+        Rate.sent++;
+        if (phase) {
+            phase->last_sent = Rate.last_sent;
+            phase->sent++;
+        }
+    }
+
+    LastMessageSent = Rate.last_sent;
+    if (!Rate.cancelled)
+        LOG("Sent.");
+}
+
+// Timer callback of @PacerTimer during a replay: send the requests which
+// are due by now, but no more than REPLAY_BURST at once, so the answers
+// can be read in the meantime.
+static void replay(void *) {
+    unsigned burst;
+    uint64_t start, first, now;
+    struct timespec ts;
+
+    // The capture may have been unloaded since a cancel.
+    if (Rate.cancelled || Replay.msgs.empty())
+        return;
+
+    start = nsecs(&StartOfMeasurement);
+    first = Replay.msgs[0].ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = nsecs(&ts);
+    for (burst = 0; Rate.sent < Rate.count && !Rate.cancelled; burst++) {
+        ConnectionCtx *conn;
+        uint64_t due, sessionId;
+        const ReplayMessage *m;
+
+        m = &Replay.msgs[Rate.sent];
+        due = start;
+        if (Replay.speed && m->ts > first)
+            due += (m->ts - first) / Replay.speed;
+        if (due > now || burst >= REPLAY_BURST) {
+            PacerTimer.due = due > now ? due : now;
+            Timers.add(&PacerTimer);
+            return;
+        }
+
+        if (!(conn = pickConnection())) {
+            ERR("no connection");
+            break;
+        }
+        sessionId = Rate.base + Rate.sent + 1;
+        sendMessage(conn, mkReplayed(conn, m->msg, m->len, sessionId),
+                    sessionId);
+        clock_gettime(CLOCK_MONOTONIC, &Rate.last_sent);
+        Rate.sent++;
+    }
+
+    LastMessageSent = Rate.last_sent;
+    if (!Rate.cancelled)
+        LOG("Sent.");
+}
+
+// Timer callback of @PacerTimer during a fuzz run: send fuzz cases as
+// fast as the connections take them, but no more than REPLAY_BURST at
+// once, and wait a bit whenever a socket is full.
+static void fuzz(void *) {
+    unsigned burst;
+    struct timespec now;
+
+    // Ditto.
+    if (Rate.cancelled)
+        return;
+
+    if (!Rate.sent)
+        Xorshift = Fuzz.seed;
+    for (burst = 0; Rate.sent < Rate.count && !Rate.cancelled; burst++) {
+        ConnectionCtx *conn;
+        uint64_t sessionId;
+        DGram *dgram;
+
+        if (!(conn = pickConnection())) {
+            ERR("no connection");
+            break;
+        } else if (burst >= REPLAY_BURST || conn->tx_blocked) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            PacerTimer.due = nsecs(&now);
+            if (conn->tx_blocked)
+                PacerTimer.due += 1000000;
+            Timers.add(&PacerTimer);
+            return;
+        }
+
+        // Keep the fuzz case to ourselves, sendMessage() sends a copy.
+        sessionId = Rate.base + Rate.sent + 1;
+        if ((dgram = mkFuzzed(conn, sessionId)) != NULL) {
+            sendMessage(conn, dgram, sessionId, false);
+            rememberFuzzCase(conn, dgram, sessionId);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &Rate.last_sent);
+        Rate.sent++;
+    }
+
+    LastMessageSent = Rate.last_sent;
+    if (!Rate.cancelled)
+        LOG("Sent.");
+}
+
+// Timer callback of @PacerTimer during a window run: end the current step
+// and start the next one with twice as many requests in flight, or stop
+// sending after the last step.
+static void window(void *) {
+    struct timespec now;
+    WindowStep step;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&MeasurementLock);
+    if (!Window.running) {
+        // Cancelled.
+        pthread_mutex_unlock(&MeasurementLock);
+        return;
+    }
+
+    if (!Window.steps.empty()) {
+        Window.steps.back().end = now;
+        Window.depth *= 2;
+    }
+
+    if (Window.depth > Window.max_depth) {
+        // Wait for the answers to the requests in flight, if any.
+        Window.draining = true;
+        Window.depth = 0;
+        if (Measured.answered + Measured.timeouts
+            >= SessionIdCounter - MeasurementBase)
+            stopMeasurement(&now);
+        pthread_mutex_unlock(&MeasurementLock);
+        LOG("Sent.");
+        return;
+    }
+
+    memset(&step, 0, sizeof(step));
+    step.depth = Window.depth;
+    step.start = now;
+    Window.steps.push_back(step);
+    pthread_mutex_unlock(&MeasurementLock);
+
+    if (Verbosity > 0)
+        LOG("Window %u.", Window.depth);
+    for (size_t i = 0; i < Connections.size(); i++)
+        fillWindow(Connections[i]);
+
+    PacerTimer.due = nsecs(&now) + Window.secs * 1000000000.0;
+    Timers.add(&PacerTimer);
+}
+
+// Called by the network thread when startRate() asks for it.
+static void startPacer() {
+    Rate.sent = 0;
+    Rate.last_sent = StartOfMeasurement;
+    PacerTimer.due = 0;
+    Timers.add(&PacerTimer);
+}
+
+// Start a rate run of @n requests with Session-Id:s after @sessionId.
+// The measurement must have been started already.  The requests are sent
+// by the network thread.
+static void startRate(double tps, uint64_t sessionId, unsigned n) {
+    pthread_mutex_lock(&MeasurementLock);
+    Rate.tps = tps;
+    Rate.base = sessionId;
+    Rate.count = n;
+    Rate.cancelled = false;
+    Rate.last_answer = StartOfMeasurement;
+    Rate.latency.reset();
+    Rate.phases.clear();
+    pthread_mutex_unlock(&MeasurementLock);
+
+    PacerTimer.fun = pace;
+    __atomic_store_n(&PacerPending, true, __ATOMIC_RELEASE);
+    wakeNetworkThread();
+}
+
+// Start running the @phases of a scenario with Session-Id:s after
+// @sessionId, reconfiguring @tmpl and the connections as they go.
+// The measurement must have been started already.
+static void startScenario(const std::vector<Phase> &phases,
+                          ConnectionCtx *tmpl, uint64_t sessionId) {
+    const Phase *last;
+
+    last = &phases.back();
+    pthread_mutex_lock(&MeasurementLock);
+    Rate.phases = phases;
+    Rate.applied = 0;
+    Rate.count = last->first + last->count;
+    Rate.tps = Rate.count / (last->start / 1000000000.0 + last->secs);
+    Rate.base = sessionId;
+    Rate.cancelled = false;
+    Rate.last_answer = StartOfMeasurement;
+    Rate.latency.reset();
+    pthread_mutex_unlock(&MeasurementLock);
+
+    PacerTimer.fun = pace;
+    PacerTimer.arg = tmpl;
+    __atomic_store_n(&PacerPending, true, __ATOMIC_RELEASE);
+    wakeNetworkThread();
+}
+
+// Start replaying the first @n requests of @Replay with Session-Id:s
+// after @sessionId, @speed times faster than they were captured.
+// The measurement must have been started already.
+static void startReplay(double speed, uint64_t sessionId, unsigned n) {
+    pthread_mutex_lock(&MeasurementLock);
+    Rate.tps = 0;
+    Rate.base = sessionId;
+    Rate.count = n;
+    Rate.cancelled = false;
+    Replay.speed = speed;
+    pthread_mutex_unlock(&MeasurementLock);
+
+    PacerTimer.fun = replay;
+    __atomic_store_n(&PacerPending, true, __ATOMIC_RELEASE);
+    wakeNetworkThread();
+}
+
+// Start sending @n fuzz cases with Session-Id:s after @sessionId, mutated
+// from the requests of @Replay if @captured, with xorshift() seeded with
+// @seed.  The measurement must have been started already.
+static void startFuzz(uint64_t seed, bool captured,
+                      uint64_t sessionId, unsigned n) {
+    pthread_mutex_lock(&MeasurementLock);
+    Rate.tps = 0;
+    Rate.base = sessionId;
+    Rate.count = n;
+    Rate.cancelled = false;
+    Fuzz.running = true;
+    Fuzz.captured = captured;
+    Fuzz.seed = seed;
+    Fuzz.disconnects = Fuzz.hangs = Fuzz.oddities = Fuzz.saved = 0;
+    pthread_mutex_unlock(&MeasurementLock);
+
+    PacerTimer.fun = fuzz;
+    __atomic_store_n(&PacerPending, true, __ATOMIC_RELEASE);
+    wakeNetworkThread();
+}
+
+// Start a window run keeping @depth..@maxDepth requests in flight on each
+// connection, doubling it every @secs seconds.  The measurement must have
+// been started already.
+static void startWindow(unsigned depth, unsigned maxDepth, double secs) {
+    pthread_mutex_lock(&MeasurementLock);
+    Rate.tps = 0;
+    Rate.count = 0;
+    Rate.cancelled = false;
+    Window.running = true;
+    Window.draining = false;
+    Window.depth = depth;
+    Window.max_depth = maxDepth;
+    Window.secs = secs;
+    Window.steps.clear();
+    pthread_mutex_unlock(&MeasurementLock);
+
+    PacerTimer.fun = window;
+    __atomic_store_n(&PacerPending, true, __ATOMIC_RELEASE);
+    wakeNetworkThread();
+} // }}}
+
+// Process the commands received on the standard input. {{{
+static void *proc_stdin(void *arg) {
+    ConnectionCtx *ctx = static_cast<ConnectionCtx *>(arg);
+    char line[10240]; // It's so large because of the "hexa" command.
+
+    // Quit the program on EOF.  @ctx is the template of all connections,
+    // so propagate the possibly changed settings after each command.
+    for (; fgets(line, sizeof(line), stdin); updateConnections(ctx)) {
+        float f;
+        double tps, speed = 1;
+        uint64_t sessionId, seed = 0;
+        unsigned n, min, max;
+        ConnectionCtx *conn;
+        char *cmd, *opt, *p, *q;
+        bool dont_measure, no_number;
+
+        // First process commands without number prefix.
+        if (line[0] == '#')
+            // A comment.
+            continue;
+        else if (!strcmp(line, "help\n")) {
+            LOG("verbosity, verbose, quiet, role,\n"
+                "\\n, <number-of-messages>, rnd, hexa, file, ?, cancel,\n"
+                "noreply, doreply, watchdog, send-delay, recv-delay,\n"
+                "streams, lga, user-data, connections, rate, replay,\n"
+                "fuzz, window, pool");
+            continue;
+        } else if (!strcmp(line, "verbosity\n")) {
+            LOG("Current verbosity level is %u.", Verbosity);
+            continue;
+        } else if (sscanf(line, "verbosity %u\n", &n) == 1) {
+            Verbosity = n;
+            LOG("Verbosity level changed to %u.", Verbosity);
+            continue;
+        } else if (!strcmp(line, "verbose\n")) {
+            Verbosity++;
+            LOG("Verbosity level changed to %u.", Verbosity);
+            continue;
+        } else if (!strcmp(line, "quiet\n")) {
+            Verbosity--;
+            LOG("Verbosity level changed to %u.", Verbosity);
+            continue;
+        } else if (!strcmp(line, "role\n")) {
+            LOG("I'm a Diameter %s.", ctx->is_client ? "client" : "server");
+            continue;
+        } else if (!strcmp(line, "cancel\n")) {
+            // Cancel an ongoing measurement.
+            pthread_mutex_lock(&MeasurementLock);
+            if (measurementInProgress()) {
+                LOG("Cancelled, time elapsed: %.3fs.", measurementTime());
+                Rate.cancelled = true;
+                reportMeasurement();
+                Rate.tps = 0;
+                Fuzz.running = false;
+                Window.running = false;
+                Window.depth = 0;
+                StartOfMeasurement.tv_sec = StartOfMeasurement.tv_nsec = 0;
+            } else
+                LOG("No measurement in progress.");
+            pthread_mutex_unlock(&MeasurementLock);
+            wakeNetworkThread();
+            continue;
+        } else if (!strcmp(line, "noreply\n")) {
+            ctx->no_reply = true;
+            LOG("autoreply off");
+            continue;
+        } else if (!strcmp(line, "doreply\n")) {
+            ctx->no_reply = false;
+            LOG("autoreply on");
+            continue;
+        } else if (!strcmp(line, "watchdog\n")) {
+            LOG("Watchdog period is %.3fs.", ctx->watchdog_timeout/1000000.0);
+            continue;
+        } else if (sscanf(line, "watchdog %f", &f) == 1) {
+            ctx->watchdog_timeout = f * 1000000.0;
+            LOG("set");
+            continue;
+        } else if (!strcmp(line, "streams\n")) {
+            getRange(&ctx->min_stream, &ctx->max_stream, &min, &max);
+            LOG("use streams %u..%u", min, max);
+            continue;
+        } else if (sscanf(line, "streams %u %u", &min, &max) == 2) {
+            if (!ctx->is_sctp)
+                ERR("can't set streams on non-SCTP connection");
+            else if (min <= max) {
+                setRange(&ctx->min_stream, &ctx->max_stream, min, max);
+                LOG("set");
+            } else
+                ERR("%u > %u", min, max);
+            continue;
+        } else if (sscanf(line, "streams %u", &min) == 1) {
+            if (ctx->is_sctp) {
+                setRange(&ctx->min_stream, &ctx->max_stream, min, min);
+                LOG("set");
+            } else
+                ERR("can't set streams on non-SCTP connections");
+            continue;
+        } else if (!strcmp(line, "lga\n")) {
+            getRange(&ctx->min_lga, &ctx->max_lga, &min, &max);
+            LOG("lga %u..%u", min, max);
+        } else if (sscanf(line, "lga %u %u", &min, &max) == 2) {
+            if (min <= max) {
+                setRange(&ctx->min_lga, &ctx->max_lga, min, max);
+                LOG("set");
+            } else
+                ERR("%u > %u", min, max);
+            continue;
+        } else if (sscanf(line, "lga %u", &min) == 1) {
+            setRange(&ctx->min_lga, &ctx->max_lga, min, min);
+            LOG("set");
+            continue;
+        } else if (!strcmp(line, "user-data\n")) {
+            getRange(&ctx->min_user_data, &ctx->max_user_data, &min, &max);
+            LOG("generate User-Data between %u..%u", min, max);
+            continue;
+        } else if (sscanf(line, "user-data %u %u", &min, &max) == 2) {
+            // Adjust the minimal and maximal size of User-Data we'll send.
+            if (max < min)
+                ERR("%u > %u", min, max);
+            else if (max - min >= UINT_MAX)
+                ERR("max-user-data (%u) is too large", max);
+            else {
+                setRange(&ctx->min_user_data, &ctx->max_user_data, min, max);
+                LOG("set");
+            }
+            continue;
+        } else if (sscanf(line, "user-data %u", &min) == 1) {
+            // Make the size of User-Data fixed.
+            setRange(&ctx->min_user_data, &ctx->max_user_data, min, min);
+            LOG("set");
+            continue;
+        } else if (!strcmp(line, "send-delay\n")) {
+            LOG("Delay between requests is %u us.", ctx->send_delay);
+            continue;
+        } else if (sscanf(line, "send-delay %f", &f) == 1) {
+            ctx->send_delay = f * 1000.0;
+            LOG("set");
+            continue;
+        } else if (!strcmp(line, "recv-delay\n")) {
+            LOG("Delay before replies is %u us.", ctx->recv_delay);
+            continue;
+        } else if (sscanf(line, "recv-delay %f", &f) == 1) {
+            ctx->recv_delay = f * 1000.0;
+            LOG("set");
+            continue;
+        } else if (!strcmp(line, "?\n")) {
+            pthread_mutex_lock(&MeasurementLock);
+            LOG("SessionId: %lu of %lu", LastSessionId, SessionIdCounter);
+            pthread_mutex_unlock(&MeasurementLock);
+            continue;
+        } else if (!strcmp(line, "connections\n")) {
+            showConnections(true);
+            continue;
+        } else if (!strcmp(line, "pool\n")) {
+            DGramPool::show();
+            continue;
+        }
+
+        // The rest of the commands may take a [!][<number>] prefix,
+        // possibly followed by whitespace before the @cmd.
+        dont_measure = line[0] == '!';
+        n = strtoul(&line[dont_measure], &cmd, 10);
+        no_number = cmd == &line[dont_measure];
+        cmd += strspn(cmd, " \t");
+
+        // NUL-terminate @cmd.
+        p = cmd + strcspn(cmd, " \t\n");
+        if (*p) {
+            *p++ = '\0';
+            p += strspn(p, " \t\n");
+        }
+
+        if (dont_measure && no_number && !cmd[0]) {
+            // A '!' alone is meaningless.
+            ERR("Syntax error.");
+            continue;
+        } else if (no_number)
+            // If there isn't a number prefix, send a single message.
+            n = 1;
+
+        // The number of messages to send at a "rate" may be given
+        // in its arguments too.
+        if (!strcmp(cmd, "rate")) {
+            float secs;
+            int nargs;
+
+            nargs = sscanf(p, "%lf %f", &tps, &secs);
+            if (nargs == 2) {
+                n = tps * secs;
+                no_number = false;
+            }
+
+            if (nargs < 1 || no_number || tps <= 0 || !n) {
+                ERR("usage: [<n>] rate <tps> [<seconds>]");
+                continue;
+            } else if (dont_measure) {
+                ERR("rate: can't do it without measurement");
+                continue;
+            } else if (ctx->sfd < 0) {
+                // There's no network thread to send them.
+                ERR("rate: not possible with --no-net");
+                continue;
+            }
+        } else if (!strcmp(cmd, "replay")) {
+            bool busy;
+
+            if (p[0] == '-' && p[1] == 'f' && isspace(p[2])) {
+                speed = 0;
+                p += 2;
+            } else if (p[0] == '-' && p[1] == 'x') {
+                speed = strtod(&p[2], &q);
+                if (q == &p[2] || speed <= 0 || !isspace(*q))
+                    speed = -1;
+                p = q;
+            } else if (p[0] == '-')
+                speed = -1;
+            p += strspn(p, " \t");
+            for (q = p + strlen(p); q > p && isspace(q[-1]); )
+                *--q = '\0';
+
+            pthread_mutex_lock(&MeasurementLock);
+            busy = measurementInProgress();
+            pthread_mutex_unlock(&MeasurementLock);
+            if (speed < 0 || !*p) {
+                ERR("usage: [<n>] replay [-f|-x<speed>] <fname>");
+                continue;
+            } else if (dont_measure) {
+                ERR("replay: can't do it without measurement");
+                continue;
+            } else if (ctx->sfd < 0) {
+                ERR("replay: not possible with --no-net");
+                continue;
+            } else if (busy) {
+                // Don't unload the capture being replayed.
+                ERR("measurement in progress");
+                continue;
+            } else if (!loadReplay(p))
+                continue;
+
+            if (no_number || n > Replay.msgs.size())
+                n = Replay.msgs.size();
+            no_number = false;
+            LOG("Replaying %u request(s).", n);
+        } else if (!strcmp(cmd, "fuzz")) {
+            bool busy, bad;
+
+            bad = false;
+            if (p[0] == '-' && p[1] == 's') {
+                seed = strtoull(&p[2], &q, 0);
+                bad = q == &p[2] || !seed || (*q && !isspace(*q));
+                p = q;
+            } else if (p[0] == '-')
+                bad = true;
+            p += strspn(p, " \t");
+            for (q = p + strlen(p); q > p && isspace(q[-1]); )
+                *--q = '\0';
+
+            pthread_mutex_lock(&MeasurementLock);
+            busy = measurementInProgress();
+            pthread_mutex_unlock(&MeasurementLock);
+            if (bad) {
+                ERR("usage: [<n>] fuzz [-s<seed>] [<fname>]");
+                continue;
+            } else if (dont_measure) {
+                ERR("fuzz: can't do it without measurement");
+                continue;
+            } else if (ctx->sfd < 0) {
+                ERR("fuzz: not possible with --no-net");
+                continue;
+            } else if (busy) {
+                // Don't unload the capture being fuzzed.
+                ERR("measurement in progress");
+                continue;
+            } else if (*p && !loadReplay(p))
+                continue;
+
+            if (!seed) {
+                struct timespec now;
+
+                clock_gettime(CLOCK_REALTIME, &now);
+                seed = nsecs(&now) | 1;
+            }
+            no_number = false;
+            LOG("Fuzzing %u request(s) with seed %lu.", n, seed);
+        } else if (!strcmp(cmd, "window")) {
+            bool bad;
+
+            // <depth>[..<max-depth>] [<seconds>]
+            min = strtoul(p, &q, 10);
+            bad = q == p;
+            max = min;
+            if (!bad && q[0] == '.' && q[1] == '.') {
+                p = q + 2;
+                max = strtoul(p, &q, 10);
+                bad = q == p;
+            }
+            f = WINDOW_STEP_SECS;
+            if (!bad && *(p = q + strspn(q, " \t")) && *p != '\n')
+                bad = sscanf(p, "%f", &f) != 1;
+
+            if (bad || !no_number || !min || min > max || f <= 0) {
+                ERR("usage: window <depth>[..<max-depth>] [<seconds>]");
+                continue;
+            } else if (max > WINDOW_MAX_DEPTH) {
+                ERR("window: %u is too deep", max);
+                continue;
+            } else if (dont_measure) {
+                ERR("window: can't do it without measurement");
+                continue;
+            } else if (ctx->sfd < 0) {
+                ERR("window: not possible with --no-net");
+                continue;
+            }
+
+            // Session-Id:s are allocated as the requests are sent.
+            n = 0;
+            no_number = false;
+        }
+
+        // Is there anyone to send to?
+        if (!(conn = pickConnection())) {
+            ERR("no connection");
+            continue;
         }
-        break; // }}}
-    case Diameter::PNR: // {{{
-        if (flags & Diameter::FLAG_REQUEST) {
-            if (ctx->recv_delay)
-                usleep(ctx->recv_delay);
-            if (ctx->no_reply)
-                return true;
 
-            DGram *reply = dia->dupe();;
-            if (reply && dia->makeResponse(&reply, false,
-                                           Diameter::RC_SUCCESS,
-                                           ctx->origin.host,
-                                           ctx->origin.realm)) {
-                if (Verbosity > 0)
-                    LOG("-> PNA");
-                sendDGram(ctx->sfd, DIAMETER_PORTS(ctx), reply,
-                          dgram->mStreamId);
-            } else
-                free(reply);
-            return true;
-        }
-        break; // }}}
-    default: // ?
-        return true;
-    } // switch @cmd
+        pthread_mutex_lock(&MeasurementLock);
+        if (measurementInProgress()) {
+            pthread_mutex_unlock(&MeasurementLock);
+            ERR("measurement in progress");
+            continue;
+        } else if (!no_number && (n > 0 || !strcmp(cmd, "window"))
+                   && !dont_measure) {
+            // A non-zero number starts a measurement unless @dont_measure.
+            clock_gettime(CLOCK_MONOTONIC, &StartOfMeasurement);
+            MeasurementBase = SessionIdCounter;
+            memset(&Measured, 0, sizeof(Measured));
+            MeasuredRTT.reset();
+        }
+
+        // Operate on a copy of @SessionIdCounter so we can exit the
+        // critical session.
+        sessionId = SessionIdCounter;
+        SessionIdCounter += n;
+        pthread_mutex_unlock(&MeasurementLock);
+
+        if (!cmd[0]) {
+            for (; n > 0; n--) {
+                sessionId++;
+                sendMessage(conn, mkUDRorPNR(conn, sessionId), sessionId);
+                if (ctx->send_delay && n > 1)
+                    usleep(ctx->send_delay);
+                if (n > 1 && !(conn = pickConnection()))
+                    break;
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &LastMessageSent);
+            if (!no_number)
+                LOG("Sent.");
+
+            continue;
+        } else if (!strcmp(cmd, "rate")) {
+            startRate(tps, sessionId, n);
+            continue;
+        } else if (!strcmp(cmd, "replay")) {
+            startReplay(speed, sessionId, n);
+            continue;
+        } else if (!strcmp(cmd, "fuzz")) {
+            startFuzz(seed, *p != '\0', sessionId, n);
+            continue;
+        } else if (!strcmp(cmd, "window")) {
+            startWindow(min, max, f);
+            continue;
+        } else if (!strcmp(cmd, "rnd")) {
+            for (; n > 0; n--) {
+                sessionId++;
+                sendMessage(conn, mkRandom(conn, sessionId), sessionId);
+                if (ctx->send_delay && n > 1)
+                    usleep(ctx->send_delay);
+                if (n > 1 && !(conn = pickConnection()))
+                    break;
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &LastMessageSent);
+            if (!no_number)
+                LOG("Sent.");
+
+            continue;
+        }
+
+        // The rest of the commands take an optional switch and
+        // a mandatory argument. Is the optional switch present?
+        opt = NULL;
+        if (p[0] == '-' && p[1]) {
+            // Skip over it and the following whitespace.
+            opt = &p[1];
+            p += strcspn(p += 2, " \t\n");
+            if (*p) {
+                *p++ = '\0';
+                p += strspn(p, " \t\n");
+            }
+        }
+
+        if (*p) {
+            // Trim the trailing whitespace.
+            q = p + strlen(p) - 1;
+            while (*q == ' ' || *q == '\t' || *q == '\n')
+                *q-- = '\0';
+        } else if (!strcmp(cmd, "file")) {
+            // File name is mandatory for the file command.
+            ERR("%s: required argument missing", cmd);
+            continue;
+        }
+
+        if (!strcmp(cmd, "file") || !strcmp(cmd, "hexa")) {
+            int c;
+            FILE *st;
+            DGram *dgram;
+            unsigned skip;
+            bool isbin, add_header, replace_header;
+
+            // Verify @opt, if it was specified.
+            isbin = false;
+            add_header = true;
+            replace_header = false;
+            if (!strcmp(cmd, "hexa")) {
+                if (opt && !opt[1]) {
+                    if (opt[0] == 'h') {
+                        replace_header = true;
+                        opt = NULL;
+                    } else if (opt[0] == 'H') {
+                        add_header = false;
+                        opt = NULL;
+                    }
+                }
+                st = NULL;
+            } else { // "file" command
+                if (opt) {
+                    // Is @p binary?
+                    if (opt[0] == 'b') {
+                        isbin = true;
+                        opt++;
+                    }
+
+                    // Get @add_header and @replace_header.
+                    if (!opt[0])
+                        // Nothing followed -b.
+                        opt = NULL;
+                    else if (opt[1])
+                        /* We sure don't know this option. */;
+                    else if (opt[0] == 'h') {
+                        replace_header = true;
+                        opt = NULL;
+                    } else if (opt[0] == 'H') {
+                        add_header = false;
+                        opt = NULL;
+                    }
+                }
+
+                if (!(st = fopen(p, "r"))) {
+                    ERR("%s: %m", p);
+                    continue;
+                }
+            }
+
+            // @opt must be NULL if it was parsed successfully.
+            if (opt) {
+                ERR("%s: -%s: unknown option", cmd, opt);
+                continue;
+            }
+
+            // Start @dgram:        @add_header     @replace_header
+            // --: prefix header    T               F
+            // -h: replace header   T               T
+            // -H: keep header      F               F
+            skip = replace_header || (!add_header && measurementInProgress())
+                ? Diameter::HEADER_SIZE : 0;
+            dgram = add_header ? mkEmpty(conn, sessionId)
+                               : DGram::alloc(512);
+            if (!dgram)
+                goto error;
+
+            // If we've just added a diameter header, add a Session-Id too
+            // if measurementInProgress().
+            if (add_header && measurementInProgress()
+                && !addSessionId(&dgram, ctx, ++sessionId))
+                goto error;
+
+            // Read the file or parse @p and add its contents to @dgram.
+            if (!st || !isbin) {
+                // Parse hex numbers from @st or @p at most two digits
+                // at a time.
+                for (;;) {
+                    // Parse the number.
+                    if (st) {
+                        if (fscanf(st, " %2x", &c) <= 0)
+                            break;
+                    } else {
+                        int i;
+
+                        while (*p == '_')
+                            *p++ = ' ';
+                        if (sscanf(p, " %2x%n", &c, &i) <= 0)
+                            break;
+                        p += i;
+                    }
+
+                    // Append @c to @dgram.
+                    if (!skip || !add_header) {
+                        if (!dgram->freeSpace() && !dgram->expand(&dgram, 64))
+                            goto error;
+                        *dgram->firstUnused() = c;
+                        dgram->mUsed++;
+                    }
+
+                    if (skip) {
+                        skip--;
+                        if (skip > 0)
+                            continue;
+                        if (add_header || !measurementInProgress())
+                            continue;
+                        // -H, we've just got through the diameter header,
+                        // and measurementInProgress(), add Session-Id.
+                        if (!addSessionId(&dgram, ctx, ++sessionId))
+                            goto error;
+                    }
+                }
+
+                // Have we reached the message body?
+                if (skip > 0) {
+                    ERR("%s doesn't contain a diameter header", p);
+                    goto error;
+                }
+
+                // Verify that nothing remained in the input.
+                if (st) {
+                    while ((c = getc(st)) != EOF)
+                        if (!isspace(c)) {
+                            ERR("%s: junk in file (%c)", p, c);
+                            goto error;
+                        }
+                } else {
+                    for (; *p; p++)
+                        if (!isspace(*p)) {
+                            ERR("junk (%c)", *p);
+                            goto error;
+                        }
+                }
+            } else
+            {   // @st && @isbin
+                size_t need;
+                struct stat sbuf;
+
+                if (fstat(fileno(st), &sbuf) < 0) {
+                    ERR("%s: %m", p);
+                    goto error;
+                }
+
+                need = sbuf.st_size;
+                if (replace_header) {
+                    // Skip the diameter header.
+                    if (sbuf.st_size < Diameter::HEADER_SIZE) {
+                        ERR("%s doesn't contain a diameter header", p);
+                        goto error;
+                    } else if (fseek(st, Diameter::HEADER_SIZE,
+                               SEEK_SET) < 0) {
+                        ERR("%s: %m", p);
+                        goto error;
+                    } else
+                        need -= Diameter::HEADER_SIZE;
+                }
+
+                // Make sure @dgram has at least @need free space.
+                if (!dgram->ensure(&dgram, need))
+                    goto error;
+                if (fread(dgram->firstUnused(), need, 1, st) != 1) {
+                    ERR("%s: %m", p);
+                    goto error;
+                } else
+                    dgram->mUsed += need;
+            }
+
+            // Finalize @dgram if we touched it.
+            if (dgram->mUsed % sizeof(uint32_t) != 0) {
+                ERR("message body not padded");
+                goto error;
+            }
+            if (add_header || measurementInProgress())
+                Diameter::finishMessage(dgram);
+
+            // Send the message(s).  If we made the header, make sure
+            // the End-to-End Id:s are unique.
+            for (;;) {
+                if (add_header)
+                    setEndToEnd(dgram, conn->end_to_end + sessionId);
+                sendMessage(conn, dgram, sessionId, false);
+                if (!--n || !(conn = pickConnection()))
+                    break;
+                // Update the Session-Id.
+                addSessionId(&dgram, ctx, ++sessionId, Diameter::HEADER_SIZE);
+                if (ctx->send_delay)
+                    usleep(ctx->send_delay);
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &LastMessageSent);
+            if (!no_number)
+                LOG("Sent.");
+
+error:      DGram::release(dgram);
+            if (st)
+                fclose(st);
+        } else
+            ERR("%s: unknown command", cmd);
+    } // until EOF
+
+    kill(getpid(), SIGINT);
+    return NULL;
+} // }}}
+
+// Run the --scenario unattended. {{{
+// Wait for a connection, run the phases of @Scenario as a single
+// measurement, and quit when it's over.
+static void *proc_scenario(void *arg) {
+    ConnectionCtx *ctx = static_cast<ConnectionCtx *>(arg);
+    uint64_t sessionId, n;
+    bool busy;
+
+    while (!pickConnection())
+        usleep(100000);
 
-    // We've got either UDA or PNA.  If a measurement is in progress,
-    // check their Session-Id and if we've reached @SessionIdCounter,
-    // stop the measurement and print the time elapsed since
-    // @StartOfMeasurement. {{{
+    n = Scenario.back().first + Scenario.back().count;
     pthread_mutex_lock(&MeasurementLock);
     if (measurementInProgress()) {
-        unsigned avp;
-        size_t datalen;
-        char *sessionId;
-        unsigned hi, lo;
-
-        // Get Session-Id out of @dia.  It should be the first AVP.
-        sessionId = NULL;
-        if ((ptr = dia->parseAVPHeader(ptr, &rem, &avp, &flags, &datalen))
-            && !(flags & Diameter::FLAG_PARSE_ERROR)
-            && avp == Diameter::SESSION_ID
-            && (ptr = dia->parseString(ptr, &rem, datalen, &sessionId))
-            && sscanf(sessionId, "%*[^;];%x;%x", &hi, &lo) == 2
-            && (LastSessionId = (((uint64_t)hi << 32) | lo))
-                >= SessionIdCounter) {
-            // Stop the measurement.
-            struct timespec now;
+        pthread_mutex_unlock(&MeasurementLock);
+        ERR("scenario: measurement in progress");
+        kill(getpid(), SIGINT);
+        return NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &StartOfMeasurement);
+    MeasurementBase = SessionIdCounter;
+    memset(&Measured, 0, sizeof(Measured));
+    MeasuredRTT.reset();
+    sessionId = SessionIdCounter;
+    SessionIdCounter += n;
+    pthread_mutex_unlock(&MeasurementLock);
 
-            clock_gettime(CLOCK_MONOTONIC, &now);
-            LOG("Test took %.3fs (%.3fs since the last message sent).",
-                measurementTime(&StartOfMeasurement, &now),
-                measurementTime(&LastMessageSent, &now));
-            StartOfMeasurement.tv_sec = StartOfMeasurement.tv_nsec = 0;
+    LOG("Running a scenario of %zu phase(s), %lu request(s).",
+        Scenario.size(), n);
+    startScenario(Scenario, ctx, sessionId);
+
+    // requestDone() or "cancel" will end the measurement.
+    do {
+        usleep(100000);
+        pthread_mutex_lock(&MeasurementLock);
+        busy = measurementInProgress();
+        pthread_mutex_unlock(&MeasurementLock);
+    } while (busy);
+
+    kill(getpid(), SIGINT);
+    return NULL;
+} // }}}
+
+// Send DWRs periodically. {{{
+// Timer callback of @WatchdogTimer.
+static void watchdog(void *arg) {
+    const ConnectionCtx *tmpl = static_cast<const ConnectionCtx *>(arg);
+    struct timespec now;
+
+    if (tmpl->watchdog_timeout)
+        sendWatchdogs();
+
+    // If the watchdog has been disabled, poll it periodically,
+    // because it might be re-enabled.
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    WatchdogTimer.due = nsecs(&now) + (tmpl->watchdog_timeout
+                                  ? tmpl->watchdog_timeout * 1000ull
+                                  : 5000000000ull);
+    Timers.add(&WatchdogTimer);
+} // }}}
+
+// Look for timed out requests every 100 ms. {{{
+// Timer callback of @ExpiryTimer.
+static void checkExpiry(void *arg) {
+    const ConnectionCtx *tmpl = static_cast<const ConnectionCtx *>(arg);
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    expireRequests(tmpl->answer_timeout, &now);
+    ExpiryTimer.due = nsecs(&now) + 100000000;
+    Timers.add(&ExpiryTimer);
+} // }}}
+
+// Make @TimerFd go off when Timers.advance() is due next. {{{
+static void armTimerFd() {
+    uint64_t due;
+    struct itimerspec its;
+
+    // A zero @its disarms it.
+    if (!Timers.next(&due))
+        due = 0;
+    if (due == TimerFdArmed)
+        return;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec  = due / 1000000000;
+    its.it_value.tv_nsec = due % 1000000000;
+    if (timerfd_settime(TimerFd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        ERR("timerfd_settime(): %s", strerror(errno));
+    else
+        TimerFdArmed = due;
+} // }}}
+
+// Receive and respond to network messages of all connections. {{{
+static void *proc_network(void *arg) {
+    ConnectionCtx *tmpl = static_cast<ConnectionCtx *>(arg);
+    struct timespec now;
+
+    // Set up the periodic timers.  The wheel needs to know the time
+    // before anything can be added.
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    Timers.advance(nsecs(&now));
+    if (tmpl->watchdog_timeout) {
+        WatchdogTimer.fun = watchdog;
+        WatchdogTimer.arg = tmpl;
+        WatchdogTimer.due = nsecs(&now)
+            + tmpl->watchdog_timeout * 1000ull;
+        Timers.add(&WatchdogTimer);
+    }
+    if (tmpl->answer_timeout) {
+        ExpiryTimer.fun = checkExpiry;
+        ExpiryTimer.arg = tmpl;
+        ExpiryTimer.due = nsecs(&now) + 100000000;
+        Timers.add(&ExpiryTimer);
+    }
+
+    // Stop when there's no connection left and we can't expect any more.
+    while (LiveConnections > 0 || ListenFd >= 0) {
+        int i, n, timeout;
+        struct epoll_event events[64];
+
+        // Fire the timers which are due, and send what has been queued
+        // before going to sleep.
+        if (__atomic_exchange_n(&PacerPending, false, __ATOMIC_ACQ_REL))
+            startPacer();
+        else if (Rate.cancelled)
+            // Don't let it fire after the capture is unloaded.
+            Timers.cancel(&PacerTimer);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        Timers.advance(nsecs(&now));
+        timeout = transmit();
+        armTimerFd();
+
+        // Submit the writes transmit() has queued on the ring, and the
+        // receives rearmed since the last time, in one go.
+        if (Uring.fd() >= 0)
+            Uring.submit();
+
+        if ((n = epoll_wait(Epoll, events, MEMBS_OF(events),
+                            timeout)) < 0) {
+            if (errno == EINTR)
+                continue;
+            ERR("epoll_wait(): %s", strerror(errno));
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            ConnectionCtx *ctx;
+
+            if (events[i].data.ptr == &ListenFd) {
+                acceptConnection(tmpl);
+                continue;
+            } else if (events[i].data.ptr == &WakeupFd) {
+                eventfd_t dummy;
+
+                // We'll see what the others want at the top of the loop.
+                eventfd_read(WakeupFd, &dummy);
+                __atomic_store_n(&WakeupPending, false, __ATOMIC_SEQ_CST);
+                continue;
+            } else if (events[i].data.ptr == &Uring) {
+                uringCompleted();
+                continue;
+            } else if (events[i].data.ptr == &TimerFd) {
+                uint64_t expirations;
+
+                if (read(TimerFd, &expirations, sizeof(expirations)) < 0
+                    && errno != EAGAIN)
+                    ERR("read(timerfd): %s", strerror(errno));
+                TimerFdArmed = 0;
+                continue;
+            }
+
+            ctx = static_cast<ConnectionCtx *>(events[i].data.ptr);
+            if (ctx->sfd < 0)
+                // Closed while processing a previous event.
+                continue;
+            else if (ctx->is_connecting) {
+                finishConnect(ctx);
+                continue;
+            }
+
+            if ((events[i].events & EPOLLOUT) && ctx->tx_blocked)
+                flushConnection(ctx);
+            if ((events[i].events & ~EPOLLOUT) && !readFromPeer(ctx)) {
+                fuzzCrashed(ctx, "disconnected", &Fuzz.disconnects);
+                closeConnection(ctx);
+            }
         }
-        free(sessionId);
     }
-    pthread_mutex_unlock(&MeasurementLock);
-    // measurement in progress }}}
 
-    return true;
-}
-// }}}
+    kill(getpid(), SIGINT);
+    return NULL;
+} // }}}
 
-// Thread entry points
-// Process the commands received on the standard input. {{{
-static void *proc_stdin(void *arg) {
-    ConnectionCtx *ctx = static_cast<ConnectionCtx *>(arg);
-    char line[10240]; // It's so large because of the "hexa" command.
+// Write the captured messages to their files in large blocks. {{{
+// Each file has a block of its own, which is written when it's full or
+// when there's nothing more to capture for the moment.  @interfaces maps
+// (connection index, stream) pairs to the PCAP-NG interfaces described
+// in the file so far.
+struct CaptureBlock {
+    int hfd;
+    size_t used;
+    std::map<std::pair<unsigned, unsigned>, uint32_t> interfaces;
+    byte data[CAPTURE_BLOCK_SIZE];
+};
 
-    // Quit the program on EOF.
-    while (fgets(line, sizeof(line), stdin)) {
-        float f;
-        uint64_t sessionId;
-        unsigned n, min, max;
-        char *cmd, *opt, *p, *q;
-        bool dont_measure, no_number;
+// Write out what's in @block.
+static void flushCapture(CaptureBlock *block) {
+    size_t pos;
+    ssize_t n;
 
-        // First process commands without number prefix.
-        if (line[0] == '#')
-            // A comment.
-            continue;
-        else if (!strcmp(line, "help\n")) {
-            LOG("verbosity, verbose, quiet, role,\n"
-                "\\n, <number-of-messages>, rnd, hexa, file, ?, cancel,\n"
-                "noreply, doreply, watchdog, send-delay, recv-delay,\n"
-                "streams, lga, user-data");
-            continue;
-        } else if (!strcmp(line, "verbosity\n")) {
-            LOG("Current verbosity level is %u.", Verbosity);
-            continue;
-        } else if (sscanf(line, "verbosity %u\n", &n) == 1) {
-            Verbosity = n;
-            LOG("Verbosity level changed to %u.", Verbosity);
-            continue;
-        } else if (!strcmp(line, "verbose\n")) {
-            Verbosity++;
-            LOG("Verbosity level changed to %u.", Verbosity);
-            continue;
-        } else if (!strcmp(line, "quiet\n")) {
-            Verbosity--;
-            LOG("Verbosity level changed to %u.", Verbosity);
-            continue;
-        } else if (!strcmp(line, "role\n")) {
-            LOG("I'm a Diameter %s.", ctx->is_client ? "client" : "server");
-            continue;
-        } else if (!strcmp(line, "cancel\n")) {
-            // Cancel an ongoing measurement.
-            pthread_mutex_lock(&MeasurementLock);
-            if (measurementInProgress()) {
-                LOG("Cancelled, time elapsed: %.3fs.", measurementTime());
-                StartOfMeasurement.tv_sec = StartOfMeasurement.tv_nsec = 0;
-            } else
-                LOG("No measurement in progress.");
-            pthread_mutex_unlock(&MeasurementLock);
-            continue;
-        } else if (!strcmp(line, "noreply\n")) {
-            ctx->no_reply = true;
-            LOG("autoreply off");
-            continue;
-        } else if (!strcmp(line, "doreply\n")) {
-            ctx->no_reply = false;
-            LOG("autoreply on");
-            continue;
-        } else if (!strcmp(line, "watchdog\n")) {
-            LOG("Watchdog period is %.3fs.", ctx->watchdog_timeout/1000000.0);
-            continue;
-        } else if (sscanf(line, "watchdog %f", &f) == 1) {
-            ctx->watchdog_timeout = f * 1000000.0;
-            LOG("set");
-            continue;
-        } else if (!strcmp(line, "streams\n")) {
-            LOG("use streams %u..%u", ctx->min_stream, ctx->max_stream);
-            continue;
-        } else if (sscanf(line, "streams %u %u", &min, &max) == 2) {
-            if (!ctx->is_sctp)
-                ERR("can't set streams on non-SCTP connection");
-            else if (min <= max) {
-                ctx->min_stream = min;
-                ctx->max_stream = max;
-                LOG("set");
-            } else
-                ERR("%u > %u", min, max);
-            continue;
-        } else if (sscanf(line, "streams %u", &ctx->min_stream) == 1) {
-            if (ctx->is_sctp) {
-                ctx->max_stream = ctx->min_stream;
-                LOG("set");
-            } else
-                ERR("can't set streams on non-SCTP connections");
-            continue;
-        } else if (!strcmp(line, "lga\n")) {
-            LOG("lga %u..%u", ctx->min_lga, ctx->max_lga);
-        } else if (sscanf(line, "lga %u %u", &min, &max) == 2) {
-            if (min <= max) {
-                ctx->min_lga = min;
-                ctx->max_lga = max;
-                LOG("set");
-            } else
-                ERR("%u > %u", min, max);
-            continue;
-        } else if (sscanf(line, "lga %u", &ctx->min_lga) == 1) {
-            ctx->max_lga = ctx->min_lga;
-            LOG("set");
-            continue;
-        } else if (!strcmp(line, "user-data\n")) {
-            LOG("generate User-Data between %u..%u",
-                ctx->min_user_data, ctx->max_user_data);
-            continue;
-        } else if (sscanf(line, "user-data %u %u", &min, &max) == 2) {
-            // Adjust the minimal and maximal size of User-Data we'll send.
-            if (max < min)
-                ERR("%u > %u", min, max);
-            else if (max - min >= UINT_MAX)
-                ERR("max-user-data (%u) is too large", max);
-            else {
-                ctx->min_user_data = min;
-                ctx->max_user_data = max;
-                LOG("set");
+    for (pos = 0; pos < block->used; pos += n)
+        if ((n = write(block->hfd, &block->data[pos],
+                       block->used - pos)) < 0) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
             }
+            ERR("capture: %m");
+            break;
+        }
+    block->used = 0;
+}
+
+// Return the interface of the connection and stream of @rec in @block,
+// adding an Interface Description Block if it's the first time we see it.
+static uint32_t captureInterface(CaptureBlock *block,
+                                 const CaptureRecord *rec) {
+    size_t len;
+    uint32_t id;
+    pcapng_idb_t idb;
+    uint8_t tsresol;
+    char str[2*DMXEndPoint::STRLEN + 64];
+    byte data[sizeof(idb) + 2*sizeof(str) + 32];
+    std::pair<unsigned, unsigned> key(rec->ctx->idx,
+                                      rec->dgram->mStreamId);
+    std::map<std::pair<unsigned, unsigned>, uint32_t>::const_iterator it;
+
+    if ((it = block->interfaces.find(key)) != block->interfaces.end())
+        return it->second;
+
+    len = sizeof(idb);
+    if (rec->ctx->is_sctp)
+        snprintf(str, sizeof(str), "connection %u stream %u",
+                 key.first, key.second);
+    else
+        snprintf(str, sizeof(str), "connection %u", key.first);
+    len += putPcapOption(&data[len], PCAPNG_IF_NAME, str, strlen(str));
+
+    DMXEndPoint::sockaddrToString(str,
+                    DMXEndPoint::toCSA(&rec->ctx->local_addr));
+    strcat(str, " <-> ");
+    DMXEndPoint::sockaddrToString(&str[strlen(str)],
+                    DMXEndPoint::toCSA(&rec->ctx->peer_addr));
+    len += putPcapOption(&data[len], PCAPNG_IF_DESCRIPTION,
+                         str, strlen(str));
+
+    // Nanosecond timestamps.
+    tsresol = 9;
+    len += putPcapOption(&data[len], PCAPNG_IF_TSRESOL,
+                         &tsresol, sizeof(tsresol));
+    len += putPcapOption(&data[len], PCAPNG_OPT_ENDOFOPT, "", 0);
+    len += sizeof(idb.block_length);
+
+    idb.block_type   = PCAPNG_IDB;
+    idb.block_length = len;
+    idb.linktype     = rec->ctx->local_addr.ss_family == AF_INET6
+        ? PCAP_LINKTYPE_IPV6 : PCAP_LINKTYPE_IPV4;
+    idb.reserved     = 0;
+    idb.snaplen      = 0;
+    memcpy(data, &idb, sizeof(idb));
+    memcpy(&data[len - sizeof(idb.block_length)],
+           &idb.block_length, sizeof(idb.block_length));
+
+    if (block->used + len > CAPTURE_BLOCK_SIZE)
+        flushCapture(block);
+    memcpy(&block->data[block->used], data, len);
+    block->used += len;
+
+    id = block->interfaces.size();
+    block->interfaces[key] = id;
+    return id;
+}
+
+// Add @rec to @block as an Enhanced Packet Block.  Messages which
+// wouldn't fit in an empty block are written directly.
+static void appendCapture(CaptureBlock *block, const CaptureRecord *rec) {
+    uint64_t ts;
+    size_t hlen, tlen, size;
+    pcapng_epb_t epb;
+    uint32_t flags;
+    char comment[64];
+    byte head[sizeof(epb) + sizeof(struct ip6_hdr) + sizeof(sctp_hdr_t)];
+    byte tail[3 + 2*sizeof(pcapng_opt_t) + sizeof(flags)
+              + sizeof(comment) + sizeof(pcapng_opt_t)
+              + sizeof(epb.block_length)];
+    struct iovec iov[3];
+
+    // The packet data.
+    hlen = sizeof(epb);
+    hlen += mkPacketHeaders(&head[hlen], rec->ctx, rec->sent,
+                            rec->dgram->mStreamId, rec->dgram->mUsed);
+    epb.captured_len = hlen - sizeof(epb) + rec->dgram->mUsed;
+
+    // The options.
+    tlen = PAD4(epb.captured_len);
+    memset(tail, 0, tlen);
+    flags = rec->sent ? PCAPNG_EPB_OUTBOUND : PCAPNG_EPB_INBOUND;
+    tlen += putPcapOption(&tail[tlen], PCAPNG_EPB_FLAGS,
+                          &flags, sizeof(flags));
+    if (!rec->latency)
+        snprintf(comment, sizeof(comment), "%s",
+                 rec->sent ? "sent" : "received");
+    else if (rec->sent)
+        snprintf(comment, sizeof(comment), "sent after %.3f ms in queue",
+                 rec->latency / 1000000.0);
+    else
+        snprintf(comment, sizeof(comment), "received, round-trip %.3f ms",
+                 rec->latency / 1000000.0);
+    tlen += putPcapOption(&tail[tlen], PCAPNG_OPT_COMMENT,
+                          comment, strlen(comment));
+    tlen += putPcapOption(&tail[tlen], PCAPNG_OPT_ENDOFOPT, "", 0);
+    tlen += sizeof(epb.block_length);
+
+    ts = rec->ts + Capture.realtime;
+    epb.block_type   = PCAPNG_EPB;
+    epb.block_length = hlen + rec->dgram->mUsed + tlen;
+    epb.interface_id = captureInterface(block, rec);
+    epb.ts_high      = ts >> 32;
+    epb.ts_low       = ts;
+    epb.orig_len     = epb.captured_len;
+    memcpy(head, &epb, sizeof(epb));
+    memcpy(&tail[tlen - sizeof(epb.block_length)],
+           &epb.block_length, sizeof(epb.block_length));
+
+    size = epb.block_length;
+    if (block->used + size > CAPTURE_BLOCK_SIZE)
+        flushCapture(block);
+
+    if (size <= CAPTURE_BLOCK_SIZE) {
+        memcpy(&block->data[block->used], head, hlen);
+        block->used += hlen;
+        memcpy(&block->data[block->used],
+               rec->dgram->mData, rec->dgram->mUsed);
+        block->used += rec->dgram->mUsed;
+        memcpy(&block->data[block->used], tail, tlen);
+        block->used += tlen;
+    } else {
+        iov[0].iov_base = head;
+        iov[0].iov_len  = hlen;
+        iov[1].iov_base = rec->dgram->mData;
+        iov[1].iov_len  = rec->dgram->mUsed;
+        iov[2].iov_base = tail;
+        iov[2].iov_len  = tlen;
+        if (writev(block->hfd, iov, MEMBS_OF(iov)) < 0)
+            ERR("capture: %m");
+    }
+}
+
+// Add @rec to the trace @block.
+static void appendTrace(CaptureBlock *block, const CaptureRecord *rec) {
+    trace_rec_t hdr;
+    struct iovec iov[2];
+
+    hdr.ts          = rec->ts + Capture.realtime;
+    hdr.latency     = rec->latency;
+    hdr.connection  = rec->ctx->idx;
+    hdr.length      = rec->dgram->mUsed;
+    hdr.stream      = rec->dgram->mStreamId;
+    hdr.sent        = rec->sent;
+    hdr.reserved    = 0;
+
+    if (block->used + sizeof(hdr) + hdr.length > CAPTURE_BLOCK_SIZE)
+        flushCapture(block);
+
+    if (sizeof(hdr) + hdr.length <= CAPTURE_BLOCK_SIZE) {
+        memcpy(&block->data[block->used], &hdr, sizeof(hdr));
+        block->used += sizeof(hdr);
+        memcpy(&block->data[block->used],
+               rec->dgram->mData, rec->dgram->mUsed);
+        block->used += rec->dgram->mUsed;
+    } else {
+        iov[0].iov_base = &hdr;
+        iov[0].iov_len  = sizeof(hdr);
+        iov[1].iov_base = rec->dgram->mData;
+        iov[1].iov_len  = rec->dgram->mUsed;
+        if (writev(block->hfd, iov, MEMBS_OF(iov)) < 0)
+            ERR("trace: %m");
+    }
+}
+
+// The capture writer thread.  Consume @Capture.ring until main() tells
+// us to stop and there's nothing left.
+static void *proc_capture(void *) {
+    bool stopping;
+    CaptureBlock *blocks;
+    CaptureRecord *rec;
+
+    // @Input and @Output may be the same file (-w).
+    blocks = new CaptureBlock[3];
+    blocks[0].hfd = Input;
+    blocks[1].hfd = Output;
+    blocks[2].hfd = Trace;
+    blocks[0].used = blocks[1].used = blocks[2].used = 0;
+
+    for (;;) {
+        // Producers are finished by the time @Capture.stopping is set,
+        // so if it's set and the ring is empty, we're done.
+        stopping = __atomic_load_n(&Capture.stopping, __ATOMIC_ACQUIRE);
+        rec = &Capture.ring[Capture.head % CAPTURE_RING_SIZE];
+        if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE)
+            != Capture.head + 1) {
+            flushCapture(&blocks[0]);
+            flushCapture(&blocks[1]);
+            flushCapture(&blocks[2]);
+            if (stopping)
+                break;
+            usleep(1000);
             continue;
-        } else if (sscanf(line, "user-data %u", &ctx->min_user_data) == 1) {
-            // Make the size of User-Data fixed.
-            ctx->max_user_data = ctx->min_user_data;
-            LOG("set");
-            continue;
-        } else if (!strcmp(line, "send-delay\n")) {
-            LOG("Delay between requests is %u us.", ctx->send_delay);
-            continue;
-        } else if (sscanf(line, "send-delay %f", &f) == 1) {
-            ctx->send_delay = f * 1000.0;
-            LOG("set");
-            continue;
-        } else if (!strcmp(line, "recv-delay\n")) {
-            LOG("Delay before replies is %u us.", ctx->recv_delay);
-            continue;
-        } else if (sscanf(line, "recv-delay %f", &f) == 1) {
-            ctx->recv_delay = f * 1000.0;
-            LOG("set");
-            continue;
-        } else if (!strcmp(line, "?\n")) {
-            pthread_mutex_lock(&MeasurementLock);
-            LOG("SessionId: %lu of %lu", LastSessionId, SessionIdCounter);
-            pthread_mutex_unlock(&MeasurementLock);
-            continue;
         }
 
-        // The rest of the commands may take a [!][<number>] prefix,
-        // possibly followed by whitespace before the @cmd.
-        dont_measure = line[0] == '!';
-        n = strtoul(&line[dont_measure], &cmd, 10);
-        no_number = cmd == &line[dont_measure];
-        cmd += strspn(cmd, " \t");
+        if (rec->hfd == Trace)
+            appendTrace(&blocks[2], rec);
+        else
+            appendCapture(&blocks[rec->hfd == blocks[0].hfd ? 0 : 1], rec);
+        DGram::release(rec->dgram);
+        Capture.written++;
+
+        __atomic_store_n(&rec->seq, Capture.head + CAPTURE_RING_SIZE,
+                         __ATOMIC_RELEASE);
+        Capture.head++;
+    }
+
+    delete[] blocks;
+    return NULL;
+} // }}}
+
+// Decoding traces {{{
+// Print the messages of the trace file @fname (written with --trace) the
+// way they would have been dumped with -vvv.
+static bool decodeTrace(const char *fname) {
+    int fd;
+    bool ok;
+    void *map;
+    size_t size, pos;
+    struct stat st;
+    const byte *data;
+    trace_hdr_t hdr;
+
+    if ((fd = open(fname, O_RDONLY)) < 0) {
+        ERR("%s: %m", fname);
+        return false;
+    } else if (fstat(fd, &st) < 0) {
+        ERR("%s: %m", fname);
+        close(fd);
+        return false;
+    } else if (st.st_size < (off_t)sizeof(hdr)) {
+        ERR("%s: not a trace file", fname);
+        close(fd);
+        return false;
+    }
+
+    size = st.st_size;
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        ERR("mmap(%s): %m", fname);
+        return false;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    data = static_cast<const byte *>(map);
+
+    memcpy(&hdr, data, sizeof(hdr));
+    if (memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic))) {
+        ERR("%s: not a trace file", fname);
+        munmap(map, size);
+        return false;
+    } else if (hdr.version != TRACE_VERSION) {
+        ERR("%s: unsupported trace version or byte order", fname);
+        munmap(map, size);
+        return false;
+    }
+
+    ok = true;
+    for (pos = sizeof(hdr); pos < size; ) {
+        trace_rec_t rec;
+        time_t t;
+        struct tm tm;
+        char date[32], latency[48];
+        unsigned cmd, flags;
+        size_t rem;
+        DGram *dgram;
+
+        if (size - pos < sizeof(rec)) {
+            ERR("%s: truncated record at offset %zu", fname, pos);
+            ok = false;
+            break;
+        }
+        memcpy(&rec, &data[pos], sizeof(rec));
+        pos += sizeof(rec);
+        if (size - pos < rec.length) {
+            ERR("%s: truncated record at offset %zu",
+                fname, pos - sizeof(rec));
+            ok = false;
+            break;
+        } else if (!(dgram = dupeMessage(&data[pos], rec.length))) {
+            ok = false;
+            break;
+        }
+        pos += rec.length;
+
+        t = rec.ts / 1000000000;
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S",
+                 localtime_r(&t, &tm));
+        if (!rec.latency)
+            latency[0] = '\0';
+        else
+            snprintf(latency, sizeof(latency),
+                     rec.sent ? ", %.3f ms in queue"
+                              : ", round-trip %.3f ms",
+                     rec.latency / 1000000.0);
+
+        rem = 0;
+        if (!Diameter::fromDGram(dgram)->parseMessageHeader(NULL, &rem,
+                                                            &cmd, &flags))
+            cmd = flags = 0;
+        LOG("%s.%.9lu connection %u stream %u: %s %s (%u bytes%s)",
+            date, rec.ts % 1000000000, rec.connection, rec.stream,
+            rec.sent ? "->" : "<-", translate(cmd, flags),
+            rec.length, latency);
+        Diameter::dumpMessage(Diameter::fromDGram(dgram));
+        DGram::release(dgram);
+    }
 
-        // NUL-terminate @cmd.
-        p = cmd + strcspn(cmd, " \t\n");
-        if (*p) {
-            *p++ = '\0';
-            p += strspn(p, " \t\n");
-        }
+    munmap(map, size);
+    return ok;
+}
+// }}}
 
-        if (dont_measure && no_number && !cmd[0]) {
-            // A '!' alone is meaningless.
-            ERR("Syntax error.");
-            continue;
-        } else if (no_number)
-            // If there isn't a number prefix, send a single message.
-            n = 1;
+// Metrics endpoint {{{
+// What we know about the connections besides their Metrics.
+struct ConnectionTotals {
+    unsigned connections, up;
+    uint64_t inflight, errors, timeouts, unmatched, duplicates, reordered;
+};
 
-        pthread_mutex_lock(&MeasurementLock);
-        if (measurementInProgress()) {
-            pthread_mutex_unlock(&MeasurementLock);
-            ERR("measurement in progress");
-            continue;
-        } else if (!no_number && n > 0 && !dont_measure)
-            // A non-zero number starts a measurement unless @dont_measure.
-            clock_gettime(CLOCK_MONOTONIC, &StartOfMeasurement);
+// Create the socket to serve the metrics on.  An existing socket at
+// @path is assumed to be left behind by a previous instance.
+static int openMetrics(const char *path) {
+    int fd;
+    struct stat st;
+    struct sockaddr_un sun;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        ERR("%s: path too long", path);
+        return -1;
+    }
+    strcpy(sun.sun_path, path);
 
-        // Operate on a copy of @SessionIdCounter so we can exit the
-        // critical session.
-        sessionId = SessionIdCounter;
-        SessionIdCounter += n;
-        pthread_mutex_unlock(&MeasurementLock);
+    if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+        unlink(path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        ERR("socket(AF_UNIX): %m");
+        return -1;
+    } else if (bind(fd, (const struct sockaddr *)&sun, sizeof(sun)) < 0
+               || listen(fd, 16) < 0) {
+        ERR("%s: %m", path);
+        close(fd);
+        return -1;
+    }
 
-        if (!cmd[0]) {
-            for (; n > 0; n--) {
-                sendMessage(ctx, mkUDRorPNR(ctx, ++sessionId));
-                if (ctx->send_delay && n > 1)
-                    usleep(ctx->send_delay);
+    return fd;
+}
+
+// Append printf()-formatted text to @out.
+static void __attribute__((format(printf, 2, 3)))
+appendf(std::string *out, const char *fmt, ...) {
+    va_list args;
+    char buf[512];
+    int n;
+
+    va_start(args, fmt);
+    n = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (n > 0)
+        out->append(buf, (size_t)n < sizeof(buf) ? n : sizeof(buf) - 1);
+}
+
+// Sum up the counters of the connections.
+static void connectionTotals(ConnectionTotals *totals) {
+    memset(totals, 0, sizeof(*totals));
+    pthread_mutex_lock(&ConnectionsLock);
+    totals->connections = Connections.size();
+    for (size_t i = 0; i < Connections.size(); i++) {
+        const ConnectionCtx *ctx = Connections[i];
+
+        if (!ctx->is_eof && !ctx->is_connecting)
+            totals->up++;
+        totals->inflight    += ctx->inflight->outstanding();
+        totals->errors      += ctx->stats.errors;
+        totals->timeouts    += ctx->stats.timeouts;
+        totals->unmatched   += ctx->stats.unmatched;
+        totals->duplicates  += ctx->stats.duplicates;
+        totals->reordered   += ctx->stats.reordered;
+    }
+    pthread_mutex_unlock(&ConnectionsLock);
+}
+
+// Format the labels identifying @key of the @which Table of Metrics
+// (0: commands, 1: streams, 2: results) into @buf, either for Prometheus
+// or for JSON.
+static void metricsLabels(char *buf, size_t size, unsigned which,
+                          uint32_t key, bool json) {
+    static const char *const names[] = { "command", "stream", "code" };
+    const char *name = names[which];
+
+    if (key == Metrics::OTHER)
+        snprintf(buf, size, json ? "\"%s\":\"other\"" : "%s=\"other\"",
+                 name);
+    else if (which == 0) {
+        unsigned cmd = key & ~Metrics::REQUEST;
+        bool isRequest = key & Metrics::REQUEST;
+        const char *str = translate(cmd,
+                            isRequest ? Diameter::FLAG_REQUEST : 0);
+
+        snprintf(buf, size,
+                 json ? "\"%s\":%u,\"request\":%s,\"name\":\"%s\""
+                      : "%s=\"%u\",request=\"%s\",name=\"%s\"",
+                 name, cmd, isRequest ? "true" : "false", str);
+    } else
+        snprintf(buf, size, json ? "\"%s\":%u" : "%s=\"%u\"", name, key);
+}
+
+// Render @m and @totals in the Prometheus text exposition format.
+static void prometheusMetrics(std::string *out, const Metrics *m,
+                              const ConnectionTotals *totals) {
+    static const struct {
+        const char *name, *help;
+    } families[] = {
+        { "radiator_command", "by command code" },
+        { "radiator_stream",  "by SCTP stream" },
+        { "radiator_result_code", "of answers by Result-Code" },
+    };
+    static const double le[] = {
+        0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005,
+        0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10,
+    };
+    static const char *const dirs[] = { "received", "sent" };
+    static const char *const suffixes[] = { "messages", "bytes" };
+    const Metrics::Table *tables[] = {
+        &m->commands, &m->streams, &m->results,
+    };
+    char labels[128];
+    unsigned bucket;
+    uint64_t seen;
+
+    for (unsigned t = 0; t < 3; t++)
+        for (unsigned what = 0; what < 2; what++) {
+            appendf(out, "# HELP %s_%s_total "
+                    "Diameter %s sent and received %s.\n",
+                    families[t].name, suffixes[what], suffixes[what],
+                    families[t].help);
+            appendf(out, "# TYPE %s_%s_total counter\n",
+                    families[t].name, suffixes[what]);
+            for (unsigned i = 0; i < Metrics::NSLOTS; i++) {
+                if (!tables[t]->keys[i])
+                    continue;
+                metricsLabels(labels, sizeof(labels), t,
+                              tables[t]->keyOf(i), false);
+                for (unsigned dir = 0; dir < 2; dir++)
+                    appendf(out,
+                            "%s_%s_total{direction=\"%s\",%s} %lu\n",
+                            families[t].name, suffixes[what],
+                            dirs[dir], labels,
+                            what ? tables[t]->bytes[i][dir]
+                                 : tables[t]->messages[i][dir]);
             }
+        }
 
-            clock_gettime(CLOCK_MONOTONIC, &LastMessageSent);
-            if (!no_number)
-                LOG("Sent.");
+    // The bucket boundaries of @m->rtt don't fall on @le, so a few
+    // values above the limit may be counted in its bucket.
+    out->append("# HELP radiator_round_trip_seconds "
+                "Round-trip time of the answered requests.\n"
+                "# TYPE radiator_round_trip_seconds histogram\n");
+    bucket = 0;
+    seen = 0;
+    for (unsigned i = 0; i < sizeof(le) / sizeof(le[0]); i++) {
+        while (bucket < Histogram::NBUCKETS
+               && Histogram::highestValueOf(bucket) <= le[i] * 1e9)
+            seen += m->rtt.buckets[bucket++];
+        appendf(out, "radiator_round_trip_seconds_bucket{le=\"%g\"} %lu\n",
+                le[i], seen);
+    }
+    while (bucket < Histogram::NBUCKETS)
+        seen += m->rtt.buckets[bucket++];
+    appendf(out, "radiator_round_trip_seconds_bucket{le=\"+Inf\"} %lu\n"
+            "radiator_round_trip_seconds_sum %.9f\n"
+            "radiator_round_trip_seconds_count %lu\n",
+            seen, m->rtt.sum / 1e9, seen);
+
+    appendf(out, "# HELP radiator_in_flight "
+            "Requests sent and not answered yet.\n"
+            "# TYPE radiator_in_flight gauge\n"
+            "radiator_in_flight %lu\n", totals->inflight);
+    appendf(out, "# HELP radiator_connections "
+            "Connections ever made and those up.\n"
+            "# TYPE radiator_connections gauge\n"
+            "radiator_connections{state=\"all\"} %u\n"
+            "radiator_connections{state=\"up\"} %u\n",
+            totals->connections, totals->up);
+    appendf(out, "# HELP radiator_errors_total "
+            "Messages not sent and answers not matched.\n"
+            "# TYPE radiator_errors_total counter\n"
+            "radiator_errors_total{kind=\"send\"} %lu\n"
+            "radiator_errors_total{kind=\"timeout\"} %lu\n"
+            "radiator_errors_total{kind=\"unmatched\"} %lu\n"
+            "radiator_errors_total{kind=\"duplicate\"} %lu\n",
+            totals->errors, totals->timeouts,
+            totals->unmatched, totals->duplicates);
+    appendf(out, "# HELP radiator_reordered_total "
+            "Answers arrived before the answer of an earlier request.\n"
+            "# TYPE radiator_reordered_total counter\n"
+            "radiator_reordered_total %lu\n", totals->reordered);
+}
+
+// Render @m and @totals as a JSON object.
+static void jsonMetrics(std::string *out, const Metrics *m,
+                        const ConnectionTotals *totals) {
+    static const char *const names[] = {
+        "commands", "streams", "results",
+    };
+    static const double pcts[] = { 50, 90, 99, 99.9 };
+    const Metrics::Table *tables[] = {
+        &m->commands, &m->streams, &m->results,
+    };
+    char labels[128];
 
+    out->append("{");
+    for (unsigned t = 0; t < 3; t++) {
+        bool first = true;
+
+        appendf(out, "\"%s\":[", names[t]);
+        for (unsigned i = 0; i < Metrics::NSLOTS; i++) {
+            if (!tables[t]->keys[i])
+                continue;
+            metricsLabels(labels, sizeof(labels), t,
+                          tables[t]->keyOf(i), true);
+            appendf(out, "%s{%s,"
+                    "\"received\":{\"messages\":%lu,\"bytes\":%lu},"
+                    "\"sent\":{\"messages\":%lu,\"bytes\":%lu}}",
+                    first ? "" : ",", labels,
+                    tables[t]->messages[i][Metrics::RECEIVED],
+                    tables[t]->bytes[i][Metrics::RECEIVED],
+                    tables[t]->messages[i][Metrics::SENT],
+                    tables[t]->bytes[i][Metrics::SENT]);
+            first = false;
+        }
+        out->append("],");
+    }
+
+    appendf(out, "\"round_trip_ns\":{\"count\":%lu,\"sum\":%lu,"
+            "\"max\":%lu", m->rtt.count, m->rtt.sum, m->rtt.max);
+    for (unsigned i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++)
+        appendf(out, ",\"p%g\":%lu", pcts[i], m->rtt.percentile(pcts[i]));
+    out->append("},");
+
+    appendf(out, "\"in_flight\":%lu,"
+            "\"connections\":{\"all\":%u,\"up\":%u},"
+            "\"errors\":{\"send\":%lu,\"timeout\":%lu,"
+            "\"unmatched\":%lu,\"duplicate\":%lu},"
+            "\"reordered\":%lu}\n",
+            totals->inflight, totals->connections, totals->up,
+            totals->errors, totals->timeouts, totals->unmatched,
+            totals->duplicates, totals->reordered);
+}
+
+// Answer the HTTP request on @fd: GET /metrics returns the Prometheus
+// text format, and GET /json returns the same as JSON.
+static void serveMetrics(int fd, Metrics *m) {
+    char req[1024], *path;
+    size_t len;
+    ssize_t n;
+    const char *status, *type;
+    ConnectionTotals totals;
+    std::string body, head;
+    struct timeval tv;
+
+    // Don't let a stuck client block the other ones forever.
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    // Read the request up to the end of the headers.
+    len = 0;
+    req[0] = '\0';
+    while (len < sizeof(req) - 1
+           && !strstr(req, "\r\n\r\n") && !strstr(req, "\n\n")) {
+        if ((n = read(fd, &req[len], sizeof(req) - 1 - len)) < 0
+            && errno == EINTR)
             continue;
-        } else if (!strcmp(cmd, "rnd")) {
-            for (; n > 0; n--) {
-                sendMessage(ctx, mkRandom(ctx, ++sessionId));
-                if (ctx->send_delay && n > 1)
-                    usleep(ctx->send_delay);
+        else if (n <= 0)
+            break;
+        len += n;
+        req[len] = '\0';
+    }
+    if (!strchr(req, '\n'))
+        return;
+
+    status = "200 OK";
+    type = "text/plain; version=0.0.4";
+    path = NULL;
+    if (!strncmp(req, "GET ", 4)) {
+        // Since it starts with "GET ", @req is at least 4 bytes long.
+        path = &req[4];
+        path[strcspn(path, " ?\r\n")] = '\0';
+    }
+
+    if (!path) {
+        status = "405 Method Not Allowed";
+        body = "Only GET is supported.\n";
+    } else if (!strcmp(path, "/metrics") || !strcmp(path, "/")) {
+        Metrics::snapshot(m);
+        connectionTotals(&totals);
+        prometheusMetrics(&body, m, &totals);
+    } else if (!strcmp(path, "/json")) {
+        Metrics::snapshot(m);
+        connectionTotals(&totals);
+        jsonMetrics(&body, m, &totals);
+        type = "application/json";
+    } else {
+        status = "404 Not Found";
+        body = "Try /metrics or /json.\n";
+    }
+
+    appendf(&head, "HTTP/1.0 %s\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: close\r\n\r\n",
+            status, type, body.size());
+    head += body;
+    for (len = 0; len < head.size(); len += n)
+        if ((n = send(fd, &head[len], head.size() - len,
+                      MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
             }
+            break;
+        }
+}
 
-            clock_gettime(CLOCK_MONOTONIC, &LastMessageSent);
-            if (!no_number)
-                LOG("Sent.");
+// The metrics server thread, which answers the clients one by one.
+static void *proc_metrics(void *) {
+    Metrics *m;
+    int fd;
 
-            continue;
+    if (!(m = static_cast<Metrics *>(malloc(sizeof(*m))))) {
+        ERR("malloc(%zu): %m", sizeof(*m));
+        return NULL;
+    }
+
+    for (;;) {
+        if ((fd = accept4(MetricsEndpoint.fd, NULL, NULL,
+                          SOCK_CLOEXEC)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            ERR("accept(%s): %m", MetricsEndpoint.path);
+            break;
         }
+        serveMetrics(fd, m);
+        close(fd);
+    }
 
-        // The rest of the commands take an optional switch and
-        // a mandatory argument. Is the optional switch present?
-        opt = NULL;
-        if (p[0] == '-' && p[1]) {
-            // Skip over it and the following whitespace.
-            opt = &p[1];
-            p += strcspn(p += 2, " \t\n");
-            if (*p) {
-                *p++ = '\0';
-                p += strspn(p, " \t\n");
-            }
+    free(m);
+    return NULL;
+}
+// }}}
+
+// Thread placement {{{
+// Parse a list of CPUs like "0-3,8" into @cpus.  Returns false if it's
+// not one.
+static bool parseCPUList(const char *str, cpu_set_t *cpus) {
+    CPU_ZERO(cpus);
+    do {
+        char *end;
+        unsigned long from, to;
+
+        from = to = strtoul(str, &end, 10);
+        if (end == str)
+            return false;
+        if (*end == '-') {
+            str = end + 1;
+            to = strtoul(str, &end, 10);
+            if (end == str)
+                return false;
         }
+        if (from > to || to >= CPU_SETSIZE)
+            return false;
 
-        if (*p) {
-            // Trim the trailing whitespace.
-            q = p + strlen(p) - 1;
-            while (*q == ' ' || *q == '\t' || *q == '\n')
-                *q-- = '\0';
-        } else if (!strcmp(cmd, "file")) {
-            // File name is mandatory for the file command.
-            ERR("%s: required argument missing", cmd);
+        for (; from <= to; from++)
+            CPU_SET(from, cpus);
+        str = end;
+    } while (*str++ == ',');
+
+    return !str[-1];
+}
+
+// Return @cpus as a list parseCPUList() understands.
+static std::string fmtCPUList(const cpu_set_t *cpus) {
+    std::string list;
+
+    for (unsigned cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        unsigned last;
+        char range[32];
+
+        if (!CPU_ISSET(cpu, cpus))
             continue;
-        }
+        for (last = cpu; last + 1 < CPU_SETSIZE
+                         && CPU_ISSET(last + 1, cpus); last++)
+            ;
 
-        if (!strcmp(cmd, "file") || !strcmp(cmd, "hexa")) {
-            int c;
-            FILE *st;
-            DGram *dgram;
-            unsigned skip;
-            bool isbin, add_header, replace_header;
+        if (last == cpu)
+            snprintf(range, sizeof(range), "%u", cpu);
+        else
+            snprintf(range, sizeof(range), "%u-%u", cpu, last);
+        if (!list.empty())
+            list += ',';
+        list += range;
+        cpu = last;
+    }
 
-            // Verify @opt, if it was specified.
-            isbin = false;
-            add_header = true;
-            replace_header = false;
-            if (!strcmp(cmd, "hexa")) {
-                if (opt && !opt[1]) {
-                    if (opt[0] == 'h') {
-                        replace_header = true;
-                        opt = NULL;
-                    } else if (opt[0] == 'H') {
-                        add_header = false;
-                        opt = NULL;
-                    }
-                }
-                st = NULL;
-            } else { // "file" command
-                if (opt) {
-                    // Is @p binary?
-                    if (opt[0] == 'b') {
-                        isbin = true;
-                        opt++;
-                    }
+    return list.empty() ? "none" : list;
+}
 
-                    // Get @add_header and @replace_header.
-                    if (!opt[0])
-                        // Nothing followed -b.
-                        opt = NULL;
-                    else if (opt[1])
-                        /* We sure don't know this option. */;
-                    else if (opt[0] == 'h') {
-                        replace_header = true;
-                        opt = NULL;
-                    } else if (opt[0] == 'H') {
-                        add_header = false;
-                        opt = NULL;
-                    }
-                }
+// Parse a "<role>=<cpus>" argument of --affinity.  Returns false if it's
+// invalid.
+static bool parseAffinity(const char *arg) {
+    const char *cpus;
+    unsigned role;
+    cpu_set_t set;
 
-                if (!(st = fopen(p, "r"))) {
-                    ERR("%s: %m", p);
-                    continue;
-                }
-            }
+    if (!(cpus = strchr(arg, '='))) {
+        ERR("%s: expected <role>=<cpus>", arg);
+        return false;
+    }
 
-            // @opt must be NULL if it was parsed successfully.
-            if (opt) {
-                ERR("%s: -%s: unknown option", cmd, opt);
-                continue;
-            }
+    for (role = 0; role < NTHREAD_ROLES; role++)
+        if (strlen(ThreadRoles[role]) == size_t(cpus - arg)
+            && !strncmp(arg, ThreadRoles[role], cpus - arg))
+            break;
+    if (role >= NTHREAD_ROLES) {
+        ERR("%.*s: unknown thread role", int(cpus - arg), arg);
+        return false;
+    }
 
-            // Start @dgram:        @add_header     @replace_header
-            // --: prefix header    T               F
-            // -h: replace header   T               T
-            // -H: keep header      F               F
-            skip = replace_header || (!add_header && measurementInProgress())
-                ? Diameter::HEADER_SIZE : 0;
-            dgram = add_header ? mkEmpty(ctx) : DGram::alloc(512);
-            if (!dgram)
-                goto error;
+    if (!parseCPUList(++cpus, &set)) {
+        ERR("%s: invalid list of CPUs", cpus);
+        return false;
+    }
 
-            // If we've just added a diameter header, add a Session-Id too
-            // if measurementInProgress().
-            if (add_header && measurementInProgress()
-                && !addSessionId(&dgram, ctx, ++sessionId))
-                goto error;
+    // Only the CPUs we may run on can be chosen.
+    CPU_AND(&Affinity.cpus[role], &set, &Affinity.allowed);
+    if (!CPU_EQUAL(&Affinity.cpus[role], &set)) {
+        ERR("%s: only CPUs %s are available",
+            cpus, fmtCPUList(&Affinity.allowed).c_str());
+        return false;
+    }
 
-            // Read the file or parse @p and add its contents to @dgram.
-            if (!st || !isbin) {
-                // Parse hex numbers from @st or @p at most two digits
-                // at a time.
-                for (;;) {
-                    // Parse the number.
-                    if (st) {
-                        if (fscanf(st, " %2x", &c) <= 0)
-                            break;
-                    } else {
-                        int i;
+    Affinity.set[role] = Affinity.any = true;
+    return true;
+}
 
-                        while (*p == '_')
-                            *p++ = ' ';
-                        if (sscanf(p, " %2x%n", &c, &i) <= 0)
-                            break;
-                        p += i;
-                    }
+// Read a list of CPUs (or NUMA nodes) from the sysfs file @fname into
+// @cpus.  Returns false if it can't be read.
+static bool readCPUList(const char *fname, cpu_set_t *cpus) {
+    FILE *st;
+    char line[1024];
+    bool ok;
 
-                    // Append @c to @dgram.
-                    if (!skip || !add_header) {
-                        if (!dgram->freeSpace() && !dgram->expand(&dgram, 64))
-                            goto error;
-                        *dgram->firstUnused() = c;
-                        dgram->mUsed++;
-                    }
+    if (!(st = fopen(fname, "r")))
+        return false;
 
-                    if (skip) {
-                        skip--;
-                        if (skip > 0)
-                            continue;
-                        if (add_header || !measurementInProgress())
-                            continue;
-                        // -H, we've just got through the diameter header,
-                        // and measurementInProgress(), add Session-Id.
-                        if (!addSessionId(&dgram, ctx, ++sessionId))
-                            goto error;
-                    }
-                }
+    ok = false;
+    if (fgets(line, sizeof(line), st)) {
+        line[strcspn(line, "\n")] = '\0';
+        ok = parseCPUList(line, cpus);
+    }
+    fclose(st);
+
+    return ok;
+}
 
-                // Have we reached the message body?
-                if (skip > 0) {
-                    ERR("%s doesn't contain a diameter header", p);
-                    goto error;
-                }
+// Learn the NUMA nodes and their CPUs from sysfs.  If it's not there,
+// all CPUs are on node 0.
+static void loadTopology() {
+    cpu_set_t online;
 
-                // Verify that nothing remained in the input.
-                if (st) {
-                    while ((c = getc(st)) != EOF)
-                        if (!isspace(c)) {
-                            ERR("%s: junk in file (%c)", p, c);
-                            goto error;
-                        }
-                } else {
-                    for (; *p; p++)
-                        if (!isspace(*p)) {
-                            ERR("junk (%c)", *p);
-                            goto error;
-                        }
-                }
-            } else
-            {   // @st && @isbin
-                size_t need;
-                struct stat sbuf;
+    Affinity.nodes.clear();
+    if (!readCPUList("/sys/devices/system/node/online", &online))
+        CPU_ZERO(&online);
 
-                if (fstat(fileno(st), &sbuf) < 0) {
-                    ERR("%s: %m", p);
-                    goto error;
-                }
+    for (unsigned id = 0; id < CPU_SETSIZE; id++) {
+        NUMANode node;
+        char fname[64];
 
-                need = sbuf.st_size;
-                if (replace_header) {
-                    // Skip the diameter header.
-                    if (sbuf.st_size < Diameter::HEADER_SIZE) {
-                        ERR("%s doesn't contain a diameter header", p);
-                        goto error;
-                    } else if (fseek(st, Diameter::HEADER_SIZE,
-                               SEEK_SET) < 0) {
-                        ERR("%s: %m", p);
-                        goto error;
-                    } else
-                        need -= Diameter::HEADER_SIZE;
-                }
+        if (!CPU_ISSET(id, &online))
+            continue;
+        snprintf(fname, sizeof(fname),
+                 "/sys/devices/system/node/node%u/cpulist", id);
+        node.id = id;
+        if (readCPUList(fname, &node.cpus))
+            Affinity.nodes.push_back(node);
+    }
 
-                // Make sure @dgram has at least @need free space.
-                if (!dgram->ensure(&dgram, need))
-                    goto error;
-                if (fread(dgram->firstUnused(), need, 1, st) != 1) {
-                    ERR("%s: %m", p);
-                    goto error;
-                } else
-                    dgram->mUsed += need;
-            }
+    if (Affinity.nodes.empty()) {
+        NUMANode node;
 
-            // Finalize @dgram if we touched it.
-            if (dgram->mUsed % sizeof(uint32_t) != 0) {
-                ERR("message body not padded");
-                goto error;
-            }
-            if (add_header || measurementInProgress())
-                Diameter::finishMessage(dgram);
+        node.id = 0;
+        CPU_ZERO(&node.cpus);
+        for (unsigned cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, &node.cpus);
+        Affinity.nodes.push_back(node);
+    }
+}
 
-            // Send the message(s).
-            for (;;) {
-                sendMessage(ctx, dgram, false);
-                if (!--n)
-                    break;
-                // Update the Session-Id.
-                addSessionId(&dgram, ctx, ++sessionId, Diameter::HEADER_SIZE);
-                if (ctx->send_delay)
-                    usleep(ctx->send_delay);
-            }
+// Return the NUMA nodes of @cpus like "node 0" or "nodes 0,1".
+static std::string fmtNodes(const cpu_set_t *cpus) {
+    std::string list;
+    unsigned n;
 
-            clock_gettime(CLOCK_MONOTONIC, &LastMessageSent);
-            if (!no_number)
-                LOG("Sent.");
+    n = 0;
+    for (size_t i = 0; i < Affinity.nodes.size(); i++) {
+        cpu_set_t common;
+        char id[16];
 
-error:      free(dgram);
-            if (st)
-                fclose(st);
-        } else
-            ERR("%s: unknown command", cmd);
-    } // until EOF
+        CPU_AND(&common, cpus, &Affinity.nodes[i].cpus);
+        if (!CPU_COUNT(&common))
+            continue;
+        snprintf(id, sizeof(id), n++ ? ",%u" : "%u", Affinity.nodes[i].id);
+        list += id;
+    }
 
-    kill(getpid(), SIGINT);
-    return NULL;
-} // }}}
+    return (n > 1 ? "nodes " : "node ") + list;
+}
 
-// Receive and respond to network messages. {{{
-static void *proc_network(void *arg) {
-    DGramTmplAry<char, 65536> dgram;
-    ConnectionCtx *ctx = static_cast<ConnectionCtx *>(arg);
+// Print where the threads whose role is @running run, and which NUMA
+// node their memory comes from.
+static void showTopology(const bool running[NTHREAD_ROLES]) {
+    LOG("Topology: %zu NUMA node(s), CPUs %s allowed.",
+        Affinity.nodes.size(), fmtCPUList(&Affinity.allowed).c_str());
+    for (size_t i = 0; i < Affinity.nodes.size(); i++) {
+        cpu_set_t cpus;
+
+        CPU_AND(&cpus, &Affinity.nodes[i].cpus, &Affinity.allowed);
+        LOG("  node %u: CPUs %s", Affinity.nodes[i].id,
+            fmtCPUList(&cpus).c_str());
+    }
 
-    for (;;) {
-        int n;
+    for (unsigned role = 0; role < NTHREAD_ROLES; role++) {
+        const cpu_set_t *cpus;
 
-        if (!dgram.freeSpace()) {
-            ERR("Message too large");
-            break;
-        }
+        if (!running[role])
+            continue;
+        cpus = Affinity.set[role] ? &Affinity.cpus[role] : &Affinity.allowed;
+        LOG("  %s thread: CPUs %s (%s)%s", ThreadRoles[role],
+            fmtCPUList(cpus).c_str(), fmtNodes(cpus).c_str(),
+            Affinity.set[role] ? "" : ", not pinned");
+    }
+}
 
-        if (ctx->is_sctp) {
-            struct sctp_sndrcvinfo sinfo;
+// Pin the calling thread to the CPUs of @role if --affinity has set them.
+static void pinThread(unsigned role) {
+    if (Affinity.set[role]
+        && sched_setaffinity(0, sizeof(Affinity.cpus[role]),
+                             &Affinity.cpus[role]) < 0)
+        ERR("sched_setaffinity(%s): %s",
+            fmtCPUList(&Affinity.cpus[role]).c_str(), strerror(errno));
+}
 
-            memset(&sinfo, 0, sizeof(sinfo));
-            n = sctp_recvmsg(ctx->sfd, dgram.firstUnused(), dgram.freeSpace(),
-                             NULL, NULL, &sinfo, NULL);
-            dgram.mStreamId = sinfo.sinfo_stream;
-        } else {
-            n = read(ctx->sfd, dgram.firstUnused(), dgram.freeSpace());
-            dgram.mStreamId = 0;
-        }
+// Like pthread_create(), but start @fun on the CPUs of @role.  Otherwise
+// it would inherit the CPUs of the network thread, which creates it.
+// Having it there from the beginning also makes its stack and the pools
+// it allocates placed on the NUMA node of its CPUs, as Linux allocates
+// memory on the node where it's first touched.
+static int startThread(pthread_t *thread, unsigned role,
+                       void *(*fun)(void *), void *arg) {
+    int ret;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    if (Affinity.any)
+        pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t),
+                                    Affinity.set[role]
+                                        ? &Affinity.cpus[role]
+                                        : &Affinity.allowed);
+    ret = pthread_create(thread, &attr, fun, arg);
+    pthread_attr_destroy(&attr);
+
+    return ret;
+}
+// }}}
 
-        if (n < 0) {
+// The main function {{{
+// Fork the --workers. {{{
+// Add the traffic counters the workers have reported so far on @fd to
+// @total, counting the reports in @nreports.  Returns false when there
+// won't be any more, because all workers have closed the pipe.
+static bool readWorkerReports(int fd, TrafficTotals *total,
+                              unsigned *nreports) {
+    TrafficTotals worker;
+    ssize_t n;
+
+    // The reports are smaller than PIPE_BUF, so they're written and read
+    // whole.
+    for (;;) {
+        if ((n = read(fd, &worker, sizeof(worker))) < 0) {
             if (errno == EINTR)
                 continue;
-            ERR("read(%d): %s", ctx->sfd, strerror(errno));
-            break;
-        } else if (!n) {
-            if (Verbosity > 0)
-            {
-                LOG("<- EOF");
-                ctx->is_eof = true;
-            }
-            break;
-        } else
-            dgram.mUsed += n;
+            else if (errno == EAGAIN)
+                return true;
+            ERR("read(): %s", strerror(errno));
+            return false;
+        } else if (n < (ssize_t)sizeof(worker))
+            return false;
+        addTraffic(total, &worker);
+        (*nreports)++;
+    }
+}
 
-        // Process @dgram.  It may contain 0 or multiple Diameter messages.
-        for (;;) {
-            size_t rest;
-            const byte *next;
+// Return -1 in the workers, which should go on setting themselves up,
+// and the exit code of the program in the parent, which waits for them
+// to finish, forwarding SIGINT and SIGTERM, then prints the sum of their
+// traffic counters.
+static int runWorkers(void) {
+    int pipefd[2], sigfd, status;
+    unsigned ncpus, failed, nreports;
+    bool reporting;
+    cpu_set_t cpus;
+    sigset_t sigs, oldsigs;
+    TrafficTotals total;
+    char what[64];
+    struct signalfd_siginfo siginfo;
+    struct pollfd pfds[2];
+    pid_t pid;
+
+    if (pipe(pipefd) < 0) {
+        ERR("pipe(): %s", strerror(errno));
+        return 1;
+    }
 
-            if (!(next = Diameter::isMessageComplete(&dgram))) {
-                ERR("Invalid message received.");
-                goto out;
-            } else if (next == dgram.begin())
-                // Incomplete message.
-                break;
+    // Don't pin the workers if we can't tell where we are allowed to run.
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) < 0) {
+        ERR("sched_getaffinity(): %s", strerror(errno));
+        CPU_ZERO(&cpus);
+    }
+    ncpus = CPU_COUNT(&cpus);
 
-            // The Diameter parser expects a single message in @dgram.
-            rest = dgram.firstUnused() - next;
-            dgram.mUsed = next - dgram.begin();
+    // Block the signals we'll sigwait() for until the workers are forked,
+    // so none of them is lost.  The workers restore @oldsigs.
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigs, &oldsigs);
+    if ((sigfd = signalfd(-1, &sigs, 0)) < 0) {
+        ERR("signalfd(): %s", strerror(errno));
+        sigprocmask(SIG_SETMASK, &oldsigs, NULL);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return 1;
+    }
 
-            if (Input >= 0)
-                write_pcap(Input, DIAMETER_PORTS(ctx),
-                           dgram.mData, dgram.mUsed);
-            if (!msgFromPeer(ctx, &dgram))
-                goto out;
+    failed = 0;
+    for (unsigned i = 0; i < Workers.count; i++) {
+        if ((pid = fork()) < 0) {
+            ERR("fork(): %s", strerror(errno));
+            failed++;
+            break;
+        } else if (pid > 0) {
+            Workers.pids.push_back(pid);
+            continue;
+        }
 
-            if (!(dgram.mUsed = rest))
+        // We're the @i-th worker.  Put ourselves in a separate process
+        // group so that only the parent gets the signals of the terminal,
+        // and die with it.
+        close(pipefd[0]);
+        close(sigfd);
+        Workers.idx = i;
+        Workers.pipe = pipefd[1];
+        Workers.pids.clear();
+        setpgid(0, 0);
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+        // Pin us to the (@i % @ncpus)-th CPU we're allowed to run on.
+        if (ncpus > 0) {
+            unsigned nth = i % ncpus;
+            cpu_set_t mine;
+
+            for (unsigned cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (!CPU_ISSET(cpu, &cpus) || nth-- > 0)
+                    continue;
+                CPU_ZERO(&mine);
+                CPU_SET(cpu, &mine);
+                if (sched_setaffinity(0, sizeof(mine), &mine) < 0)
+                    ERR("worker %u: sched_setaffinity(%u): %s",
+                        i, cpu, strerror(errno));
+                else if (Verbosity > 1)
+                    LOG("Worker %u (pid %d) runs on CPU %u.",
+                        i, getpid(), cpu);
                 break;
-            memmove(dgram.begin(), next, dgram.mUsed);
+            }
         }
+
+        // Make the workers' random numbers differ.
+        srand(time(NULL) + i);
+        sigprocmask(SIG_SETMASK, &oldsigs, NULL);
+        return -1;
     }
+    close(pipefd[1]);
+
+    if (!failed)
+        LOG("Started %u worker(s).", Workers.count);
+    else // Don't leave the already started workers behind.
+        for (size_t i = 0; i < Workers.pids.size(); i++)
+            kill(Workers.pids[i], SIGTERM);
+
+    // Wait until all workers are gone.  If one of them fails, stop the
+    // others too.  Meanwhile take their reports, because they can't exit
+    // while the pipe is full.
+    memset(&total, 0, sizeof(total));
+    nreports = 0;
+    reporting = true;
+    fcntl(pipefd[0], F_SETFL, fcntl(pipefd[0], F_GETFL) | O_NONBLOCK);
+    pfds[0].fd = sigfd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = pipefd[0];
+    pfds[1].events = POLLIN;
+    while (!Workers.pids.empty()) {
+        if (poll(pfds, reporting ? 2 : 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            ERR("poll(): %s", strerror(errno));
+            break;
+        }
 
-out:
-    kill(getpid(), SIGINT);
-    return NULL;
-} // }}}
+        if (reporting && pfds[1].revents)
+            reporting = readWorkerReports(pipefd[0], &total, &nreports);
+        if (!(pfds[0].revents & POLLIN))
+            continue;
+        if (read(sigfd, &siginfo, sizeof(siginfo)) != sizeof(siginfo))
+            continue;
 
-// Send DWRs periodically. {{{
-static void *__attribute__((noreturn)) watchdog(void *arg) {
-    const ConnectionCtx *ctx = static_cast<const ConnectionCtx *>(arg);
+        if (siginfo.ssi_signo != SIGCHLD) {
+            for (size_t i = 0; i < Workers.pids.size(); i++)
+                kill(Workers.pids[i], SIGTERM);
+            continue;
+        }
 
-    for (;;) {
-        if (ctx->watchdog_timeout) {
-            usleep(ctx->watchdog_timeout);
-            sendDGram(ctx->sfd, DIAMETER_PORTS(ctx),
-                      createSimpleMessage(ctx, Diameter::DWR));
-        } else
-            // Watchdog has been disabled, but poll it periodically,
-            // because it might be re-enabled.
-            sleep(5);
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (size_t i = 0; i < Workers.pids.size(); i++)
+                if (Workers.pids[i] == pid) {
+                    Workers.pids.erase(Workers.pids.begin() + i);
+                    break;
+                }
+
+            if (WIFEXITED(status) && !WEXITSTATUS(status))
+                continue;
+            if (WIFSIGNALED(status))
+                ERR("worker (pid %d) killed by signal %d",
+                    pid, WTERMSIG(status));
+            else
+                ERR("worker (pid %d) exited with %d",
+                    pid, WEXITSTATUS(status));
+            failed++;
+            for (size_t i = 0; i < Workers.pids.size(); i++)
+                kill(Workers.pids[i], SIGTERM);
+        }
     }
+
+    // Sum up what the workers have reported.  They're all gone, so
+    // there's no need to wait for the rest of their reports.
+    if (reporting)
+        readWorkerReports(pipefd[0], &total, &nreports);
+    snprintf(what, sizeof(what), "Total of %u worker(s)", nreports);
+    logTraffic(what, &total);
+    close(pipefd[0]);
+    close(sigfd);
+
+    LOG("Bye-bye");
+    return failed ? 1 : 0;
 } // }}}
 
-// The main function {{{
 int main(int argc, char *const argv[])
 {
     static const struct option longopts[] = { // {{{
@@ -3872,6 +12081,7 @@ int main(int argc, char *const argv[])
         { "dest-host",      required_argument,  NULL, 'H' },
         { "dest-realm",     required_argument,  NULL, 'R' },
         { "watchdog",       required_argument,  NULL, 't' },
+        { "answer-timeout", required_argument,  NULL, 'T' },
         { "send-delay",     required_argument,  NULL, 'u' },
         { "recv-delay",     required_argument,  NULL, 'U' },
         { "min-stream",     required_argument,  NULL, 'a' },
@@ -3880,14 +12090,33 @@ int main(int argc, char *const argv[])
         { "max-hbh",        required_argument,  NULL, 'B' },
         { "min-payload",    required_argument,  NULL, 'm' },
         { "max-payload",    required_argument,  NULL, 'M' },
+        { "connect",        required_argument,  NULL, 'C' },
+        { "listen",         required_argument,  NULL, 'l' },
+        { "connections",    required_argument,  NULL, 'n' },
+        { "sctp",           no_argument,        NULL, 'P' },
+        { "flush-bytes",    required_argument,  NULL, 'F' },
+        { "flush-delay",    required_argument,  NULL, 'W' },
+        { "bench",          no_argument,        NULL, 'X' },
+        { "capture-overload", required_argument, NULL, 'Y' },
+        { "metrics",        required_argument,  NULL, 'K' },
+        { "trace",          required_argument,  NULL, 'J' },
+        { "decode",         required_argument,  NULL, 'E' },
+        { "scenario",       required_argument,  NULL, 'Q' },
+        { "workers",        required_argument,  NULL, 'G' },
+        { "io-uring",       no_argument,        NULL, 'g' },
+        { "bench-codec",    no_argument,        NULL, 'x' },
+        { "baseline",       required_argument,  NULL, 'y' },
+        { "affinity",       required_argument,  NULL, 'k' },
         { 0 },
     }; // }}}
     int optchar;
     sigset_t sigs;
     ConnectionCtx ctx;
-    bool nocmd, nonet, lbsdia;
-    struct sockaddr_storage saddr;
-    pthread_t command_thread, watchdog_thread;
+    bool nocmd, nonet, bench, benchCodec, uring;
+    unsigned nconnections;
+    const char *connectTo, *listenOn, *decode, *baseline;
+    pthread_t command_thread, scenario_thread;
+    int ret;
 
     // Preset defaults.  The value of @max_user_data has been chosen so
     // that UDR and PNR generation takes about the same time.
@@ -3897,22 +12126,43 @@ int main(int argc, char *const argv[])
     ctx.end_to_end = 4444;
     ctx.max_user_data = 352;
     ctx.watchdog_timeout = 5 * 1000000;
+    ctx.answer_timeout = 5 * 1000000;
+    ctx.flush_bytes = 65536;
+
+    // --affinity needs to know where we may run.
+    if (sched_getaffinity(0, sizeof(Affinity.allowed),
+                          &Affinity.allowed) < 0) {
+        ERR("sched_getaffinity(): %s", strerror(errno));
+        return 1;
+    }
 
     // Parse the command line. {{{
-    nocmd = nonet = lbsdia = false;
+    nocmd = nonet = bench = benchCodec = uring = false;
+    nconnections = 1;
+    connectTo = listenOn = decode = baseline = NULL;
     while ((optchar = getopt_long(argc, argv,
-                            "vqcsSDNLO:o:w:i:I:h:r:H:R:t:u:U:a:A:b:B:m:M:",
-                            longopts, NULL)) != EOF) {
+                        "vqcsSDNLO:o:w:i:I:h:r:H:R:t:u:U:a:A:b:B:m:M:"
+                        "C:l:n:PT:F:W:",
+                        longopts, NULL)) != EOF) {
         switch (optchar) {
         case 'Z':
             puts("usage: radiator -vq -cs -SDN -L "
                  "-O <input-pcap> -o <output-pcap> -w <fname> "
+                 "--capture-overload <block|drop> "
+                 "--trace <fname> --decode <fname> "
                  "-i <hop-by-hop> -I <end-to-end> "
                  "-h <origin-host> -r <origin-realm> "
                  "-H <destination-host> -R <desination-realm> "
-                 "-t <watchdog-timeout> -u <send-delay> -U <recv-delay> "
+                 "-t <watchdog-timeout> -T <answer-timeout> "
+                 "-u <send-delay> -U <recv-delay> "
                  "-aA <min/max-streams> -bB <min/max-hbh> "
-                 "-mM <min/max-user-data>");
+                 "-mM <min/max-user-data> "
+                 "-F <flush-bytes> -W <flush-delay> "
+                 "-C <connect-addr> -l <listen-addr> -n <connections> -P "
+                 "--workers <n> --io-uring "
+                 "--metrics <socket> --scenario <fname> --bench "
+                 "--bench-codec --baseline <fname> "
+                 "--affinity <role>=<cpus>");
             return 0;
         case 'v':
             Verbosity++;
@@ -3938,7 +12188,63 @@ int main(int argc, char *const argv[])
             ctx.is_client = false;
             break;
         case 'L':
-            lbsdia = true;
+            ctx.to_lbsdia = true;
+            break;
+
+        case 'C':
+            connectTo = optarg;
+            break;
+        case 'l':
+            listenOn = optarg;
+            break;
+        case 'n': {
+            char *end;
+            unsigned long n;
+
+            // Each connection takes a local port.
+            n = strtoul(optarg, &end, 10);
+            if (end == optarg || *end || !n || n > 65535
+                || optarg[0] == '-') {
+                ERR("%s: the number of connections must be 1..65535",
+                    optarg);
+                return 1;
+            }
+            nconnections = n;
+            break;
+        }
+        case 'G': {
+            char *end;
+            unsigned long n;
+
+            // More workers than CPUs we could pin them to make no sense.
+            n = strtoul(optarg, &end, 10);
+            if (end == optarg || *end || !n || n > CPU_SETSIZE
+                || optarg[0] == '-') {
+                ERR("%s: the number of workers must be 1..%u",
+                    optarg, CPU_SETSIZE);
+                return 1;
+            }
+            Workers.count = n;
+            break;
+        }
+        case 'g':
+            uring = true;
+            break;
+        case 'P':
+            ctx.is_sctp = true;
+            break;
+        case 'X':
+            bench = true;
+            break;
+        case 'x':
+            benchCodec = true;
+            break;
+        case 'y':
+            baseline = optarg;
+            break;
+        case 'k':
+            if (!parseAffinity(optarg))
+                return 1;
             break;
 
         case 'O':
@@ -3954,6 +12260,30 @@ int main(int argc, char *const argv[])
                 return 1;
             Output = Input;
             break;
+        case 'Y':
+            if (!strcmp(optarg, "block"))
+                Capture.drop = false;
+            else if (!strcmp(optarg, "drop"))
+                Capture.drop = true;
+            else {
+                ERR("%s: unknown overload policy", optarg);
+                return 1;
+            }
+            break;
+        case 'K':
+            MetricsEndpoint.path = optarg;
+            break;
+        case 'J':
+            if ((Trace = open_trace(optarg)) < 0)
+                return 1;
+            break;
+        case 'E':
+            decode = optarg;
+            break;
+        case 'Q':
+            if (!loadScenario(optarg, &Scenario))
+                return 1;
+            break;
 
         case 'i':
             ctx.hop_by_hop = strtoul(optarg, NULL, 0);
@@ -3978,12 +12308,21 @@ int main(int argc, char *const argv[])
         case 't':
             ctx.watchdog_timeout = atof(optarg) * 1000000.0;
             break;
+        case 'T':
+            ctx.answer_timeout = atof(optarg) * 1000000.0;
+            break;
         case 'u':
             ctx.send_delay = atof(optarg) * 1000.0;
             break;
         case 'U':
             ctx.recv_delay = atof(optarg) * 1000.0;
             break;
+        case 'F':
+            ctx.flush_bytes = atoi(optarg);
+            break;
+        case 'W':
+            ctx.flush_delay = atof(optarg) * 1000.0;
+            break;
 
         case 'a':
             ctx.min_stream = ctx.max_stream = atoi(optarg);
@@ -4021,8 +12360,36 @@ int main(int argc, char *const argv[])
     if (nocmd && nonet) {
         ERR("--no-stdin and --no-net: what am I supposed to do?");
         return 1;
+    } else if (nonet && (connectTo || listenOn)) {
+        ERR("--no-net and --connect/--listen are not compatible");
+        return 1;
+    } else if (connectTo && listenOn) {
+        ERR("--connect and --listen are not compatible");
+        return 1;
+    } else if (connectTo && !nconnections) {
+        ERR("--connections must be at least 1");
+        return 1;
+    } else if (nonet && !Scenario.empty()) {
+        ERR("--no-net and --scenario are not compatible");
+        return 1;
+    } else if (baseline && !benchCodec) {
+        ERR("--baseline needs --bench-codec");
+        return 1;
+    } else if (Workers.count && !listenOn) {
+        ERR("--workers needs --listen");
+        return 1;
+    } else if (Workers.count
+               && (Input >= 0 || Output >= 0 || Trace >= 0
+                   || MetricsEndpoint.path || !Scenario.empty())) {
+        ERR("--workers is not compatible with capturing, --trace, "
+            "--metrics and --scenario");
+        return 1;
     }
 
+    // The workers can't share the standard input.
+    if (Workers.count)
+        nocmd = true;
+
     // Verify that ctx.min_* >= ctx.max_*.
     if (ctx.min_stream < ctx.max_stream) {
         ERR("min-stream (%u) > max-stream (%u)",
@@ -4041,55 +12408,6 @@ int main(int argc, char *const argv[])
         return 1;
     }
 
-    // Set the low 16 bits of our Hop-by-Hop Id to our local port number.
-    socklen_t slen = sizeof(saddr);
-    if (!nonet && !getsockname(ctx.sfd, (struct sockaddr *)&saddr, &slen)) {
-        int proto;
-
-        if (ctx.hop_by_hop <= 0xffff) {
-            if (saddr.ss_family == AF_INET) {
-                const struct sockaddr_in *saddr4;
-
-                saddr4 = DMXEndPoint::toCS4(&saddr);
-                ctx.hop_by_hop |= ntohs(saddr4->sin_port) << 16;
-            } else if (saddr.ss_family == AF_INET6) {
-                const struct sockaddr_in6 *saddr6;
-
-                saddr6 = DMXEndPoint::toCS6(&saddr);
-                ctx.hop_by_hop |= ntohs(saddr6->sin6_port) << 16;
-            }
-        }
-
-        // Is @ctx.sfd SCTP?
-        slen = sizeof(proto);
-        if (getsockopt(ctx.sfd, SOL_SOCKET, SO_PROTOCOL, &proto, &slen) < 0) {
-            ERR("getsockopt(%d, SO_PROTOCOL): %s", ctx.sfd, strerror(errno));
-            return 1;
-        } else {
-            ctx.is_sctp = proto == IPPROTO_SCTP;
-            if (!ctx.is_sctp && ctx.min_stream > 0) {
-                ERR("can only use more than one streams on SCTP");
-                return 1;
-            }
-        }
-
-        // If we're a client, the server is DiaLBS and we're running
-        // over SCTP, subscribe to sctp_sndrcvinfo data.  This is
-        // necessary in order to see on which stream we got a request.
-        if (ctx.is_client && ctx.is_sctp && lbsdia) {
-            struct sctp_event_subscribe events;
-
-            memset(&events, 0, sizeof(events));
-            events.sctp_data_io_event = 1;
-            if (setsockopt(ctx.sfd, SOL_SCTP, SCTP_EVENTS,
-                           &events, sizeof(events)) < 0) {
-                ERR("setsockopt(%d, SCTP_EVENTS): %s",
-                    ctx.sfd, strerror(errno));
-                return 1;
-            }
-        } // we're a client and DiaLBS is the server
-    } // ctx.sfd is a socket
-
     // ctx.origin.* depends on whether we're the client.
     // ctx.destination.* depends on whether we're talking to LBSDiaCore,
     // or otherwise if we're the client.
@@ -4102,7 +12420,7 @@ int main(int argc, char *const argv[])
             ? "radiator-client-realm"
             : "radiator-server-realm";
     if (!ctx.destination.host) {
-        if (lbsdia)
+        if (ctx.to_lbsdia)
             ctx.destination.host = "lbsdia-host";
         else if (ctx.is_client)
             ctx.destination.host = "radiator-server-host";
@@ -4110,7 +12428,7 @@ int main(int argc, char *const argv[])
             ctx.destination.host = "radiator-client-host";
     }
     if (!ctx.destination.realm) {
-        if (lbsdia)
+        if (ctx.to_lbsdia)
             ctx.destination.realm = "lbsdia-realm";
         else if (ctx.is_client)
             ctx.destination.realm = "radiator-server-realm";
@@ -4120,7 +12438,7 @@ int main(int argc, char *const argv[])
 
     // Makes no sense to send DWRs to DiaLBS, as it would forward them
     // to the server, which is supervised by the load balancer anyway.
-    if (ctx.is_client && lbsdia && ctx.watchdog_timeout) {
+    if (ctx.is_client && ctx.to_lbsdia && ctx.watchdog_timeout) {
         ctx.watchdog_timeout = 0;
         LOG("Watchdog disabled.");
     }
@@ -4128,17 +12446,139 @@ int main(int argc, char *const argv[])
 
     srand(time(NULL));
     pthread_mutex_init(&MeasurementLock, NULL);
+    if (bench)
+        return runBenchmarks(&ctx);
+    if (benchCodec)
+        return runCodecBenchmarks(&ctx, baseline);
+    if (decode)
+        return decodeTrace(decode) ? 0 : 1;
+
+    // Move to the CPUs of the network thread (or of the command thread,
+    // which we'll be with -N) before we allocate anything, so that the
+    // connections, the rings and the pools are placed on their NUMA node.
+    // The --workers inherit these CPUs and divide them among themselves.
+    if (Affinity.any || Verbosity > 1) {
+        bool running[NTHREAD_ROLES];
+
+        running[THREAD_NETWORK]  = !nonet;
+        running[THREAD_COMMAND]  = !nocmd;
+        running[THREAD_SCENARIO] = !Scenario.empty();
+        running[THREAD_CAPTURE]  = Input >= 0 || Output >= 0 || Trace >= 0;
+        running[THREAD_METRICS]  = MetricsEndpoint.path != NULL;
+        loadTopology();
+        showTopology(running);
+    }
+    pinThread(nonet ? THREAD_COMMAND : THREAD_NETWORK);
 
-    // Say hello to the server unless we're talking to DiaLBS,
-    // which doesn't expect it.
-    if (ctx.is_client && !lbsdia)
-        sendDGram(ctx.sfd, DIAMETER_PORTS(&ctx), mkCERorCEA(&ctx));
+    if (Workers.count && (ret = runWorkers()) >= 0)
+        return ret;
 
-    // sigint() will make us quit.
+    // Set up the connection(s). {{{
+    if ((Epoll = epoll_create1(0)) < 0) {
+        ERR("epoll_create1(): %s", strerror(errno));
+        return 1;
+    } else if ((WakeupFd = eventfd(0, EFD_NONBLOCK)) < 0) {
+        ERR("eventfd(): %s", strerror(errno));
+        return 1;
+    } else if (!watchFd(EPOLL_CTL_ADD, WakeupFd, EPOLLIN, &WakeupFd))
+        return 1;
+    else if ((TimerFd = timerfd_create(CLOCK_MONOTONIC,
+                                       TFD_NONBLOCK)) < 0) {
+        ERR("timerfd_create(): %s", strerror(errno));
+        return 1;
+    } else if (!watchFd(EPOLL_CTL_ADD, TimerFd, EPOLLIN, &TimerFd))
+        return 1;
+
+    // Fall back to epoll if the kernel can't do what we need.
+    if (uring) {
+        if (!Uring.init(URING_ENTRIES)
+            || !watchFd(EPOLL_CTL_ADD, Uring.fd(), EPOLLIN, &Uring)) {
+            Uring.destroy();
+            LOG("io_uring is not usable, falling back to epoll.");
+        } else if (Verbosity > 1)
+            LOG("Using io_uring.");
+    }
+
+    // Block SIGINT and SIGTERM in the helper threads we'll start, so
+    // they are delivered to us.
     sigemptyset(&sigs);
     sigaddset(&sigs, SIGINT);
     sigaddset(&sigs, SIGTERM);
     sigprocmask(SIG_BLOCK, &sigs, NULL);
+
+    // We'll be the network thread.
+    NetworkThread = pthread_self();
+
+    // Start the capture writer.
+    if (Input >= 0 || Output >= 0 || Trace >= 0) {
+        struct timespec mono, real;
+
+        for (unsigned i = 0; i < CAPTURE_RING_SIZE; i++)
+            Capture.ring[i].seq = i;
+        clock_gettime(CLOCK_MONOTONIC, &mono);
+        clock_gettime(CLOCK_REALTIME, &real);
+        Capture.realtime = nsecs(&real) - nsecs(&mono);
+        if ((errno = startThread(&Capture.writer, THREAD_CAPTURE,
+                                 proc_capture, NULL)) != 0) {
+            ERR("pthread_create(): %m");
+            return 1;
+        }
+        Capture.running = true;
+    }
+
+    if (connectTo || listenOn) {
+        struct addrinfo *ai;
+
+        if (!(ai = resolve(connectTo ? connectTo : listenOn, !connectTo)))
+            return 1;
+
+        if (connectTo) {
+            for (; nconnections > 0; nconnections--)
+                if (!openConnection(&ctx, ai))
+                    break;
+        } else if ((ListenFd = openListener(ai, ctx.is_sctp)) < 0
+                   || !watchFd(EPOLL_CTL_ADD, ListenFd, EPOLLIN, &ListenFd))
+            return 1;
+
+        freeaddrinfo(ai);
+        if (connectTo && !LiveConnections)
+            return 1;
+    } else {
+        ConnectionCtx *conn;
+
+        // Use the socket we've been given (or nothing at all if @nonet).
+        if (!(conn = newConnection(&ctx, nonet ? -1 : STDOUT_FILENO)))
+            return 1;
+        if (!nonet
+            && !watchFd(EPOLL_CTL_ADD, conn->sfd, EPOLLIN, conn))
+            return 1;
+        if (!connectionUp(conn))
+            return 1;
+
+        // The "streams" command needs to know whether we're on SCTP.
+        ctx.is_sctp = conn->is_sctp;
+    }
+
+    // Like the "streams" command, the scenario can't set them on TCP.
+    for (size_t i = 0; i < Scenario.size(); i++)
+        if (Scenario[i].streams.set && !ctx.is_sctp) {
+            ERR("scenario: can't set streams on non-SCTP connections");
+            return 1;
+        } // }}}
+
+    // Start serving the metrics.
+    if (MetricsEndpoint.path) {
+        if ((MetricsEndpoint.fd = openMetrics(MetricsEndpoint.path)) < 0)
+            return 1;
+        Metrics::enabled = true;
+        if ((errno = startThread(&MetricsEndpoint.server, THREAD_METRICS,
+                                 proc_metrics, NULL)) != 0) {
+            ERR("pthread_create(): %m");
+            return 1;
+        }
+    }
+
+    // sigint() will make us quit.
     signal(SIGINT, sigint);
     signal(SIGTERM, sigint);
 
@@ -4149,30 +12589,55 @@ int main(int argc, char *const argv[])
             pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
             proc_stdin(&ctx);
         }
-    } else if (nocmd && !ctx.watchdog_timeout) {
-        DIAASSERT(!nonet);
-        if (!setjmp(Quit)) {
-            pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
-            proc_network(&ctx);
-        }
-    } else { // !@nonet && (!@nocmd || @ctx.watchdog_timeout)
-        // We'll have at least one another thread.
+    } else {
         if (!nocmd)
-            pthread_create(&command_thread, NULL, proc_stdin,  &ctx);
-        if (ctx.watchdog_timeout)
-            pthread_create(&watchdog_thread, NULL, watchdog, &ctx);
+            startThread(&command_thread, THREAD_COMMAND, proc_stdin, &ctx);
+        if (!Scenario.empty())
+            startThread(&scenario_thread, THREAD_SCENARIO,
+                        proc_scenario, &ctx);
         if (!setjmp(Quit)) {
             pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
             proc_network(&ctx);
         }
     }
 
-    // Say proper good-bye to the peer and to the user.  Stupid DiaLBS
-    // forwards *all* requests to the server, so sending DPR would cause
-    // the server to disconnect.
-    if (!ctx.is_eof && (!ctx.is_client || !lbsdia))
-        sendDGram(ctx.sfd, DIAMETER_PORTS(&ctx),
-                  createSimpleMessage(&ctx, Diameter::DPR));
+    // Say proper good-bye to the peers and to the user.
+    for (size_t i = 0; i < Connections.size(); i++)
+        sayGoodbye(Connections[i]);
+    drainConnections();
+    if (Capture.running) {
+        __atomic_store_n(&Capture.stopping, true, __ATOMIC_RELEASE);
+        pthread_join(Capture.writer, NULL);
+        if (Capture.dropped || Verbosity > 1)
+            LOG("Captured %lu messages, dropped %lu.",
+                Capture.written, Capture.dropped);
+    }
+    if (Fuzz.running)
+        // The peer may have crashed before the end of the fuzz run.
+        reportFuzz();
+    if (Workers.pipe >= 0) {
+        // Let the parent sum up the traffic counters.
+        TrafficTotals totals;
+        char what[32];
+
+        sumConnections(&totals, Verbosity > 1);
+        if (Verbosity > 1) {
+            snprintf(what, sizeof(what), "Worker %u", Workers.idx);
+            logTraffic(what, &totals);
+        }
+        if (write(Workers.pipe, &totals, sizeof(totals)) < 0)
+            ERR("write(): %s", strerror(errno));
+        if (Verbosity > 1)
+            DGramPool::show();
+
+        // The parent says good-bye.
+        return 0;
+    } else if (connectTo || listenOn)
+        showConnections(Verbosity > 1);
+    if (Verbosity > 1)
+        DGramPool::show();
+    if (MetricsEndpoint.fd >= 0)
+        unlink(MetricsEndpoint.path);
     LOG("Bye-bye");
 	return 0;
 } // }}}